@@ -1,371 +1,1457 @@
-/**
- Boilerplate code implementing the GUI for the pingpong game. Update the file accordingly as necessary.
- You are allowed to update functions, add new functions, modify the stuctures etc. Keep the output graphics intact.
-
- CS3205 - Assignment 2 (Holi'25)
- Instructor: Ayon Chakraborty
- **/
-
- #include <ncurses.h>
- #include <pthread.h>
- #include <stdlib.h>
- #include <unistd.h>
- #include <stdio.h>
- #include <string.h>
- #include <sys/socket.h>
- #include <netinet/in.h>
- #include <arpa/inet.h>
-
-
- #define WIDTH 80
- #define HEIGHT 30
- #define OFFSETX 10
- #define OFFSETY 5
-
- typedef struct {
-     int x, y;
-     int dx, dy;
- } Ball;
-
- typedef struct {
-     int x;
-     int width;
- } Paddle;
-
- typedef struct {
-     Ball ball;
-     Paddle paddleA, paddleB;
-     int penaltyA, penaltyB;
-     int game_running;
- } GameState;
-
-// This is the struct that will be used for communication
-
- const int stride = 1;
- int server_fd, client_fd;
- Ball ball;
- Paddle paddleA,paddleB;
- int game_running = 1;
- int penaltyA = 0;
- int penaltyB = 0;
- GameState game;
- pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
- void init();
- void* read_threadA(void *args);
- void* write_threadA(void *args);
- void* read_threadB(void* args);
- void* write_threadB(void* args);
- void client();
- void server();
- void end_game();
- void draw(WINDOW *win);
- void *handle_render(void *args);
- void *move_ballA(void *args);
- void *move_ballB(void *args);
- void *read_from_server(void *args);
- void *move_ball(void *args);
- void *rcv_paddleB_from_client_handler(void *args);
- void update_paddle_old(int ch);
- void update_paddleA(int ch);
- void update_paddleB(int ch);
- void reset_ball();
- void* handle_networkA(void* args);
- void* handle_networkB(void* args);
- void server();
- void client();
- int penalty;
- Paddle paddle;
-
-
-// check whether we are running the client or the server
-int main(int argc, char *argv[]) {
-
-     ball = (Ball){WIDTH / 2, HEIGHT / 2, 1, 1};
-     paddleA = (Paddle){WIDTH / 2 - 3, 10};
-     paddleB = (Paddle){WIDTH / 2 - 3, 10};
-     game = (GameState){ball, paddleA, paddleB, penaltyA, penaltyB,game_running};
-
-
-     if (strcmp(argv[1],"server")==0){
-         printf("Server\n");
-         // pthread_create(&ball_thread, NULL, move_ballA, NULL);
-         struct sockaddr_in address;
-         int addrlen = sizeof(address);
-
-         server_fd = socket(AF_INET, SOCK_STREAM, 0); //step 1
-         memset(&address, '\0', sizeof(address));  //step 2, next 3 lines
-         address.sin_family = AF_INET;
-         address.sin_addr.s_addr = htonl(INADDR_ANY);
-         address.sin_port = htons(atoi(argv[2]));
-
-         bind(server_fd, (struct sockaddr *)&address, sizeof(address)); //step 3
-         listen(server_fd, 5); //step 4
-
-         client_fd = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-         printf("Client connected\n");
-         server();
-         close(client_fd);
-     }
-     else if(strcmp(argv[1],"client")==0){
-
-         struct sockaddr_in address;
-         int addrlen = sizeof(address);
-         char buffer[100] = {0};
-
-         client_fd = socket(AF_INET, SOCK_STREAM, 0);
-         memset(&address, '\0', sizeof(address));
-         address.sin_family = AF_INET;
-         address.sin_port = htons(12345);
-         printf("IP: %s\n",argv[2]);
-         inet_pton(AF_INET,argv[2], &address.sin_addr); //change the IP accordingly
-
-         connect(client_fd, (struct sockaddr *)&address, addrlen);
-         printf("Connected to server\n");
-         client();
-         close(client_fd);
-     }
-     return 0;
- }
-
-// use different threads for each of - receieve, send, computing ball's motion, etc..
-void server()
-{
-  printf("Hello from Server!\n");
-  init();
-
-    pthread_t ball_thread, network_threadA_read, network_threadA_write;
-    pthread_create(&ball_thread, NULL, move_ballA, NULL);
-    pthread_create(&network_threadA_write, NULL, write_threadA,NULL);
-    pthread_create(&network_threadA_read, NULL, read_threadA, NULL);
-
-    while (game_running) {
-        int ch = getch();
-        if (ch == 'q') {
-            game_running = 0;
-            break;
-        }
-        update_paddleA(ch);
-        draw(stdscr);
-    }
-
-    pthread_join(network_threadA_read,NULL);
-    pthread_join(ball_thread,NULL);
-    pthread_join(network_threadA_write,NULL);
-    end_game();
-    return;
-}
-
-
-void client()
-{
-  printf("Hello from Client!\n");
-  init();
-
-    pthread_t network_threadB_write, network_threadB_read;
-    pthread_create(&network_threadB_read, NULL, read_threadB,NULL);
-    pthread_create(&network_threadB_write,NULL, write_threadB, NULL);
-
-    while (game_running) {
-        int ch = getch();
-        if (ch == 'q') {
-            game_running = 0;
-            break;
-        }
-        update_paddleB(ch);
-        draw(stdscr);
-    }
-
-    pthread_join(network_threadB_read,NULL);
-    pthread_join(network_threadB_write,NULL);
-    end_game();
-    return;
-}
-
-void* read_threadA(void* args) {
-    int new_paddleB_x;
-    while (game_running) {
-        if (read(client_fd, &new_paddleB_x, sizeof(new_paddleB_x)) > 0) {
-            paddleB.x = new_paddleB_x;
-        }
-        usleep(10000);
-    }
-    return NULL;
-}
-
-void* write_threadA(void* args) {
-    while (game_running) {
-        GameState new_gamestate = {ball, paddleA, paddleB, penaltyA, penaltyB, game_running};
-        write(client_fd, &new_gamestate, sizeof(new_gamestate));
-        usleep(10000);
-    }
-    return NULL;
-}
-
-void* read_threadB(void* args) {
-    GameState new_gamestate;
-    while (game_running) {
-        if (read(client_fd, &new_gamestate, sizeof(new_gamestate)) > 0) {
-            paddleA = new_gamestate.paddleA;
-            ball = new_gamestate.ball;
-            game_running = new_gamestate.game_running;
-            penaltyA = new_gamestate.penaltyA;
-            penaltyB = new_gamestate.penaltyB;
-        }
-        usleep(10000);
-    }
-    return NULL;
-}
-
-void* write_threadB(void* args) {
-    while (game_running) {
-        write(client_fd, &paddleB.x, sizeof(paddleB.x));
-        usleep(10000);
-    }
-    return NULL;
-}
-
-
-void reset_ball() {
-    ball.x = OFFSETX + WIDTH / 2;
-    ball.y = OFFSETY + HEIGHT / 2;
-    ball.dx = 1;
-    ball.dy = 1;
-}
-
-void* handle_networkB(void* args)
-{
-   GameState new_gamestate;
-   while(game_running)
-   {
-        write(client_fd, &paddleB.x, sizeof(paddleB.x));
-        read(client_fd, &new_gamestate,sizeof(new_gamestate));
-        paddleA = new_gamestate.paddleA;
-        ball = new_gamestate.ball;
-        game_running = new_gamestate.game_running;
-        penaltyA = new_gamestate.penaltyA;
-        penaltyB = new_gamestate.penaltyB;
-        usleep(10000);
-   }
-   return NULL;
-}
-
-void* handle_networkA(void* args)
-{
-   int new_paddleB_x;
-   //GameState new_gamestate = (GameState){ball, paddleA, paddleB, 0, 0,game_running};
-   while(game_running)
-   {
-       read(client_fd, &new_paddleB_x, sizeof(new_paddleB_x));
-       paddleB.x = new_paddleB_x;
-       GameState new_gamestate = (GameState){ball, paddleA, paddleB, penaltyA, penaltyB,game_running};
-       write(client_fd, &new_gamestate, sizeof(new_gamestate));
-       usleep(10000);
-   }
-   return NULL;
-}
-
-void draw(WINDOW *win) {
-     clear();  // Clear the screen
-
-     // Draw the border
-     attron(COLOR_PAIR(1));
-     for (int i = OFFSETX; i <= OFFSETX + WIDTH; i++) {
-         mvprintw(OFFSETY-1, i, " ");
-     }
-     mvprintw(OFFSETY-1, OFFSETX + 3, "CS3205 NetPong, Ball: %d, %d", ball.x, ball.y);
-     mvprintw(OFFSETY-1, OFFSETX + WIDTH-25, "Player A: %d, Player B: %d", penaltyA, penaltyB);
-
-     for (int i = OFFSETY; i < OFFSETY + HEIGHT; i++) {
-         mvprintw(i, OFFSETX, "  ");
-         mvprintw(i, OFFSETX + WIDTH - 1, "  ");
-     }
-     for (int i = OFFSETX; i < OFFSETX + WIDTH; i++) {
-         mvprintw(OFFSETY, i, " ");
-         mvprintw(OFFSETY + HEIGHT - 1, i, " ");
-     }
-     attroff(COLOR_PAIR(1));
-
-     // Draw the ball
-     mvprintw(OFFSETY + ball.y, OFFSETX + ball.x, "o");
-
-     // Draw the paddle
-     attron(COLOR_PAIR(2));
-     for (int i = 0; i < paddleA.width; i++) {
-         mvprintw(OFFSETY + HEIGHT-2, OFFSETX + paddleA.x + i, " ");
-     }
-     for (int i = 0; i < paddleB.width; i++) {
-         mvprintw(OFFSETY+1, OFFSETX + paddleB.x + i, " ");
-     }
-     attroff(COLOR_PAIR(2));
-
-     refresh();
- }
-
-void *move_ballA(void *args) {
-     while (game_running){
-      // Move the ball
-         ball.x += ball.dx;
-         ball.y += ball.dy;
-
-         if (ball.y == 2 && ball.x >= paddleB.x -1 && ball.x < paddleB.x + paddleB.width + 1) {
-             ball.dy = -ball.dy;
-         }
-
-         // Ball goes past paddle (Game Over)
-         if (ball.y <= 1) {
-             penaltyA++;
-             reset_ball();
-         }
-
-         // Ball bounces off left and right walls
-         if (ball.x <= 2 || ball.x >= WIDTH - 2) {
-             ball.dx = -ball.dx;
-         }
-
-         // Ball hits the paddle
-         if (ball.y == HEIGHT - 3 && ball.x >= paddleA.x -1 && ball.x < paddleA.x + paddleA.width + 1) {
-             ball.dy = -ball.dy;
-         }
-
-         // Ball goes past paddle (Game Over)
-         if (ball.y >= HEIGHT - 2) {
-             penaltyB++;
-             reset_ball();
-         }
-             usleep(50000);
-     }
-     return NULL;
- }
-
-void update_paddleA(int ch) {
-     if (ch == KEY_LEFT && paddleA.x > 2) {
-         paddleA.x -= 1;  // Move paddle left
-   }
-     if (ch == KEY_RIGHT && paddleA.x < WIDTH - paddleA.width - 1) {
-         paddleA.x += 1;  // Move paddle right
-     }
- }
-
-void update_paddleB(int ch) {
-     if (ch == KEY_LEFT && paddleB.x > 2) {
-         paddleB.x -= 1;  // Move paddle left
-   }
-     if (ch == KEY_RIGHT && paddleB.x < WIDTH - paddleB.width - 1) {
-         paddleB.x += 1;  // Move paddle right
-     }
- }
-
-void init() {
-    initscr();
-    start_color();
-    init_pair(1, COLOR_BLUE, COLOR_WHITE);
-    init_pair(2, COLOR_YELLOW, COLOR_YELLOW);
-    timeout(10);
-    keypad(stdscr, TRUE);
-    curs_set(FALSE);
-    noecho();
-}
-
-void end_game() {
-    endwin();  // End curses mode
+#define _GNU_SOURCE
+/**
+ Boilerplate code implementing the GUI for the pingpong game. Update the file accordingly as necessary.
+ You are allowed to update functions, add new functions, modify the stuctures etc. Keep the output graphics intact.
+
+ CS3205 - Assignment 2 (Holi'25)
+ Instructor: Ayon Chakraborty
+ **/
+
+ #include <ncurses.h>
+ #include <term.h>
+ #include <pthread.h>
+ #include <stdlib.h>
+ #include <unistd.h>
+ #include <stdio.h>
+ #include <string.h>
+ #include <errno.h>
+ #include <stdint.h>
+ #include <stddef.h>
+ #include <time.h>
+ #include <poll.h>
+ #include <sched.h>
+ #include <sys/socket.h>
+ #include <sys/epoll.h>
+ #include <sys/timerfd.h>
+ #include <sys/eventfd.h>
+ #include <netinet/in.h>
+ #include <arpa/inet.h>
+
+
+ #define WIDTH 80
+ #define HEIGHT 30
+ #define OFFSETX 10
+ #define OFFSETY 5
+
+ #define TICK_NS 10000000L     // one tick: inputs in, physics, snapshot out (both sides)
+ #define BALL_TICKS 5          // the ball moves every 5th tick, every 50 ms
+ #define SNAP_HISTORY 64       // snapshots kept on both sides to delta-encode against
+ #define INPUT_REDUNDANCY 8    // inputs repeated in every input packet
+ #define QUIT_REPEATS 10       // snapshots sent after the server quits, so one gets through
+ #define PACKET_MAX 128
+ #define INTERP_DELAY_NS (5 * TICK_NS)   // client: how far behind the server's clock it renders
+ #define EXTRAPOLATE_TICKS 25  // client: how far past the newest snapshot the ball is carried on
+ #define CORRECTION_NS 100000000L  // client: time to ease out a misprediction
+ #define CLOCK_DRIFT_NS 1000   // client: per snapshot, how fast the clock estimate may rise
+ #define MAX_SHARDS 64         // host: shard threads, at most
+ #define PADDLE_WIDTH 10
+ #define MATCH_TIMEOUT_TICKS 500   // host: a match with no input for 5 s is dropped
+ #define MMSG_BATCH 64         // host: packets per recvmmsg()/sendmmsg()
+ #define STATS_INTERVAL 5      // host, bots: seconds between stats lines
+ #define JOIN_CACHE 4096       // host: lobby's memory of who was sent where
+ #define DEFAULT_FPS 60        // renderer: frames per second unless given
+ #define FRAME_ROWS (HEIGHT + 1)   // renderer: the scoreboard row, then the field
+ #define FRAME_COLS (WIDTH + 10)   // renderer: the field, and room for the scores past it
+ #define FRAME_HIST_US 10000   // renderer: frame times kept to the microsecond, up to 10 ms
+
+ typedef struct {
+     int x, y;
+     int dx, dy;
+ } Ball;
+
+ typedef struct {
+     int x;
+     int width;
+ } Paddle;
+
+ typedef struct {
+     Ball ball;
+     Paddle paddleA, paddleB;
+     int penaltyA, penaltyB;
+     int game_running;
+ } GameState;
+
+// This is the struct that will be used for communication
+
+// Fields of a GameState as sent in snapshots, in bitmask order
+ static const size_t state_fields[] = {
+     offsetof(GameState, ball.x), offsetof(GameState, ball.y),
+     offsetof(GameState, ball.dx), offsetof(GameState, ball.dy),
+     offsetof(GameState, paddleA.x), offsetof(GameState, paddleA.width),
+     offsetof(GameState, paddleB.x), offsetof(GameState, paddleB.width),
+     offsetof(GameState, penaltyA), offsetof(GameState, penaltyB),
+     offsetof(GameState, game_running),
+ };
+ #define STATE_FIELDS (int)(sizeof(state_fields) / sizeof(state_fields[0]))
+
+// One character cell of the picture the renderer keeps of the screen
+ typedef struct {
+     char ch;
+     char pair;    // color pair, 0 for none
+ } Cell;
+
+// Wait-free handoff of the newest copy of a value from one thread to
+// another. Of three slots, the writer fills one, the reader holds one, and
+// the third is the newest finished copy. Publishing swaps the filled slot
+// for the middle one; the reader swaps its slot for the middle one only if
+// something was published since it last did. Neither side ever waits, and
+// a slot is never written while the reader can see it.
+ typedef struct {
+     void *slot[3];
+     int middle;        // slot index, ORed with TB_FRESH when not taken yet
+     int back, front;   // the writer's slot and the reader's
+ } TripleBuffer;
+ #define TB_FRESH 4
+
+// What the client's tick thread hands the renderer: the snapshots kept,
+// and the clock estimate to place them in time.
+ typedef struct {
+     GameState history[SNAP_HISTORY];
+     uint32_t history_seq[SNAP_HISTORY];
+     uint32_t newest;
+     long long clock_offset;
+ } SnapshotView;
+
+ const int stride = 1;
+ int server_fd, client_fd;   // UDP; client_fd is connected to the other side
+ Ball ball;                  // server: the tick thread's, like paddleA, paddleB and the penalties
+ Paddle paddleA,paddleB;
+ int game_running = 1;       // shared: read and written with __atomic builtins only
+ int penaltyA = 0;
+ int penaltyB = 0;
+ GameState game;
+ Paddle local_paddle;        // input thread: the paddle our keys move, A on the server, B on the client
+ int paddle_input;           // local_paddle.x, for the tick thread
+ int local_side = 'B';       // client: the paddle we play, 'A' (bottom) after joining a host as A
+ TripleBuffer state_pub;     // server: tick thread -> renderer
+ GameState state_slots[3];
+ TripleBuffer view_pub;      // client: tick thread -> renderer
+ SnapshotView view_slots[3];
+ uint32_t snap_seq;                        // server: newest snapshot sent; client: newest applied
+ GameState snap_history[SNAP_HISTORY];     // snapshot seq is at seq % SNAP_HISTORY
+ uint32_t snap_history_seq[SNAP_HISTORY];
+ uint32_t client_ack;                      // server: newest snapshot the client applied
+ uint32_t input_seq;                       // server: newest input applied; client: newest sent
+ int input_moves[INPUT_REDUNDANCY];        // client: paddle moves by input seq
+ int pending_move;                         // client: paddle moves not sent yet
+ long long clock_offset;                   // client: local time of server tick 0, estimated
+ double view_x, view_y, view_err_x, view_err_y;  // client: ball as shown, and its correction
+ long long view_ns;                        // client: when the view was last computed
+ int view_extrapolated;                    // client: the last view was past the newest snapshot
+ int render_fps = DEFAULT_FPS;
+ void (*render_state)(GameState *s);       // renderer: fills in the state to show
+ Cell frame_cells[2][FRAME_ROWS][FRAME_COLS];  // renderer: the frame on screen, and the next one
+ long long frame_hist[FRAME_HIST_US + 1];  // renderer: frame times, by microsecond
+ long long frame_count, frame_bytes, frame_max_ns, frame_over;
+ void init();
+ void tb_init(TripleBuffer *tb, void *a, void *b, void *c);
+ void *tb_back(TripleBuffer *tb);
+ void tb_publish(TripleBuffer *tb);
+ const void *tb_latest(TripleBuffer *tb);
+ void* server_tick(void *args);
+ void* client_tick(void *args);
+ void step_ball();
+ void update_view(GameState *s);
+ void client();
+ void server();
+ void end_game();
+ void draw(Cell frame[FRAME_ROWS][FRAME_COLS], const GameState *s);
+ void* render_loop(void *args);
+ void server_frame(GameState *s);
+ void client_frame(GameState *s);
+ void *handle_render(void *args);
+ void *move_ballB(void *args);
+ void *read_from_server(void *args);
+ void *move_ball(void *args);
+ void *rcv_paddleB_from_client_handler(void *args);
+ void update_paddle_old(int ch);
+ void update_paddle(Paddle *paddle, int ch);
+ void host(int port, int shards);
+ void bots(const char *ip, int port, int count);
+ int join_host(const char *ip, int port);
+ void reset_ball();
+ void server();
+ void client();
+ int penalty;
+ Paddle paddle;
+
+
+// check whether we are running the client or the server
+int main(int argc, char *argv[]) {
+
+     ball = (Ball){WIDTH / 2, HEIGHT / 2, 1, 1};
+     paddleA = (Paddle){WIDTH / 2 - 3, 10};
+     paddleB = (Paddle){WIDTH / 2 - 3, 10};
+     game = (GameState){ball, paddleA, paddleB, penaltyA, penaltyB,game_running};
+
+
+     if (strcmp(argv[1],"server")==0){
+         printf("Server\n");
+         // pthread_create(&ball_thread, NULL, move_ballA, NULL);
+         struct sockaddr_in address;
+         int addrlen = sizeof(address);
+
+         server_fd = socket(AF_INET, SOCK_DGRAM, 0); //step 1
+         memset(&address, '\0', sizeof(address));  //step 2, next 3 lines
+         address.sin_family = AF_INET;
+         address.sin_addr.s_addr = htonl(INADDR_ANY);
+         address.sin_port = htons(atoi(argv[2]));
+
+         bind(server_fd, (struct sockaddr *)&address, sizeof(address)); //step 3
+
+         // The client is whoever sends the first input packet; its inputs
+         // are repeated in the packets that follow, so this one is dropped
+         unsigned char first[PACKET_MAX];
+         recvfrom(server_fd, first, sizeof(first), 0, (struct sockaddr *)&address, (socklen_t *)&addrlen);
+         connect(server_fd, (struct sockaddr *)&address, addrlen);
+         client_fd = server_fd;
+         printf("Client connected\n");
+         if (argc > 3)
+             render_fps = atoi(argv[3]);  // ./pingpong server <port> [fps]
+         server();
+         close(client_fd);
+     }
+     else if(strcmp(argv[1],"client")==0){
+
+         struct sockaddr_in address;
+         int addrlen = sizeof(address);
+
+         client_fd = socket(AF_INET, SOCK_DGRAM, 0);
+         memset(&address, '\0', sizeof(address));
+         address.sin_family = AF_INET;
+         address.sin_port = htons(12345);
+         printf("IP: %s\n",argv[2]);
+         inet_pton(AF_INET,argv[2], &address.sin_addr); //change the IP accordingly
+
+         connect(client_fd, (struct sockaddr *)&address, addrlen);
+         printf("Connected to server\n");
+         if (argc > 3)
+             render_fps = atoi(argv[3]);  // ./pingpong client <ip> [fps]
+         client();
+         close(client_fd);
+     }
+     else if(strcmp(argv[1],"host")==0){
+         // Headless: ./pingpong host <port> [shards]
+         host(atoi(argv[2]), argc > 3 ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+     }
+     else if(strcmp(argv[1],"join")==0){
+         // ./pingpong join <host_ip> <port> [fps]: plays a match the host's lobby assigns
+         if (argc > 4)
+             render_fps = atoi(argv[4]);
+         if (join_host(argv[2], atoi(argv[3])) < 0) {
+             printf("No answer from the host\n");
+             return 1;
+         }
+         printf("Joined as player %c\n", local_side);
+         client();
+         close(client_fd);
+     }
+     else if(strcmp(argv[1],"bots")==0){
+         // Load for a host: ./pingpong bots <host_ip> <port> <count>
+         bots(argv[2], atoi(argv[3]), atoi(argv[4]));
+     }
+     return 0;
+ }
+
+// use different threads for each of - receieve, send, computing ball's motion, etc..
+void server()
+{
+  printf("Hello from Server!\n");
+  init();
+
+    for (int i = 0; i < 3; i++)
+        state_slots[i] = (GameState){ball, paddleA, paddleB, penaltyA, penaltyB, 1};
+    tb_init(&state_pub, &state_slots[0], &state_slots[1], &state_slots[2]);
+    local_paddle = paddleA;
+    paddle_input = paddleA.x;
+    render_state = server_frame;
+    pthread_t tick_thread, render_thread;
+    pthread_create(&tick_thread, NULL, server_tick, NULL);
+    pthread_create(&render_thread, NULL, render_loop, NULL);
+
+    // This thread only reads keys; render_loop() draws
+    while (__atomic_load_n(&game_running, __ATOMIC_RELAXED)) {
+        int ch = getch();
+        if (ch == 'q') {
+            __atomic_store_n(&game_running, 0, __ATOMIC_RELAXED);
+            break;
+        }
+        update_paddle(&local_paddle, ch);
+        __atomic_store_n(&paddle_input, local_paddle.x, __ATOMIC_RELAXED);
+    }
+
+    pthread_join(tick_thread,NULL);
+    pthread_join(render_thread,NULL);
+    end_game();
+    return;
+}
+
+
+void client()
+{
+  printf("Hello from Client!\n");
+  init();
+
+    tb_init(&view_pub, &view_slots[0], &view_slots[1], &view_slots[2]);
+    local_paddle = local_side == 'A' ? paddleA : paddleB;
+    paddle_input = local_paddle.x;
+    render_state = client_frame;
+    pthread_t tick_thread, render_thread;
+    pthread_create(&tick_thread, NULL, client_tick, NULL);
+    pthread_create(&render_thread, NULL, render_loop, NULL);
+
+    // This thread only reads keys; render_loop() draws
+    while (__atomic_load_n(&game_running, __ATOMIC_RELAXED)) {
+        int ch = getch();
+        if (ch == 'q') {
+            __atomic_store_n(&game_running, 0, __ATOMIC_RELAXED);
+            break;
+        }
+        // Our paddle moves at once; the move goes out with the next input
+        int before = local_paddle.x;
+        update_paddle(&local_paddle, ch);
+        __atomic_store_n(&paddle_input, local_paddle.x, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&pending_move, local_paddle.x - before, __ATOMIC_RELAXED);
+    }
+
+    pthread_join(tick_thread,NULL);
+    pthread_join(render_thread,NULL);
+    end_game();
+    return;
+}
+
+void tb_init(TripleBuffer *tb, void *a, void *b, void *c) {
+    tb->slot[0] = a;
+    tb->slot[1] = b;
+    tb->slot[2] = c;
+    tb->back = 0;
+    tb->middle = 1;
+    tb->front = 2;
+}
+
+// Writer: the slot to fill before tb_publish().
+void *tb_back(TripleBuffer *tb) {
+    return tb->slot[tb->back];
+}
+
+void tb_publish(TripleBuffer *tb) {
+    tb->back = __atomic_exchange_n(&tb->middle, tb->back | TB_FRESH, __ATOMIC_ACQ_REL) & ~TB_FRESH;
+}
+
+// Reader: the newest copy published, valid until the next call.
+const void *tb_latest(TripleBuffer *tb) {
+    if (__atomic_load_n(&tb->middle, __ATOMIC_RELAXED) & TB_FRESH)
+        tb->front = __atomic_exchange_n(&tb->middle, tb->front, __ATOMIC_ACQ_REL) & ~TB_FRESH;
+    return tb->slot[tb->front];
+}
+
+long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Moves *next on by period on a fixed schedule. A schedule that fell more
+// than a few periods behind (the process was descheduled) restarts from
+// now rather than running the missed ones back to back.
+void advance_schedule(struct timespec *next, long long period) {
+    long long at = next->tv_sec * 1000000000LL + next->tv_nsec + period;
+    if (now_ns() - at > 4 * period)
+        clock_gettime(CLOCK_MONOTONIC, next);
+    else
+        *next = (struct timespec){ at / 1000000000LL, at % 1000000000LL };
+}
+
+// Moves *next to the next tick
+void advance_tick(struct timespec *next) {
+    advance_schedule(next, TICK_NS);
+}
+
+void sleep_until_tick(struct timespec *next) {
+    advance_tick(next);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+}
+
+void put32(unsigned char *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+uint32_t get32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+int *state_field(GameState *s, int i) {
+    return (int *)((char *)s + state_fields[i]);
+}
+
+// Snapshot packet: 'S', seq, base, a bitmask of the fields that differ
+// from snapshot base, then those fields. Base 0 means a full state, with
+// every field present. Deltas are against the newest snapshot the client
+// acknowledged, not the previous one sent, so every packet that arrives
+// can be decoded whatever was lost before it.
+int encode_snapshot(unsigned char *buf, uint32_t seq, GameState *s, uint32_t base, GameState *from) {
+    int len = 11, mask = 0;
+    buf[0] = 'S';
+    put32(buf + 1, seq);
+    put32(buf + 5, base);
+    for (int i = 0; i < STATE_FIELDS; i++) {
+        if (base && *state_field(s, i) == *state_field(from, i))
+            continue;
+        mask |= 1 << i;
+        put32(buf + len, *state_field(s, i));
+        len += 4;
+    }
+    buf[9] = mask >> 8;
+    buf[10] = mask;
+    return len;
+}
+
+// Decodes a snapshot into *s. Returns its seq, or 0 if it is already kept
+// or too old to keep, or its base is no longer kept. A snapshot overtaken
+// by a newer one is still decoded, to fill its slot in the history.
+uint32_t decode_snapshot(const unsigned char *buf, int len, GameState *s) {
+    if (len < 11 || buf[0] != 'S')
+        return 0;
+    uint32_t seq = get32(buf + 1), base = get32(buf + 5);
+    int mask = buf[9] << 8 | buf[10], pos = 11;
+    if (snap_history_seq[seq % SNAP_HISTORY] == seq || (snap_seq >= SNAP_HISTORY && seq <= snap_seq - SNAP_HISTORY))
+        return 0;
+    if (base) {
+        if (snap_history_seq[base % SNAP_HISTORY] != base)
+            return 0;
+        *s = snap_history[base % SNAP_HISTORY];
+    }
+    for (int i = 0; i < STATE_FIELDS; i++) {
+        if (!(mask & 1 << i))
+            continue;
+        if (pos + 4 > len)
+            return 0;
+        *state_field(s, i) = (int)get32(buf + pos);
+        pos += 4;
+    }
+    return seq;
+}
+
+// Server: sends *s as snapshot snap_seq + 1.
+void send_snapshot(GameState *s) {
+    unsigned char buf[PACKET_MAX];
+    uint32_t base = 0;
+    snap_seq++;
+    snap_history[snap_seq % SNAP_HISTORY] = *s;
+    snap_history_seq[snap_seq % SNAP_HISTORY] = snap_seq;
+    if (client_ack && snap_seq - client_ack < SNAP_HISTORY &&
+        snap_history_seq[client_ack % SNAP_HISTORY] == client_ack)
+        base = client_ack;
+    int len = encode_snapshot(buf, snap_seq, s, base, &snap_history[base % SNAP_HISTORY]);
+    send(client_fd, buf, len, 0);
+}
+
+// Input packet: 'I', the newest snapshot applied, the newest input seq,
+// how many inputs follow, the paddle position after the newest, then
+// that many paddle moves (signed bytes), oldest first.
+//
+// Server: applies every input not seen yet, in order. If more were lost
+// than a packet repeats, the moves are gone and the paddle is put where
+// the client says it is. sent is the newest snapshot sent to the player,
+// *ack and *last_input the player's. Returns 0 for something not an input.
+int apply_input(const unsigned char *buf, int n, uint32_t sent, uint32_t *ack, uint32_t *last_input, Paddle *paddle) {
+    if (n < 14 || buf[0] != 'I' || n < 14 + buf[9])
+        return 0;
+    uint32_t acked = get32(buf + 1), newest = get32(buf + 5);
+    int count = buf[9];
+    if (acked > *ack && acked <= sent)
+        *ack = acked;
+    if (newest <= *last_input)
+        return 1;
+    int lost = newest - count > *last_input;
+    for (int i = 0; i < count; i++) {
+        if (newest - count + 1 + i <= *last_input)
+            continue;
+        for (int move = (signed char)buf[14 + i]; move; move += move < 0 ? 1 : -1)
+            update_paddle(paddle, move < 0 ? KEY_LEFT : KEY_RIGHT);
+    }
+    if (lost)
+        paddle->x = (int)get32(buf + 10);
+    *last_input = newest;
+    return 1;
+}
+
+void receive_inputs() {
+    unsigned char buf[PACKET_MAX];
+    int n;
+    while ((n = recv(client_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        apply_input(buf, n, snap_seq, &client_ack, &input_seq, &paddleB);
+}
+
+// Client: keeps every snapshot that arrives in time, for
+// update_view() to render from. The server sends one per tick, so snapshot
+// seq is the server's clock; the least delayed snapshot gives the local
+// time of tick 0. The estimate may creep up by CLOCK_DRIFT_NS a snapshot,
+// so it follows a route that got slower. A snapshot that arrives after a
+// newer one only fills in the history. Our own paddle is left alone; it
+// already moved when the key was pressed. What changed is published to the
+// renderer.
+void receive_snapshots() {
+    unsigned char buf[PACKET_MAX];
+    int n, kept = 0;
+    while ((n = recv(client_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        GameState s = {0};
+        uint32_t seq = decode_snapshot(buf, n, &s);
+        if (!seq)
+            continue;
+        long long offset = now_ns() - (long long)seq * TICK_NS;
+        if (!snap_seq || offset < clock_offset + CLOCK_DRIFT_NS)
+            clock_offset = offset;
+        else
+            clock_offset += CLOCK_DRIFT_NS;
+        snap_history[seq % SNAP_HISTORY] = s;
+        snap_history_seq[seq % SNAP_HISTORY] = seq;
+        kept = 1;
+        if (seq < snap_seq)
+            continue;
+        snap_seq = seq;
+        if (!s.game_running)
+            __atomic_store_n(&game_running, 0, __ATOMIC_RELAXED);
+    }
+    if (!kept)
+        return;
+    SnapshotView *v = tb_back(&view_pub);
+    memcpy(v->history, snap_history, sizeof(snap_history));
+    memcpy(v->history_seq, snap_history_seq, sizeof(snap_history_seq));
+    v->newest = snap_seq;
+    v->clock_offset = clock_offset;
+    tb_publish(&view_pub);
+}
+
+// Client: fills *s with what is shown now, from the newest SnapshotView
+// the tick thread published. Rendering runs
+// INTERP_DELAY_NS behind the server's clock, between the two snapshots
+// around that moment, so a late or lost snapshot inside the delay changes
+// nothing on screen. Past the newest snapshot the ball is carried on along
+// dx/dy for up to EXTRAPOLATE_TICKS. When snapshots resume, the difference
+// between where it was shown and where it really is gets eased out over
+// CORRECTION_NS instead of jumped; a jump of more than a few cells (a
+// serve after a miss) is shown as it is.
+void update_view(GameState *s) {
+    const SnapshotView *v = tb_latest(&view_pub);
+    uint32_t newest = v->newest;
+    *s = (GameState){ball, paddleA, paddleB, penaltyA, penaltyB, 1};
+    if (!newest)
+        return;
+    long long now = now_ns();
+    double t = (double)(now - v->clock_offset - INTERP_DELAY_NS) / TICK_NS;
+    const GameState *a = NULL, *b = NULL;
+    uint32_t sa = 0, sb = 0;
+    for (uint32_t seq = newest; seq && newest - seq < SNAP_HISTORY; seq--) {
+        if (v->history_seq[seq % SNAP_HISTORY] != seq)
+            continue;
+        if (seq <= t) {
+            a = &v->history[seq % SNAP_HISTORY];
+            sa = seq;
+            break;
+        }
+        b = &v->history[seq % SNAP_HISTORY];
+        sb = seq;
+    }
+    if (!a && !b)
+        return;
+    *s = v->history[newest % SNAP_HISTORY];
+
+    double x, y, pa, pb;  // the caller puts our own paddle over one of pa, pb
+    int extrapolated = 0;
+    if (a && b) {
+        double f = (t - sa) / (sb - sa);
+        int steps = (sb - sa) / BALL_TICKS + 1;
+        if (abs(b->ball.x - a->ball.x) > steps || abs(b->ball.y - a->ball.y) > steps)
+            f = f < 0.5 ? 0 : 1;  // jumps at the moment a step would round over
+        x = a->ball.x + (b->ball.x - a->ball.x) * f;
+        y = a->ball.y + (b->ball.y - a->ball.y) * f;
+        pa = a->paddleA.x + (b->paddleA.x - a->paddleA.x) * f;
+        pb = a->paddleB.x + (b->paddleB.x - a->paddleB.x) * f;
+        s->ball = a->ball;
+    } else if (a) {
+        double ahead = t - sa < EXTRAPOLATE_TICKS ? t - sa : EXTRAPOLATE_TICKS;
+        x = a->ball.x + a->ball.dx * ahead / BALL_TICKS;
+        y = a->ball.y + a->ball.dy * ahead / BALL_TICKS;
+        x = x < 2 ? 2 : x > WIDTH - 2 ? WIDTH - 2 : x;
+        y = y < 1 ? 1 : y > HEIGHT - 2 ? HEIGHT - 2 : y;
+        pa = a->paddleA.x;
+        pb = a->paddleB.x;
+        s->ball = a->ball;
+        extrapolated = 1;
+    } else {
+        x = b->ball.x;
+        y = b->ball.y;
+        pa = b->paddleA.x;
+        pb = b->paddleB.x;
+        s->ball = b->ball;
+    }
+
+    if (view_extrapolated && !extrapolated) {
+        view_err_x = view_x - x;
+        view_err_y = view_y - y;
+    }
+    double keep = view_ns ? 1 - (double)(now - view_ns) / CORRECTION_NS : 0;
+    keep = keep < 0 ? 0 : keep;
+    view_err_x *= keep;
+    view_err_y *= keep;
+    if (view_err_x > 3 || view_err_x < -3 || view_err_y > 3 || view_err_y < -3)
+        view_err_x = view_err_y = 0;
+    view_x = x + view_err_x;
+    view_y = y + view_err_y;
+    view_ns = now;
+    view_extrapolated = extrapolated;
+    s->ball.x = (int)(view_x + 0.5);
+    s->ball.y = (int)(view_y + 0.5);
+    s->paddleA.x = (int)(pa + 0.5);
+    s->paddleB.x = (int)(pb + 0.5);
+}
+
+// Client: sends this tick's paddle moves, with the previous ones again.
+void send_input() {
+    unsigned char buf[PACKET_MAX];
+    int move = __atomic_exchange_n(&pending_move, 0, __ATOMIC_RELAXED);
+    input_seq++;
+    input_moves[input_seq % INPUT_REDUNDANCY] = move < -127 ? -127 : move > 127 ? 127 : move;
+    int count = input_seq < INPUT_REDUNDANCY ? input_seq : INPUT_REDUNDANCY;
+    buf[0] = 'I';
+    put32(buf + 1, snap_seq);
+    put32(buf + 5, input_seq);
+    buf[9] = count;
+    put32(buf + 10, __atomic_load_n(&paddle_input, __ATOMIC_RELAXED));
+    for (int i = 0; i < count; i++)
+        buf[14 + i] = (unsigned char)input_moves[(input_seq - count + 1 + i) % INPUT_REDUNDANCY];
+    send(client_fd, buf, 14 + count, 0);
+}
+
+// The server's only game loop, on a fixed timestep: inputs that arrived
+// since the last tick, physics, then the new state, which is published to
+// the renderer and sent as a snapshot. The game state is this thread's
+// alone; nothing on the tick takes a lock.
+void* server_tick(void* args) {
+    struct timespec next;
+    long tick = 0;
+    int running = 1;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (int quit = 0; quit <= QUIT_REPEATS; quit += !running) {
+        paddleA.x = __atomic_load_n(&paddle_input, __ATOMIC_RELAXED);
+        receive_inputs();
+        if (running && ++tick % BALL_TICKS == 0)
+            step_ball();
+        running = __atomic_load_n(&game_running, __ATOMIC_RELAXED);
+        GameState *s = tb_back(&state_pub);
+        *s = (GameState){ball, paddleA, paddleB, penaltyA, penaltyB, running};
+        send_snapshot(s);
+        tb_publish(&state_pub);
+        sleep_until_tick(&next);
+    }
+    return NULL;
+}
+
+// The client's loop, on the same timestep: input out, then snapshots in
+// as they arrive until the next tick, so each is stamped on arrival. The
+// input doubles as the acknowledgement the server encodes deltas against.
+void* client_tick(void* args) {
+    struct timespec next;
+    struct pollfd pfd = { .fd = client_fd, .events = POLLIN };
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (__atomic_load_n(&game_running, __ATOMIC_RELAXED)) {
+        send_input();
+        advance_tick(&next);
+        long long left;
+        while ((left = next.tv_sec * 1000000000LL + next.tv_nsec - now_ns()) > 0)
+            if (poll(&pfd, 1, (left + 999999) / 1000000) > 0)
+                receive_snapshots();
+    }
+    return NULL;
+}
+
+// Headless host: ./pingpong host <port> [shards] runs many matches at
+// once for ./pingpong join clients. The lobby listens on <port>, shard i
+// on <port> + 1 + i. Each shard is a thread pinned to one core, with its
+// own socket, tick timer and epoll loop, and owns its matches outright:
+// shards share nothing, and the lobby only hands them new players. The
+// lobby sends joining players to shards two at a time, so they pair up,
+// and the shard answers the player itself: 'A' and the side it plays. The
+// client then talks to the address the answer came from, with the same
+// snapshots and inputs as a 1v1 game.
+//
+// A shard's matches are a struct of arrays. Everything a ball step reads
+// and writes is in its own contiguous array, so one branch-free sweep
+// advances every ball of the shard and the compiler can vectorize it;
+// what only a packet touches (addresses, acks, snapshot history) is kept
+// apart so the sweep never pulls it into cache.
+ typedef struct {
+     // swept every ball step
+     int *ball_x, *ball_y, *ball_dx, *ball_dy;
+     int *paddleA_x, *paddleB_x;
+     int *penaltyA, *penaltyB;
+     int *ready;                   // both players joined; the ball waits until then
+     // per tick or per packet
+     int *idle;                    // ticks since either player's last input
+     uint32_t *seq;                // newest snapshot sent
+     GameState *history;           // SNAP_HISTORY per match
+     uint32_t *history_seq;
+     struct sockaddr_in *addr;     // per player: 2 * match plays A, 2 * match + 1 plays B
+     uint32_t *ack, *input_seq;    // per player
+     int count, cap;
+     int open;                     // match waiting for its second player, or -1
+     // players by address: open addressing, linear probing
+     uint64_t *keys;               // 0 in an empty slot
+     int *vals;                    // 2 * match + side
+     int slots;
+     // lobby -> shard
+     pthread_mutex_t lock;
+     struct sockaddr_in *joins;
+     int njoins, joins_cap;
+     int fd, epfd, timerfd, eventfd, cpu;
+     long tick;
+     // read and reset by the lobby for its stats line
+     long long stat_ticks, stat_tick_ns, stat_sweep_ns, stat_match_ticks;
+     int stat_matches;
+ } Shard;
+
+ Shard shards[MAX_SHARDS];
+ int shard_count;
+
+uint64_t addr_key(const struct sockaddr_in *a) {
+    return 1ULL << 48 | (uint64_t)ntohl(a->sin_addr.s_addr) << 16 | ntohs(a->sin_port);
+}
+
+int shard_slot(Shard *sh, uint64_t key) {
+    int i = (int)((key * 0x9e3779b97f4a7c15ULL) >> 40) & (sh->slots - 1);
+    while (sh->keys[i] && sh->keys[i] != key)
+        i = (i + 1) & (sh->slots - 1);
+    return i;
+}
+
+void shard_map_put(Shard *sh, uint64_t key, int val) {
+    if ((sh->count * 2 + 2) * 2 > sh->slots) {
+        uint64_t *keys = sh->keys;
+        int *vals = sh->vals, old = sh->slots;
+        sh->slots = sh->slots ? sh->slots * 2 : 1024;
+        sh->keys = calloc(sh->slots, sizeof(uint64_t));
+        sh->vals = calloc(sh->slots, sizeof(int));
+        for (int i = 0; i < old; i++)
+            if (keys[i]) {
+                int j = shard_slot(sh, keys[i]);
+                sh->keys[j] = keys[i];
+                sh->vals[j] = vals[i];
+            }
+        free(keys);
+        free(vals);
+    }
+    int i = shard_slot(sh, key);
+    sh->keys[i] = key;
+    sh->vals[i] = val;
+}
+
+// Removes key, shifting later entries of its probe run back into the hole.
+void shard_map_del(Shard *sh, uint64_t key) {
+    int i = shard_slot(sh, key), mask = sh->slots - 1;
+    if (!sh->keys[i])
+        return;
+    for (int j = (i + 1) & mask; sh->keys[j]; j = (j + 1) & mask) {
+        int home = (int)((sh->keys[j] * 0x9e3779b97f4a7c15ULL) >> 40) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            sh->keys[i] = sh->keys[j];
+            sh->vals[i] = sh->vals[j];
+            i = j;
+        }
+    }
+    sh->keys[i] = 0;
+}
+
+void shard_grow(Shard *sh) {
+    sh->cap = sh->cap ? sh->cap * 2 : 256;
+    int **ints[] = { &sh->ball_x, &sh->ball_y, &sh->ball_dx, &sh->ball_dy, &sh->paddleA_x,
+                     &sh->paddleB_x, &sh->penaltyA, &sh->penaltyB, &sh->ready, &sh->idle };
+    for (int i = 0; i < (int)(sizeof(ints) / sizeof(ints[0])); i++)
+        *ints[i] = realloc(*ints[i], sh->cap * sizeof(int));
+    sh->seq = realloc(sh->seq, sh->cap * sizeof(uint32_t));
+    sh->history = realloc(sh->history, sh->cap * SNAP_HISTORY * sizeof(GameState));
+    sh->history_seq = realloc(sh->history_seq, sh->cap * SNAP_HISTORY * sizeof(uint32_t));
+    sh->addr = realloc(sh->addr, sh->cap * 2 * sizeof(struct sockaddr_in));
+    sh->ack = realloc(sh->ack, sh->cap * 2 * sizeof(uint32_t));
+    sh->input_seq = realloc(sh->input_seq, sh->cap * 2 * sizeof(uint32_t));
+}
+
+// Copies match `from` over match `to`, every array.
+void match_move(Shard *sh, int to, int from) {
+    sh->ball_x[to] = sh->ball_x[from];
+    sh->ball_y[to] = sh->ball_y[from];
+    sh->ball_dx[to] = sh->ball_dx[from];
+    sh->ball_dy[to] = sh->ball_dy[from];
+    sh->paddleA_x[to] = sh->paddleA_x[from];
+    sh->paddleB_x[to] = sh->paddleB_x[from];
+    sh->penaltyA[to] = sh->penaltyA[from];
+    sh->penaltyB[to] = sh->penaltyB[from];
+    sh->ready[to] = sh->ready[from];
+    sh->idle[to] = sh->idle[from];
+    sh->seq[to] = sh->seq[from];
+    memcpy(&sh->history[to * SNAP_HISTORY], &sh->history[from * SNAP_HISTORY], SNAP_HISTORY * sizeof(GameState));
+    memcpy(&sh->history_seq[to * SNAP_HISTORY], &sh->history_seq[from * SNAP_HISTORY], SNAP_HISTORY * sizeof(uint32_t));
+    for (int p = 0; p < 2; p++) {
+        sh->addr[2 * to + p] = sh->addr[2 * from + p];
+        sh->ack[2 * to + p] = sh->ack[2 * from + p];
+        sh->input_seq[2 * to + p] = sh->input_seq[2 * from + p];
+    }
+}
+
+int match_add(Shard *sh) {
+    if (sh->count == sh->cap)
+        shard_grow(sh);
+    int i = sh->count++;
+    sh->ball_x[i] = WIDTH / 2;  // where main() starts the 1v1 game's ball
+    sh->ball_y[i] = HEIGHT / 2;
+    sh->ball_dx[i] = sh->ball_dy[i] = 1;
+    sh->paddleA_x[i] = sh->paddleB_x[i] = WIDTH / 2 - 3;
+    sh->penaltyA[i] = sh->penaltyB[i] = 0;
+    sh->ready[i] = sh->idle[i] = 0;
+    sh->seq[i] = 0;
+    memset(&sh->history_seq[i * SNAP_HISTORY], 0, SNAP_HISTORY * sizeof(uint32_t));
+    memset(&sh->addr[2 * i], 0, 2 * sizeof(struct sockaddr_in));
+    sh->ack[2 * i] = sh->ack[2 * i + 1] = 0;
+    sh->input_seq[2 * i] = sh->input_seq[2 * i + 1] = 0;
+    return i;
+}
+
+// Drops match i; the last match takes its place.
+void match_remove(Shard *sh, int i) {
+    int last = --sh->count;
+    for (int p = 0; p < 2; p++)
+        if (sh->addr[2 * i + p].sin_family)
+            shard_map_del(sh, addr_key(&sh->addr[2 * i + p]));
+    if (sh->open == i)
+        sh->open = -1;
+    if (i == last)
+        return;
+    match_move(sh, i, last);
+    for (int p = 0; p < 2; p++)
+        if (sh->addr[2 * i + p].sin_family)
+            sh->vals[shard_slot(sh, addr_key(&sh->addr[2 * i + p]))] = 2 * i + p;
+    if (sh->open == last)
+        sh->open = i;
+}
+
+// A player the lobby sent: seats it in the open match, or opens one, and
+// tells it which side it plays. A player seated already (its answer was
+// lost and it asked again) is told again.
+void shard_join(Shard *sh, const struct sockaddr_in *addr) {
+    uint64_t key = addr_key(addr);
+    int slot = sh->slots ? shard_slot(sh, key) : -1, player;
+    if (slot >= 0 && sh->keys[slot])
+        player = sh->vals[slot];
+    else {
+        if (sh->open >= 0) {
+            player = 2 * sh->open + 1;
+            sh->ready[sh->open] = 1;
+            sh->open = -1;
+        } else {
+            sh->open = match_add(sh);
+            player = 2 * sh->open;
+        }
+        sh->addr[player] = *addr;
+        sh->idle[player / 2] = 0;
+        shard_map_put(sh, key, player);
+    }
+    unsigned char answer[2] = { 'A', player % 2 ? 'B' : 'A' };
+    sendto(sh->fd, answer, 2, 0, (const struct sockaddr *)addr, sizeof(*addr));
+}
+
+// One ball step for every match of the shard: step_ball()'s rules, in the
+// same order, with each branch turned into a mask (all ones or zero) so
+// the loop has no control flow and vectorizes (at -O3). A match still
+// waiting for its second player keeps its ball where it is.
+void sweep_balls(int n, int *restrict bx, int *restrict by, int *restrict bdx, int *restrict bdy,
+                 const int *restrict pa, const int *restrict pb, const int *restrict ready,
+                 int *restrict pena, int *restrict penb) {
+    for (int i = 0; i < n; i++) {
+        int go = -ready[i];
+        int dx = bdx[i], dy = bdy[i];
+        int x = bx[i] + (dx & go), y = by[i] + (dy & go);
+        int flip = -((y == 2) & (x >= pb[i] - 1) & (x < pb[i] + PADDLE_WIDTH + 1)) & go;
+        dy = (dy ^ flip) - flip;
+        int miss = -(y <= 1) & go;
+        pena[i] -= miss;
+        x ^= (x ^ (OFFSETX + WIDTH / 2)) & miss;
+        y ^= (y ^ (OFFSETY + HEIGHT / 2)) & miss;
+        dx ^= (dx ^ 1) & miss;
+        dy ^= (dy ^ 1) & miss;
+        flip = -((x <= 2) | (x >= WIDTH - 2)) & go;
+        dx = (dx ^ flip) - flip;
+        flip = -((y == HEIGHT - 3) & (x >= pa[i] - 1) & (x < pa[i] + PADDLE_WIDTH + 1)) & go;
+        dy = (dy ^ flip) - flip;
+        miss = -(y >= HEIGHT - 2) & go;
+        penb[i] -= miss;
+        bx[i] = x ^ ((x ^ (OFFSETX + WIDTH / 2)) & miss);
+        by[i] = y ^ ((y ^ (OFFSETY + HEIGHT / 2)) & miss);
+        bdx[i] = dx ^ ((dx ^ 1) & miss);
+        bdy[i] = dy ^ ((dy ^ 1) & miss);
+    }
+}
+
+void shard_sweep(Shard *sh) {
+    sweep_balls(sh->count, sh->ball_x, sh->ball_y, sh->ball_dx, sh->ball_dy,
+                sh->paddleA_x, sh->paddleB_x, sh->ready, sh->penaltyA, sh->penaltyB);
+}
+
+// Inputs that arrived since the last tick, in batches.
+void shard_receive(Shard *sh) {
+    unsigned char bufs[MMSG_BATCH][PACKET_MAX];
+    struct sockaddr_in from[MMSG_BATCH];
+    struct iovec iov[MMSG_BATCH];
+    struct mmsghdr msgs[MMSG_BATCH];
+    int n;
+    do {
+        for (int i = 0; i < MMSG_BATCH; i++) {
+            iov[i] = (struct iovec){ bufs[i], PACKET_MAX };
+            msgs[i].msg_hdr = (struct msghdr){ .msg_name = &from[i], .msg_namelen = sizeof(from[i]),
+                                               .msg_iov = &iov[i], .msg_iovlen = 1 };
+        }
+        n = recvmmsg(sh->fd, msgs, MMSG_BATCH, MSG_DONTWAIT, NULL);
+        for (int i = 0; i < n && sh->slots; i++) {
+            int slot = shard_slot(sh, addr_key(&from[i]));
+            if (!sh->keys[slot])
+                continue;
+            int player = sh->vals[slot], m = player / 2;
+            Paddle paddle = { player % 2 ? sh->paddleB_x[m] : sh->paddleA_x[m], PADDLE_WIDTH };
+            if (!apply_input(bufs[i], msgs[i].msg_len, sh->seq[m], &sh->ack[player], &sh->input_seq[player], &paddle))
+                continue;
+            if (player % 2)
+                sh->paddleB_x[m] = paddle.x;
+            else
+                sh->paddleA_x[m] = paddle.x;
+            sh->idle[m] = 0;
+        }
+    } while (n == MMSG_BATCH);
+}
+
+// One tick of every match: the ball sweep every BALL_TICKS ticks, then a
+// snapshot to each player, delta-encoded against what that player acked.
+// Matches nobody has played for MATCH_TIMEOUT_TICKS are dropped.
+void shard_tick(Shard *sh) {
+    static __thread unsigned char bufs[MMSG_BATCH][PACKET_MAX];
+    struct iovec iov[MMSG_BATCH];
+    struct mmsghdr msgs[MMSG_BATCH];
+    int queued = 0;
+    long long start = now_ns(), swept = start;
+    if (++sh->tick % BALL_TICKS == 0) {
+        shard_sweep(sh);
+        swept = now_ns();
+    }
+    for (int m = 0; m < sh->count; m++) {
+        if (++sh->idle[m] > MATCH_TIMEOUT_TICKS) {
+            match_remove(sh, m--);
+            continue;
+        }
+        GameState s = { { sh->ball_x[m], sh->ball_y[m], sh->ball_dx[m], sh->ball_dy[m] },
+                        { sh->paddleA_x[m], PADDLE_WIDTH }, { sh->paddleB_x[m], PADDLE_WIDTH },
+                        sh->penaltyA[m], sh->penaltyB[m], 1 };
+        uint32_t seq = ++sh->seq[m];
+        GameState *history = &sh->history[m * SNAP_HISTORY];
+        uint32_t *history_seq = &sh->history_seq[m * SNAP_HISTORY];
+        history[seq % SNAP_HISTORY] = s;
+        history_seq[seq % SNAP_HISTORY] = seq;
+        for (int p = 2 * m; p < 2 * m + 2; p++) {
+            if (!sh->addr[p].sin_family)
+                continue;
+            uint32_t base = sh->ack[p];
+            if (!base || seq - base >= SNAP_HISTORY || history_seq[base % SNAP_HISTORY] != base)
+                base = 0;
+            int len = encode_snapshot(bufs[queued], seq, &s, base, &history[base % SNAP_HISTORY]);
+            iov[queued] = (struct iovec){ bufs[queued], len };
+            msgs[queued].msg_hdr = (struct msghdr){ .msg_name = &sh->addr[p], .msg_namelen = sizeof(sh->addr[p]),
+                                                    .msg_iov = &iov[queued], .msg_iovlen = 1 };
+            if (++queued == MMSG_BATCH) {
+                sendmmsg(sh->fd, msgs, queued, 0);
+                queued = 0;
+            }
+        }
+    }
+    if (queued)
+        sendmmsg(sh->fd, msgs, queued, 0);
+    long long end = now_ns();
+    __atomic_add_fetch(&sh->stat_ticks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sh->stat_tick_ns, end - start, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sh->stat_sweep_ns, swept - start, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sh->stat_match_ticks, sh->count, __ATOMIC_RELAXED);
+    __atomic_store_n(&sh->stat_matches, sh->count, __ATOMIC_RELAXED);
+}
+
+// A shard's thread: one epoll loop for its timer, its socket and the
+// lobby's wakeups, on the core it is pinned to.
+void* shard_main(void* args) {
+    Shard *sh = args;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(sh->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    struct epoll_event events[3];
+    for (;;) {
+        int n = epoll_wait(sh->epfd, events, 3, -1);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            uint64_t count;
+            if (fd == sh->fd)
+                shard_receive(sh);
+            else if (fd == sh->eventfd && read(fd, &count, sizeof(count)) == sizeof(count)) {
+                pthread_mutex_lock(&sh->lock);
+                int njoins = sh->njoins;
+                struct sockaddr_in joins[njoins ? njoins : 1];
+                memcpy(joins, sh->joins, njoins * sizeof(joins[0]));
+                sh->njoins = 0;
+                pthread_mutex_unlock(&sh->lock);
+                for (int j = 0; j < njoins; j++)
+                    shard_join(sh, &joins[j]);
+            } else if (fd == sh->timerfd && read(fd, &count, sizeof(count)) == sizeof(count)) {
+                // Ticks missed while descheduled are run, but no more
+                // than a few, as sleep_until_tick() does
+                for (uint64_t t = 0; t < count && t < 4; t++)
+                    shard_tick(sh);
+            }
+        }
+    }
+    return NULL;
+}
+
+int udp_socket(int port) {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port),
+                                   .sin_addr.s_addr = htonl(INADDR_ANY) };
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    return fd;
+}
+
+void host(int port, int count) {
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    shard_count = count < 1 ? 1 : count > MAX_SHARDS ? MAX_SHARDS : count;
+    int lobby = udp_socket(port);
+    for (int i = 0; i < shard_count; i++) {
+        Shard *sh = &shards[i];
+        sh->fd = udp_socket(port + 1 + i);
+        sh->cpu = i % cpus;
+        sh->open = -1;
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->epfd = epoll_create1(0);
+        sh->eventfd = eventfd(0, EFD_NONBLOCK);
+        sh->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        struct itimerspec every = { { 0, TICK_NS }, { 0, TICK_NS } };
+        timerfd_settime(sh->timerfd, 0, &every, NULL);
+        int fds[] = { sh->fd, sh->eventfd, sh->timerfd };
+        for (int j = 0; j < 3; j++) {
+            struct epoll_event ev = { .events = EPOLLIN, .data.fd = fds[j] };
+            epoll_ctl(sh->epfd, EPOLL_CTL_ADD, fds[j], &ev);
+        }
+        pthread_t thread;
+        pthread_create(&thread, NULL, shard_main, sh);
+    }
+    printf("Host: lobby on port %d, %d shards on ports %d-%d\n", port, shard_count, port + 1, port + shard_count);
+    fflush(stdout);
+
+    // The lobby remembers where it sent each player, so one that asks
+    // again is sent to the same shard
+    static struct { uint64_t key; int shard; } sent[JOIN_CACHE];
+    int next = 0, joined = 0;
+    long long stats_at = now_ns() + STATS_INTERVAL * 1000000000LL;
+    struct pollfd pfd = { .fd = lobby, .events = POLLIN };
+    for (;;) {
+        if (poll(&pfd, 1, 1000) > 0) {
+            unsigned char buf[PACKET_MAX];
+            struct sockaddr_in from;
+            socklen_t len = sizeof(from);
+            if (recvfrom(lobby, buf, sizeof(buf), 0, (struct sockaddr *)&from, &len) > 0 && buf[0] == 'J') {
+                uint64_t key = addr_key(&from);
+                int c = (int)((key * 0x9e3779b97f4a7c15ULL) >> 40) % JOIN_CACHE;
+                if (sent[c].key != key) {
+                    sent[c].key = key;
+                    sent[c].shard = next;
+                    if (++joined % 2 == 0)
+                        next = (next + 1) % shard_count;
+                }
+                Shard *sh = &shards[sent[c].shard];
+                pthread_mutex_lock(&sh->lock);
+                if (sh->njoins == sh->joins_cap) {
+                    int cap = sh->joins_cap ? sh->joins_cap * 2 : 64;
+                    struct sockaddr_in *grown = realloc(sh->joins, cap * sizeof(from));
+                    if (grown) {
+                        sh->joins = grown;
+                        sh->joins_cap = cap;
+                    }
+                }
+                if (sh->njoins < sh->joins_cap)
+                    sh->joins[sh->njoins++] = from;  // else dropped; the player asks again
+                pthread_mutex_unlock(&sh->lock);
+                uint64_t one = 1;
+                // EAGAIN means the counter is saturated: the shard has a wakeup pending anyway
+                if (write(sh->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                    perror("eventfd");
+            }
+        }
+        if (now_ns() < stats_at)
+            continue;
+        stats_at += STATS_INTERVAL * 1000000000LL;
+        long long tick_ns = 0, sweep_ns = 0, match_ticks = 0;
+        int matches = 0;
+        char line[MAX_SHARDS * 16] = "";
+        for (int i = 0; i < shard_count; i++) {
+            Shard *sh = &shards[i];
+            int m = __atomic_load_n(&sh->stat_matches, __ATOMIC_RELAXED);
+            __atomic_exchange_n(&sh->stat_ticks, 0, __ATOMIC_RELAXED);
+            tick_ns += __atomic_exchange_n(&sh->stat_tick_ns, 0, __ATOMIC_RELAXED);
+            sweep_ns += __atomic_exchange_n(&sh->stat_sweep_ns, 0, __ATOMIC_RELAXED);
+            match_ticks += __atomic_exchange_n(&sh->stat_match_ticks, 0, __ATOMIC_RELAXED);
+            matches += m;
+            snprintf(line + strlen(line), sizeof(line) - strlen(line), " %d", m);
+        }
+        // Sweep time is spread over every tick, though it runs on one in BALL_TICKS
+        printf("Host: %d matches (per shard:%s); per 1000 matches a tick takes %.3f ms, the ball sweep %.4f ms\n",
+               matches, line, match_ticks ? tick_ns / 1e3 / match_ticks : 0,
+               match_ticks ? sweep_ns / 1e3 / match_ticks * BALL_TICKS : 0);
+        fflush(stdout);
+    }
+}
+
+// Asks the host's lobby for a match, and points client_fd at the shard
+// that answers. Returns -1 if no answer came.
+int join_host(const char *ip, int port) {
+    struct sockaddr_in lobby = { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, ip, &lobby.sin_addr);
+    client_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct pollfd pfd = { .fd = client_fd, .events = POLLIN };
+    for (int tries = 0; tries < 20; tries++) {
+        sendto(client_fd, "J", 1, 0, (struct sockaddr *)&lobby, sizeof(lobby));
+        if (poll(&pfd, 1, 250) <= 0)
+            continue;
+        unsigned char buf[PACKET_MAX];
+        struct sockaddr_in shard;
+        socklen_t len = sizeof(shard);
+        if (recvfrom(client_fd, buf, sizeof(buf), 0, (struct sockaddr *)&shard, &len) == 2 && buf[0] == 'A') {
+            local_side = buf[1];
+            connect(client_fd, (struct sockaddr *)&shard, len);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Load for a host: count players that join, then send an input every tick
+// (a random paddle move) and ack the snapshots they get, like a client
+// that never looks at them.
+void bots(const char *ip, int port, int count) {
+    struct sockaddr_in lobby = { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, ip, &lobby.sin_addr);
+    int *fds = calloc(count, sizeof(int)), *joined = calloc(count, sizeof(int));
+    uint32_t *ack = calloc(count, sizeof(uint32_t)), *sent = calloc(count, sizeof(uint32_t));
+    Paddle *paddles = calloc(count, sizeof(Paddle));
+    int epfd = epoll_create1(0), timer = timerfd_create(CLOCK_MONOTONIC, 0);
+    struct itimerspec every = { { 0, TICK_NS }, { 0, TICK_NS } };
+    timerfd_settime(timer, 0, &every, NULL);
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = count };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, timer, &ev);
+    for (int i = 0; i < count; i++) {
+        fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        paddles[i] = (Paddle){ WIDTH / 2 - 3, PADDLE_WIDTH };
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+    long long snapshots = 0, stats_at = now_ns() + STATS_INTERVAL * 1000000000LL;
+    long tick = 0;
+    struct epoll_event events[256];
+    for (;;) {
+        int n = epoll_wait(epfd, events, 256, -1);
+        for (int e = 0; e < n; e++) {
+            int i = events[e].data.u32;
+            unsigned char buf[PACKET_MAX];
+            if (i < count) {
+                struct sockaddr_in from;
+                socklen_t len = sizeof(from);
+                int got = recvfrom(fds[i], buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &len);
+                if (got == 2 && buf[0] == 'A' && !joined[i]) {
+                    joined[i] = 1;
+                    connect(fds[i], (struct sockaddr *)&from, len);
+                } else if (got >= 11 && buf[0] == 'S') {
+                    snapshots++;
+                    if (get32(buf + 1) > ack[i])
+                        ack[i] = get32(buf + 1);
+                }
+                continue;
+            }
+            uint64_t expired;
+            if (read(timer, &expired, sizeof(expired)) != sizeof(expired))
+                continue;
+            tick++;
+            for (i = 0; i < count; i++) {
+                if (!joined[i]) {
+                    if (tick % 25 == i % 25)
+                        sendto(fds[i], "J", 1, 0, (struct sockaddr *)&lobby, sizeof(lobby));
+                    continue;
+                }
+                int before = paddles[i].x;
+                update_paddle(&paddles[i], rand() % 3 == 0 ? KEY_LEFT : rand() % 2 ? KEY_RIGHT : 0);
+                buf[0] = 'I';
+                put32(buf + 1, ack[i]);
+                put32(buf + 5, ++sent[i]);
+                buf[9] = 1;
+                put32(buf + 10, paddles[i].x);
+                buf[14] = (unsigned char)(signed char)(paddles[i].x - before);
+                send(fds[i], buf, 15, 0);
+            }
+        }
+        if (now_ns() >= stats_at) {
+            int in = 0;
+            for (int i = 0; i < count; i++)
+                in += joined[i];
+            printf("Bots: %d of %d joined, %.0f snapshots/s\n", in, count, (double)snapshots / STATS_INTERVAL);
+            fflush(stdout);
+            snapshots = 0;
+            stats_at += STATS_INTERVAL * 1000000000LL;
+        }
+    }
+}
+
+void reset_ball() {
+    ball.x = OFFSETX + WIDTH / 2;
+    ball.y = OFFSETY + HEIGHT / 2;
+    ball.dx = 1;
+    ball.dy = 1;
+}
+
+// Writes text into a frame at screen row y, column x, clipped to the frame
+void put_text(Cell frame[FRAME_ROWS][FRAME_COLS], int y, int x, int pair, const char *text) {
+    y -= OFFSETY - 1;
+    x -= OFFSETX;
+    if (y < 0 || y >= FRAME_ROWS)
+        return;
+    for (; *text && x < FRAME_COLS; text++, x++)
+        if (x >= 0)
+            frame[y][x] = (Cell){ *text, pair };
+}
+
+// Puts the picture of *s in frame; the same picture draw() has always made,
+// which the renderer then puts on screen cell by cell.
+void draw(Cell frame[FRAME_ROWS][FRAME_COLS], const GameState *s) {
+     char text[FRAME_COLS + 1];
+     for (int y = 0; y < FRAME_ROWS; y++)
+         for (int x = 0; x < FRAME_COLS; x++)
+             frame[y][x] = (Cell){ ' ', 0 };
+
+     // Draw the border
+     for (int i = OFFSETX; i <= OFFSETX + WIDTH; i++) {
+         put_text(frame, OFFSETY-1, i, 1, " ");
+     }
+     snprintf(text, sizeof(text), "CS3205 NetPong, Ball: %d, %d", s->ball.x, s->ball.y);
+     put_text(frame, OFFSETY-1, OFFSETX + 3, 1, text);
+     snprintf(text, sizeof(text), "Player A: %d, Player B: %d", s->penaltyA, s->penaltyB);
+     put_text(frame, OFFSETY-1, OFFSETX + WIDTH-25, 1, text);
+
+     for (int i = OFFSETY; i < OFFSETY + HEIGHT; i++) {
+         put_text(frame, i, OFFSETX, 1, "  ");
+         put_text(frame, i, OFFSETX + WIDTH - 1, 1, "  ");
+     }
+     for (int i = OFFSETX; i < OFFSETX + WIDTH; i++) {
+         put_text(frame, OFFSETY, i, 1, " ");
+         put_text(frame, OFFSETY + HEIGHT - 1, i, 1, " ");
+     }
+
+     // Draw the ball
+     put_text(frame, OFFSETY + s->ball.y, OFFSETX + s->ball.x, 0, "o");
+
+     // Draw the paddle
+     for (int i = 0; i < s->paddleA.width; i++) {
+         put_text(frame, OFFSETY + HEIGHT-2, OFFSETX + s->paddleA.x + i, 2, " ");
+     }
+     for (int i = 0; i < s->paddleB.width; i++) {
+         put_text(frame, OFFSETY+1, OFFSETX + s->paddleB.x + i, 2, " ");
+     }
+ }
+
+// Appends the terminal's string for cap, with parameters, to out
+int put_cap(char *out, const char *cap, int a, int b) {
+    const char *str = cap ? tiparm(cap, a, b) : NULL;
+    if (!str)
+        return 0;
+    int n = strlen(str);
+    memcpy(out, str, n);
+    return n;
+}
+
+// Sends the terminal the cells of next that differ from shown, in one
+// write, and makes shown a copy of next. A run of changed cells on a row
+// needs one cursor move, and colors change only between cells of
+// different pairs. Returns the bytes written.
+int flush_frame(Cell shown[FRAME_ROWS][FRAME_COLS], Cell next[FRAME_ROWS][FRAME_COLS]) {
+    static char out[FRAME_ROWS * FRAME_COLS * 64];
+    static const char *cup, *setaf, *setab, *sgr0;
+    static short colors[3][2];
+    if (!cup) {
+        cup = tigetstr("cup");
+        setaf = tigetstr("setaf");
+        setab = tigetstr("setab");
+        sgr0 = tigetstr("sgr0");
+        for (short pair = 1; pair < 3; pair++)
+            pair_content(pair, &colors[pair][0], &colors[pair][1]);
+        if (cup == (char *)-1 || !cup)
+            cup = "";
+        if (setaf == (char *)-1)
+            setaf = NULL;
+        if (setab == (char *)-1)
+            setab = NULL;
+        if (sgr0 == (char *)-1)
+            sgr0 = NULL;
+    }
+    int len = 0, pair = -1;
+    for (int y = 0; y < FRAME_ROWS; y++) {
+        int at = -1;  // the column the cursor is at, if on this row
+        for (int x = 0; x < FRAME_COLS; x++) {
+            Cell c = next[y][x];
+            if (c.ch == shown[y][x].ch && c.pair == shown[y][x].pair)
+                continue;
+            shown[y][x] = c;
+            if (at != x)
+                len += put_cap(out + len, cup, OFFSETY - 1 + y, OFFSETX + x);
+            if (c.pair != pair) {
+                len += put_cap(out + len, sgr0, 0, 0);
+                if (c.pair) {
+                    len += put_cap(out + len, setaf, colors[(int)c.pair][0], 0);
+                    len += put_cap(out + len, setab, colors[(int)c.pair][1], 0);
+                }
+                pair = c.pair;
+            }
+            out[len++] = c.ch;
+            at = x + 1;
+        }
+    }
+    if (pair > 0)
+        len += put_cap(out + len, sgr0, 0, 0);
+    for (int done = 0, n; done < len; done += n)
+        if ((n = write(STDOUT_FILENO, out + done, len - done)) < 0)
+            break;
+    return len;
+}
+
+// Server: our paddle as the keys left it, the rest as of the newest tick
+void server_frame(GameState *s) {
+    *s = *(const GameState *)tb_latest(&state_pub);
+    s->paddleA.x = __atomic_load_n(&paddle_input, __ATOMIC_RELAXED);
+}
+
+// Client: the interpolated view, with our own paddle where the keys left it
+void client_frame(GameState *s) {
+    update_view(s);
+    int x = __atomic_load_n(&paddle_input, __ATOMIC_RELAXED);
+    if (local_side == 'A')
+        s->paddleA.x = x;
+    else
+        s->paddleB.x = x;
+}
+
+// The render thread: render_fps frames a second on a fixed schedule, each
+// only what changed since the last. It alone writes to the terminal; the
+// main thread reads keys through curses, and as stdscr is never touched
+// after init(), getch() never repaints over it. A frame's time is from
+// taking the state to the end of the write, which is where a slow
+// terminal (over SSH) shows up.
+void* render_loop(void* args) {
+    render_fps = render_fps < 1 ? 1 : render_fps > 1000 ? 1000 : render_fps;
+    long long period = 1000000000LL / render_fps;
+    // The screen is blank after init()
+    for (int y = 0; y < FRAME_ROWS; y++)
+        for (int x = 0; x < FRAME_COLS; x++)
+            frame_cells[0][y][x] = (Cell){ ' ', 0 };
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (__atomic_load_n(&game_running, __ATOMIC_RELAXED)) {
+        long long start = now_ns();
+        GameState s;
+        render_state(&s);
+        draw(frame_cells[1], &s);
+        frame_bytes += flush_frame(frame_cells[0], frame_cells[1]);
+        long long took = now_ns() - start;
+        frame_hist[took / 1000 < FRAME_HIST_US ? took / 1000 : FRAME_HIST_US]++;
+        frame_count++;
+        frame_over += took > period;
+        if (took > frame_max_ns)
+            frame_max_ns = took;
+        advance_schedule(&next, period);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+// Frame time at quantile q, in microseconds
+long frame_quantile(double q) {
+    long long seen = 0;
+    for (int us = 0; us <= FRAME_HIST_US; us++)
+        if ((seen += frame_hist[us]) >= q * frame_count)
+            return us;
+    return FRAME_HIST_US;
+}
+
+// One step of the ball, every BALL_TICKS ticks of server_tick()
+void step_ball() {
+     // Move the ball
+     ball.x += ball.dx;
+     ball.y += ball.dy;
+
+     if (ball.y == 2 && ball.x >= paddleB.x -1 && ball.x < paddleB.x + paddleB.width + 1) {
+         ball.dy = -ball.dy;
+     }
+
+     // Ball goes past paddle (Game Over)
+     if (ball.y <= 1) {
+         penaltyA++;
+         reset_ball();
+     }
+
+     // Ball bounces off left and right walls
+     if (ball.x <= 2 || ball.x >= WIDTH - 2) {
+         ball.dx = -ball.dx;
+     }
+
+     // Ball hits the paddle
+     if (ball.y == HEIGHT - 3 && ball.x >= paddleA.x -1 && ball.x < paddleA.x + paddleA.width + 1) {
+         ball.dy = -ball.dy;
+     }
+
+     // Ball goes past paddle (Game Over)
+     if (ball.y >= HEIGHT - 2) {
+         penaltyB++;
+         reset_ball();
+     }
+ }
+
+void update_paddle(Paddle *paddle, int ch) {
+     if (ch == KEY_LEFT && paddle->x > 2) {
+         paddle->x -= 1;  // Move paddle left
+   }
+     if (ch == KEY_RIGHT && paddle->x < WIDTH - paddle->width - 1) {
+         paddle->x += 1;  // Move paddle right
+     }
+ }
+
+void init() {
+    initscr();
+    start_color();
+    init_pair(1, COLOR_BLUE, COLOR_WHITE);
+    init_pair(2, COLOR_YELLOW, COLOR_YELLOW);
+    timeout(10);
+    keypad(stdscr, TRUE);
+    curs_set(FALSE);
+    noecho();
+    refresh();  // the blank screen render_loop() starts from
+}
+
+void end_game() {
+    endwin();  // End curses mode
+    if (frame_count)
+        printf("Frames: %lld at %d fps; frame time p50 %ld us, p99 %ld us, max %lld us, %lld over %.1f ms; %lld bytes a frame\n",
+               frame_count, render_fps, frame_quantile(0.5), frame_quantile(0.99), frame_max_ns / 1000,
+               frame_over, 1000.0 / render_fps, frame_bytes / frame_count);
 }
\ No newline at end of file
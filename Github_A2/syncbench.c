@@ -0,0 +1,764 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "syncproto.h"
+
+//RUN: ./syncbench [-c clients] [-s scale] [-t timeout] [-B bin_dir] [-S "server args"] [-C "client args"] [-l label] [-o out.json] [-k] [workload...]
+//Compile: gcc syncbench.c -o syncbench -lpthread
+//Workloads: small huge deep renames append (all of them by default)
+
+#define MAX_CLIENTS 16
+#define MAX_ARGS 32
+#define POLL_US 500                // between scans of a replica that showed no progress
+#define START_TIMEOUT 10           // seconds for the server to listen and every client to sync
+#define DEFAULT_TIMEOUT 300        // seconds for the replicas to catch up after the last op
+#define WRITE_CHUNK (1024 * 1024)
+
+/* One operation of a workload, done on the server's tree and then
+   watched for on every replica. Ops on the same file or directory are
+   chained through prev: a replica may skip states (a file renamed twice
+   before the client hears of it never shows up under the middle name),
+   so once an op is seen, every earlier op on the same object counts as
+   seen at that moment too.
+*/
+enum { OP_FILE, OP_DIR, OP_RENAME, OP_DELETE };
+
+typedef struct {
+    int type;
+    int prev;               // earlier op on the same object, or -1
+    char *path;
+    char *from;             // OP_RENAME: the old path
+    long long size;         // OP_FILE: the size the file has reached
+    uint64_t issued_ns;     // when the op returned on the server's tree
+} Op;
+
+/* A replica: a client process and the thread watching its directory. */
+typedef struct {
+    char dir[PATH_MAX + 16];  // <root>/c<n>, as src is <root>/src
+    int dirfd;
+    pid_t pid;
+    uint64_t *seen;         // per op, when it was first seen here; 0 until then
+    size_t complete;        // every op before this one has been seen
+    uint64_t last_ns;       // newest op seen
+    pthread_t thread;
+} Replica;
+
+typedef struct {
+    const char *name;
+    size_t ops;             // ops per unit of scale, at most
+    void (*run)(int scale);
+    const char *help;
+} Workload;
+
+static char bin_dir[PATH_MAX] = ".";
+static char *server_args[MAX_ARGS], *client_args[MAX_ARGS];
+static int server_argc, client_argc;
+static const char *server_args_str = "", *client_args_str = "";
+static int nclients = 2, scale = 1, timeout_s = DEFAULT_TIMEOUT, keep;
+
+static Op *ops;
+static size_t op_cap, op_count;
+static size_t ops_published;        // read by the watching threads
+static uint64_t gen_end_ns;         // set once the workload has issued its last op
+static long long gen_bytes;
+static int src_fd;
+static uint64_t rng;
+static Replica replicas[MAX_CLIENTS];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*: workloads are seeded identically on every run, so results
+   from different commits describe the same trees. */
+static uint64_t rand64(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545f4914f6cdd1dULL;
+}
+
+static void fill_random(unsigned char *buf, size_t len) {
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t v = rand64();
+        memcpy(buf + i, &v, len - i < 8 ? len - i : 8);
+    }
+}
+
+static void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+/* Records an op that has just been done on the server's tree and makes it
+   visible to the watching threads. Returns its index, for chaining. */
+static int op_add(int type, const char *path, const char *from, long long size, int prev) {
+    if (op_count == op_cap) {
+        fprintf(stderr, "syncbench: workload issued more than %zu ops\n", op_cap);
+        exit(1);
+    }
+    Op *o = &ops[op_count];
+    o->type = type;
+    o->prev = prev;
+    o->path = strdup(path);
+    o->from = from ? strdup(from) : NULL;
+    o->size = size;
+    o->issued_ns = now_ns();
+    __atomic_store_n(&ops_published, ++op_count, __ATOMIC_RELEASE);
+    return (int)op_count - 1;
+}
+
+/* Writes a file of random content in one go, as an editor or a copy would. */
+static int write_file(const char *path, long long size, int prev) {
+    static unsigned char buf[WRITE_CHUNK];
+    int fd = openat(src_fd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        die(path);
+    for (long long done = 0; done < size; ) {
+        size_t n = size - done < WRITE_CHUNK ? size - done : WRITE_CHUNK;
+        fill_random(buf, n);
+        write_all(fd, buf, n);
+        done += n;
+    }
+    close(fd);
+    gen_bytes += size;
+    return op_add(OP_FILE, path, NULL, size, prev);
+}
+
+static int make_dir(const char *path) {
+    if (mkdirat(src_fd, path, 0755) < 0)
+        die(path);
+    return op_add(OP_DIR, path, NULL, 0, -1);
+}
+
+/* Many small files spread over a few directories. */
+static void run_small(int scale) {
+    char path[64];
+    for (int d = 0; d < 20; d++) {
+        snprintf(path, sizeof(path), "small/d%02d", d);
+        make_dir(path);
+    }
+    for (int i = 0; i < 2000 * scale; i++) {
+        snprintf(path, sizeof(path), "small/d%02d/f%06d", i % 20, i);
+        write_file(path, 1024 + rand64() % 7168, -1);
+    }
+}
+
+/* A few files far larger than a transfer chunk. */
+static void run_huge(int scale) {
+    char path[64];
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "huge/f%d", i);
+        write_file(path, 32LL * 1024 * 1024 * scale, -1);
+    }
+}
+
+/* A chain of nested directories made faster than a watcher can be added
+   to each, with a few files at every level. */
+static void run_deep(int scale) {
+    char path[PATH_MAX], file[PATH_MAX + 8];
+    int depth = 64 * scale > 512 ? 512 : 64 * scale;
+    size_t len = snprintf(path, sizeof(path), "deep");
+    for (int level = 0; level < depth; level++) {
+        len += snprintf(path + len, sizeof(path) - len, "/d%d", level % 10);
+        make_dir(path);
+        for (int i = 0; i < 4; i++) {
+            snprintf(file, sizeof(file), "%s/f%d", path, i);
+            write_file(file, 4096, -1);
+        }
+    }
+}
+
+/* Files renamed back and forth between two directories, ten times each,
+   without waiting for the replicas in between. */
+static void run_renames(int scale) {
+    int n = 200 * scale, rounds = 10;
+    int *last = malloc(n * sizeof(int));
+    char from[64], to[64];
+    make_dir("renames/a");
+    make_dir("renames/b");
+    for (int i = 0; i < n; i++) {
+        snprintf(to, sizeof(to), "renames/a/f%d.0", i);
+        last[i] = write_file(to, 4096, -1);
+    }
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < n; i++) {
+            snprintf(from, sizeof(from), "renames/%c/f%d.%d", r % 2 ? 'b' : 'a', i, r);
+            snprintf(to, sizeof(to), "renames/%c/f%d.%d", r % 2 ? 'a' : 'b', i, r + 1);
+            if (renameat(src_fd, from, src_fd, to) < 0)
+                die(from);
+            last[i] = op_add(OP_RENAME, to, from, 0, last[i]);
+        }
+    free(last);
+}
+
+/* Appends to a log, opening and closing it around the write. Returns len. */
+static int append_line(const char *path, const char *line, size_t len) {
+    int fd = openat(src_fd, path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        die(path);
+    write_all(fd, line, len);
+    close(fd);
+    gen_bytes += len;
+    return (int)len;
+}
+
+/* Log files growing by a line at a time, at a steady 4000 lines a second.
+   Each line is appended as a logger that reopens its file would: the
+   server syncs on close, so every line is an op a replica can be seen to
+   apply, and the latencies are sync latencies, not the length of the run.
+*/
+static void run_append(int scale) {
+    enum { LOGS = 8 };
+    int last[LOGS];
+    long long size[LOGS] = { 0 };
+    char path[64], line[320];
+    for (int i = 0; i < LOGS; i++) {
+        snprintf(path, sizeof(path), "append/log%d", i);
+        append_line(path, "", 0);
+        last[i] = op_add(OP_FILE, path, NULL, 0, -1);
+    }
+    for (int n = 0; n < 4000 * scale; n++) {
+        int i = n % LOGS;
+        int len = snprintf(line, sizeof(line), "%08d ", n);
+        int extra = 64 + rand64() % 192;
+        for (int k = 0; k < extra; k++)
+            line[len++] = 'a' + rand64() % 26;
+        line[len++] = '\n';
+        snprintf(path, sizeof(path), "append/log%d", i);
+        size[i] += append_line(path, line, len);
+        last[i] = op_add(OP_FILE, path, NULL, size[i], last[i]);
+        usleep(250);
+    }
+}
+
+static const Workload workloads[] = {
+    { "small", 2020, run_small, "2000 files of 1-8 KiB in 20 directories" },
+    { "huge", 3, run_huge, "3 files of 32 MiB" },
+    { "deep", 320, run_deep, "64 nested directories with 4 files each" },
+    { "renames", 2202, run_renames, "200 files renamed 10 times each" },
+    { "append", 4008, run_append, "8 logs appended 4000 lines" },
+};
+#define NWORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+/* Whether a replica's tree shows the op (or something past it). */
+static int op_visible(int dirfd, const Op *o) {
+    struct stat st;
+    int found = fstatat(dirfd, o->path, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    switch (o->type) {
+    case OP_FILE:
+        return found && S_ISREG(st.st_mode) && st.st_size >= o->size;
+    case OP_DIR:
+        return found && S_ISDIR(st.st_mode);
+    case OP_RENAME:
+        return found && fstatat(dirfd, o->from, &st, AT_SYMLINK_NOFOLLOW) < 0 && errno == ENOENT;
+    default:
+        return !found && errno == ENOENT;
+    }
+}
+
+/* Watches one replica: scans the ops it has not shown yet, oldest first,
+   until it has shown all of them or the timeout after the last op passes. */
+static void *watch_replica(void *arg) {
+    Replica *r = arg;
+    for (;;) {
+        uint64_t end = __atomic_load_n(&gen_end_ns, __ATOMIC_ACQUIRE);
+        size_t n = __atomic_load_n(&ops_published, __ATOMIC_ACQUIRE);
+        int progress = 0;
+        for (size_t i = r->complete; i < n; i++) {
+            if (r->seen[i] || !op_visible(r->dirfd, &ops[i]))
+                continue;
+            uint64_t now = now_ns();
+            for (int j = i; j >= 0 && !r->seen[j]; j = ops[j].prev)
+                r->seen[j] = now;
+            r->last_ns = now;
+            progress = 1;
+        }
+        while (r->complete < n && r->seen[r->complete])
+            r->complete++;
+        if (end && r->complete == n)
+            break;
+        if (end && now_ns() > end + timeout_s * 1000000000ULL)
+            break;
+        if (!progress)
+            usleep(POLL_US);
+    }
+    return NULL;
+}
+
+/* Starts bin_dir/prog with extra args (from -S or -C) ahead of the fixed
+   ones; its output goes to log. */
+static pid_t spawn(const char *prog, char **extra, int nextra, char **fixed, int nfixed, const char *log) {
+    char path[PATH_MAX + 64];
+    char *argv[MAX_ARGS * 2 + 2];
+    int argc = 0;
+    snprintf(path, sizeof(path), "%s/%s", bin_dir, prog);
+    argv[argc++] = path;
+    for (int i = 0; i < nextra; i++)
+        argv[argc++] = extra[i];
+    for (int i = 0; i < nfixed; i++)
+        argv[argc++] = fixed[i];
+    argv[argc] = NULL;
+    pid_t pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (pid == 0) {
+        int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+            close(fd);
+        }
+        execv(path, argv);
+        perror(path);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void stop(pid_t pid) {
+    if (pid <= 0)
+        return;
+    kill(pid, SIGTERM);
+    for (int i = 0; i < 200; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return;
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+/* A port nothing listens on right now, picked by the kernel. */
+static int free_port(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0 || bind(s, (struct sockaddr *)&addr, len) < 0 ||
+        getsockname(s, (struct sockaddr *)&addr, &len) < 0)
+        die("port");
+    close(s);
+    return ntohs(addr.sin_port);
+}
+
+static int wait_listening(int port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    for (int i = 0; i < START_TIMEOUT * 100; i++) {
+        int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int ok = connect(s, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(s);
+        if (ok)
+            return 0;
+        usleep(10000);
+    }
+    return -1;
+}
+
+/* CPU time (user + system, all threads) of a running process in seconds,
+   from its CPU-time clock: nanoseconds, where /proc/<pid>/stat counts in
+   clock ticks and a short workload would read as 0. */
+static double proc_cpu(pid_t pid) {
+    clockid_t clock;
+    struct timespec ts;
+    if (pid <= 0 || clock_getcpuclockid(pid, &clock) != 0 || clock_gettime(clock, &ts) != 0)
+        return 0;
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A "VmHWM:"/"VmRSS:" line of /proc/<pid>/status, in KiB. */
+static long proc_kb(pid_t pid, const char *field) {
+    char path[64], line[256];
+    long kb = 0;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f))
+        if (strncmp(line, field, strlen(field)) == 0) {
+            kb = atol(line + strlen(field));
+            break;
+        }
+    fclose(f);
+    return kb;
+}
+
+/* Tree check: every file and directory below a root, except the client's
+   metadata and transfer temp files, hashed into one digest in path order. */
+typedef struct {
+    char *path;
+    int dir;
+    long long size;
+    Hash128 hash;
+} Entry;
+
+static Entry *entries;
+static size_t entry_count, entry_cap;
+
+static void tree_collect(int fd, char *path, size_t len) {
+    DIR *d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        const char *name = de->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..") || is_temp_name(name) ||
+            (len == 0 && !strcmp(name, ".syncmeta")))
+            continue;
+        size_t sub = len + snprintf(path + len, PATH_MAX - len, "%s%s", len ? "/" : "", name);
+        struct stat st;
+        if (fstatat(dirfd(d), name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+        if (entry_count == entry_cap) {
+            entry_cap = entry_cap ? entry_cap * 2 : 1024;
+            entries = realloc(entries, entry_cap * sizeof(Entry));
+        }
+        Entry *e = &entries[entry_count++];
+        e->path = strdup(path);
+        e->dir = S_ISDIR(st.st_mode);
+        e->size = e->dir ? 0 : st.st_size;
+        e->hash = (Hash128){ 0, 0 };
+        int sub_fd = openat(dirfd(d), name, O_RDONLY | O_CLOEXEC | (e->dir ? O_DIRECTORY : 0));
+        if (sub_fd >= 0) {
+            if (e->dir)
+                tree_collect(sub_fd, path, sub);
+            else {
+                file_hash(sub_fd, &e->hash);
+                close(sub_fd);
+            }
+        }
+        path[len] = '\0';
+    }
+    closedir(d);
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    return strcmp(((const Entry *)a)->path, ((const Entry *)b)->path);
+}
+
+/* Digest of the tree at dir; *files is set to the number of entries. */
+static Hash128 tree_digest(const char *dir, size_t *files) {
+    char path[PATH_MAX] = "";
+    Hash128 h = { 0, 0 };
+    entry_count = 0;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+        tree_collect(fd, path, 0);
+    qsort(entries, entry_count, sizeof(Entry), entry_cmp);
+    for (size_t i = 0; i < entry_count; i++) {
+        unsigned char rec[PATH_MAX + 32];
+        size_t n = strlen(entries[i].path);
+        memcpy(rec, entries[i].path, n + 1);
+        rec[n + 1] = entries[i].dir;
+        put_u64(rec + n + 2, entries[i].size);
+        put_u64(rec + n + 10, entries[i].hash.h1);
+        put_u64(rec + n + 18, entries[i].hash.h2);
+        h = hash128(rec, n + 26, h.h1 ^ rotl64(h.h2, 17));
+        free(entries[i].path);
+    }
+    *files = entry_count;
+    return h;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static int double_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted v. */
+static double percentile(const double *v, size_t n, double q) {
+    if (n == 0)
+        return 0;
+    size_t rank = (size_t)(q * n + 0.999999);
+    return v[rank ? rank - 1 : 0];
+}
+
+/* Runs one workload against a fresh server and fresh clients in a temp
+   directory under tmp_dir, and writes its JSON object to out. Returns
+   whether the replicas ended up identical to the server's tree. */
+static int run_workload(const Workload *w, const char *tmp_dir, FILE *out) {
+    char root[PATH_MAX], src[PATH_MAX + 8], ignore[PATH_MAX + 8], log[PATH_MAX + 16];
+    char port_str[16], max_str[16];
+    if ((size_t)snprintf(root, sizeof(root), "%s/syncbench.XXXXXX", tmp_dir) >= sizeof(root)) {
+        errno = ENAMETOOLONG;
+        die(tmp_dir);
+    }
+    if (!mkdtemp(root))
+        die(root);
+    snprintf(src, sizeof(src), "%s/src", root);
+    snprintf(ignore, sizeof(ignore), "%s/ignore", root);
+    if (mkdir(src, 0755) < 0 || (src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        die(src);
+    FILE *f = fopen(ignore, "w");
+    if (!f)
+        die(ignore);
+    fputs(".syncbench-ignored\n", f);  // clients need a list; this one matches nothing
+    fclose(f);
+    if (mkdirat(src_fd, w->name, 0755) < 0)
+        die(w->name);
+
+    int port = free_port();
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    snprintf(max_str, sizeof(max_str), "%d", nclients + 1);  // the listening probe is a client too
+    char *server_fixed[] = { src, port_str, max_str };
+    snprintf(log, sizeof(log), "%s/server.log", root);
+    pid_t server = spawn("syncserver", server_args, server_argc, server_fixed, 3, log);
+    int started = wait_listening(port) == 0;
+    for (int i = 0; i < nclients; i++) {
+        Replica *r = &replicas[i];
+        memset(r, 0, sizeof(*r));
+        snprintf(r->dir, sizeof(r->dir), "%s/c%d", root, i);
+        if (mkdir(r->dir, 0755) < 0 || (r->dirfd = open(r->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+            die(r->dir);
+        char *client_fixed[] = { r->dir, ignore, "127.0.0.1", port_str };
+        snprintf(log, sizeof(log), "%s/client%d.log", root, i);
+        if (started)
+            r->pid = spawn("syncclient", client_args, client_argc, client_fixed, 4, log);
+    }
+
+    /* Every client has synced once the workload's directory shows up. */
+    Op ready = { .type = OP_DIR, .path = (char *)w->name };
+    for (int i = 0; started && i < nclients; i++) {
+        int tries = START_TIMEOUT * 1000;
+        while (tries-- > 0 && !op_visible(replicas[i].dirfd, &ready))
+            usleep(1000);
+        started = tries > 0;
+    }
+    if (!started)
+        fprintf(stderr, "syncbench: %s: the server and clients did not start; see %s\n", w->name, root);
+
+    rng = 0x9e3779b97f4a7c15ULL;
+    op_cap = w->ops * scale;
+    op_count = ops_published = 0;
+    gen_end_ns = 0;
+    gen_bytes = 0;
+    ops = calloc(op_cap, sizeof(Op));
+    double server_cpu = proc_cpu(server), client_cpu = 0;
+    for (int i = 0; i < nclients; i++) {
+        client_cpu -= proc_cpu(replicas[i].pid);
+        replicas[i].seen = calloc(op_cap, sizeof(uint64_t));
+        if (started)
+            pthread_create(&replicas[i].thread, NULL, watch_replica, &replicas[i]);
+    }
+    uint64_t start = now_ns();
+    if (started) {
+        fprintf(stderr, "syncbench: %s: %s\n", w->name, w->help);
+        w->run(scale);
+    }
+    __atomic_store_n(&gen_end_ns, now_ns(), __ATOMIC_RELEASE);
+
+    uint64_t end = start;
+    size_t samples = 0, missing = 0;
+    double *lat = malloc((op_count * nclients + 1) * sizeof(double));
+    for (int i = 0; i < nclients; i++) {
+        Replica *r = &replicas[i];
+        if (started)
+            pthread_join(r->thread, NULL);
+        if (r->last_ns > end)
+            end = r->last_ns;
+        for (size_t j = 0; j < op_count; j++) {
+            if (r->seen[j])
+                lat[samples++] = (r->seen[j] - ops[j].issued_ns) / 1e6;
+            else
+                missing++;
+        }
+    }
+    qsort(lat, samples, sizeof(double), double_cmp);
+    server_cpu = proc_cpu(server) - server_cpu;
+    long server_hwm = proc_kb(server, "VmHWM:"), server_rss = proc_kb(server, "VmRSS:");
+    long client_hwm = 0;
+    for (int i = 0; i < nclients; i++) {
+        long hwm = proc_kb(replicas[i].pid, "VmHWM:");
+        client_cpu += proc_cpu(replicas[i].pid);
+        if (hwm > client_hwm)
+            client_hwm = hwm;
+    }
+
+    size_t files, replica_files;
+    Hash128 want = tree_digest(src, &files);
+    int verified = started;
+    for (int i = 0; i < nclients; i++) {
+        Hash128 got = tree_digest(replicas[i].dir, &replica_files);
+        if (got.h1 != want.h1 || got.h2 != want.h2 || replica_files != files) {
+            fprintf(stderr, "syncbench: %s: replica %s differs from the server's tree\n", w->name, replicas[i].dir);
+            verified = 0;
+        }
+    }
+
+    for (int i = 0; i < nclients; i++) {
+        stop(replicas[i].pid);
+        close(replicas[i].dirfd);
+        free(replicas[i].seen);
+    }
+    stop(server);
+    close(src_fd);
+    if (verified && !keep)
+        nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    else
+        fprintf(stderr, "syncbench: %s: kept %s\n", w->name, root);
+
+    double seconds = (end - start) / 1e9;
+    fprintf(out, "    {\"name\": \"%s\", \"ops\": %zu, \"bytes\": %lld, \"complete\": %s, \"seconds\": %.6f,\n",
+            w->name, op_count, gen_bytes, started && missing == 0 ? "true" : "false", seconds);
+    fprintf(out, "     \"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f,\n",
+            seconds > 0 ? op_count / seconds : 0, seconds > 0 ? gen_bytes / seconds / 1e6 : 0);
+    fprintf(out, "     \"latency_ms\": {\"samples\": %zu, \"missing\": %zu, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f},\n",
+            samples, missing, percentile(lat, samples, 0.5), percentile(lat, samples, 0.99),
+            percentile(lat, samples, 0.999), samples ? lat[samples - 1] : 0);
+    fprintf(out, "     \"server\": {\"cpu_seconds\": %.3f, \"rss_kb\": %ld, \"max_rss_kb\": %ld},\n",
+            server_cpu, server_rss, server_hwm);
+    fprintf(out, "     \"clients\": {\"cpu_seconds\": %.3f, \"max_rss_kb\": %ld},\n", client_cpu, client_hwm);
+    fprintf(out, "     \"files\": %zu, \"tree_hash\": \"%016llx%016llx\", \"verified\": %s}",
+            files, (unsigned long long)want.h1, (unsigned long long)want.h2, verified ? "true" : "false");
+
+    for (size_t j = 0; j < op_count; j++) {
+        free(ops[j].path);
+        free(ops[j].from);
+    }
+    free(ops);
+    free(lat);
+    return verified;
+}
+
+/* Splits a -S/-C argument on spaces (no quoting) into argv. */
+static int split_args(char *s, char **argv) {
+    int n = 0;
+    for (char *tok = strtok(s, " "); tok && n < MAX_ARGS; tok = strtok(NULL, " "))
+        argv[n++] = tok;
+    return n;
+}
+
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', out);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+/* Benchmark for the sync pair: for each workload, starts syncserver and
+   N syncclients on loopback in a temp directory, does the workload's ops
+   on the server's tree and times each one until every replica shows it.
+   Reports throughput, event-to-replica latency percentiles over every
+   (op, replica) pair, CPU time and RSS, and checks that each replica's
+   tree hashes the same as the server's. Results are JSON, on stdout or
+   in the -o file, tagged with -l (a commit id, say) so runs can be
+   compared; progress goes to stderr. Exits 1 if any replica differed.
+
+   Usage: ./syncbench [-c clients] [-s scale] [-t timeout] [-B bin_dir] [-S "server args"]
+                      [-C "client args"] [-l label] [-o out.json] [-k] [workload...]
+*/
+int main(int argc, char *argv[]) {
+    const char *label = "", *out_path = NULL;
+    const char *tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    int opt, bad_args = 0;
+    while ((opt = getopt(argc, argv, "B:C:S:c:kl:o:s:t:")) != -1) {
+        switch (opt) {
+        case 'B':
+            snprintf(bin_dir, sizeof(bin_dir), "%s", optarg);
+            break;
+        case 'C':
+            client_args_str = optarg;
+            client_argc = split_args(strdup(optarg), client_args);
+            break;
+        case 'S':
+            server_args_str = optarg;
+            server_argc = split_args(strdup(optarg), server_args);
+            break;
+        case 'c':
+            nclients = atoi(optarg);
+            if (nclients < 1 || nclients > MAX_CLIENTS)
+                bad_args = 1;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 's':
+            if ((scale = atoi(optarg)) < 1)
+                bad_args = 1;
+            break;
+        case 't':
+            if ((timeout_s = atoi(optarg)) < 1)
+                bad_args = 1;
+            break;
+        default:
+            bad_args = 1;
+        }
+    }
+    const Workload *run[NWORKLOADS];
+    int nrun = 0;
+    for (int i = optind; i < argc && !bad_args; i++) {
+        int k = 0;
+        while (k < NWORKLOADS && strcmp(argv[i], workloads[k].name))
+            k++;
+        if (k == NWORKLOADS || nrun == NWORKLOADS)
+            bad_args = 1;
+        else
+            run[nrun++] = &workloads[k];
+    }
+    if (bad_args) {
+        fprintf(stderr, "Usage: %s [-c clients] [-s scale] [-t timeout] [-B bin_dir] [-S \"server args\"] "
+                        "[-C \"client args\"] [-l label] [-o out.json] [-k] [workload...]\nWorkloads:\n", argv[0]);
+        for (int k = 0; k < NWORKLOADS; k++)
+            fprintf(stderr, "  %-8s %s (times scale)\n", workloads[k].name, workloads[k].help);
+        return 1;
+    }
+    if (nrun == 0)
+        for (int k = 0; k < NWORKLOADS; k++)
+            run[nrun++] = &workloads[k];
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out)
+        die(out_path);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(out, "{\"label\": ");
+    json_string(out, label);
+    fprintf(out, ", \"clients\": %d, \"scale\": %d, \"cpus\": %ld,\n \"server_args\": ", nclients, scale,
+            sysconf(_SC_NPROCESSORS_ONLN));
+    json_string(out, server_args_str);
+    fprintf(out, ", \"client_args\": ");
+    json_string(out, client_args_str);
+    fprintf(out, ",\n \"workloads\": [\n");
+    int ok = 1;
+    for (int i = 0; i < nrun; i++) {
+        ok &= run_workload(run[i], tmp_dir, out);
+        fprintf(out, "%s\n", i + 1 < nrun ? "," : "");
+        fflush(out);
+    }
+    fprintf(out, " ]}\n");
+    if (out != stdout)
+        fclose(out);
+    return ok ? 0 : 1;
+}
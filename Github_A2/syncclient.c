@@ -1,261 +1,1695 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <pthread.h>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <sys/stat.h>
-#include <dirent.h>
-#include <time.h>
-
-//RUN: ./syncclient <client_dir> <ignore_list> <server_ip> <server_port>
-//Compile: gcc syncclient.c -o syncclient 
-//Ignore List Format Example: ".mp4,.zip"
-
-#define BUFFER_SIZE 512
-
-int client_socket;
-char sync_directory[512];
-char old_filename[256] = "";  // For handling move operations
-time_t moved_from_time = 0;     // Timestamp for MOVED_FROM events
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // Global lock
-
-/* Recursively removes a directory and its contents. */
-void remove_dir_recursive(const char *dir_path) {
-    DIR *d = opendir(dir_path);
-    if (!d) return;
-    struct dirent *entry;
-    char full_path[512];
-    while ((entry = readdir(d)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-        struct stat st;
-        if (stat(full_path, &st) == 0) {
-            if (S_ISDIR(st.st_mode))
-                remove_dir_recursive(full_path);
-            else
-                remove(full_path);
-        }
-    }
-    closedir(d);
-    rmdir(dir_path);
-}
-
-/* Removes trailing slashes from a path. */
-void normalize_path(char *path) {
-    size_t len = strlen(path);
-    while (len > 0 && path[len-1] == '/') {
-        path[len-1] = '\0';
-        len--;
-    }
-}
-
-/* Reads the ignore list file and sends it to the server. */
-void send_ignore_list(const char *ignore_file) {
-    FILE *file = fopen(ignore_file, "r");
-    if (!file) {
-        perror("fopen");
-        exit(1);
-    }
-    char ignore_list[256] = "";
-    char extension[50];
-    while (fscanf(file, "%49s", extension) == 1) {
-        if (ignore_list[0] != '\0')
-            strcat(ignore_list, ",");
-        strcat(ignore_list, extension);
-    }
-    fclose(file);
-    send(client_socket, ignore_list, strlen(ignore_list), 0);
-}
-
-/* Ensures that the directory structure exists for the given filepath. */
-void ensure_directory_exists(const char *filepath) {
-    char path[512];
-    strcpy(path, filepath);
-    char *p = strrchr(path, '/'); //Finds the last slash in the path
-    if (p) {
-        *p = '\0';
-        mkdir(path, 0777);
-    }
-} //This is a simplified version. It doesn’t create full nested paths like mkdir -p, but it's used when the parent directory is assumed to already exist or be created before.
-
-/* Monitor thread for MOVED_FROM events.
-   If no MOVED_TO event is received within 1 second, deletes the directory.
-*/
-void *moved_from_monitor(void *arg) {
-    while (1) {
-        sleep(1);
-        pthread_mutex_lock(&lock);
-        if (old_filename[0] != '\0' && (time(NULL) - moved_from_time) >= 1) {
-            char full_path[512];
-            snprintf(full_path, sizeof(full_path), "%s/%s", sync_directory, old_filename);
-            remove_dir_recursive(full_path);
-            printf("Deleted (via MOVED_FROM timeout): %s\n", full_path);
-            old_filename[0] = '\0';
-            moved_from_time = 0;
-        }
-        pthread_mutex_unlock(&lock);
-    }
-    return NULL;
-}
-
-/* Processes an update received from the server.
-   Expected message formats:
-     - For file creation: "CREATE FILE <relative_path> <filesize>\n" followed by file data.
-     - For other events: "<command> <type> <relative_path>\n"
-*/
-void process_update(FILE *fp, const char *header) {
-    char command[20], type[10], rel_path[256];
-    if (strncmp(header, "CREATE FILE", 11) == 0) {
-        long filesize = 0;
-        if (sscanf(header, "%s %s %s %ld", command, type, rel_path, &filesize) != 4)
-            return;
-        normalize_path(rel_path);
-        char full_path[512];
-        snprintf(full_path, sizeof(full_path), "%s/%s", sync_directory, rel_path);
-        ensure_directory_exists(full_path);
-        FILE *out = fopen(full_path, "wb");
-        if (!out) return;
-        if (filesize > 0) {
-            char *buf = malloc(filesize);
-            if (buf) {
-                size_t total = 0;
-                while (total < filesize) {
-                    size_t r = fread(buf + total, 1, filesize - total, fp);
-                    if (r <= 0) break;
-                    total += r;
-                }
-                fwrite(buf, 1, total, out);
-                free(buf);
-            }
-        }
-        fclose(out);
-        printf("File created: %s (size: %ld bytes)\n", full_path, filesize);
-    } else {
-        if (sscanf(header, "%s %s %s", command, type, rel_path) != 3)
-            return;
-        normalize_path(rel_path);
-        char full_path[512];
-        snprintf(full_path, sizeof(full_path), "%s/%s", sync_directory, rel_path);
-        if (strcmp(command, "CREATE") == 0) {
-            if (strcmp(type, "DIR") == 0) {
-                ensure_directory_exists(full_path);
-                mkdir(full_path, 0777);
-                printf("Directory created: %s\n", full_path);
-            } else {
-                ensure_directory_exists(full_path);
-                FILE *fp_tmp = fopen(full_path, "w");
-                if (fp_tmp) { fclose(fp_tmp); }
-                printf("Empty file created: %s\n", full_path);
-            }
-        } else if (strcmp(command, "DELETE") == 0) {
-            struct stat st;
-            if (stat(full_path, &st) == 0) {
-                if (S_ISDIR(st.st_mode))
-                    remove_dir_recursive(full_path);
-                else
-                    remove(full_path);
-                printf("Deleted: %s\n", full_path);
-            }
-        } else if (strcmp(command, "MOVED_FROM") == 0) {
-            strncpy(old_filename, rel_path, sizeof(old_filename)-1);
-            old_filename[sizeof(old_filename)-1] = '\0';
-            normalize_path(old_filename);
-            moved_from_time = time(NULL);
-        } else if (strcmp(command, "MOVED_TO") == 0) {
-            if (old_filename[0] != '\0') {
-                char old_full[512], new_full[512];
-                snprintf(old_full, sizeof(old_full), "%s/%s", sync_directory, old_filename);
-                snprintf(new_full, sizeof(new_full), "%s/%s", sync_directory, rel_path);
-                ensure_directory_exists(new_full);
-                rename(old_full, new_full);
-                printf("Renamed: %s -> %s\n", old_full, new_full);
-                old_filename[0] = '\0';
-                moved_from_time = 0;
-            } else {
-                // Treat as creation event.
-                if (strcmp(type, "DIR") == 0) {
-                    ensure_directory_exists(full_path);
-                    mkdir(full_path, 0777);
-                    printf("Directory created (via MOVED_TO): %s\n", full_path);
-                } else {
-                    ensure_directory_exists(full_path);
-                    FILE *fp_tmp = fopen(full_path, "w");
-                    if (fp_tmp) { fclose(fp_tmp); }
-                    printf("Empty file created (via MOVED_TO): %s\n", full_path);
-                }
-            }
-        }
-    }
-}
-
-/* Receives updates from the server and applies them.
-   Uses a FILE stream (via fdopen) to support file content transfer.
-*/
-void *receive_updates(void *arg) {
-    FILE *fp = fdopen(client_socket, "rb");
-    if (!fp) {
-        perror("fdopen");
-        return NULL;
-    }
-    char buffer[BUFFER_SIZE];
-    while (fgets(buffer, sizeof(buffer), fp)) {
-        if (strncmp(buffer, "CREATE FILE", 11) == 0)
-            process_update(fp, buffer);
-        else {
-            printf("Update: %s", buffer);
-            process_update(fp, buffer);
-        }
-    }
-    fclose(fp);
-    return NULL;
-}
-
-/* Main function - connects to the server and starts receiving updates.
-   Usage: ./client <sync_directory> <ignore_file> <server_ip> <port>
-*/
-int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <sync_directory> <ignore_file> <server_ip> <port>\n", argv[0]);
-        return 1;
-    }
-    
-    strncpy(sync_directory, argv[1], sizeof(sync_directory)-1);
-    sync_directory[sizeof(sync_directory)-1] = '\0';
-    char *ignore_file = argv[2];
-    char *server_ip = argv[3];
-    int port = atoi(argv[4]);
-    
-    struct sockaddr_in server_addr;
-    client_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket < 0) {
-        perror("socket");
-        return 1;
-    }
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        perror("inet_pton");
-        return 1;
-    }
-    if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connect");
-        return 1;
-    }
-    
-    // Send ignore list to the server.
-    send_ignore_list(ignore_file);
-    
-    printf("Connected to server. Syncing directory: %s\n", sync_directory);
-    
-    pthread_t monitor_thread, update_thread;
-    pthread_create(&monitor_thread, NULL, moved_from_monitor, &lock);
-    pthread_create(&update_thread, NULL, receive_updates, NULL);
-    pthread_join(update_thread, NULL);
-    
-    close(client_socket);
-    return 0;
-}
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <zlib.h>
+#include "syncproto.h"
+
+//RUN: ./syncclient [-w workers] [-z] [-b sync|uring] [-m metrics_port] <client_dir> <ignore_list> <server_ip> <server_port>
+//Compile: gcc syncclient.c -o syncclient -lpthread -lz
+//Ignore List Format Example: ".mp4,.zip"
+
+#define RECV_BUF_SIZE (FRAME_MAX + CHUNK_SIZE)  // a whole frame, and room to read ahead
+#define META_DIR ".syncmeta"       // client state, inside the sync directory
+#define STATE_MAGIC "SYNCSTA1"
+#define RECONNECT_MAX_DELAY 30     // seconds between reconnect attempts, at most
+#define APPLY_QUEUE_BYTES (16 * 1024 * 1024)  // read from the server but not applied yet, at most
+#define MAX_WORKERS 64
+#define DEFAULT_WORKERS 8          // unless there are fewer CPUs
+#define STREAM_BUCKETS 1024
+#define CONTENT_BUCKETS 4096
+#define APPLY_BATCH 32             // files one worker writes in an io_uring batch (-b uring), at most
+#define APPLY_RING_ENTRIES 256
+#define ACK_INTERVAL_MS 50         // between ACKs while frames keep coming, at least
+
+/* A file transfer in progress: the server interleaves DATA frames of
+   several files. Each is built in a temp file next to the target,
+   preallocated to its final size, and renamed over the target once
+   complete, so nothing ever sees a partial file. A delta transfer builds
+   the new version from COPY frames (blocks of the old copy) and DATA
+   frames. All frames of a transfer are applied by the same worker; the
+   stream table finds it by stream id. A MATERIALIZE gets a transfer too,
+   which stays waiting if the content has to be asked for with NEED, and
+   is then filled by the OPEN that answers it.
+*/
+typedef struct Transfer {
+    struct Transfer *prev, *next;  // every transfer, oldest first
+    struct Transfer *hnext;        // stream table chain
+    int refs;               // the stream table, plus queued frames for it
+    int worker;
+    unsigned sid;
+    int fd;
+    int base_fd;            // old copy for COPY frames, -1 for a plain transfer
+    uint32_t block_size;    // 0 for a plain transfer
+    long long size, received;
+    uint64_t seq;           // event it belongs to
+    int waiting;            // MATERIALIZE not applied yet, or waiting for its content
+    int done;               // ended; frames still queued for it are dropped
+    int committed;          // renamed over the target; no temp file to remove
+    struct Work *parked;    // MATERIALIZEs copying from this file once it is complete
+    char full_path[PATH_MAX + 512];
+    char tmp_path[PATH_MAX + 544];
+} Transfer;
+
+Transfer *transfers, *transfers_tail;
+Transfer *stream_table[STREAM_BUCKETS];
+
+/* The apply pipeline. The reader thread decodes frames off the socket
+   into Work items for the dispatcher, which hands each to a worker keyed
+   by path (or, for transfer frames, by stream), so independent paths are
+   applied in parallel while each path's ops stay in order. Ops that touch
+   a whole subtree (deleting or renaming a directory) and RECONCILE are
+   barriers: the dispatcher waits for the workers to go idle and applies
+   them itself. A file rename waits only for the workers of its two
+   names. The reader stops reading once APPLY_QUEUE_BYTES are
+   waiting, so the server's queue limit still applies. With -b uring a
+   worker lets small transfers collect while the dispatcher is busy and
+   writes them as one batch (see take_batch()).
+*/
+typedef struct Work {
+    struct Work *next;
+    int op;
+    uint64_t seq;           // event it belongs to
+    Transfer *t;            // for OPEN, DELTA, DATA, COPY, ABORT and MATERIALIZE
+    size_t len;
+    unsigned char body[];   // the frame body
+} Work;
+
+typedef struct {
+    pthread_cond_t ready;
+    Work *head, *tail;
+    uint64_t busy_seq;      // seq of the item being applied, 0 when idle
+    int batching;           // writes small files in io_uring batches (-b uring)
+} Worker;
+
+Worker workers[MAX_WORKERS];
+int nworkers;
+Work *inbox_head, *inbox_tail;  // read, not yet dispatched
+int dispatching;
+int draining;               // the dispatcher is waiting for workers to go idle
+int acking;                 // ACKs being sent; the connection stays open for them
+size_t queued_bytes;
+pthread_mutex_t apply_lock = PTHREAD_MUTEX_INITIALIZER;  // all of the above, transfers and progress
+pthread_cond_t inbox_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t room = PTHREAD_COND_INITIALIZER;
+pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;  // one frame at a time to the server
+
+/* Where this replica stands in the server's journal, kept in
+   <sync_dir>/.syncmeta/state and mapped so recording progress is a plain
+   store. seq only advances past an event once its transfer is complete,
+   so after a crash or disconnect the server replays anything unfinished.
+*/
+typedef struct {
+    char magic[8];
+    uint64_t journal_id;
+    uint64_t seq;
+} SyncState;
+
+SyncState *state;
+uint64_t last_mark;         // newest SEQ received
+uint64_t journal_id;        // journal the server named in WELCOME
+int marked;                 // a SEQ has arrived since then
+int server_acks;            // the server agreed to SYNC_CAP_ACK
+uint64_t ack_seq;           // last position acknowledged
+long long ack_ms;           // when
+
+/* Files we hold whose content hash is known, so MATERIALIZE can copy
+   from any of them rather than only from the path the server names.
+   One path per content; entries are checked before use.
+*/
+typedef struct Content {
+    struct Content *next;
+    int64_t size, mtime_ns; // of the file when it was hashed
+    Hash128 hash;
+    char path[];            // full path
+} Content;
+
+Content *content_table[CONTENT_BUCKETS];
+pthread_mutex_t content_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int client_socket;
+char sync_directory[512];
+int want_zlib;              // -z: ask for compressed transfers
+int use_uring;              // -b uring: workers write small files in io_uring batches
+mode_t file_umask;          // applied by the kernel to files io_uring creates
+
+/* Metrics (-m port; see syncproto.h): how long each op takes to apply,
+   by frame type (a batch of -b uring files counts once), and bytes read
+   from the server; the queue and positions are gauges. apply_metric maps
+   an F_* op to its histogram, 0 meaning it is not timed.
+*/
+enum {
+    M_RECEIVED_BYTES,
+    M_OPEN, M_DELTA, M_DATA, M_ZDATA, M_COPY, M_ABORT, M_MATERIALIZE, M_SIGREQ,
+    M_CREATE, M_DELETE, M_RENAME, M_RECONCILE, M_BATCH,
+    M_COUNT
+};
+
+static const MetricDef client_metrics[M_COUNT] = {
+    [M_RECEIVED_BYTES] = { "sync_client_received_bytes_total", NULL, 0, "Bytes read from the server." },
+    [M_OPEN] = { "sync_apply_seconds", "op=\"open\"", 1, "Applying one frame, by op." },
+    [M_DELTA] = { "sync_apply_seconds", "op=\"delta\"", 1, NULL },
+    [M_DATA] = { "sync_apply_seconds", "op=\"data\"", 1, NULL },
+    [M_ZDATA] = { "sync_apply_seconds", "op=\"zdata\"", 1, NULL },
+    [M_COPY] = { "sync_apply_seconds", "op=\"copy\"", 1, NULL },
+    [M_ABORT] = { "sync_apply_seconds", "op=\"abort\"", 1, NULL },
+    [M_MATERIALIZE] = { "sync_apply_seconds", "op=\"materialize\"", 1, NULL },
+    [M_SIGREQ] = { "sync_apply_seconds", "op=\"sigreq\"", 1, NULL },
+    [M_CREATE] = { "sync_apply_seconds", "op=\"create\"", 1, NULL },
+    [M_DELETE] = { "sync_apply_seconds", "op=\"delete\"", 1, NULL },
+    [M_RENAME] = { "sync_apply_seconds", "op=\"rename\"", 1, NULL },
+    [M_RECONCILE] = { "sync_apply_seconds", "op=\"reconcile\"", 1, NULL },
+    [M_BATCH] = { "sync_apply_seconds", "op=\"batch\"", 1, NULL },
+};
+
+static const unsigned char apply_metric[F_MATERIALIZE + 1] = {
+    [F_OPEN] = M_OPEN, [F_DELTA] = M_DELTA, [F_DATA] = M_DATA, [F_ZDATA] = M_ZDATA,
+    [F_COPY] = M_COPY, [F_ABORT] = M_ABORT, [F_MATERIALIZE] = M_MATERIALIZE,
+    [F_SIGREQ] = M_SIGREQ, [F_CREATE] = M_CREATE, [F_DELETE] = M_DELETE,
+    [F_RENAME] = M_RENAME, [F_RECONCILE] = M_RECONCILE,
+};
+
+/* Observes how long op took to apply since start (-m). */
+static void apply_timed(int op, uint64_t start) {
+    if (op >= 0 && op <= F_MATERIALIZE && apply_metric[op])
+        metric_since(apply_metric[op], start);
+}
+
+/* Recursively removes a directory and its contents. */
+void remove_dir_recursive(const char *dir_path) {
+    DIR *d = opendir(dir_path);
+    if (!d) return;
+    struct dirent *entry;
+    char full_path[PATH_MAX + 512];
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if ((size_t)snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name) >= sizeof(full_path))
+            continue;  // never act on a cut-short name
+        struct stat st;
+        if (stat(full_path, &st) == 0) {
+            if (S_ISDIR(st.st_mode))
+                remove_dir_recursive(full_path);
+            else
+                remove(full_path);
+        }
+    }
+    closedir(d);
+    rmdir(dir_path);
+}
+
+/* Removes trailing slashes from a path. */
+void normalize_path(char *path) {
+    size_t len = strlen(path);
+    while (len > 0 && path[len-1] == '/') {
+        path[len-1] = '\0';
+        len--;
+    }
+}
+
+/* Maps .syncmeta/state, creating it for a replica that has never synced. */
+void open_state(void) {
+    char path[sizeof(sync_directory) + 32];
+    snprintf(path, sizeof(path), "%s/%s", sync_directory, META_DIR);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/%s/state", sync_directory, META_DIR);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(SyncState)) < 0) {
+        perror("sync state");
+        exit(1);
+    }
+    state = mmap(NULL, sizeof(SyncState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (state == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (memcmp(state->magic, STATE_MAGIC, 8) != 0) {
+        memset(state, 0, sizeof(SyncState));
+        memcpy(state->magic, STATE_MAGIC, 8);
+    }
+}
+
+/* Records the newest event whose effects are complete: the last SEQ mark,
+   held back by any op still queued or being applied and by any transfer
+   still running (each list is oldest first). A new journal is only
+   adopted once everything up to a mark is complete, so a position in it
+   is never claimed for a copy that reconciliation left half done.
+   Caller holds apply_lock.
+*/
+void update_applied(void) {
+    uint64_t applied = last_mark;
+    for (int i = 0; i < nworkers; i++) {
+        uint64_t seq = workers[i].busy_seq ? workers[i].busy_seq
+                     : workers[i].head ? workers[i].head->seq : 0;
+        if (seq && seq - 1 < applied)
+            applied = seq - 1;
+    }
+    if (transfers && transfers->seq - 1 < applied)
+        applied = transfers->seq - 1;
+    if (state->journal_id != journal_id) {
+        if (marked && applied == last_mark) {
+            state->journal_id = journal_id;
+            state->seq = applied;
+        }
+    } else if (applied > state->seq)
+        state->seq = applied;
+}
+
+/* Sends len bytes to the server, retrying short sends. A connection the
+   server dropped is noticed by the reader, not by a SIGPIPE here. */
+void send_all(const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(client_socket, p, len, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        p += n;
+        len -= n;
+    }
+}
+
+/* Reads the ignore list file and sends HELLO: the protocol version and
+   capabilities (compression only with -z; MATERIALIZE and ACK always),
+   the journal and last event this replica applied (so the server can
+   replay whatever it missed), then the list.
+*/
+void send_hello(const char *ignore_file) {
+    FILE *file = fopen(ignore_file, "r");
+    if (!file) {
+        perror("fopen");
+        exit(1);
+    }
+    static char ignore_list[HELLO_MAX_BYTES - 64];
+    size_t len = 0;
+    char pattern[PATH_MAX];
+    ignore_list[0] = '\0';
+    while (fscanf(file, "%4095s", pattern) == 1) {
+        size_t n = strlen(pattern);
+        if (len + n + 1 >= sizeof(ignore_list))
+            break;
+        len += sprintf(ignore_list + len, "%s%s", len ? "," : "", pattern);
+    }
+    fclose(file);
+    uint64_t v[4] = { SYNC_VERSION, SYNC_CAP_BATCH | SYNC_CAP_DEDUP | SYNC_CAP_ACK | (want_zlib ? SYNC_CAP_ZLIB : 0),
+                      state->journal_id, state->seq };
+    static unsigned char hello[FRAME_BOUND(4, HELLO_MAX_BYTES)];
+    size_t body = 4 + len;
+    for (int i = 0; i < 4; i++)
+        body += varint_size(v[i]);
+    size_t n = frame_header_put(hello, F_HELLO, body);
+    memcpy(hello + n, SYNC_MAGIC, 4);
+    n += 4;
+    for (int i = 0; i < 4; i++)
+        n += varint_put(hello + n, v[i]);
+    memcpy(hello + n, ignore_list, len);
+    send_all(hello, n + len);
+}
+
+/* Ensures that the directory structure exists for the given filepath. */
+void ensure_directory_exists(const char *filepath) {
+    char path[sizeof(((Transfer *)0)->full_path)];  // callers pass <sync_directory>/<rel_path>
+    if (strlen(filepath) >= sizeof(path))
+        return;
+    strcpy(path, filepath);
+    char *p = strrchr(path, '/'); //Finds the last slash in the path
+    if (p) {
+        *p = '\0';
+        mkdir(path, 0777);
+    }
+} //This is a simplified version. It doesn’t create full nested paths like mkdir -p, but it's used when the parent directory is assumed to already exist or be created before.
+
+/* Whether path is prefix, or (for a directory) lies below it. */
+static int path_within(const char *path, const char *prefix, int subtree) {
+    size_t n = strlen(prefix);
+    return strncmp(path, prefix, n) == 0 && (path[n] == '\0' || (subtree && path[n] == '/'));
+}
+
+/* The worker that applies ops on rel_path. */
+static int path_worker(const char *rel_path) {
+    size_t h = 14695981039346656037ULL;  // FNV-1a
+    while (*rel_path)
+        h = (h ^ (unsigned char)*rel_path++) * 1099511628211ULL;
+    return h % nworkers;
+}
+
+/* Creates a transfer and enters it in the stream table. Caller holds apply_lock. */
+Transfer *transfer_new(unsigned sid, int worker, long long size, uint32_t block_size, const char *rel_path) {
+    Transfer *t = calloc(1, sizeof(Transfer));
+    if (!t) return NULL;
+    t->refs = 1;
+    t->worker = worker;
+    t->sid = sid;
+    t->fd = t->base_fd = -1;
+    t->size = size;
+    t->block_size = block_size;
+    t->seq = last_mark + 1;
+    snprintf(t->full_path, sizeof(t->full_path), "%s/%s", sync_directory, rel_path);
+    char *slash = strrchr(t->full_path, '/');
+    snprintf(t->tmp_path, sizeof(t->tmp_path), "%.*s/.%s.sync%u",
+             (int)(slash - t->full_path), t->full_path, slash + 1, sid);
+    Transfer **bucket = &stream_table[sid % STREAM_BUCKETS];
+    t->hnext = *bucket;
+    *bucket = t;
+    t->prev = transfers_tail;
+    if (transfers_tail) transfers_tail->next = t;
+    else transfers = t;
+    transfers_tail = t;
+    return t;
+}
+
+/* Caller holds apply_lock. */
+Transfer *find_transfer(unsigned sid) {
+    for (Transfer *t = stream_table[sid % STREAM_BUCKETS]; t; t = t->hnext)
+        if (t->sid == sid)
+            return t;
+    return NULL;
+}
+
+/* Drops a reference to a transfer. Caller holds apply_lock. */
+void transfer_put(Transfer *t) {
+    if (--t->refs == 0)
+        free(t);
+}
+
+/* Whether a batching worker should leave its queue to fill up: it holds
+   only small transfers (the last possibly still arriving), fewer than a
+   batch of them, and the dispatcher is still handing out frames. Caller
+   holds apply_lock.
+*/
+static int batch_filling(const Worker *k) {
+    if (!k->batching || draining || !(inbox_head || dispatching))
+        return 0;
+    int files = 0;
+    for (const Work *w = k->head; w; ) {
+        const Transfer *t = w->t;
+        if (w->op != F_OPEN || !t || t->block_size || t->size > CHUNK_SIZE || ++files == APPLY_BATCH)
+            return 0;
+        do
+            w = w->next;
+        while (w && w->op == F_DATA && w->t == t);
+    }
+    return 1;
+}
+
+/* Wakes the workers that have frames to apply and are not filling a
+   batch. Caller holds apply_lock. */
+static void wake_workers(void) {
+    for (int i = 0; i < nworkers; i++)
+        if (workers[i].head && !batch_filling(&workers[i]))
+            pthread_cond_signal(&workers[i].ready);
+}
+
+/* Appends w to a worker's queue. Caller holds apply_lock. */
+static void push_work(Work *w, int worker) {
+    Worker *k = &workers[worker];
+    w->next = NULL;
+    if (k->tail) k->tail->next = w;
+    else k->head = w;
+    k->tail = w;
+    if (!batch_filling(k))
+        pthread_cond_signal(&k->ready);
+}
+
+static void work_free(Work *w);
+
+/* Closes a transfer (its temp file is removed unless it was committed)
+   and takes it out of the stream table. MATERIALIZEs parked on it go to
+   their workers, which copy the finished file or, if it did not
+   complete, ask for the content.
+*/
+void end_transfer(Transfer *t) {
+    if (t->fd >= 0) close(t->fd);
+    if (t->base_fd >= 0) close(t->base_fd);
+    t->fd = t->base_fd = -1;
+    if (!t->committed)
+        unlink(t->tmp_path);
+    pthread_mutex_lock(&apply_lock);
+    Transfer **pp = &stream_table[t->sid % STREAM_BUCKETS];
+    while (*pp && *pp != t)
+        pp = &(*pp)->hnext;
+    if (*pp) {
+        *pp = t->hnext;
+        if (t->prev) t->prev->next = t->next;
+        else transfers = t->next;
+        if (t->next) t->next->prev = t->prev;
+        else transfers_tail = t->prev;
+        t->done = 1;
+        while (t->parked) {
+            Work *w = t->parked;
+            t->parked = w->next;
+            if (w->t->done) {
+                transfer_put(w->t);
+                work_free(w);
+            } else {
+                push_work(w, w->t->worker);
+            }
+        }
+        update_applied();
+        transfer_put(t);
+    }
+    pthread_mutex_unlock(&apply_lock);
+}
+
+/* Ends waiting MATERIALIZE transfers into t's path: t brings newer
+   content. Called by the worker that owns them.
+*/
+static void supersede_waiting(Transfer *t) {
+    while (1) {
+        pthread_mutex_lock(&apply_lock);
+        Transfer *old = transfers;
+        while (old && (old == t || !old->waiting || strcmp(old->full_path, t->full_path) != 0))
+            old = old->next;
+        pthread_mutex_unlock(&apply_lock);
+        if (!old)
+            break;
+        end_transfer(old);
+    }
+}
+
+/* Ends the transfers into rel_path (or, for a directory, below it) so a
+   deleted file is not brought back when its transfer completes. Called by
+   the worker that owns them, or with all workers idle.
+*/
+void abort_transfers(const char *rel_path, int is_dir) {
+    char full_path[PATH_MAX + 512];
+    snprintf(full_path, sizeof(full_path), "%s/%s", sync_directory, rel_path);
+    while (1) {
+        pthread_mutex_lock(&apply_lock);
+        Transfer *t = transfers;
+        while (t && !path_within(t->full_path, full_path, is_dir))
+            t = t->next;
+        pthread_mutex_unlock(&apply_lock);
+        if (!t)
+            break;
+        end_transfer(t);
+    }
+}
+
+/* Follows a rename of old_rel to new_rel: transfers into it or below it
+   write there from now on. Called with the workers that own them idle.
+   One whose new path would not fit keeps the old one, and fails when it
+   is committed rather than landing under a cut-short name.
+*/
+void rebase_transfers(const char *old_rel, const char *new_rel) {
+    char old_full[PATH_MAX + 512], new_full[PATH_MAX + 512];
+    snprintf(old_full, sizeof(old_full), "%s/%s", sync_directory, old_rel);
+    snprintf(new_full, sizeof(new_full), "%s/%s", sync_directory, new_rel);
+    size_t n = strlen(old_full);
+    pthread_mutex_lock(&apply_lock);
+    for (Transfer *t = transfers; t; t = t->next) {
+        if (!path_within(t->full_path, old_full, 1))
+            continue;
+        char full[sizeof(t->full_path)], tmp[sizeof(t->tmp_path)];
+        int moved = t->full_path[n] != '\0';  // the temp file moved with its directory
+        if ((size_t)snprintf(full, sizeof(full), "%s%s", new_full, t->full_path + n) >= sizeof(full) ||
+            (moved && (size_t)snprintf(tmp, sizeof(tmp), "%s%s", new_full, t->tmp_path + n) >= sizeof(tmp))) {
+            fprintf(stderr, "%s: renamed path too long\n", t->full_path);
+            continue;
+        }
+        strcpy(t->full_path, full);
+        if (moved) strcpy(t->tmp_path, tmp);
+        t->worker = path_worker(t->full_path + strlen(sync_directory) + 1);
+    }
+    pthread_mutex_unlock(&apply_lock);
+}
+
+void finish_transfer_if_done(Transfer *t) {
+    if (t->received < t->size)
+        return;
+    if (rename(t->tmp_path, t->full_path) < 0) {
+        perror("rename");
+    } else {
+        t->committed = 1;
+        if (t->block_size)
+            printf("File patched: %s (size: %lld bytes)\n", t->full_path, t->size);
+        else
+            printf("File created: %s (size: %lld bytes)\n", t->full_path, t->size);
+    }
+    end_transfer(t);
+}
+
+/* Opens a transfer's temp file (and, for a delta, the old copy), keeping
+   the old copy's permissions, and reserves the final size up front. */
+void start_transfer(Transfer *t) {
+    supersede_waiting(t);
+    ensure_directory_exists(t->full_path);
+    t->fd = open(t->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (t->fd < 0) {
+        perror("open");
+        end_transfer(t);
+        return;
+    }
+    int old = open(t->full_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (old >= 0 && fstat(old, &st) == 0)
+        fchmod(t->fd, st.st_mode & 07777);
+    if (t->block_size)
+        t->base_fd = old;
+    else if (old >= 0)
+        close(old);
+    if (t->size > 0)
+        fallocate(t->fd, 0, 0, t->size);  // best effort; fails harmlessly where unsupported
+    finish_transfer_if_done(t);  // an empty file is complete already
+}
+
+static size_t content_bucket(int64_t size, Hash128 h) {
+    return (h.h1 ^ (uint64_t)size) % CONTENT_BUCKETS;
+}
+
+/* Records that full_path holds content h, as of its size and mtime in st.
+   Replaces the path known for that content, if any. */
+static void content_add(const char *full_path, const struct stat *st, Hash128 h) {
+    if (st->st_size < DEDUP_MIN_SIZE)
+        return;
+    size_t len = strlen(full_path);
+    Content *c = malloc(sizeof(Content) + len + 1);
+    if (!c) return;
+    c->size = st->st_size;
+    c->mtime_ns = stat_mtime_ns(st);
+    c->hash = h;
+    memcpy(c->path, full_path, len + 1);
+    pthread_mutex_lock(&content_lock);
+    Content **pp = &content_table[content_bucket(c->size, h)];
+    while (*pp && ((*pp)->size != c->size || (*pp)->hash.h1 != h.h1 || (*pp)->hash.h2 != h.h2))
+        pp = &(*pp)->next;
+    if (*pp) {
+        Content *old = *pp;
+        *pp = old->next;
+        free(old);
+    }
+    c->next = *pp;
+    *pp = c;
+    pthread_mutex_unlock(&content_lock);
+}
+
+/* Copies the path known to hold content h into path (PATH_MAX + 512
+   bytes), along with the mtime it had when hashed. Returns 0 if none. */
+static int content_find(int64_t size, Hash128 h, char *path, int64_t *mtime_ns) {
+    int found = 0;
+    pthread_mutex_lock(&content_lock);
+    for (Content *c = content_table[content_bucket(size, h)]; c; c = c->next) {
+        if (c->size == size && c->hash.h1 == h.h1 && c->hash.h2 == h.h2) {
+            snprintf(path, PATH_MAX + 512, "%s", c->path);
+            *mtime_ns = c->mtime_ns;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&content_lock);
+    return found;
+}
+
+/* Answers SIGREQ for full_path (see send_signatures() in syncproto.h). */
+static void answer_sigreq(unsigned sid, const char *full_path) {
+    int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    pthread_mutex_lock(&send_lock);
+    send_signatures(client_socket, sid, fd);
+    pthread_mutex_unlock(&send_lock);
+    if (fd >= 0) close(fd);
+}
+
+/* Local entries gathered for a manifest. */
+typedef struct {
+    ManifestItem *items;
+    size_t count, cap;
+    Manifest old;           // the previous manifest, for hashes of unchanged files
+    size_t hashed;          // files that had to be read
+} ManifestBuild;
+
+/* Adds every file and directory below rel_dir ("" for the root). */
+static void collect_entries(ManifestBuild *b, const char *rel_dir) {
+    char abs_dir[PATH_MAX + 512];
+    if (rel_dir[0])
+        snprintf(abs_dir, sizeof(abs_dir), "%s/%s", sync_directory, rel_dir);
+    else
+        snprintf(abs_dir, sizeof(abs_dir), "%s", sync_directory);
+    DIR *d = opendir(abs_dir);
+    if (!d) return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            (!rel_dir[0] && strcmp(entry->d_name, META_DIR) == 0) || is_temp_name(entry->d_name))
+            continue;
+        char rel[PATH_MAX], full[PATH_MAX + 512];
+        if (rel_dir[0])
+            snprintf(rel, sizeof(rel), "%s/%s", rel_dir, entry->d_name);
+        else
+            snprintf(rel, sizeof(rel), "%s", entry->d_name);
+        snprintf(full, sizeof(full), "%s/%s", sync_directory, rel);
+        struct stat st;
+        if (lstat(full, &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+            continue;
+        if (b->count == b->cap) {
+            size_t cap = b->cap ? b->cap * 2 : 256;
+            ManifestItem *grown = realloc(b->items, cap * sizeof(ManifestItem));
+            if (!grown) break;
+            b->items = grown;
+            b->cap = cap;
+        }
+        ManifestItem *it = &b->items[b->count];
+        memset(it, 0, sizeof(*it));
+        if (!(it->path = strdup(rel)))
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            it->type = MANIFEST_DIR;
+            b->count++;
+            collect_entries(b, rel);
+            continue;
+        }
+        it->type = MANIFEST_FILE;
+        it->size = st.st_size;
+        it->mtime_ns = stat_mtime_ns(&st);
+        const ManifestRecord *r = manifest_find(&b->old, rel);
+        if (r && r->type == MANIFEST_FILE && r->size == it->size && r->mtime_ns == it->mtime_ns) {
+            it->hash = r->hash;
+        } else {
+            int fd = open(full, O_RDONLY);
+            int ok = fd >= 0 && file_hash(fd, &it->hash) == 0;
+            if (fd >= 0) close(fd);
+            if (!ok) {
+                free((char *)it->path);
+                continue;
+            }
+            b->hashed++;
+        }
+        content_add(full, &st, it->hash);
+        b->count++;
+    }
+    closedir(d);
+}
+
+/* Answers RECONCILE: sends MANIFEST with an entry for every local file
+   and directory, sorted, so the server can send just what differs.
+   Hashes come from the previous manifest (.syncmeta/manifest) for files
+   whose size and mtime are unchanged, so only files changed since the
+   last reconciliation are read. The new manifest replaces the old one.
+*/
+void send_manifest(void) {
+    static unsigned char buf[CHUNK_SIZE];
+    ManifestBuild b;
+    memset(&b, 0, sizeof(b));
+    char path[sizeof(sync_directory) + 32];
+    snprintf(path, sizeof(path), "%s/%s/manifest", sync_directory, META_DIR);
+    manifest_open(path, &b.old);
+    collect_entries(&b, "");
+    manifest_close(&b.old);
+    qsort(b.items, b.count, sizeof(ManifestItem), manifest_item_cmp);
+    if (manifest_write(path, b.items, b.count, 0, 0) < 0)
+        perror("manifest");
+
+    size_t bytes = varint_size(b.count), used;
+    for (size_t i = 0; i < b.count; i++)
+        bytes += MANIFEST_WIRE_FIXED + strlen(b.items[i].path);
+    used = frame_header_put(buf, F_MANIFEST, bytes);
+    used += varint_put(buf + used, b.count);
+    for (size_t i = 0; i < b.count; i++) {
+        if (used + MANIFEST_WIRE_FIXED + PATH_MAX > sizeof(buf)) {
+            send_all(buf, used);
+            used = 0;
+        }
+        used += manifest_wire_put(buf + used, &b.items[i]);
+        free((char *)b.items[i].path);
+    }
+    send_all(buf, used);
+    free(b.items);
+    printf("Sent manifest: %zu entries, %zu files hashed\n", b.count, b.hashed);
+}
+
+/* Applies COPY: appends blocks of the old copy. */
+void copy_blocks(Transfer *t, long long block, long long count) {
+    static __thread char buf[CHUNK_SIZE];
+    if (t->fd < 0 || t->base_fd < 0) return;
+    long long pos = block * t->block_size, left = count * t->block_size;
+    while (left > 0) {
+        size_t want = (size_t)left < sizeof(buf) ? (size_t)left : sizeof(buf);  // left > 0 here
+        ssize_t r = pread(t->base_fd, buf, want, pos);
+        if (r <= 0) {
+            memset(buf, 0, want);  // old copy changed underneath us; keep the framing
+            r = want;
+        }
+        if (pwrite(t->fd, buf, r, t->received) < 0)
+            perror("pwrite");
+        t->received += r;
+        pos += r;
+        left -= r;
+    }
+    finish_transfer_if_done(t);
+}
+
+/* Writes one DATA frame body at the transfer's current offset. */
+void receive_chunk(Transfer *t, const unsigned char *data, size_t len) {
+    if (t->fd < 0)
+        return;
+    if (pwrite(t->fd, data, len, t->received) < 0)
+        perror("pwrite");
+    t->received += len;
+    finish_transfer_if_done(t);
+}
+
+/* Applies ZDATA: inflates the chunk and writes it like DATA. A chunk
+   that does not inflate to what was announced drops the connection; the
+   transfer is sent again after reconnecting.
+*/
+void receive_zchunk(Transfer *t, uint64_t len, const unsigned char *data, size_t zlen) {
+    static __thread unsigned char buf[CHUNK_SIZE];
+    uLongf n = len;
+    if (uncompress(buf, &n, data, zlen) != Z_OK || n != len) {
+        fprintf(stderr, "Corrupt compressed frame from server\n");
+        shutdown(client_socket, SHUT_RDWR);
+        return;
+    }
+    receive_chunk(t, buf, n);
+}
+
+/* Copies the path that ends a frame body into rel_path (PATH_MAX bytes)
+   without its trailing slashes. Returns 0 if it is empty, too long or
+   holds a NUL.
+*/
+static int frame_path(const unsigned char *p, const unsigned char *end, char *rel_path) {
+    size_t len = end - p;
+    if (len == 0 || len >= PATH_MAX || memchr(p, '\0', len))
+        return 0;
+    memcpy(rel_path, p, len);
+    rel_path[len] = '\0';
+    normalize_path(rel_path);
+    return rel_path[0] != '\0';
+}
+
+/* Fills out with the first size bytes of in: a reflink where the file
+   system can share the blocks, otherwise an in-kernel copy, otherwise
+   read and write. Returns -1 on failure. */
+static int copy_content(int in, int out, off_t size) {
+    static __thread char buf[CHUNK_SIZE];
+    if (ioctl(out, FICLONE, in) == 0)
+        return 0;
+    loff_t pos = 0;
+    while (pos < size) {
+        loff_t in_off = pos, out_off = pos;
+        ssize_t n = copy_file_range(in, &in_off, out, &out_off, size - pos, 0);
+        if (n <= 0)
+            break;
+        pos += n;
+    }
+    while (pos < size) {
+        ssize_t n = pread(in, buf, size - pos < (off_t)sizeof(buf) ? size - pos : (off_t)sizeof(buf), pos);
+        if (n <= 0 || pwrite(out, buf, n, pos) != n)
+            return -1;
+        pos += n;
+    }
+    return 0;
+}
+
+/* Applies MATERIALIZE: builds the file from content we already hold
+   instead of having it sent. Candidates are the file itself (a rewrite
+   with the same bytes), the content index, then the path the server sent
+   that content to; each is checked against the size and hash first (the
+   index's entries are trusted while their mtime is unchanged). If none
+   has it, NEED asks for the content and the transfer waits for its OPEN.
+*/
+void materialize(Transfer *t, const unsigned char *p, const unsigned char *end) {
+    uint64_t v[6] = { 0 };  // validated by dispatch()
+    char src_rel[PATH_MAX], cand[3][PATH_MAX + 512];
+    int64_t trust_mtime[3] = { -1, -1, -1 };
+    pthread_mutex_lock(&apply_lock);
+    int done = t->done;
+    pthread_mutex_unlock(&apply_lock);
+    if (done)
+        return;  // superseded or aborted while parked
+    frame_fields(&p, end, v, 6);
+    frame_path(p, p + v[5], src_rel);
+    Hash128 h = { v[2], v[3] };
+    supersede_waiting(t);
+    snprintf(cand[0], sizeof(cand[0]), "%s", t->full_path);
+    int n = 1;
+    if (content_find(v[1], h, cand[n], &trust_mtime[n]))
+        n++;
+    snprintf(cand[n++], sizeof(cand[0]), "%s/%s", sync_directory, src_rel);
+    for (int i = 0; i < n; i++) {
+        if (i > 0 && strcmp(cand[i], t->full_path) == 0)
+            continue;
+        int in = open(cand[i], O_RDONLY | O_CLOEXEC);
+        if (in < 0)
+            continue;
+        struct stat st;
+        Hash128 got;
+        int ok = fstat(in, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == (off_t)v[1];
+        if (ok && stat_mtime_ns(&st) != trust_mtime[i]) {
+            ok = file_hash(in, &got) == 0 && got.h1 == h.h1 && got.h2 == h.h2;
+            if (ok)
+                content_add(cand[i], &st, h);
+        }
+        if (ok && i == 0) {
+            close(in);
+            printf("File unchanged: %s (size: %lld bytes)\n", t->full_path, t->size);
+            end_transfer(t);
+            return;
+        }
+        int out = -1;
+        if (ok) {
+            ensure_directory_exists(t->full_path);
+            out = open(t->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        }
+        struct stat old;
+        if (out >= 0 && stat(t->full_path, &old) == 0)
+            fchmod(out, old.st_mode & 07777);
+        ok = out >= 0 && copy_content(in, out, st.st_size) == 0 && fstat(out, &st) == 0;
+        close(in);
+        if (out >= 0)
+            close(out);
+        if (ok && rename(t->tmp_path, t->full_path) == 0) {
+            t->committed = 1;
+            content_add(t->full_path, &st, h);
+            printf("File materialized: %s from %s (size: %lld bytes)\n", t->full_path, cand[i], t->size);
+            end_transfer(t);
+            return;
+        }
+        unlink(t->tmp_path);
+    }
+    const char *rel = t->full_path + strlen(sync_directory) + 1;
+    uint64_t sid = t->sid;
+    unsigned char msg[FRAME_BOUND(1, PATH_MAX)];
+    size_t len = frame_put(msg, F_NEED, &sid, 1, rel, strlen(rel));
+    pthread_mutex_lock(&send_lock);
+    send_all(msg, len);
+    pthread_mutex_unlock(&send_lock);
+}
+
+/* Applies CREATE or DELETE. */
+static void apply_op(int op, int is_dir, const char *rel_path) {
+    char full_path[PATH_MAX + 512];
+    snprintf(full_path, sizeof(full_path), "%s/%s", sync_directory, rel_path);
+    if (op == F_CREATE) {
+        if (is_dir) {
+            ensure_directory_exists(full_path);
+            mkdir(full_path, 0777);
+            printf("Directory created: %s\n", full_path);
+        } else {
+            ensure_directory_exists(full_path);
+            FILE *fp_tmp = fopen(full_path, "w");
+            if (fp_tmp) { fclose(fp_tmp); }
+            printf("Empty file created: %s\n", full_path);
+        }
+    } else if (op == F_DELETE) {
+        struct stat st;
+        if (stat(full_path, &st) == 0) {
+            if (S_ISDIR(st.st_mode))
+                remove_dir_recursive(full_path);
+            else
+                remove(full_path);
+            printf("Deleted: %s\n", full_path);
+        }
+    }
+}
+
+/* Applies RENAME, taking in-progress transfers along. */
+static void apply_rename(const char *from, const char *to) {
+    char old_full[PATH_MAX + 512], new_full[PATH_MAX + 512];
+    snprintf(old_full, sizeof(old_full), "%s/%s", sync_directory, from);
+    snprintf(new_full, sizeof(new_full), "%s/%s", sync_directory, to);
+    rebase_transfers(from, to);
+    ensure_directory_exists(new_full);
+    if (rename(old_full, new_full) < 0)
+        perror("rename");
+    else
+        printf("Renamed: %s -> %s\n", old_full, new_full);
+}
+
+/* Allocates a Work item holding a copy of a frame body. */
+static Work *work_new(int op, const unsigned char *body, size_t len) {
+    Work *w = malloc(sizeof(Work) + len);
+    if (!w) return NULL;
+    w->next = NULL;
+    w->op = op;
+    w->seq = 0;
+    w->t = NULL;
+    w->len = len;
+    memcpy(w->body, body, len);
+    return w;
+}
+
+/* Frees a Work item, making room for the reader. Caller holds apply_lock. */
+static void work_free(Work *w) {
+    queued_bytes -= w->len;
+    free(w);
+    pthread_cond_signal(&room);
+}
+
+/* Whether a worker (or, for -1, every worker) has nothing to do. Caller holds apply_lock. */
+static int workers_idle(int worker) {
+    for (int i = 0; i < nworkers; i++)
+        if ((worker < 0 || i == worker) && (workers[i].head || workers[i].busy_seq))
+            return 0;
+    return 1;
+}
+
+/* Waits until workers_idle(worker). */
+static void wait_idle(int worker) {
+    pthread_mutex_lock(&apply_lock);
+    draining = 1;
+    wake_workers();
+    while (!workers_idle(worker))
+        pthread_cond_wait(&idle, &apply_lock);
+    draining = 0;
+    pthread_mutex_unlock(&apply_lock);
+}
+
+/* The position to ACK, or 0 if none is due. The applied position is
+   acknowledged at most every ACK_INTERVAL_MS while frames keep coming,
+   and at once when everything read has been applied, so the server can
+   tell how far behind we are without an ACK per event. A position
+   returned must be passed to ack_send(); until then the connection is
+   kept open. Caller holds apply_lock.
+*/
+static uint64_t ack_due(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+    uint64_t seq = state->journal_id == journal_id ? state->seq : 0;
+    if (!server_acks || seq <= ack_seq ||
+        (now - ack_ms < ACK_INTERVAL_MS && (inbox_head || !workers_idle(-1))))
+        return 0;
+    ack_seq = seq;
+    ack_ms = now;
+    acking++;
+    return seq;
+}
+
+static void ack_send(uint64_t seq) {
+    unsigned char msg[FRAME_BOUND(1, 0)];
+    size_t len = frame_put(msg, F_ACK, &seq, 1, NULL, 0);
+    pthread_mutex_lock(&send_lock);
+    send_all(msg, len);
+    pthread_mutex_unlock(&send_lock);
+    pthread_mutex_lock(&apply_lock);
+    if (--acking == 0)
+        pthread_cond_broadcast(&idle);
+    pthread_mutex_unlock(&apply_lock);
+}
+
+/* Dispatches one frame from the server (see the F_* ops in syncproto.h):
+     - For file content: OPEN, then DATA frames (ZDATA if we asked for
+       compression), possibly interleaved with other transfers, until the
+       advertised size has arrived.
+     - For a modified file: SIGREQ, answered with signatures, then DELTA
+       followed by COPY and DATA frames (or a plain OPEN transfer).
+     - ABORT when a newer version of the file replaced the transfer.
+     - MATERIALIZE for content we were sent before: the file is copied
+       from a local file with that content, once the transfer that brought
+       it is complete, or asked for with NEED.
+     - WELCOME first, naming the journal the SEQ marks refer to.
+     - SEQ after the messages of each event.
+     - RECONCILE when the journal cannot bring us up to date; answered
+       with our manifest.
+     - CREATE, DELETE and RENAME for other events, usually arriving many
+       at a time in a BATCH.
+   File ops and transfer frames go to the worker for their path; the
+   rest is applied here, after waiting for whatever it depends on. Takes
+   ownership of w. Returns -1 if the frame is malformed.
+*/
+static int dispatch(Work *w) {
+    const unsigned char *p = w->body, *end = w->body + w->len;
+    char rel_path[PATH_MAX];
+    uint64_t v[6];
+    int worker = -1, parked = 0, ret = 0;
+    switch (w->op) {
+    case F_BATCH:
+        while (p < end) {
+            int inner;
+            uint64_t len;
+            int h = frame_header_get(p, end - p, &inner, &len);
+            if (h <= 0 || len > (uint64_t)(end - p - h) || inner == F_BATCH) {
+                ret = -1;
+                break;
+            }
+            Work *in = work_new(inner, p + h, len);
+            if (in) {
+                pthread_mutex_lock(&apply_lock);
+                queued_bytes += len;
+                pthread_mutex_unlock(&apply_lock);
+                if (dispatch(in) < 0) {
+                    ret = -1;
+                    break;
+                }
+            }
+            p += h + len;
+        }
+        break;
+    case F_DATA:
+    case F_ZDATA:
+    case F_COPY:
+    case F_ABORT:
+        if (frame_fields(&p, end, v, w->op == F_COPY ? 3 : w->op == F_ZDATA ? 2 : 1) < 0 ||
+            (w->op == F_ZDATA && v[1] > CHUNK_SIZE)) {
+            ret = -1;
+            break;
+        }
+        pthread_mutex_lock(&apply_lock);
+        if ((w->t = find_transfer(v[0]))) {  // gone if it failed or was aborted
+            w->t->refs++;
+            worker = w->t->worker;
+        }
+        pthread_mutex_unlock(&apply_lock);
+        break;
+    case F_OPEN:
+    case F_DELTA:
+        if (frame_fields(&p, end, v, w->op == F_DELTA ? 3 : 2) < 0 ||
+            !frame_path(p, end, rel_path) || (w->op == F_DELTA && v[2] == 0)) {
+            ret = -1;
+            break;
+        }
+        pthread_mutex_lock(&apply_lock);
+        w->t = find_transfer(v[0]);
+        if (w->t && w->t->waiting && w->op == F_OPEN) {  // answers our NEED
+            w->t->waiting = 0;
+            w->t->size = v[1];
+        } else {
+            w->t = transfer_new(v[0], path_worker(rel_path), v[1], w->op == F_DELTA ? v[2] : 0, rel_path);
+        }
+        if (w->t) {
+            w->t->refs++;
+            worker = w->t->worker;
+        }
+        pthread_mutex_unlock(&apply_lock);
+        break;
+    case F_MATERIALIZE: {
+        char src_path[PATH_MAX];
+        if (frame_fields(&p, end, v, 6) < 0 || v[5] > (uint64_t)(end - p) ||
+            !frame_path(p, p + v[5], src_path) || !frame_path(p + v[5], end, rel_path)) {
+            ret = -1;
+            break;
+        }
+        pthread_mutex_lock(&apply_lock);
+        if ((w->t = transfer_new(v[0], path_worker(rel_path), v[1], 0, rel_path))) {
+            w->t->waiting = 1;
+            w->t->refs++;
+            Transfer *src = find_transfer(v[4]);
+            if (src && src != w->t) {  // still arriving; wait for end_transfer()
+                w->seq = last_mark + 1;
+                w->next = src->parked;
+                src->parked = w;
+                parked = 1;
+            } else {
+                worker = w->t->worker;
+            }
+        }
+        pthread_mutex_unlock(&apply_lock);
+        break;
+    }
+    case F_SIGREQ:
+        if (frame_fields(&p, end, v, 1) < 0 || !frame_path(p, end, rel_path))
+            ret = -1;
+        else
+            worker = path_worker(rel_path);
+        break;
+    case F_CREATE:
+    case F_DELETE:
+        if (frame_fields(&p, end, v, 1) < 0 || !frame_path(p, end, rel_path)) {
+            ret = -1;
+        } else if (!v[0]) {
+            worker = path_worker(rel_path);
+        } else if (w->op == F_CREATE) {
+            // Later ops below it may go to any worker; create it now.
+            wait_idle(path_worker(rel_path));
+            uint64_t start = metric_clock();
+            apply_op(w->op, 1, rel_path);
+            apply_timed(w->op, start);
+        } else {
+            wait_idle(-1);
+            uint64_t start = metric_clock();
+            abort_transfers(rel_path, 1);
+            apply_op(w->op, 1, rel_path);
+            apply_timed(w->op, start);
+        }
+        break;
+    case F_RENAME: {
+        char to_path[PATH_MAX];
+        if (frame_fields(&p, end, v, 2) < 0 || v[1] > (uint64_t)(end - p) ||
+            !frame_path(p, p + v[1], rel_path) || !frame_path(p + v[1], end, to_path)) {
+            ret = -1;
+            break;
+        }
+        if (v[0]) {
+            wait_idle(-1);  // anything below it may be queued anywhere
+        } else {
+            wait_idle(path_worker(rel_path));
+            wait_idle(path_worker(to_path));
+        }
+        uint64_t start = metric_clock();
+        apply_rename(rel_path, to_path);
+        apply_timed(w->op, start);
+        break;
+    }
+    case F_SEQ:
+        if (frame_fields(&p, end, v, 1) < 0) {
+            ret = -1;
+            break;
+        }
+        pthread_mutex_lock(&apply_lock);
+        last_mark = v[0];
+        marked = 1;
+        update_applied();
+        uint64_t ack = ack_due();
+        pthread_mutex_unlock(&apply_lock);
+        if (ack)
+            ack_send(ack);
+        break;
+    case F_WELCOME:
+        if (frame_fields(&p, end, v, 3) < 0) {
+            ret = -1;
+            break;
+        }
+        if (v[0] != SYNC_VERSION) {
+            fprintf(stderr, "Server speaks protocol version %llu, not %d\n",
+                    (unsigned long long)v[0], SYNC_VERSION);
+            exit(1);
+        }
+        pthread_mutex_lock(&apply_lock);
+        server_acks = (v[1] & SYNC_CAP_ACK) != 0;
+        ack_seq = 0;
+        pthread_mutex_unlock(&apply_lock);
+        if (v[2] != state->journal_id) {
+            // A journal we have no position in: the server reconciles us.
+            pthread_mutex_lock(&apply_lock);
+            journal_id = v[2];
+            state->journal_id = 0;
+            state->seq = 0;
+            last_mark = 0;
+            marked = 0;
+            pthread_mutex_unlock(&apply_lock);
+        }
+        break;
+    case F_RECONCILE: {
+        wait_idle(-1);
+        uint64_t start = metric_clock();
+        pthread_mutex_lock(&send_lock);
+        send_manifest();
+        pthread_mutex_unlock(&send_lock);
+        apply_timed(w->op, start);
+        break;
+    }
+    }  // unknown ops are skipped
+    pthread_mutex_lock(&apply_lock);
+    if (worker >= 0) {
+        w->seq = last_mark + 1;
+        push_work(w, worker);
+    } else if (!parked) {
+        if (w->t) transfer_put(w->t);
+        work_free(w);
+    }
+    pthread_mutex_unlock(&apply_lock);
+    return ret;
+}
+
+/* Dispatcher thread: takes frames from the inbox in arrival order. */
+void *dispatch_updates(void *arg) {
+    pthread_mutex_lock(&apply_lock);
+    while (1) {
+        while (!inbox_head) {
+            dispatching = 0;
+            wake_workers();  // batches stop filling
+            pthread_cond_broadcast(&idle);
+            pthread_cond_wait(&inbox_ready, &apply_lock);
+        }
+        Work *w = inbox_head;
+        if (!(inbox_head = w->next))
+            inbox_tail = NULL;
+        dispatching = 1;
+        pthread_mutex_unlock(&apply_lock);
+        if (dispatch(w) < 0) {
+            fprintf(stderr, "Malformed frame from server\n");
+            shutdown(client_socket, SHUT_RDWR);  // the reader sees the end and reconnects
+        }
+        pthread_mutex_lock(&apply_lock);
+    }
+    return NULL;
+}
+
+/* Applies a frame handed to a worker. */
+static void apply_work(Work *w) {
+    const unsigned char *p = w->body, *end = w->body + w->len;
+    char rel_path[PATH_MAX], full_path[PATH_MAX + 512];
+    uint64_t v[3] = { 0 };  // validated by dispatch()
+    switch (w->op) {
+    case F_OPEN:
+    case F_DELTA:
+        start_transfer(w->t);
+        break;
+    case F_DATA:
+        frame_fields(&p, end, v, 1);
+        receive_chunk(w->t, p, end - p);
+        break;
+    case F_ZDATA:
+        frame_fields(&p, end, v, 2);
+        receive_zchunk(w->t, v[1], p, end - p);
+        break;
+    case F_COPY:
+        frame_fields(&p, end, v, 3);
+        copy_blocks(w->t, v[1], v[2]);
+        break;
+    case F_ABORT:
+        end_transfer(w->t);
+        break;
+    case F_MATERIALIZE:
+        materialize(w->t, p, end);
+        break;
+    case F_SIGREQ:
+        frame_fields(&p, end, v, 1);
+        frame_path(p, end, rel_path);
+        snprintf(full_path, sizeof(full_path), "%s/%s", sync_directory, rel_path);
+        answer_sigreq(v[0], full_path);
+        break;
+    case F_CREATE:
+    case F_DELETE:
+        frame_fields(&p, end, v, 1);
+        frame_path(p, end, rel_path);
+        if (w->op == F_DELETE)
+            abort_transfers(rel_path, 0);
+        apply_op(w->op, 0, rel_path);
+        break;
+    }
+}
+
+/* Batched apply (-b uring). When a worker's queue starts with complete
+   plain transfers (an OPEN followed by DATA frames adding up to its
+   size), the worker takes up to APPLY_BATCH of them and writes them
+   through its own ring in two rounds: a statx of each target, for the
+   permissions to keep, then for each file a linked chain that opens the
+   temp file into a registered slot, writes the frames, closes it and
+   renames it over the target. A file whose chain fails anywhere (its
+   directory is missing, say), or whose permissions the umask would
+   strip, is applied the plain way afterwards, which reports the error.
+*/
+typedef struct {
+    Work *open;             // the OPEN; its DATA frames follow it
+    struct statx stx;
+    int ok;                 // still on the batched path
+} BatchFile;
+
+static __thread Uring apply_ring;
+static __thread int apply_ring_ok;
+
+/* Sets up the calling worker's ring, with APPLY_BATCH free file slots. */
+static void apply_ring_setup(void) {
+    int fds[APPLY_BATCH];
+    for (int i = 0; i < APPLY_BATCH; i++)
+        fds[i] = -1;
+    if (uring_init(&apply_ring, APPLY_RING_ENTRIES) < 0) {
+        perror("io_uring unavailable, using plain system calls");
+        return;
+    }
+    if (uring_register(&apply_ring, IORING_REGISTER_FILES, fds, APPLY_BATCH) < 0) {
+        perror("io_uring file table");
+        close(apply_ring.fd);
+        return;
+    }
+    apply_ring_ok = 1;
+}
+
+/* The data of a DATA frame body, after its stream id. */
+static const unsigned char *data_start(const Work *w) {
+    const unsigned char *p = w->body;
+    uint64_t sid;
+    frame_fields(&p, w->body + w->len, &sid, 1);
+    return p;
+}
+
+/* Detaches the complete plain transfers at the head of a worker's queue,
+   as many as fit in a batch. Their Work items stay linked in order.
+   Returns how many files were taken. Caller holds apply_lock.
+*/
+static int take_batch(Worker *me, BatchFile *files) {
+    int n = 0;
+    unsigned entries = 0;
+    Work *w = me->head, *last = NULL;
+    while (n < APPLY_BATCH && w && w->op == F_OPEN && w->t && !w->t->block_size &&
+           !w->t->done && w->t->fd < 0) {
+        Transfer *t = w->t;
+        Work *end = w;
+        long long got = 0;
+        unsigned ops = 3;  // open, close, rename
+        while (got < t->size && end->next && end->next->op == F_DATA && end->next->t == t) {
+            end = end->next;
+            got += end->body + end->len - data_start(end);
+            ops++;
+        }
+        if (got != t->size || entries + ops > apply_ring.entries)
+            break;  // not all here yet, or too big for what is left of the ring
+        files[n].open = w;
+        files[n++].ok = 1;
+        entries += ops;
+        last = end;
+        w = end->next;
+    }
+    if (n) {
+        if (!(me->head = w))
+            me->tail = NULL;
+        last->next = NULL;
+    }
+    return n;
+}
+
+/* Submits what is queued on the apply ring and waits for all of it. The
+   ring is never partly used, so a failure here cannot be recovered from. */
+static void apply_ring_wait(void) {
+    if (uring_submit(&apply_ring, apply_ring.queued + apply_ring.inflight) < 0) {
+        perror("io_uring_enter");
+        exit(1);
+    }
+}
+
+/* Applies the files take_batch() detached. */
+static void apply_batch(BatchFile *files, int n) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    for (int i = 0; i < n; i++) {
+        supersede_waiting(files[i].open->t);
+        sqe = uring_get(&apply_ring);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)files[i].open->t->full_path;
+        sqe->len = STATX_MODE;
+        sqe->off = (uintptr_t)&files[i].stx;
+        sqe->user_data = i;
+    }
+    apply_ring_wait();
+    while ((cqe = uring_peek(&apply_ring))) {
+        BatchFile *f = &files[cqe->user_data];
+        if (cqe->res < 0)
+            f->stx.stx_mode = 0666;  // a new file, made like open() would
+        else if (((f->stx.stx_mode & 07777) & ~file_umask) != (f->stx.stx_mode & 07777))
+            f->ok = 0;  // needs the fchmod() of the plain path
+        uring_seen(&apply_ring);
+    }
+    for (int i = 0; i < n; i++) {
+        if (!files[i].ok)
+            continue;
+        Transfer *t = files[i].open->t;
+        sqe = uring_get(&apply_ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)t->tmp_path;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        sqe->len = files[i].stx.stx_mode & 07777;
+        sqe->file_index = i + 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = i;  // expects 0
+        long long pos = 0;
+        for (Work *w = files[i].open->next; w && w->t == t; w = w->next) {
+            const unsigned char *p = data_start(w);
+            size_t len = w->body + w->len - p;
+            sqe = uring_get(&apply_ring);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = i;
+            sqe->addr = (uintptr_t)p;
+            sqe->len = len;
+            sqe->off = pos;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            sqe->user_data = (uint64_t)len << 32 | i;  // expects the whole frame written
+            pos += len;
+        }
+        sqe = uring_get(&apply_ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = i + 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = i;
+        sqe = uring_get(&apply_ring);
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)t->tmp_path;
+        sqe->len = AT_FDCWD;
+        sqe->addr2 = (uintptr_t)t->full_path;
+        sqe->user_data = i;
+    }
+    apply_ring_wait();
+    while ((cqe = uring_peek(&apply_ring))) {
+        if (cqe->res != (int)(cqe->user_data >> 32))
+            files[(uint32_t)cqe->user_data].ok = 0;
+        uring_seen(&apply_ring);
+    }
+    for (int i = 0; i < n; i++) {
+        Transfer *t = files[i].open->t;
+        if (files[i].ok) {
+            t->received = t->size;
+            t->committed = 1;
+            printf("File created: %s (size: %lld bytes)\n", t->full_path, t->size);
+            end_transfer(t);
+        } else {
+            for (Work *w = files[i].open; w && w->t == t; w = w->next)
+                apply_work(w);
+        }
+    }
+}
+
+/* Worker thread: applies its queue in order, a batch of files at a time
+   where it can (-b uring). */
+void *apply_worker(void *arg) {
+    Worker *me = arg;
+    BatchFile files[APPLY_BATCH];
+    if (use_uring)
+        apply_ring_setup();
+    pthread_mutex_lock(&apply_lock);
+    me->batching = apply_ring_ok;
+    while (1) {
+        while (!me->head || batch_filling(me))
+            pthread_cond_wait(&me->ready, &apply_lock);
+        Work *w = me->head;
+        int n = apply_ring_ok && w->op == F_OPEN ? take_batch(me, files) : 0;
+        if (!n) {
+            if (!(me->head = w->next))
+                me->tail = NULL;
+            w->next = NULL;
+        }
+        me->busy_seq = w->seq;
+        pthread_mutex_unlock(&apply_lock);
+        uint64_t start = metric_clock();
+        if (n) {
+            apply_batch(files, n);
+            metric_since(M_BATCH, start);
+        } else {
+            apply_work(w);
+            apply_timed(w->op, start);
+        }
+        pthread_mutex_lock(&apply_lock);
+        me->busy_seq = 0;
+        while (w) {
+            Work *next = w->next;
+            if (w->t) transfer_put(w->t);
+            work_free(w);
+            w = next;
+        }
+        update_applied();
+        uint64_t ack = ack_due();
+        if (ack) {
+            pthread_mutex_unlock(&apply_lock);
+            ack_send(ack);
+            pthread_mutex_lock(&apply_lock);
+        }
+        if (!me->head)
+            pthread_cond_broadcast(&idle);
+    }
+    return NULL;
+}
+
+/* Receives frames from the server and queues them for the dispatcher.
+   The socket is read in large blocks, so a burst of small ops costs a
+   few reads, not one per op. Once the connection ends, waits for
+   everything read to be applied, then closes the socket.
+*/
+void *receive_updates(void *arg) {
+    static unsigned char buf[RECV_BUF_SIZE];
+    size_t have = 0;
+    while (1) {
+        ssize_t n = recv(client_socket, buf + have, sizeof(buf) - have, 0);
+        if (n <= 0)
+            break;
+        metric_add(M_RECEIVED_BYTES, n);
+        have += n;
+        size_t off = 0;
+        int op, bad = 0;
+        uint64_t len;
+        while (1) {
+            int h = frame_header_get(buf + off, have - off, &op, &len);
+            if (h < 0 || (h > 0 && len > FRAME_MAX)) {
+                bad = 1;
+                break;
+            }
+            if (h == 0 || have - off - h < len)
+                break;
+            Work *w = work_new(op, buf + off + h, len);
+            if (w) {
+                pthread_mutex_lock(&apply_lock);
+                while (queued_bytes > APPLY_QUEUE_BYTES)
+                    pthread_cond_wait(&room, &apply_lock);
+                queued_bytes += len;
+                if (inbox_tail) inbox_tail->next = w;
+                else inbox_head = w;
+                inbox_tail = w;
+                pthread_cond_signal(&inbox_ready);
+                pthread_mutex_unlock(&apply_lock);
+            }
+            off += h + len;
+        }
+        if (bad) {
+            fprintf(stderr, "Malformed frame from server\n");
+            break;
+        }
+        memmove(buf, buf + off, have - off);
+        have -= off;
+    }
+    pthread_mutex_lock(&apply_lock);
+    while (inbox_head || dispatching || acking || !workers_idle(-1))
+        pthread_cond_wait(&idle, &apply_lock);
+    pthread_mutex_unlock(&apply_lock);
+    close(client_socket);
+    return NULL;
+}
+
+/* Gauges for a scrape (-m): positions in the server's journal, and
+   what is read but not applied yet. */
+static void client_gauges(FILE *out) {
+    pthread_mutex_lock(&apply_lock);
+    unsigned long long applied = state->seq, received = last_mark;
+    size_t queued = queued_bytes, open = 0;
+    for (Transfer *t = transfers; t; t = t->next)
+        open++;
+    pthread_mutex_unlock(&apply_lock);
+    fprintf(out, "# HELP sync_client_applied_seq Newest event applied, with all before it.\n"
+                 "# TYPE sync_client_applied_seq gauge\nsync_client_applied_seq %llu\n", applied);
+    fprintf(out, "# HELP sync_client_received_seq Newest event received.\n"
+                 "# TYPE sync_client_received_seq gauge\nsync_client_received_seq %llu\n", received);
+    fprintf(out, "# HELP sync_client_queue_bytes Frames read but not applied yet.\n"
+                 "# TYPE sync_client_queue_bytes gauge\nsync_client_queue_bytes %zu\n", queued);
+    fprintf(out, "# HELP sync_client_transfers Files being received.\n"
+                 "# TYPE sync_client_transfers gauge\nsync_client_transfers %zu\n", open);
+}
+
+/* Connects to the server; returns the socket or -1. */
+int connect_to_server(struct sockaddr_in *server_addr) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* Main function - connects to the server and starts receiving updates.
+   When the connection drops it reconnects, backing off up to
+   RECONNECT_MAX_DELAY seconds, and resumes from the recorded position.
+   Usage: ./client [-w workers] [-z] [-b sync|uring] [-m metrics_port] <sync_directory> <ignore_file> <server_ip> <port>
+*/
+int main(int argc, char *argv[]) {
+    int opt, bad_args = 0;
+    int metrics_port = 0;
+    while ((opt = getopt(argc, argv, "b:m:w:z")) != -1) {
+        switch (opt) {
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'z':
+            want_zlib = 1;
+            break;
+        case 'm':
+            if ((metrics_port = atoi(optarg)) <= 0)
+                bad_args = 1;
+            break;
+        case 'b':
+            if (strcmp(optarg, "uring") == 0)
+                use_uring = 1;
+            else if (strcmp(optarg, "sync") != 0)
+                bad_args = 1;
+            break;
+        default:
+            bad_args = 1;
+        }
+    }
+    if (bad_args || argc - optind != 4 || nworkers < 0 || nworkers > MAX_WORKERS) {
+        fprintf(stderr, "Usage: %s [-w workers] [-z] [-b sync|uring] [-m metrics_port] <sync_directory> <ignore_file> <server_ip> <port>\n", argv[0]);
+        return 1;
+    }
+    if (nworkers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = cpus < 1 ? 1 : cpus > DEFAULT_WORKERS ? DEFAULT_WORKERS : (int)cpus;
+    }
+    
+    if (strlen(argv[optind]) >= sizeof(sync_directory)) {
+        fprintf(stderr, "sync directory path too long\n");
+        return 1;
+    }
+    strcpy(sync_directory, argv[optind]);
+    char *ignore_file = argv[optind + 1];
+    char *server_ip = argv[optind + 2];
+    int port = atoi(argv[optind + 3]);
+    open_state();
+    file_umask = umask(0);
+    umask(file_umask);
+    if (metrics_port && metrics_start(metrics_port, client_metrics, M_COUNT, client_gauges) < 0) {
+        perror("metrics port");
+        return 1;
+    }
+    
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
+        perror("inet_pton");
+        return 1;
+    }
+    client_socket = connect_to_server(&server_addr);
+    if (client_socket < 0) {
+        perror("connect");
+        return 1;
+    }
+    
+    pthread_t update_thread, thread;
+    pthread_create(&thread, NULL, dispatch_updates, NULL);
+    for (int i = 0; i < nworkers; i++) {
+        pthread_cond_init(&workers[i].ready, NULL);
+        pthread_create(&thread, NULL, apply_worker, &workers[i]);
+    }
+    int delay = 1;
+    while (1) {
+        last_mark = state->seq;
+        journal_id = state->journal_id;
+        // Send hello with the ignore list to the server.
+        send_hello(ignore_file);
+        printf("Connected to server. Syncing directory: %s\n", sync_directory);
+
+        pthread_create(&update_thread, NULL, receive_updates, NULL);
+        pthread_join(update_thread, NULL);  // drains the queues and closes the socket
+        pthread_mutex_lock(&apply_lock);
+        // Nothing past the recorded position is complete: the SEQ marks
+        // after the unfinished transfers must not count once they are ended.
+        last_mark = state->seq;
+        marked = 0;
+        for (Transfer *t = transfers; t; t = t->next)
+            t->done = 1;  // MATERIALIZEs parked on them are dropped, not applied
+        pthread_mutex_unlock(&apply_lock);
+        while (transfers)
+            end_transfer(transfers);  // unfinished; the server will send them again
+
+        printf("Disconnected from server, reconnecting...\n");
+        while ((client_socket = connect_to_server(&server_addr)) < 0) {
+            sleep(delay);
+            if (delay < RECONNECT_MAX_DELAY)
+                delay *= 2;
+        }
+        delay = 1;
+    }
+    return 0;
+}
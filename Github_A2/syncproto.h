@@ -0,0 +1,836 @@
+/* Definitions shared by syncserver.c and syncclient.c: transfer sizes,
+   the checksums used by delta sync and the manifest format. Header-only
+   so each program still builds from a single gcc command. syncbench.c
+   uses file_hash() to compare trees.
+*/
+#ifndef SYNCPROTO_H
+#define SYNCPROTO_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#define CHUNK_SIZE (64 * 1024)       // largest DATA frame; bounds memory per transfer
+#define DELTA_MIN_SIZE (64 * 1024)   // smaller modified files are simply re-sent
+#define SIG_BYTES 20                 // per block: weak checksum (4) + strong hash (16)
+#define MAX_SIG_BLOCKS (1 << 20)
+
+typedef struct {
+    uint64_t h1, h2;
+} Hash128;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* MurmurHash3 x64_128: the strong per-block hash. */
+static inline Hash128 hash128(const void *key, size_t len, uint64_t seed) {
+    const unsigned char *data = key;
+    size_t nblocks = len / 16;
+    uint64_t h1 = seed, h2 = seed;
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    for (size_t i = 0; i < nblocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    const unsigned char *tail = data + nblocks * 16;
+    uint64_t k1 = 0, k2 = 0;
+    switch (len & 15) {
+    case 15: k2 ^= (uint64_t)tail[14] << 48; /* fall through */
+    case 14: k2 ^= (uint64_t)tail[13] << 40; /* fall through */
+    case 13: k2 ^= (uint64_t)tail[12] << 32; /* fall through */
+    case 12: k2 ^= (uint64_t)tail[11] << 24; /* fall through */
+    case 11: k2 ^= (uint64_t)tail[10] << 16; /* fall through */
+    case 10: k2 ^= (uint64_t)tail[9] << 8;   /* fall through */
+    case 9:  k2 ^= (uint64_t)tail[8];
+             k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2; /* fall through */
+    case 8:  k1 ^= (uint64_t)tail[7] << 56;  /* fall through */
+    case 7:  k1 ^= (uint64_t)tail[6] << 48;  /* fall through */
+    case 6:  k1 ^= (uint64_t)tail[5] << 40;  /* fall through */
+    case 5:  k1 ^= (uint64_t)tail[4] << 32;  /* fall through */
+    case 4:  k1 ^= (uint64_t)tail[3] << 24;  /* fall through */
+    case 3:  k1 ^= (uint64_t)tail[2] << 16;  /* fall through */
+    case 2:  k1 ^= (uint64_t)tail[1] << 8;   /* fall through */
+    case 1:  k1 ^= (uint64_t)tail[0];
+             k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+    Hash128 h = { h1, h2 };
+    return h;
+}
+
+/* rsync-style weak checksum: a is the byte sum, b the sum of the running
+   a values, both mod 2^16. It can be rolled one byte at a time. */
+typedef struct {
+    uint32_t a, b;
+} WeakSum;
+
+static inline WeakSum weak_init(const unsigned char *p, size_t len) {
+    WeakSum w = { 0, 0 };
+    for (size_t i = 0; i < len; i++) {
+        w.a += p[i];
+        w.b += (uint32_t)(len - i) * p[i];
+    }
+    w.a &= 0xffff;
+    w.b &= 0xffff;
+    return w;
+}
+
+static inline void weak_roll(WeakSum *w, unsigned char out, unsigned char in, size_t len) {
+    w->a = (w->a - out + in) & 0xffff;
+    w->b = (w->b - (uint32_t)len * out + w->a) & 0xffff;
+}
+
+static inline uint32_t weak_value(WeakSum w) {
+    return w.a | (w.b << 16);
+}
+
+/* Block size for signing a file: the power of two nearest above
+   sqrt(size), kept between 1 KiB and CHUNK_SIZE. */
+static inline uint32_t choose_block_size(long long size) {
+    uint32_t bs = 1024;
+    while ((long long)bs * bs < size && bs < CHUNK_SIZE)
+        bs <<= 1;
+    return bs;
+}
+
+static inline void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline uint32_t get_u32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void put_u64(unsigned char *p, uint64_t v) {
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint64_t get_u64(const unsigned char *p) {
+    return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/* Whole-file content hash for manifests: hash128 over CHUNK_SIZE pieces,
+   each seeded with the running hash, so files of any size are hashed in
+   constant memory. Returns -1 on a read error.
+*/
+static inline int file_hash(int fd, Hash128 *out) {
+    static __thread unsigned char buf[CHUNK_SIZE];
+    Hash128 h = { 0, 0 };
+    off_t pos = 0;
+    ssize_t n;
+    while ((n = pread(fd, buf, sizeof(buf), pos)) > 0) {
+        h = hash128(buf, n, h.h1 ^ rotl64(h.h2, 17) ^ (uint64_t)pos);
+        pos += n;
+    }
+    *out = h;
+    return n < 0 ? -1 : 0;
+}
+
+/* Manifest file: a header, then fixed-size records sorted by path_cmp()
+   (so a mapped manifest can be binary searched), then the path bytes. Written
+   in native byte order; it never leaves the machine that wrote it.
+*/
+#define MANIFEST_MAGIC "SYNCMAN1"
+#define MANIFEST_FILE 1
+#define MANIFEST_DIR 2
+#define MANIFEST_UNHASHED 0x80  // type flag: content hash not computed yet
+
+typedef struct {
+    char magic[8];
+    uint64_t seq;           // journal position it reflects (server side)
+    uint64_t count;
+    uint64_t journal_id;    // journal that seq refers to (server side)
+} ManifestHeader;
+
+typedef struct {
+    uint64_t path_off;      // from the start of the file
+    uint32_t path_len;
+    uint32_t type;
+    int64_t size;
+    int64_t mtime_ns;
+    Hash128 hash;
+} ManifestRecord;
+
+/* An entry as the writer sees it. */
+typedef struct {
+    const char *path;
+    int type;
+    int64_t size, mtime_ns;
+    Hash128 hash;
+} ManifestItem;
+
+static inline int64_t stat_mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* Manifest order: bytewise, except that '/' sorts before everything else,
+   so a directory is followed directly by its contents. */
+static inline int path_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+    size_t n = alen < blen ? alen : blen;
+    for (size_t i = 0; i < n; i++) {
+        int x = a[i] == '/' ? 1 : (unsigned char)a[i];
+        int y = b[i] == '/' ? 1 : (unsigned char)b[i];
+        if (x != y) return x - y;
+    }
+    return alen < blen ? -1 : alen > blen;
+}
+
+static inline int manifest_item_cmp(const void *a, const void *b) {
+    const char *x = ((const ManifestItem *)a)->path, *y = ((const ManifestItem *)b)->path;
+    return path_cmp(x, strlen(x), y, strlen(y));
+}
+
+/* Writes items (sorted with manifest_item_cmp) to path via a temp file and rename(). */
+static inline int manifest_write(const char *path, const ManifestItem *items, size_t n,
+                                 uint64_t seq, uint64_t journal_id) {
+    char tmp[PATH_MAX];
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    ManifestHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MANIFEST_MAGIC, 8);
+    hdr.seq = seq;
+    hdr.count = n;
+    hdr.journal_id = journal_id;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    uint64_t off = sizeof(hdr) + n * sizeof(ManifestRecord);
+    for (size_t i = 0; i < n; i++) {
+        ManifestRecord r;
+        memset(&r, 0, sizeof(r));
+        r.path_off = off;
+        r.path_len = strlen(items[i].path);
+        r.type = items[i].type;
+        r.size = items[i].size;
+        r.mtime_ns = items[i].mtime_ns;
+        r.hash = items[i].hash;
+        fwrite(&r, sizeof(r), 1, f);
+        off += r.path_len;
+    }
+    for (size_t i = 0; i < n; i++)
+        fwrite(items[i].path, 1, strlen(items[i].path), f);
+    int bad = ferror(f);
+    if (fclose(f) != 0 || bad || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* A manifest mapped read-only. */
+typedef struct {
+    const unsigned char *map;
+    size_t map_len;
+    uint64_t seq, count, journal_id;
+    const ManifestRecord *records;
+} Manifest;
+
+/* Maps a manifest; an absent or damaged file reads as empty. */
+static inline void manifest_open(const char *path, Manifest *m) {
+    memset(m, 0, sizeof(*m));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(ManifestHeader)) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            const ManifestHeader *hdr = map;
+            uint64_t end = sizeof(ManifestHeader) + hdr->count * sizeof(ManifestRecord);
+            if (memcmp(hdr->magic, MANIFEST_MAGIC, 8) == 0 && hdr->count < ((uint64_t)1 << 32) &&
+                end <= (uint64_t)st.st_size) {
+                m->map = map;
+                m->map_len = st.st_size;
+                m->seq = hdr->seq;
+                m->count = hdr->count;
+                m->journal_id = hdr->journal_id;
+                m->records = (const ManifestRecord *)((const unsigned char *)map + sizeof(ManifestHeader));
+            } else {
+                munmap(map, st.st_size);
+            }
+        }
+    }
+    close(fd);
+}
+
+static inline void manifest_close(Manifest *m) {
+    if (m->map) munmap((void *)m->map, m->map_len);
+    memset(m, 0, sizeof(*m));
+}
+
+/* Copies record i's path into buf (size bytes); returns 0 if it does not fit. */
+static inline int manifest_path(const Manifest *m, uint64_t i, char *buf, size_t size) {
+    const ManifestRecord *r = &m->records[i];
+    if (r->path_off + r->path_len > m->map_len || r->path_len >= size)
+        return 0;
+    memcpy(buf, m->map + r->path_off, r->path_len);
+    buf[r->path_len] = '\0';
+    return 1;
+}
+
+/* Binary search by path; returns the record or NULL. */
+static inline const ManifestRecord *manifest_find(const Manifest *m, const char *path) {
+    size_t plen = strlen(path);
+    uint64_t lo = 0, hi = m->count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const ManifestRecord *r = &m->records[mid];
+        if (r->path_off + r->path_len > m->map_len)
+            return NULL;
+        int c = path_cmp((const char *)m->map + r->path_off, r->path_len, path, plen);
+        if (c == 0)
+            return r;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+/* Wire protocol. The client opens with HELLO and the server answers
+   WELCOME; after that both directions carry frames of
+       u8 op, varint body length, body
+   Numbers in a body are varints (LEB128), and a path is whatever is left
+   of the body, so it may hold any byte but NUL. BATCH wraps a run of small
+   frames (never another BATCH) so that a burst of metadata ops costs one
+   frame; only clients that offered SYNC_CAP_BATCH get it. Clients that
+   offered SYNC_CAP_ZLIB may get ZDATA, a zlib-compressed DATA, instead.
+   Clients that offered SYNC_CAP_DEDUP may be told to MATERIALIZE a file
+   from content they already hold, and answer NEED when they do not.
+   Clients whose HELLO offered SYNC_CAP_ACK and whose WELCOME confirmed it
+   send ACK as their applied position advances.
+*/
+#define SYNC_MAGIC "SYNC"
+#define SYNC_VERSION 2
+#define SYNC_CAP_BATCH 1             // HELLO/WELCOME capability bits
+#define SYNC_CAP_ZLIB 2
+#define SYNC_CAP_DEDUP 4
+#define SYNC_CAP_ACK 8
+#define DEDUP_MIN_SIZE (16 * 1024)   // smaller files are simply sent
+#define FRAME_HDR_MAX 11             // op + largest varint
+#define FRAME_MAX (CHUNK_SIZE + 64 * 1024)  // largest frame the server sends
+#define BATCH_MAX_BYTES (32 * 1024)  // a BATCH body stays below this
+#define HELLO_MAX_BYTES (64 * 1024)  // mostly the ignore list
+
+enum {
+    // server to client
+    F_WELCOME = 1,  // version, caps, journal id
+    F_BATCH,        // frames
+    F_SEQ,          // seq: the messages of event seq are all out
+    F_RECONCILE,    // answer with MANIFEST
+    F_CREATE,       // is_dir, path (an empty file, or a directory)
+    F_DELETE,       // is_dir, path
+    F_RENAME,       // is_dir, old path length, then the old path and the new path
+    F_OPEN,         // sid, size, path; DATA frames follow
+    F_SIGREQ,       // sid, path; answer with SIGS
+    F_DELTA,        // sid, size, block size, path; COPY and DATA frames follow
+    F_DATA,         // sid, then the bytes
+    F_COPY,         // sid, first block, block count
+    F_ABORT,        // sid
+    F_ZDATA,        // sid, byte count, then the bytes compressed with zlib
+    F_MATERIALIZE,  // sid, size, hash (2 words), source sid, source path length,
+                    // then the source path and the path
+    // client to server
+    F_HELLO = 64,   // "SYNC", version, caps, journal id, seq, ignore list
+    F_MANIFEST,     // count, then count entries (see manifest_wire_put())
+    F_SIGS,         // sid, block size, count, then count * SIG_BYTES
+    F_NEED,         // sid, path: send a MATERIALIZE's content after all
+    F_ACK,          // seq: every event up to seq is applied
+};
+
+static inline size_t varint_size(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline size_t varint_put(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+/* Reads a varint at *p, advancing it. Returns -1 if it runs past end or
+   does not fit in 64 bits. */
+static inline int varint_get(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    uint64_t x = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static inline size_t frame_header_put(unsigned char *p, int op, uint64_t body_len) {
+    p[0] = op;
+    return 1 + varint_put(p + 1, body_len);
+}
+
+/* Reads a frame header. Returns its length, 0 if buf does not hold all of
+   it yet, -1 if it is malformed. */
+static inline int frame_header_get(const unsigned char *buf, size_t len, int *op, uint64_t *body_len) {
+    if (len < 2)
+        return 0;
+    const unsigned char *p = buf + 1;
+    if (varint_get(&p, buf + len, body_len) < 0)
+        return len < FRAME_HDR_MAX ? 0 : -1;
+    *op = buf[0];
+    return p - buf;
+}
+
+#define FRAME_BOUND(nfields, tail_len) (FRAME_HDR_MAX + 10 * (nfields) + (tail_len))
+
+/* Writes a frame whose body is n varints followed by tail_len bytes of
+   tail. buf must hold FRAME_BOUND(n, tail_len). Returns the frame length. */
+static inline size_t frame_put(unsigned char *buf, int op, const uint64_t *v, int n,
+                               const void *tail, size_t tail_len) {
+    size_t body = tail_len;
+    for (int i = 0; i < n; i++)
+        body += varint_size(v[i]);
+    size_t len = frame_header_put(buf, op, body);
+    for (int i = 0; i < n; i++)
+        len += varint_put(buf + len, v[i]);
+    if (tail_len)
+        memcpy(buf + len, tail, tail_len);
+    return len + tail_len;
+}
+
+/* Reads n varints from the front of a body, advancing *p. */
+static inline int frame_fields(const unsigned char **p, const unsigned char *end, uint64_t *v, int n) {
+    for (int i = 0; i < n; i++)
+        if (varint_get(p, end, &v[i]) < 0)
+            return -1;
+    return 0;
+}
+
+/* Wire form of a manifest entry, as carried by MANIFEST:
+   type (1), path length (2), size (8), hash (16), then the path.
+*/
+#define MANIFEST_WIRE_FIXED 27
+
+static inline size_t manifest_wire_put(unsigned char *p, const ManifestItem *it) {
+    size_t plen = strlen(it->path);
+    p[0] = it->type;
+    p[1] = plen;
+    p[2] = plen >> 8;
+    put_u64(p + 3, (uint64_t)it->size);
+    put_u64(p + 11, it->hash.h1);
+    put_u64(p + 19, it->hash.h2);
+    memcpy(p + MANIFEST_WIRE_FIXED, it->path, plen);
+    return MANIFEST_WIRE_FIXED + plen;
+}
+
+/* Writes len bytes to fd, retrying short writes. */
+static inline void write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) return;
+        p += n;
+        len -= n;
+    }
+}
+
+/* write_all() for a socket: a peer that has gone away shows up as an
+   error on the next read, not as a SIGPIPE that kills the process. */
+static inline void send_full(int sock, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        p += n;
+        len -= n;
+    }
+}
+
+/* Answers SIGREQ on sock: sends SIGS with a weak checksum and strong hash
+   for every full block of the local copy open at fd. A missing file
+   (fd -1) is answered with zero blocks, which makes the server send the
+   whole file.
+*/
+static inline void send_signatures(int sock, unsigned sid, int fd) {
+    static __thread unsigned char buf[CHUNK_SIZE], out[CHUNK_SIZE];
+    struct stat st;
+    long long size = (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : 0;
+    uint32_t bs = choose_block_size(size);
+    uint32_t count = size / bs;
+    if (count > MAX_SIG_BLOCKS) count = MAX_SIG_BLOCKS;
+    uint64_t v[3] = { sid, bs, count };
+    size_t body = (size_t)count * SIG_BYTES, used;
+    for (int i = 0; i < 3; i++)
+        body += varint_size(v[i]);
+    used = frame_header_put(out, F_SIGS, body);
+    for (int i = 0; i < 3; i++)
+        used += varint_put(out + used, v[i]);
+    for (uint32_t i = 0; i < count; i++) {
+        if (pread(fd, buf, bs, (off_t)i * bs) != (ssize_t)bs)
+            memset(buf, 0, bs);  // keep the promised count; a bad block just won't match
+        if (used + SIG_BYTES > sizeof(out)) {
+            send_full(sock, out, used);
+            used = 0;
+        }
+        unsigned char *sig = out + used;
+        put_u32(sig, weak_value(weak_init(buf, bs)));
+        Hash128 h = hash128(buf, bs, 0);
+        put_u64(sig + 4, h.h1);
+        put_u64(sig + 12, h.h2);
+        used += SIG_BYTES;
+    }
+    send_full(sock, out, used);
+}
+
+/* Whether name is the temp file of a transfer (".<name>.sync<sid>"). */
+static inline int is_temp_name(const char *name) {
+    const char *p = strrchr(name, '.');
+    if (name[0] != '.' || p == name || strncmp(p, ".sync", 5) != 0 || !p[5])
+        return 0;
+    for (p += 5; *p; p++)
+        if (*p < '0' || *p > '9')
+            return 0;
+    return 1;
+}
+
+/* io_uring (-b uring), driven through its system calls directly. A ring
+   belongs to one thread. Entries are filled in place with uring_get() and
+   handed to the kernel by uring_submit(), all of them in one
+   io_uring_enter() that also waits for completions; those are then read
+   off the completion ring with uring_peek() and uring_seen(). The number
+   of entries in flight never exceeds the ring size, so the completion
+   ring (twice as large) cannot overflow.
+*/
+typedef struct {
+    int fd;                 // -1 if the ring could not be set up
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned queued;        // filled since the last submit
+    unsigned inflight;      // submitted, completion not read yet
+} Uring;
+
+static inline int uring_init(Uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_len > sq_len)
+        sq_len = cq_len;
+    unsigned char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             r->fd, IORING_OFF_SQ_RING);
+    unsigned char *cq = single || sq == MAP_FAILED ? sq
+                      : mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             r->fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+        if (cq != MAP_FAILED && cq != sq) munmap(cq, cq_len);
+        if (sq != MAP_FAILED) munmap(sq, sq_len);
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+    r->entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;  // entries are used in ring order
+    r->sqes = sqes;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/* A cleared submission entry, or NULL if the ring is full. */
+static inline struct io_uring_sqe *uring_get(Uring *r) {
+    if (r->queued + r->inflight >= r->entries)
+        return NULL;
+    struct io_uring_sqe *sqe = &r->sqes[(*r->sq_tail + r->queued) & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->queued++;
+    return sqe;
+}
+
+/* Submits what was filled and waits until at least wait completions are
+   ready (fewer if fewer are in flight). Returns -1 on error. */
+static inline int uring_submit(Uring *r, unsigned wait) {
+    __atomic_store_n(r->sq_tail, *r->sq_tail + r->queued, __ATOMIC_RELEASE);
+    r->inflight += r->queued;
+    r->queued = 0;
+    if (wait > r->inflight)
+        wait = r->inflight;
+    while (1) {
+        unsigned unsent = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        unsigned ready = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+        if (!unsent && ready >= wait)
+            return 0;
+        unsigned want = ready >= wait ? 0 : wait;
+        if (syscall(__NR_io_uring_enter, r->fd, unsent, want, want ? IORING_ENTER_GETEVENTS : 0,
+                    NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return -1;
+    }
+}
+
+/* The oldest completion not yet seen, or NULL. */
+static inline struct io_uring_cqe *uring_peek(Uring *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+/* Releases the completion uring_peek() returned. */
+static inline void uring_seen(Uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+    r->inflight--;
+}
+
+static inline int uring_register(Uring *r, unsigned op, void *arg, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, r->fd, op, arg, n);
+}
+
+/* Points slot of a ring's registered file table at fd (-1 to clear it). */
+static inline int uring_set_file(Uring *r, unsigned slot, int fd) {
+    struct io_uring_files_update u;
+    memset(&u, 0, sizeof(u));
+    u.offset = slot;
+    u.fds = (uintptr_t)&fd;
+    return uring_register(r, IORING_REGISTER_FILES_UPDATE, &u, 1) == 1 ? 0 : -1;
+}
+
+/* Metrics (-m port): counters and latency histograms, served in the
+   Prometheus text format over HTTP on 127.0.0.1. Each thread records into
+   its own shard, allocated on first use and never freed, so recording is
+   a relaxed add to memory no other thread writes; a scrape sums the
+   shards. A program describes its metrics in a MetricDef table indexed by
+   its own ids, where one name may span several consecutive ids that
+   differ in their labels. Histogram buckets are powers of two from 1 us
+   to about 8 s. With metrics off, recording costs one branch.
+*/
+#define METRICS_MAX 32
+#define METRIC_BUCKETS 24
+
+typedef struct {
+    const char *name;
+    const char *labels;     // e.g. "type=\"create\"", or NULL
+    int histogram;          // 0 for a counter
+    const char *help;
+} MetricDef;
+
+typedef struct MetricShard {
+    struct MetricShard *next;
+    uint64_t count[METRICS_MAX];    // counter value, or observations
+    uint64_t sum_ns[METRICS_MAX];
+    uint64_t bucket[METRICS_MAX][METRIC_BUCKETS];
+} MetricShard;
+
+static int metrics_on;
+static const MetricDef *metric_defs;
+static int metric_count;
+static MetricShard *metric_shards;
+static pthread_mutex_t metric_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread MetricShard *metric_shard;
+static void (*metric_gauges)(FILE *out);  // writes the program's gauges at scrape time
+
+/* A monotonic timestamp for metric_since(), or 0 with metrics off. */
+static inline uint64_t metric_clock(void) {
+    if (!metrics_on)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static MetricShard *metric_shard_new(void) {
+    MetricShard *s = calloc(1, sizeof(MetricShard));
+    if (!s)
+        return NULL;
+    pthread_mutex_lock(&metric_lock);
+    s->next = metric_shards;
+    metric_shards = s;
+    pthread_mutex_unlock(&metric_lock);
+    return metric_shard = s;
+}
+
+static inline void metric_add(int id, uint64_t n) {
+    MetricShard *s;
+    if (metrics_on && ((s = metric_shard) || (s = metric_shard_new())))
+        __atomic_fetch_add(&s->count[id], n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_observe(int id, uint64_t ns) {
+    MetricShard *s;
+    if (!metrics_on || !((s = metric_shard) || (s = metric_shard_new())))
+        return;
+    uint64_t us = ns / 1000;
+    int b = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);  // smallest b with us <= 2^b
+    __atomic_fetch_add(&s->count[id], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->sum_ns[id], ns, __ATOMIC_RELAXED);
+    if (b < METRIC_BUCKETS)
+        __atomic_fetch_add(&s->bucket[id][b], 1, __ATOMIC_RELAXED);
+}
+
+/* Observes the time since start, a metric_clock() reading. */
+static inline void metric_since(int id, uint64_t start) {
+    if (metrics_on)
+        metric_observe(id, metric_clock() - start);
+}
+
+/* Writes every metric, summed over the shards, then the gauges. */
+static void metrics_write(FILE *out) {
+    for (int id = 0; id < metric_count; id++) {
+        const MetricDef *d = &metric_defs[id];
+        uint64_t count = 0, sum = 0, bucket[METRIC_BUCKETS] = { 0 };
+        pthread_mutex_lock(&metric_lock);
+        for (MetricShard *s = metric_shards; s; s = s->next) {
+            count += __atomic_load_n(&s->count[id], __ATOMIC_RELAXED);
+            sum += __atomic_load_n(&s->sum_ns[id], __ATOMIC_RELAXED);
+            for (int b = 0; d->histogram && b < METRIC_BUCKETS; b++)
+                bucket[b] += __atomic_load_n(&s->bucket[id][b], __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&metric_lock);
+        if (id == 0 || strcmp(d->name, metric_defs[id - 1].name) != 0)
+            fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", d->name, d->help, d->name,
+                    d->histogram ? "histogram" : "counter");
+        const char *l = d->labels ? d->labels : "", *sep = d->labels ? "," : "";
+        if (!d->histogram) {
+            fprintf(out, "%s%s%s%s %llu\n", d->name, d->labels ? "{" : "", l, d->labels ? "}" : "",
+                    (unsigned long long)count);
+            continue;
+        }
+        uint64_t cum = 0;
+        for (int b = 0; b < METRIC_BUCKETS; b++) {
+            cum += bucket[b];
+            fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", d->name, l, sep,
+                    (double)(1ULL << b) / 1e6, (unsigned long long)cum);
+        }
+        fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", d->name, l, sep, (unsigned long long)count);
+        fprintf(out, "%s_sum%s%s%s %.9f\n", d->name, d->labels ? "{" : "", l, d->labels ? "}" : "",
+                sum / 1e9);
+        fprintf(out, "%s_count%s%s%s %llu\n", d->name, d->labels ? "{" : "", l, d->labels ? "}" : "",
+                (unsigned long long)count);
+    }
+    if (metric_gauges)
+        metric_gauges(out);
+}
+
+/* Exporter thread: answers every HTTP request on its socket with the
+   metrics, one connection at a time. */
+static void *metrics_serve(void *arg) {
+    int server = (int)(intptr_t)arg;
+    while (1) {
+        int sock = accept(server, NULL, NULL);
+        if (sock < 0)
+            continue;
+        struct timeval tv = { 1, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char req[4096];
+        ssize_t n = recv(sock, req, sizeof(req), 0);  // the request line is all we look at
+        char *body = NULL;
+        size_t len = 0;
+        FILE *out = n > 0 ? open_memstream(&body, &len) : NULL;
+        if (out) {
+            int get = n >= 4 && memcmp(req, "GET ", 4) == 0;
+            if (get)
+                metrics_write(out);
+            fclose(out);
+            char head[160];
+            int h = snprintf(head, sizeof(head),
+                             "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                             get ? "200 OK" : "405 Method Not Allowed", len);
+            size_t off = send(sock, head, h, MSG_NOSIGNAL | MSG_MORE) == h ? 0 : len;
+            while (off < len) {
+                ssize_t w = send(sock, body + off, len - off, MSG_NOSIGNAL);
+                if (w <= 0)
+                    break;
+                off += w;
+            }
+        }
+        free(body);
+        close(sock);
+    }
+    return NULL;
+}
+
+/* Starts recording defs (count of them) and serving them on port.
+   Returns -1 if the port cannot be bound. */
+static inline int metrics_start(int port, const MetricDef *defs, int count, void (*gauges)(FILE *out)) {
+    int server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    if (server < 0)
+        return -1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server, 16) < 0) {
+        close(server);
+        return -1;
+    }
+    metric_defs = defs;
+    metric_count = count;
+    metric_gauges = gauges;
+    metrics_on = 1;
+    pthread_t thread;
+    pthread_create(&thread, NULL, metrics_serve, (void *)(intptr_t)server);
+    pthread_detach(thread);
+    return 0;
+}
+
+#endif
@@ -1,358 +1,5172 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <pthread.h>
-#include <unistd.h>
-#include <sys/inotify.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <dirent.h>
-#include <sys/stat.h>
-
-//RUN: ./syncserver <sync_dir> <port> <max_clients>
-//Compile: gcc syncserver.c -o syncserver
-
-#define EVENT_SIZE (sizeof(struct inotify_event))
-#define BUF_LEN (1024 * (EVENT_SIZE + 16))
-#define MAX_CLIENTS 5
-#define MAX_WATCHES 1024
-
-// Mapping from watch descriptor to its relative path (from base_directory)
-typedef struct {
-    int wd;
-    char rel_path[512];
-} WatchMapping;
-
-WatchMapping watch_mappings[MAX_WATCHES];
-int mapping_count = 0;
-
-typedef struct {
-    int socket;
-    char ignore_list[256];  // Comma-separated list (e.g., ".mp4,.zip")
-} Client;
-
-Client clients[MAX_CLIENTS];
-int client_count = 0;
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-int inotify_fd;
-char base_directory[512];
-
-/* Helper: remove trailing '/' characters from a path */
-void normalize_path(char *path) {
-    size_t len = strlen(path);
-    while (len > 0 && path[len-1] == '/') {
-        path[len-1] = '\0';
-        len--;
-    }
-}
-
-/* Classic ignore function */
-int should_ignore(const char *filename, const char *ignore_list) {
-    const char *ext = strrchr(filename, '.'); //gets the last occurrence of the dot
-    if (!ext) return 0;
-    char ignore_copy[256];
-    strncpy(ignore_copy, ignore_list, sizeof(ignore_copy));
-    char *token = strtok(ignore_copy, ","); //splits ignore list by commas
-    while (token) {
-        if (strcmp(token, ext) == 0)
-            return 1;
-        token = strtok(NULL, ",");
-    }
-    return 0;
-}
-
-/* Recursively adds a directory and its subdirectories to inotify.
-   abs_path: absolute path of the directory
-   rel_path: path relative to base_directory ("" for base)
-*/
-void add_watch_recursive(const char *abs_path, const char *rel_path) {
-    int wd = inotify_add_watch(inotify_fd, abs_path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE);
-    if (wd >= 0 && mapping_count < MAX_WATCHES) {
-        watch_mappings[mapping_count].wd = wd;
-        strncpy(watch_mappings[mapping_count].rel_path, rel_path, sizeof(watch_mappings[mapping_count].rel_path)-1);
-        watch_mappings[mapping_count].rel_path[sizeof(watch_mappings[mapping_count].rel_path)-1] = '\0';
-        mapping_count++;
-    }
-    
-    DIR *dir = opendir(abs_path);
-    if (!dir) return;
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-             continue;
-         char child_abs[512], child_rel[512];
-         snprintf(child_abs, sizeof(child_abs), "%s/%s", abs_path, entry->d_name);
-         if (strlen(rel_path) == 0)
-             snprintf(child_rel, sizeof(child_rel), "%s", entry->d_name);
-         else
-             snprintf(child_rel, sizeof(child_rel), "%s/%s", rel_path, entry->d_name);
-         struct stat st;
-         if (stat(child_abs, &st) == 0 && S_ISDIR(st.st_mode)) {
-              add_watch_recursive(child_abs, child_rel);
-         }
-    }
-    closedir(dir);
-}
-
-/* Recursively scans a directory and broadcasts CREATE events for all items.
-   Used when a directory is moved in from outside.
-*/
-void scan_and_broadcast_creation(const char *abs_path, const char *rel_path) {
-    struct stat st;
-    if (stat(abs_path, &st) != 0) //use stat to get metadata information
-        return;
-    if (S_ISDIR(st.st_mode)) {
-        char msg[512];
-        snprintf(msg, sizeof(msg), "CREATE DIR %s\n", rel_path);
-        pthread_mutex_lock(&lock);
-        for (int j = 0; j < client_count; j++) {
-            if (!should_ignore(rel_path, clients[j].ignore_list))
-                send(clients[j].socket, msg, strlen(msg), 0);
-        }
-        pthread_mutex_unlock(&lock);
-        add_watch_recursive(abs_path, rel_path);
-        DIR *dir = opendir(abs_path);
-        if (!dir) return;
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                continue;
-            char child_abs[512], child_rel[512];
-            snprintf(child_abs, sizeof(child_abs), "%s/%s", abs_path, entry->d_name);
-            if (strlen(rel_path) == 0)
-                snprintf(child_rel, sizeof(child_rel), "%s", entry->d_name);
-            else
-                snprintf(child_rel, sizeof(child_rel), "%s/%s", rel_path, entry->d_name);
-            scan_and_broadcast_creation(child_abs, child_rel);
-        }
-        closedir(dir);
-    } else {
-        FILE *fp = fopen(abs_path, "rb");
-        if (!fp) return;
-        fseek(fp, 0, SEEK_END);
-        long filesize = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-        char header[512];
-        snprintf(header, sizeof(header), "CREATE FILE %s %ld\n", rel_path, filesize);
-        pthread_mutex_lock(&lock);
-        for (int j = 0; j < client_count; j++) {
-            if (!should_ignore(rel_path, clients[j].ignore_list)) {
-                send(clients[j].socket, header, strlen(header), 0);
-                // Always send file content even if filesize is 0.
-                if (filesize > 0) {
-                    char *buf = malloc(filesize);
-                    if (buf) {
-                        fread(buf, 1, filesize, fp);
-                        send(clients[j].socket, buf, filesize, 0);
-                        free(buf);
-                    }
-                }
-            }
-        }
-        pthread_mutex_unlock(&lock);
-        fclose(fp);
-    }
-}
-
-/* Broadcasts an update message to all connected clients.
-   Message format: <command> <type> <relative_path>\n
-   For file creation events (non-directory), file content is sent instead.
-*/
-void broadcast_update(const char *cmd, const char *rel_path, int is_dir) {
-    char norm_rel[512];
-    strncpy(norm_rel, rel_path, sizeof(norm_rel));
-    norm_rel[sizeof(norm_rel)-1] = '\0';
-    normalize_path(norm_rel);
-    
-    // For a MOVED_TO event on a directory coming in from outside, recursively scan.
-    if (strcmp(cmd, "MOVED_TO") == 0 && is_dir) {
-        char abs_path[512];
-        snprintf(abs_path, sizeof(abs_path), "%s/%s", base_directory, norm_rel);
-        scan_and_broadcast_creation(abs_path, norm_rel);
-        return;
-    }
-    
-    pthread_mutex_lock(&lock);
-    for (int j = 0; j < client_count; j++) {
-        if (!should_ignore(norm_rel, clients[j].ignore_list)) {
-            if (strcmp(cmd, "CREATE") == 0 && !is_dir) {
-                char abs_path[512];
-                snprintf(abs_path, sizeof(abs_path), "%s/%s", base_directory, norm_rel);
-                FILE *fp = fopen(abs_path, "rb");
-                if (fp) {
-                    fseek(fp, 0, SEEK_END);
-                    long filesize = ftell(fp);
-                    fseek(fp, 0, SEEK_SET);
-                    char header[512];
-                    snprintf(header, sizeof(header), "CREATE FILE %s %ld\n", norm_rel, filesize);
-                    send(clients[j].socket, header, strlen(header), 0);
-                    if (filesize > 0) {
-                        char *buf = malloc(filesize);
-                        if (buf) {
-                            fread(buf, 1, filesize, fp);
-                            send(clients[j].socket, buf, filesize, 0);
-                            free(buf);
-                        }
-                    }
-                    fclose(fp);
-                    continue;
-                }
-            }
-            char msg[512];
-            const char *type_str = is_dir ? "DIR" : "FILE";
-            snprintf(msg, sizeof(msg), "%s %s %s\n", cmd, type_str, norm_rel);
-            send(clients[j].socket, msg, strlen(msg), 0);
-        }
-    }
-    pthread_mutex_unlock(&lock);
-}
-
-/* inotify watcher thread: reads events, builds full relative paths using watch mappings, and broadcasts updates. */
-void *watch_directory(void *arg) {
-    char buffer[BUF_LEN];
-    while (1) {
-        int length = read(inotify_fd, buffer, BUF_LEN);
-        if (length < 0)
-            continue;
-        int i = 0;
-        while (i < length) {
-            struct inotify_event *event = (struct inotify_event *)&buffer[i];
-            if (event->len) {
-                char dir_rel[512] = "";
-                for (int k = 0; k < mapping_count; k++) {
-                    if (watch_mappings[k].wd == event->wd) {
-                        strncpy(dir_rel, watch_mappings[k].rel_path, sizeof(dir_rel));
-                        break;
-                    }
-                }
-                char full_rel[512] = "";
-                if (strlen(dir_rel) > 0)
-                    snprintf(full_rel, sizeof(full_rel), "%s/%s", dir_rel, event->name);
-                else
-                    snprintf(full_rel, sizeof(full_rel), "%s", event->name);
-                normalize_path(full_rel);
-                
-                const char *cmd = NULL;
-                int is_dir = (event->mask & IN_ISDIR) ? 1 : 0;
-                if ((event->mask & IN_CREATE) || ((event->mask & IN_CLOSE_WRITE) && !is_dir))
-                    cmd = "CREATE";
-                else if (event->mask & IN_DELETE)
-                    cmd = "DELETE";
-                else if (event->mask & IN_MOVED_FROM)
-                    cmd = "MOVED_FROM";
-                else if (event->mask & IN_MOVED_TO)
-                    cmd = "MOVED_TO";
-                else
-                    cmd = "UNKNOWN";
-                
-                if ((event->mask & IN_CREATE) && is_dir) {
-                    char new_abs[512];
-                    snprintf(new_abs, sizeof(new_abs), "%s/%s", base_directory, full_rel);
-                    add_watch_recursive(new_abs, full_rel);
-                }
-                broadcast_update(cmd, full_rel, is_dir);
-            }
-            i += EVENT_SIZE + event->len;
-        }
-    }
-    return NULL;
-}
-
-/* Handles communication with a connected client.
-   The client sends its ignore list upon connecting.
-*/
-void *handle_client(void *arg) {
-    Client *client = (Client *)arg;
-    char buffer[256];
-    recv(client->socket, buffer, sizeof(buffer), 0);
-    strncpy(client->ignore_list, buffer, sizeof(client->ignore_list)-1);
-    client->ignore_list[sizeof(client->ignore_list)-1] = '\0';
-    
-    while (1) {
-        int bytes = recv(client->socket, buffer, sizeof(buffer), 0);
-        if (bytes <= 0)
-            break;
-    }
-    close(client->socket);
-    pthread_mutex_lock(&lock);
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].socket == client->socket) {
-            for (int j = i; j < client_count-1; j++) {
-                clients[j] = clients[j+1];
-            }
-            client_count--;
-            break;
-        }
-    }
-    pthread_mutex_unlock(&lock);
-    return NULL;
-}
-
-/* Main server function.
-   Usage: ./server <sync_directory> <port> <max_clients>
-*/
-int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <sync_directory> <port> <max_clients>\n", argv[0]);
-        exit(1);
-    }
-    char *sync_dir = argv[1];
-    int port = atoi(argv[2]);
-    int max_clients = atoi(argv[3]);
-    
-    strncpy(base_directory, sync_dir, sizeof(base_directory)-1);
-    base_directory[sizeof(base_directory)-1] = '\0';
-    
-    inotify_fd = inotify_init();
-    if (inotify_fd < 0) {
-        perror("inotify_init");
-        exit(1);
-    }
-    add_watch_recursive(base_directory, "");
-    
-    pthread_t watcher_thread;
-    pthread_create(&watcher_thread, NULL, watch_directory, NULL);
-    
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("socket");
-        exit(1);
-    }
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind");
-        exit(1);
-    }
-    if (listen(server_socket, max_clients) < 0) {
-        perror("listen");
-        exit(1);
-    }
-    printf("Server listening on port %d...\n", port);
-    
-    while (1) {
-        int client_sock = accept(server_socket, NULL, NULL);
-        if (client_sock < 0) {
-            perror("accept");
-            continue;
-        }
-        pthread_mutex_lock(&lock);
-        if (client_count >= max_clients) {
-            pthread_mutex_unlock(&lock);
-            close(client_sock);
-            continue;
-        }
-        clients[client_count].socket = client_sock;
-        client_count++;
-        pthread_mutex_unlock(&lock);
-        
-        pthread_t client_thread;
-        pthread_create(&client_thread, NULL, handle_client, &clients[client_count-1]);
-    }
-    
-    close(server_socket);
-    return 0;
-}
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <zlib.h>
+#include "syncproto.h"
+
+//RUN: ./syncserver [-d debounce_ms] [-D max_wait_ms] [-j journal_dir] [-u upstream_ip:port] [-b sync|uring] [-m metrics_port] <sync_dir> <port> <max_clients>
+//Compile: gcc syncserver.c -o syncserver -lpthread -lz
+
+#define EVENT_SIZE (sizeof(struct inotify_event))
+#define BUF_LEN (1024 * (EVENT_SIZE + 16))
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF)
+#define MOVE_PAIR_TIMEOUT_MS 50  // how long a MOVED_FROM waits for its MOVED_TO
+#define MOVE_HELD_MAX 1024       // MOVED_FROMs waiting at once, at most
+#define DEFAULT_DEBOUNCE_MS 100  // quiet period before a file's events are broadcast
+#define DEFAULT_MAX_WAIT_MS 1000  // after this, events no longer hold a file back
+#define JOURNAL_MAGIC "SYNCJRN2"
+#define JOURNAL_SEGMENT_SIZE (4 * 1024 * 1024)
+#define JOURNAL_HEADER_SIZE 64
+#define JOURNAL_MAX_SEGMENTS 16
+#define JOURNAL_RECORD_HEADER 32
+#define MANIFEST_SAVE_INTERVAL 30         // seconds between saves of a changed index
+#define MANIFEST_MAX_BYTES (512 * 1024 * 1024)  // largest manifest a client may send
+#define CATCHUP_QUEUE_BYTES (256 * 1024)  // replay pauses while a client has this much queued
+#define CATCHUP_MAX_STREAMS 32            // ... or this many files open for it
+#define CATCHUP_MAX_MOVED 4096            // files replay may chase through renames
+#define MAX_EVENTS 64
+#define MAX_IOV 64
+#define MAX_WALK_THREADS 64
+#define CLIENT_QUEUE_MAX (64 * 1024 * 1024)  // bytes a client may fall behind before it is dropped
+#define CLIENT_BODY_MAX 4096                 // ... or file bodies, each an open descriptor, it may hold
+#define EMIT_RETRY_MS 100                    // a file not opened for want of descriptors is tried again after
+#define FAIRNESS_INTERVAL 8                  // every Nth chunk goes to the oldest stream
+#define ZLIB_LEVEL 6                         // links that want compression are short of bandwidth, not CPU
+#define ZLIB_MIN_SIZE 1024                   // smaller files are not worth a ZDATA frame
+#define ZLIB_MAX_PERCENT 90                  // a chunk compressed to more than this is sent as it is
+#define ZLIB_CACHE_MAX (256 * 1024 * 1024)   // larger files are compressed per client, not cached
+#define DEDUP_SLOTS 4096                     // content remembered for MATERIALIZE
+#define RELAY_STATE_MAGIC "SYNCUPS1"
+#define RELAY_STREAM_BUCKETS 1024
+#define RELAY_RECONNECT_MAX_DELAY 30         // seconds between upstream reconnect attempts, at most
+#define PREFETCH_BATCH 64                    // files opened, statted and read per ring round (-b uring)
+#define PREFETCH_READ_MAX (16 * 1024)        // files up to this size are read whole in that round
+#define RING_MAX_ENTRIES 4096                // reactor ring size, at most
+#define RING_FIXED_BUFFERS 64                // client slots whose frame buffer is registered
+#define EVENT_TIMES 16384                    // newest events whose origin time is kept (-m)
+
+/* Mapping from watch descriptor to its relative path (from base_directory),
+   kept in a growable open-addressing table with linear probing. Each path
+   is allocated to fit. The tree size is limited only by the kernel's
+   fs.inotify.max_user_watches.
+*/
+typedef struct {
+    int wd;                 // 0 marks an empty slot (watch descriptors start at 1)
+    char *rel_path;
+} WatchEntry;
+
+WatchEntry *watch_table;
+size_t watch_cap, watch_count;
+pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Event journal. Every event broadcast to clients is also appended, with
+   a sequence number, to segment files in journal_dir. Each segment is
+   JOURNAL_SEGMENT_SIZE bytes, mapped MAP_SHARED and filled front to back:
+   a JOURNAL_HEADER_SIZE header (magic, journal id, first sequence number),
+   then records of
+       u32 len   (whole record, 8-byte aligned; 0 marks the end)
+       u8  op, u8 is_dir, u16 path_len, u64 seq,
+       i64 size, i64 mtime_ns   (file records; the index is rebuilt from them),
+       path bytes, then the rename target (if any) up to len.
+   A record's length is written last, so one cut short by a crash reads
+   as the end of the segment. Only the newest JOURNAL_MAX_SEGMENTS segments are kept; a
+   client that falls further behind is reconciled against its manifest instead.
+   Records name paths only. Replaying a file record sends the file's
+   current content, so the journal stays small.
+*/
+enum { J_MKDIR = 1, J_FILE, J_DELETE, J_RENAME };
+
+typedef struct {
+    uint64_t first_seq;
+    unsigned char *map;
+    size_t used;
+} JournalSegment;
+
+typedef struct {
+    uint64_t seq;
+    int op, is_dir;
+    int64_t size, mtime_ns;
+    char path[PATH_MAX];
+    char to[PATH_MAX];
+} JournalRecord;
+
+/* Where a reader's previous record ended, so the next read need not scan. */
+typedef struct {
+    uint64_t seg_first;
+    size_t off;             // 0 when unknown
+} JournalPos;
+
+char journal_dir[PATH_MAX - 32];  // leaves room for the names kept in it
+uint64_t journal_id;
+uint64_t journal_next_seq = 1;
+JournalSegment journal_segs[JOURNAL_MAX_SEGMENTS];
+int journal_nsegs;
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+/* With -m, when each of the newest events was first reported (a
+   metric_clock() reading, by seq % EVENT_TIMES), so acknowledgements can
+   be timed against it. A thread broadcasting an event sets event_origin
+   to the time of the inotify read behind it; 0 means now. */
+uint64_t event_times[EVENT_TIMES];
+uint64_t acked_all;         // newest event every acknowledging client has applied
+static __thread uint64_t event_origin;
+
+static void journal_seg_path(char *buf, size_t size, uint64_t first_seq) {
+    snprintf(buf, size, "%s/seg-%016llx", journal_dir, (unsigned long long)first_seq);
+}
+
+/* Maps a segment file, creating it (with a fresh header) if asked to. */
+static unsigned char *journal_map(uint64_t first_seq, int create) {
+    char path[PATH_MAX];
+    journal_seg_path(path, sizeof(path), first_seq);
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd < 0)
+        return NULL;
+    if (create && ftruncate(fd, JOURNAL_SEGMENT_SIZE) < 0) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size != JOURNAL_SEGMENT_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    unsigned char *map = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    if (create) {
+        memcpy(map, JOURNAL_MAGIC, 8);
+        put_u64(map + 8, journal_id);
+        put_u64(map + 16, first_seq);
+    }
+    return map;
+}
+
+/* Drops the oldest segment. Caller holds journal_lock. */
+static void journal_compact(void) {
+    char path[PATH_MAX];
+    journal_seg_path(path, sizeof(path), journal_segs[0].first_seq);
+    munmap(journal_segs[0].map, JOURNAL_SEGMENT_SIZE);
+    unlink(path);
+    memmove(journal_segs, journal_segs + 1, --journal_nsegs * sizeof(JournalSegment));
+}
+
+/* Starts a segment whose first record will be journal_next_seq. Caller holds journal_lock. */
+static int journal_rotate(void) {
+    unsigned char *map = journal_map(journal_next_seq, 1);
+    if (!map)
+        return -1;
+    if (journal_nsegs > 0)
+        msync(journal_segs[journal_nsegs - 1].map, JOURNAL_SEGMENT_SIZE, MS_ASYNC);
+    if (journal_nsegs == JOURNAL_MAX_SEGMENTS)
+        journal_compact();
+    journal_segs[journal_nsegs].first_seq = journal_next_seq;
+    journal_segs[journal_nsegs].map = map;
+    journal_segs[journal_nsegs].used = JOURNAL_HEADER_SIZE;
+    journal_nsegs++;
+    return 0;
+}
+
+static int seq_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Gives the journal a new random id and its first segment. */
+static void journal_start(void) {
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || read(fd, &journal_id, sizeof(journal_id)) != sizeof(journal_id) || journal_id == 0)
+        journal_id = ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid();
+    if (fd >= 0) close(fd);
+    if (journal_rotate() < 0) {
+        perror("journal segment");
+        exit(1);
+    }
+}
+
+/* Opens the journal in dir, picking up where a previous run left off, or
+   starts a new one (with a new id) if there is none or it is unreadable.
+*/
+void journal_open(const char *dir) {
+    if (strlen(dir) >= sizeof(journal_dir)) {
+        fprintf(stderr, "journal directory path too long\n");
+        exit(1);
+    }
+    strcpy(journal_dir, dir);
+    if (mkdir(journal_dir, 0755) < 0 && errno != EEXIST) {
+        perror("journal directory");
+        exit(1);
+    }
+    DIR *d = opendir(journal_dir);
+    if (!d) {
+        perror("journal directory");
+        exit(1);
+    }
+    uint64_t *firsts = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        unsigned long long first;
+        if (sscanf(entry->d_name, "seg-%16llx", &first) != 1 || strlen(entry->d_name) != 20)
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *grown = realloc(firsts, cap * sizeof(uint64_t));
+            if (!grown) break;
+            firsts = grown;
+        }
+        firsts[n++] = first;
+    }
+    closedir(d);
+    qsort(firsts, n, sizeof(uint64_t), seq_cmp);
+
+    // Keep the newest segments that share one id; anything else is stale.
+    for (size_t i = n; i-- > 0;) {
+        unsigned char *map = journal_nsegs < JOURNAL_MAX_SEGMENTS ? journal_map(firsts[i], 0) : NULL;
+        int ok = map && memcmp(map, JOURNAL_MAGIC, 8) == 0 && get_u64(map + 16) == firsts[i] &&
+                 (journal_nsegs == 0 || get_u64(map + 8) == journal_id);
+        if (!ok) {
+            if (map) munmap(map, JOURNAL_SEGMENT_SIZE);
+            char path[PATH_MAX];
+            journal_seg_path(path, sizeof(path), firsts[i]);
+            unlink(path);
+            continue;
+        }
+        journal_id = get_u64(map + 8);
+        memmove(journal_segs + 1, journal_segs, journal_nsegs * sizeof(JournalSegment));
+        journal_segs[0].first_seq = firsts[i];
+        journal_segs[0].map = map;
+        journal_nsegs++;
+    }
+    free(firsts);
+
+    if (journal_nsegs > 0) {
+        JournalSegment *last = &journal_segs[journal_nsegs - 1];
+        journal_next_seq = last->first_seq;
+        size_t off = JOURNAL_HEADER_SIZE;
+        uint32_t len;
+        while (off + JOURNAL_RECORD_HEADER <= JOURNAL_SEGMENT_SIZE && (len = get_u32(last->map + off)) != 0 &&
+               off + len <= JOURNAL_SEGMENT_SIZE) {
+            journal_next_seq = get_u64(last->map + off + 8) + 1;
+            off += len;
+        }
+        last->used = off;
+        for (int i = 0; i + 1 < journal_nsegs; i++)
+            journal_segs[i].used = JOURNAL_SEGMENT_SIZE;  // full; only the last is appended to
+        return;
+    }
+    journal_start();
+}
+
+/* Discards every segment and starts over under a new id, so that every
+   client is reconciled when it next connects. Sequence numbers carry on.
+*/
+void journal_reset(void) {
+    pthread_mutex_lock(&journal_lock);
+    while (journal_nsegs > 0)
+        journal_compact();
+    journal_start();
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int path_in_subtree(const char *path, const char *prefix, size_t plen) {
+    return strncmp(path, prefix, plen) == 0 && (path[plen] == '\0' || path[plen] == '/');
+}
+
+/* Formats a path into buf, which holds PATH_MAX bytes. A path that does
+   not fit is never cut short: it is reported and -1 returned (errno
+   ENAMETOOLONG), and the caller skips whatever it named.
+*/
+__attribute__((format(printf, 2, 3)))
+int path_printf(char *buf, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, PATH_MAX, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && n < PATH_MAX)
+        return 0;
+    fprintf(stderr, "path too long, skipped: %.80s...\n", buf);
+    errno = ENAMETOOLONG;
+    return -1;
+}
+
+static size_t path_hash(const char *s) {
+    size_t h = 14695981039346656037ULL;  // FNV-1a
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+/* Index of the tree as of the newest journal record: one entry per file
+   and directory with its size, mtime and content hash. It changes with
+   every record, under journal_lock, and is saved every
+   MANIFEST_SAVE_INTERVAL seconds as <journal_dir>/manifest; on startup
+   that file plus the records written after it give the index back.
+   Reconnecting clients are diffed against it (see reconcile()). Hashes
+   are computed lazily, the first time a client holds a file of the same
+   size, and kept until the file changes.
+*/
+typedef struct IndexEntry {
+    struct IndexEntry *hnext;
+    int type;               // MANIFEST_FILE or MANIFEST_DIR
+    int hashed;             // hash matches the current size and mtime
+    int seen;               // found by the last scan of the tree
+    int64_t size, mtime_ns;
+    uint64_t ino;           // inode of the file, 0 if not known
+    Hash128 hash;
+    char path[];
+} IndexEntry;
+
+IndexEntry **index_buckets;
+size_t index_nbuckets, index_count;
+int index_dirty;            // changed since it was last saved
+
+IndexEntry *index_find(const char *path) {
+    if (!index_nbuckets) return NULL;
+    IndexEntry *e = index_buckets[path_hash(path) & (index_nbuckets - 1)];
+    while (e && strcmp(e->path, path) != 0)
+        e = e->hnext;
+    return e;
+}
+
+/* Returns path's entry, adding a blank one if there is none. The bucket
+   array doubles when it fills up. */
+static IndexEntry *index_get(const char *path) {
+    IndexEntry *e = index_find(path);
+    if (e) return e;
+    if (index_count >= index_nbuckets) {
+        size_t nb = index_nbuckets ? index_nbuckets * 2 : 4096;
+        IndexEntry **nbk = calloc(nb, sizeof(IndexEntry *));
+        if (!nbk) return NULL;
+        for (size_t i = 0; i < index_nbuckets; i++) {
+            while ((e = index_buckets[i])) {
+                index_buckets[i] = e->hnext;
+                size_t b = path_hash(e->path) & (nb - 1);
+                e->hnext = nbk[b];
+                nbk[b] = e;
+            }
+        }
+        free(index_buckets);
+        index_buckets = nbk;
+        index_nbuckets = nb;
+    }
+    size_t len = strlen(path) + 1;
+    if (!(e = calloc(1, sizeof(IndexEntry) + len))) return NULL;
+    memcpy(e->path, path, len);
+    size_t b = path_hash(path) & (index_nbuckets - 1);
+    e->hnext = index_buckets[b];
+    index_buckets[b] = e;
+    index_count++;
+    return e;
+}
+
+/* Records what is at path. A file record always means new content, even
+   if size and mtime happen to match, so its hash is dropped. */
+static void index_set(const char *path, int type, int64_t size, int64_t mtime_ns) {
+    IndexEntry *e = index_get(path);
+    if (!e) return;
+    e->hashed = 0;
+    e->ino = 0;
+    e->type = type;
+    e->size = size;
+    e->mtime_ns = mtime_ns;
+    index_dirty = 1;
+}
+
+/* Unlinks path's entry, or with subtree set every entry at or below it,
+   and returns them chained through hnext. */
+static IndexEntry *index_take(const char *path, int subtree) {
+    IndexEntry *taken = NULL;
+    size_t plen = strlen(path);
+    size_t i = 0, end = index_nbuckets;
+    if (!subtree && index_nbuckets) {
+        i = path_hash(path) & (index_nbuckets - 1);
+        end = i + 1;
+    }
+    for (; i < end; i++) {
+        IndexEntry **pp = &index_buckets[i];
+        while (*pp) {
+            IndexEntry *e = *pp;
+            if (subtree ? path_in_subtree(e->path, path, plen) : strcmp(e->path, path) == 0) {
+                *pp = e->hnext;
+                e->hnext = taken;
+                taken = e;
+                index_count--;
+            } else {
+                pp = &e->hnext;
+            }
+        }
+    }
+    index_dirty = 1;
+    return taken;
+}
+
+static void index_free_list(IndexEntry *e) {
+    while (e) {
+        IndexEntry *next = e->hnext;
+        free(e);
+        e = next;
+    }
+}
+
+/* Applies one journal record to the index. Caller holds journal_lock. */
+void index_apply(int op, int is_dir, const char *path, const char *to, int64_t size, int64_t mtime_ns) {
+    switch (op) {
+    case J_MKDIR:
+        index_set(path, MANIFEST_DIR, 0, 0);
+        break;
+    case J_FILE:
+        index_set(path, MANIFEST_FILE, size, mtime_ns);
+        break;
+    case J_DELETE:
+        index_free_list(index_take(path, is_dir));
+        break;
+    case J_RENAME: {
+        size_t plen = strlen(path);
+        IndexEntry *moved = index_take(path, is_dir);
+        index_free_list(index_take(to, 1));  // whatever the rename replaced
+        while (moved) {
+            IndexEntry *e = moved, *n;
+            moved = e->hnext;
+            char renamed[PATH_MAX];
+            if (path_printf(renamed, "%s%s", to, e->path + plen) == 0 && (n = index_get(renamed))) {
+                n->type = e->type;
+                n->hashed = e->hashed;
+                n->size = e->size;
+                n->mtime_ns = e->mtime_ns;
+                n->ino = e->ino;
+                n->hash = e->hash;
+            }
+            free(e);
+        }
+        break;
+    }
+    }
+}
+
+/* Writes the index to <journal_dir>/manifest, tagged with the journal
+   position it reflects. Paths are copied under the lock and written
+   outside it. */
+void index_save(void) {
+    pthread_mutex_lock(&journal_lock);
+    uint64_t seq = journal_next_seq - 1;
+    ManifestItem *items = malloc((index_count + 1) * sizeof(ManifestItem));
+    size_t n = 0;
+    for (size_t i = 0; items && i < index_nbuckets; i++) {
+        for (IndexEntry *e = index_buckets[i]; e; e = e->hnext) {
+            if (!(items[n].path = strdup(e->path)))
+                continue;
+            items[n].type = e->type | (e->hashed ? 0 : MANIFEST_UNHASHED);
+            items[n].size = e->size;
+            items[n].mtime_ns = e->mtime_ns;
+            items[n].hash = e->hash;
+            n++;
+        }
+    }
+    if (items) index_dirty = 0;
+    pthread_mutex_unlock(&journal_lock);
+    if (!items) return;
+    qsort(items, n, sizeof(ManifestItem), manifest_item_cmp);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/manifest", journal_dir);
+    if (manifest_write(path, items, n, seq, journal_id) < 0)
+        perror("manifest");
+    for (size_t i = 0; i < n; i++)
+        free((char *)items[i].path);
+    free(items);
+}
+
+/* Saves the index in the background while it keeps changing. */
+void *index_saver(void *arg) {
+    while (1) {
+        sleep(MANIFEST_SAVE_INTERVAL);
+        pthread_mutex_lock(&journal_lock);
+        int dirty = index_dirty;
+        pthread_mutex_unlock(&journal_lock);
+        if (dirty)
+            index_save();
+    }
+    return NULL;
+}
+
+/* Appends an event, applies it to the index and returns its sequence
+   number. st describes the file of a J_FILE record. The number is used
+   even if the record could not be written; a reader just skips the gap.
+*/
+uint64_t journal_append(int op, int is_dir, const char *path, const char *to, const struct stat *st) {
+    size_t plen = strlen(path), tlen = to ? strlen(to) : 0;
+    size_t len = (JOURNAL_RECORD_HEADER + plen + tlen + 7) & ~(size_t)7;
+    int64_t size = st ? st->st_size : 0, mtime_ns = st ? stat_mtime_ns(st) : 0;
+    pthread_mutex_lock(&journal_lock);
+    uint64_t seq = journal_next_seq;
+    JournalSegment *seg = journal_nsegs ? &journal_segs[journal_nsegs - 1] : NULL;
+    if ((!seg || seg->used + len > JOURNAL_SEGMENT_SIZE) && journal_rotate() == 0)
+        seg = &journal_segs[journal_nsegs - 1];
+    if (seg && seg->used + len <= JOURNAL_SEGMENT_SIZE) {
+        unsigned char *r = seg->map + seg->used;
+        r[4] = op;
+        r[5] = is_dir;
+        r[6] = plen;
+        r[7] = plen >> 8;
+        put_u64(r + 8, seq);
+        put_u64(r + 16, (uint64_t)size);
+        put_u64(r + 24, (uint64_t)mtime_ns);
+        memcpy(r + JOURNAL_RECORD_HEADER, path, plen);
+        if (tlen) memcpy(r + JOURNAL_RECORD_HEADER + plen, to, tlen);
+        put_u32(r, (uint32_t)len);  // last, so a half-written record is never read
+        seg->used += len;
+    } else {
+        static int warned = 0;
+        if (!warned++)
+            fprintf(stderr, "journal write failed; reconnecting clients may need reconciling\n");
+    }
+    journal_next_seq = seq + 1;
+    event_times[seq % EVENT_TIMES] = event_origin ? event_origin : metric_clock();
+    index_apply(op, is_dir, path, to, size, mtime_ns);
+    IndexEntry *e;
+    if (st && op == J_FILE && (e = index_find(path)))
+        e->ino = st->st_ino;
+    pthread_mutex_unlock(&journal_lock);
+    return seq;
+}
+
+/* Reads the first record with a sequence number above `after`.
+   Returns 1 with *rec filled in, 0 if there is none yet, and -1 if
+   records after `after` have been compacted away (or never existed).
+*/
+int journal_next(JournalPos *pos, uint64_t after, JournalRecord *rec) {
+    pthread_mutex_lock(&journal_lock);
+    if (journal_nsegs == 0 || after + 1 < journal_segs[0].first_seq || after >= journal_next_seq) {
+        pthread_mutex_unlock(&journal_lock);
+        return -1;
+    }
+    int idx = journal_nsegs - 1;
+    size_t off = JOURNAL_HEADER_SIZE;
+    if (pos->off) {
+        while (idx > 0 && journal_segs[idx].first_seq != pos->seg_first) idx--;
+        if (journal_segs[idx].first_seq == pos->seg_first)
+            off = pos->off;
+        else
+            idx = journal_nsegs - 1;
+    }
+    if (off == JOURNAL_HEADER_SIZE) {
+        while (idx > 0 && journal_segs[idx].first_seq > after + 1) idx--;
+    }
+    int found = 0;
+    while (!found) {
+        JournalSegment *seg = &journal_segs[idx];
+        uint32_t len = off + JOURNAL_RECORD_HEADER <= seg->used ? get_u32(seg->map + off) : 0;
+        if (len == 0) {
+            if (++idx == journal_nsegs)
+                break;
+            off = JOURNAL_HEADER_SIZE;
+            continue;
+        }
+        const unsigned char *r = seg->map + off;
+        uint64_t seq = get_u64(r + 8);
+        if (seq > after) {
+            const unsigned char *names = r + JOURNAL_RECORD_HEADER;
+            size_t plen = r[6] | (r[7] << 8);
+            size_t tlen = len - JOURNAL_RECORD_HEADER - plen;
+            while (tlen > 0 && names[plen + tlen - 1] == 0) tlen--;  // alignment padding
+            if (plen >= sizeof(rec->path)) plen = sizeof(rec->path) - 1;
+            if (tlen >= sizeof(rec->to)) tlen = sizeof(rec->to) - 1;
+            rec->seq = seq;
+            rec->op = r[4];
+            rec->is_dir = r[5];
+            rec->size = (int64_t)get_u64(r + 16);
+            rec->mtime_ns = (int64_t)get_u64(r + 24);
+            memcpy(rec->path, names, plen);
+            rec->path[plen] = '\0';
+            memcpy(rec->to, names + plen, tlen);
+            rec->to[tlen] = '\0';
+            found = 1;
+        }
+        off += len;
+    }
+    if (found) {
+        pos->seg_first = journal_segs[idx].first_seq;
+        pos->off = off;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return found;
+}
+
+/* A message body shared by every client it is queued to. */
+typedef struct {
+    int refs;
+    size_t len;
+    char data[];
+} Payload;
+
+/* One CHUNK_SIZE chunk of a file body, compressed for ZDATA. */
+typedef struct {
+    size_t len;
+    unsigned char data[];
+} ZChunk;
+
+/* A file body streamed straight from the page cache with sendfile().
+   The file is opened once per event and the descriptor is shared by
+   every client that receives it. The stream id is global, so the OPEN
+   header can be shared as well. For clients that take compression, whole
+   file transfers are sent in compressed chunks, made by the reactor when
+   the first such client needs one and kept for the others. A small file,
+   one with a compressed extension, or one whose first chunk does not
+   compress is left alone. A small file read ahead by the watcher
+   (-b uring) is sent from memory instead.
+*/
+typedef struct {
+    int refs;
+    int fd;
+    unsigned char *data;    // the whole body if it was read ahead (-b uring), else NULL
+    off_t size;             // size advertised in the header
+    unsigned sid;
+    char *rel_path;
+    Hash128 delta_key;      // signatures the cached delta was computed against
+    struct OpList *delta;   // lets clients with identical copies share one delta
+    int zlib;               // 1 compress, 0 send as it is, -1 not decided yet
+    ZChunk **zchunks;       // by chunk index; zchunk_raw where it did not pay
+    long long z_in, z_out;  // bytes compressed, and what they came to
+    long long z_sent;       // compressed bytes sent, over all clients
+    long long z_ns;         // CPU time spent compressing
+} FileBody;
+
+/* One instruction of a delta: copy blocks from the client's old copy,
+   or send a literal byte range of the new file. */
+typedef struct {
+    int copy;
+    long long pos;          // block index (copy) or file offset (literal)
+    long long len;          // block count (copy) or byte count (literal)
+} DeltaOp;
+
+typedef struct OpList {
+    int refs;
+    uint32_t block_size;
+    int count;
+    DeltaOp ops[];
+} OpList;
+
+/* Per-client progress through one file body. */
+typedef struct Stream {
+    struct Stream *next;
+    FileBody *body;
+    OpList *ops;            // delta instructions, or NULL to send the whole body
+    int op_idx;
+    long long op_off;       // bytes of the current literal op already framed
+    off_t off;              // bytes of the target file already framed
+    int announced;          // its OPEN/DELTA header has been sent
+    int cancelled;          // superseded by a newer version of the same path
+} Stream;
+
+typedef struct OutMsg {
+    struct OutMsg *next;
+    Payload *payload;       // NULL while waiting for the client's signatures
+    size_t off;             // bytes already sent
+    Stream *announces;      // stream started by this header, if any
+} OutMsg;
+
+typedef struct {
+    int socket;             // -1 when the slot is free
+    unsigned gen;           // bumped on every accept, so stale delta jobs are dropped
+    int have_ignore;
+    unsigned caps;          // SYNC_CAP_* it offered in HELLO
+    struct Filter *filter;  // compiled ignore list, shared with identical ones
+    int filter_next;        // next slot using the same filter, -1 at the end
+    unsigned char *in_buf;  // partial input from the client
+    size_t in_len, in_cap;
+    pthread_mutex_t qlock;  // protects the outgoing queue and streams below
+    OutMsg *q_head, *q_tail;  // control messages, always sent before file data
+    size_t q_bytes;         // queued memory
+    Stream *streams;        // active transfers, oldest first
+    unsigned chunk_count;
+    Stream *cur;            // stream whose frame is partly sent
+    unsigned char chunk_hdr[FRAME_BOUND(3, 0)];
+    int hdr_len, hdr_off;
+    off_t chunk_pos;        // file offset of the frame body (ZDATA: offset in zcur)
+    size_t chunk_left;      // body bytes of the current frame still to send
+    ZChunk *zcur;           // body of a ZDATA frame in flight
+    int zown;               // zcur is not cached; free it once sent
+    int out_armed;          // EPOLLOUT currently requested
+    int closing;            // queue overflowed; reactor will drop it
+    int stream_count;
+    int resuming;           // replaying missed events; live ones are not queued yet
+    uint64_t cursor;        // last event queued to this client
+    JournalPos jpos;
+    int reconciling;        // 1 while its manifest is awaited, 2 while it is diffed
+    struct Action *actions; // what the diff found, when the journal cannot cover the gap
+    size_t action_count, next_action;
+    char **moved;           // replayed files already renamed away (see replay_record)
+    int moved_count, moved_cap;
+    uint64_t acked;         // newest event it acknowledged (SYNC_CAP_ACK)
+    uint64_t sent_bytes;    // since it connected (-m); updated under qlock
+    char peer[INET_ADDRSTRLEN + 8];  // ip:port, the client label of its metrics
+} Client;
+
+/* One difference found by reconciliation, sent like the journal record
+   of the same op. */
+typedef struct Action {
+    int op;                 // J_MKDIR, J_FILE or J_DELETE
+    int is_dir;             // J_DELETE: what the client has there
+    int update;             // J_FILE: the client has an older copy
+    char *path;
+} Action;
+
+/* A client's manifest, waiting for the reconcile worker. */
+typedef struct ReconcileJob {
+    struct ReconcileJob *next;
+    int slot;
+    unsigned gen;
+    struct Filter *filter;  // the client's, referenced until the diff is done
+    uint64_t count;
+    size_t len;
+    unsigned char *data;    // count wire entries (see manifest_wire_put())
+} ReconcileJob;
+
+/* Signatures received from a client, waiting for the delta worker. */
+typedef struct DeltaJob {
+    struct DeltaJob *next;
+    int slot;
+    unsigned gen;
+    unsigned sid;
+    uint32_t block_size;
+    uint32_t count;
+    unsigned char *sigs;
+} DeltaJob;
+
+Client *clients;
+int max_clients;
+int client_body_max = CLIENT_BODY_MAX;  // at most half the descriptor limit (see main())
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;  // protects client slots, never held across I/O
+int inotify_fd;
+int epoll_fd;
+char base_directory[PATH_MAX];
+int base_fd = -1;           // base_directory, opened by walk_init()
+int relay_mode;             // -u: the tree is fed from upstream, not watched
+int use_uring;              // -b uring: batch file and socket I/O through io_uring
+DeltaJob *job_head, *job_tail;
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+ReconcileJob *recon_head, *recon_tail;
+pthread_mutex_t recon_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t recon_cond = PTHREAD_COND_INITIALIZER;
+
+/* Metrics (-m port; see syncproto.h). Events are counted by type as they
+   are journaled. The histograms time a watcher round (reading inotify and
+   emitting what is due), preparing a file to send (open, stat and, for
+   dedup, hashing), waiting for and holding `lock` to queue an event, and
+   the time from an event's first inotify report until the last client
+   that acknowledges events has applied it. Per-client bytes sent, queued
+   bytes and lag are read off the client slots at scrape time.
+*/
+enum {
+    M_EV_CREATE, M_EV_MODIFY, M_EV_DELETE, M_EV_MKDIR, M_EV_RMDIR, M_EV_RENAME,
+    M_INOTIFY_EVENTS, M_RESCANS, M_SENT_BYTES,
+    M_WATCH_ROUND, M_FILE_PREPARE, M_LOCK_WAIT, M_LOCK_HOLD, M_EVENT_ACKED,
+    M_COUNT
+};
+
+static const MetricDef server_metrics[M_COUNT] = {
+    [M_EV_CREATE] = { "sync_events_total", "type=\"create\"", 0, "Events journaled and broadcast, by type." },
+    [M_EV_MODIFY] = { "sync_events_total", "type=\"modify\"", 0, NULL },
+    [M_EV_DELETE] = { "sync_events_total", "type=\"delete\"", 0, NULL },
+    [M_EV_MKDIR] = { "sync_events_total", "type=\"mkdir\"", 0, NULL },
+    [M_EV_RMDIR] = { "sync_events_total", "type=\"rmdir\"", 0, NULL },
+    [M_EV_RENAME] = { "sync_events_total", "type=\"rename\"", 0, NULL },
+    [M_INOTIFY_EVENTS] = { "sync_inotify_events_total", NULL, 0, "Events read from inotify." },
+    [M_RESCANS] = { "sync_rescans_total", NULL, 0, "Tree rescans after the inotify queue overflowed." },
+    [M_SENT_BYTES] = { "sync_sent_bytes_total", NULL, 0, "Bytes sent to clients." },
+    [M_WATCH_ROUND] = { "sync_watch_round_seconds", NULL, 1, "One watcher round: an inotify read and what it emits." },
+    [M_FILE_PREPARE] = { "sync_file_prepare_seconds", NULL, 1, "Opening, statting and hashing a file to broadcast." },
+    [M_LOCK_WAIT] = { "sync_broadcast_lock_wait_seconds", NULL, 1, "Waiting for the client lock to queue an event." },
+    [M_LOCK_HOLD] = { "sync_broadcast_lock_hold_seconds", NULL, 1, "Holding the client lock to queue an event." },
+    [M_EVENT_ACKED] = { "sync_event_ack_seconds", NULL, 1, "From an event's inotify report to its last client acknowledgement." },
+};
+
+/* Takes `lock` to queue an event, timing the wait. Returns when it was
+   acquired, for broadcast_unlock(). */
+static uint64_t broadcast_lock(void) {
+    uint64_t start = metric_clock();
+    pthread_mutex_lock(&lock);
+    uint64_t now = metric_clock();
+    metric_observe(M_LOCK_WAIT, now - start);
+    return now;
+}
+
+static void broadcast_unlock(uint64_t locked) {
+    metric_since(M_LOCK_HOLD, locked);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Helper: remove trailing '/' characters from a path */
+void normalize_path(char *path) {
+    size_t len = strlen(path);
+    while (len > 0 && path[len-1] == '/') {
+        path[len-1] = '\0';
+        len--;
+    }
+}
+
+/* Ignore filters. A client's ignore list is compiled once, when it says
+   hello, and clients with the same list (in any order) share the compiled
+   Filter, so an event is matched once per distinct list rather than once
+   per client. Patterns, comma separated:
+     .ext  *.ext    by extension (the last '.' of the name on): a hash set
+     dir/           a directory and everything in it (a trailing "**" is
+                    allowed): a hash set of prefixes, probed once per
+                    ancestor of the path
+     anything else  a glob: '?' and '*' stop at '/', '**' does not. Without
+                    a '/' it is matched against the name, with one against
+                    the whole relative path.
+   Filters live on the `filters` list, each with the slots of the clients
+   using it chained through Client.filter_next. Protected by `lock`.
+*/
+typedef struct {
+    char **slots;           // open addressing, linear probing
+    size_t cap, count;
+} StrSet;
+
+typedef struct Filter {
+    struct Filter *next;
+    int refs;               // clients, plus reconcile jobs, using it
+    int first;              // first client slot using it, -1 if none
+    char *spec;             // the list, sorted and without duplicates
+    StrSet exts, prefixes;
+    char **globs;
+    int nglobs;
+    unsigned char *batch;   // frames waiting to go to the group (see batch_flush())
+    size_t batch_len, batch_cap;
+    uint64_t batch_first, batch_last;  // events they belong to
+} Filter;
+
+Filter *filters;
+
+static size_t bytes_hash(const char *s, size_t n) {
+    size_t h = 14695981039346656037ULL;  // FNV-1a
+    while (n--)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+static int strset_has(const StrSet *set, const char *s, size_t n) {
+    if (!set->count) return 0;
+    for (size_t i = bytes_hash(s, n) & (set->cap - 1); set->slots[i]; i = (i + 1) & (set->cap - 1)) {
+        if (strncmp(set->slots[i], s, n) == 0 && set->slots[i][n] == '\0')
+            return 1;
+    }
+    return 0;
+}
+
+/* Adds a copy of s[0..n) (kept at most half full). Returns -1 on failure. */
+static int strset_add(StrSet *set, const char *s, size_t n) {
+    if (strset_has(set, s, n)) return 0;
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 16;
+        char **slots = calloc(cap, sizeof(char *));
+        if (!slots) return -1;
+        for (size_t i = 0; i < set->cap; i++) {
+            if (!set->slots[i]) continue;
+            size_t j = bytes_hash(set->slots[i], strlen(set->slots[i])) & (cap - 1);
+            while (slots[j]) j = (j + 1) & (cap - 1);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->cap = cap;
+    }
+    char *copy = strndup(s, n);
+    if (!copy) return -1;
+    size_t i = bytes_hash(s, n) & (set->cap - 1);
+    while (set->slots[i]) i = (i + 1) & (set->cap - 1);
+    set->slots[i] = copy;
+    set->count++;
+    return 0;
+}
+
+static void strset_free(StrSet *set) {
+    for (size_t i = 0; i < set->cap; i++)
+        free(set->slots[i]);
+    free(set->slots);
+}
+
+/* Matches a glob: '?' is one character and '*' any run, neither crossing
+   a '/'; '**' is any run at all, and '**' followed by '/' may also match
+   nothing. */
+static int glob_match(const char *p, const char *s) {
+    while (*p) {
+        if (*p == '*') {
+            int deep = p[1] == '*';
+            p += deep ? 2 : 1;
+            if (deep && *p == '/' && glob_match(p + 1, s))
+                return 1;
+            while (1) {
+                if (glob_match(p, s))
+                    return 1;
+                if (!*s || (!deep && *s == '/'))
+                    return 0;
+                s++;
+            }
+        }
+        if (!*s || (*p == '?' ? *s == '/' : *p != *s))
+            return 0;
+        p++;
+        s++;
+    }
+    return !*s;
+}
+
+/* Whether the filter excludes rel_path. */
+int filter_ignores(const Filter *f, const char *rel_path) {
+    const char *slash = strrchr(rel_path, '/');
+    const char *name = slash ? slash + 1 : rel_path;
+    const char *ext = strrchr(name, '.');
+    if (ext && strset_has(&f->exts, ext, strlen(ext)))
+        return 1;
+    if (f->prefixes.count) {
+        for (const char *p = rel_path;; p++) {
+            if ((*p == '/' || *p == '\0') && strset_has(&f->prefixes, rel_path, p - rel_path))
+                return 1;
+            if (!*p) break;
+        }
+    }
+    for (int i = 0; i < f->nglobs; i++) {
+        if (glob_match(f->globs[i], strchr(f->globs[i], '/') ? rel_path : name))
+            return 1;
+    }
+    return 0;
+}
+
+static void filter_free(Filter *f) {
+    strset_free(&f->exts);
+    strset_free(&f->prefixes);
+    for (int i = 0; i < f->nglobs; i++)
+        free(f->globs[i]);
+    free(f->globs);
+    free(f->spec);
+    free(f->batch);
+    free(f);
+}
+
+static int add_glob(Filter *f, const char *pat, size_t len) {
+    char **grown = realloc(f->globs, (f->nglobs + 1) * sizeof(char *));
+    if (!grown) return -1;
+    f->globs = grown;
+    if (!(f->globs[f->nglobs] = strndup(pat, len)))
+        return -1;
+    f->nglobs++;
+    return 0;
+}
+
+/* Sorts one pattern into the extension set, the prefix set or the globs. */
+static int filter_add(Filter *f, const char *pat) {
+    while (*pat == '/') pat++;  // patterns are relative to the sync directory anyway
+    size_t len = strlen(pat);
+    if (len == 0) return 0;
+    const char *wild = strpbrk(pat, "*?");
+    if (pat[0] == '.' && !wild && !strchr(pat, '/'))
+        return strset_add(&f->exts, pat, len);
+    if (pat[0] == '*' && pat[1] == '.' && !strpbrk(pat + 1, "*?/") && !strchr(pat + 2, '.'))
+        return strset_add(&f->exts, pat + 1, len - 1);
+    size_t dir = len;
+    if (len > 3 && strcmp(pat + len - 3, "/**") == 0)
+        dir = len - 3;
+    else if (len > 1 && pat[len - 1] == '/')
+        dir = len - 1;
+    if (dir < len && (!wild || wild >= pat + dir))
+        return strset_add(&f->prefixes, pat, dir);
+    if (dir < len) {
+        // a directory glob: the directory itself, and what is below it
+        char below[PATH_MAX];
+        if (path_printf(below, "%.*s/**", (int)dir, pat) < 0)
+            return -1;
+        if (add_glob(f, pat, dir) < 0)
+            return -1;
+        return add_glob(f, below, strlen(below));
+    }
+    return add_glob(f, pat, len);
+}
+
+static int pattern_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* The canonical form of an ignore list: its patterns sorted, without
+   duplicates, comma separated. NULL on failure. */
+static char *filter_spec(const char *list) {
+    size_t len = strlen(list);
+    char *copy = strdup(list), *spec = malloc(len + 1);
+    char **pats = malloc((len / 2 + 1) * sizeof(char *));  // patterns are separated
+    if (copy && spec && pats) {
+        int n = 0;
+        for (char *tok = strtok(copy, ", \t\r"); tok; tok = strtok(NULL, ", \t\r"))
+            pats[n++] = tok;
+        qsort(pats, n, sizeof(char *), pattern_cmp);
+        size_t used = 0;
+        spec[0] = '\0';
+        for (int i = 0; i < n; i++) {
+            if (i == 0 || strcmp(pats[i], pats[i - 1]) != 0)
+                used += sprintf(spec + used, "%s%s", used ? "," : "", pats[i]);
+        }
+    } else {
+        free(spec);
+        spec = NULL;
+    }
+    free(copy);
+    free(pats);
+    return spec;
+}
+
+/* Returns the shared filter for an ignore list, compiling it if no other
+   client uses the same one, with a reference taken. NULL on failure.
+   Caller holds `lock`.
+*/
+Filter *filter_acquire(const char *list) {
+    char *spec = filter_spec(list);
+    if (!spec)
+        return NULL;
+    for (Filter *f = filters; f; f = f->next) {
+        if (strcmp(f->spec, spec) == 0) {
+            f->refs++;
+            free(spec);
+            return f;
+        }
+    }
+    Filter *f = calloc(1, sizeof(Filter));
+    char *pats = strdup(spec);
+    if (!f || !pats) {
+        free(f);
+        free(pats);
+        free(spec);
+        return NULL;
+    }
+    f->spec = spec;
+    int ok = 1;
+    for (char *tok = strtok(pats, ","); tok && ok; tok = strtok(NULL, ","))
+        ok = filter_add(f, tok) == 0;
+    free(pats);
+    if (!ok) {
+        filter_free(f);
+        return NULL;
+    }
+    f->refs = 1;
+    f->first = -1;
+    f->next = filters;
+    filters = f;
+    return f;
+}
+
+/* Drops a reference; the last one frees the filter. Caller holds `lock`. */
+void filter_release(Filter *f) {
+    if (--f->refs > 0)
+        return;
+    for (Filter **pp = &filters; *pp; pp = &(*pp)->next) {
+        if (*pp == f) {
+            *pp = f->next;
+            break;
+        }
+    }
+    filter_free(f);
+}
+
+/* Puts a client in its filter's group. Caller holds `lock`. */
+void filter_join(int slot, Filter *f) {
+    clients[slot].filter = f;
+    clients[slot].filter_next = f->first;
+    f->first = slot;
+}
+
+/* Takes a client out of its filter's group. Caller holds `lock`. */
+void filter_leave(int slot) {
+    Client *c = &clients[slot];
+    Filter *f = c->filter;
+    if (!f) return;
+    for (int *pp = &f->first; *pp >= 0; pp = &clients[*pp].filter_next) {
+        if (*pp == slot) {
+            *pp = c->filter_next;
+            break;
+        }
+    }
+    c->filter = NULL;
+    filter_release(f);
+}
+
+static size_t watch_slot(int wd) {
+    return ((uint32_t)wd * 2654435761u) & (watch_cap - 1);
+}
+
+/* Returns the path watched by wd, or NULL if it is not (or no longer) watched. */
+const char *watch_lookup(int wd) {
+    if (watch_cap == 0) return NULL;
+    for (size_t i = watch_slot(wd); watch_table[i].wd != 0; i = (i + 1) & (watch_cap - 1)) {
+        if (watch_table[i].wd == wd)
+            return watch_table[i].rel_path;
+    }
+    return NULL;
+}
+
+/* Inserts or replaces the path for wd; the table doubles at 50% load. */
+void watch_put(int wd, const char *rel_path) {
+    char *copy = strdup(rel_path);
+    if (!copy) return;
+    if ((watch_count + 1) * 2 > watch_cap) {
+        size_t old_cap = watch_cap;
+        WatchEntry *old = watch_table;
+        size_t cap = old_cap ? old_cap * 2 : 1024;
+        WatchEntry *grown = calloc(cap, sizeof(WatchEntry));
+        if (!grown) {
+            free(copy);
+            return;
+        }
+        watch_table = grown;
+        watch_cap = cap;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].wd == 0) continue;
+            size_t j = watch_slot(old[i].wd);
+            while (watch_table[j].wd != 0) j = (j + 1) & (watch_cap - 1);
+            watch_table[j] = old[i];
+        }
+        free(old);
+    }
+    size_t i = watch_slot(wd);
+    while (watch_table[i].wd != 0 && watch_table[i].wd != wd)
+        i = (i + 1) & (watch_cap - 1);
+    if (watch_table[i].wd == wd) {
+        free(watch_table[i].rel_path);
+    } else {
+        watch_table[i].wd = wd;
+        watch_count++;
+    }
+    watch_table[i].rel_path = copy;
+}
+
+/* Removes wd, shifting later entries of its probe run back so lookups
+   never need tombstones. */
+void watch_remove(int wd) {
+    if (watch_cap == 0) return;
+    size_t i = watch_slot(wd);
+    while (watch_table[i].wd != wd) {
+        if (watch_table[i].wd == 0) return;
+        i = (i + 1) & (watch_cap - 1);
+    }
+    free(watch_table[i].rel_path);
+    watch_count--;
+    size_t hole = i;
+    for (size_t j = (i + 1) & (watch_cap - 1); watch_table[j].wd != 0; j = (j + 1) & (watch_cap - 1)) {
+        size_t home = watch_slot(watch_table[j].wd);
+        // Move j into the hole unless its home slot lies cyclically in (hole, j].
+        if ((j > hole && (home <= hole || home > j)) || (j < hole && home <= hole && home > j)) {
+            watch_table[hole] = watch_table[j];
+            hole = j;
+        }
+    }
+    watch_table[hole].wd = 0;
+    watch_table[hole].rel_path = NULL;
+}
+
+/* A directory was renamed inside the tree: its watches (and those of
+   everything below it) keep their descriptors, so only the paths change.
+   One whose new path is too long is dropped. */
+void watch_rebase(const char *old_prefix, const char *new_prefix) {
+    size_t plen = strlen(old_prefix);
+    size_t i = 0;
+    while (i < watch_cap) {
+        char *path = watch_table[i].rel_path;
+        if (watch_table[i].wd == 0 || !path_in_subtree(path, old_prefix, plen)) {
+            i++;
+            continue;
+        }
+        char rebased[PATH_MAX];
+        if (path_printf(rebased, "%s%s", new_prefix, path + plen) < 0) {
+            int wd = watch_table[i].wd;
+            inotify_rm_watch(inotify_fd, wd);
+            watch_remove(wd);  // may shift another entry into slot i; look again
+            continue;
+        }
+        char *copy = strdup(rebased);
+        if (copy) {
+            free(path);
+            watch_table[i].rel_path = copy;
+        }
+        i++;
+    }
+}
+
+/* A directory left the tree: stop watching it and everything below it. */
+void watch_forget_subtree(const char *prefix) {
+    size_t plen = strlen(prefix);
+    size_t i = 0;
+    while (i < watch_cap) {
+        if (watch_table[i].wd != 0 && path_in_subtree(watch_table[i].rel_path, prefix, plen)) {
+            int wd = watch_table[i].wd;
+            inotify_rm_watch(inotify_fd, wd);
+            watch_remove(wd);  // may shift another entry into slot i; look again
+            continue;
+        }
+        i++;
+    }
+}
+
+Payload *payload_new(size_t len) {
+    Payload *p = malloc(sizeof(Payload) + len);
+    if (!p) return NULL;
+    p->refs = 1;
+    p->len = len;
+    return p;
+}
+
+void payload_unref(Payload *p) {
+    if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(p);
+}
+
+void oplist_unref(OpList *l) {
+    if (l && __atomic_sub_fetch(&l->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(l);
+}
+
+static ZChunk zchunk_raw;  // marks a cached chunk that is sent uncompressed
+
+void body_unref(FileBody *b) {
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (b->z_in)
+            printf("Compressed %s: %lld -> %lld bytes (%.1f%%), %.2f ms CPU, %lld bytes sent\n",
+                   b->rel_path, b->z_in, b->z_out, 100.0 * b->z_out / b->z_in,
+                   b->z_ns / 1e6, b->z_sent);
+        if (b->zchunks) {
+            for (off_t i = 0; i < (b->size + CHUNK_SIZE - 1) / CHUNK_SIZE; i++)
+                if (b->zchunks[i] != &zchunk_raw)
+                    free(b->zchunks[i]);
+            free(b->zchunks);
+        }
+        close(b->fd);
+        free(b->data);
+        oplist_unref(b->delta);
+        free(b->rel_path);
+        free(b);
+    }
+}
+
+/* Builds a payload holding one frame: n varint fields, then path if any
+   (see frame_put()). */
+Payload *frame_payload(int op, const uint64_t *v, int n, const char *path) {
+    size_t plen = path ? strlen(path) : 0;
+    Payload *p = payload_new(FRAME_BOUND(n, plen));
+    if (p) p->len = frame_put((unsigned char *)p->data, op, v, n, path, plen);
+    return p;
+}
+
+/* Appends a control message to a client's queue. A NULL payload queues a
+   placeholder that holds back everything after it until filled in.
+   Caller holds qlock.
+*/
+OutMsg *queue_msg(Client *c, Payload *p, Stream *announces) {
+    OutMsg *m = calloc(1, sizeof(OutMsg));
+    if (!m) return NULL;
+    if (p) {
+        __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+        c->q_bytes += p->len;
+    }
+    m->payload = p;
+    m->announces = announces;
+    if (c->q_tail) c->q_tail->next = m;
+    else c->q_head = m;
+    c->q_tail = m;
+    c->q_bytes += sizeof(OutMsg);
+    return m;
+}
+
+void free_stream(Client *c, Stream *st) {
+    c->q_bytes -= sizeof(Stream);
+    c->stream_count--;
+    body_unref(st->body);
+    oplist_unref(st->ops);
+    free(st);
+}
+
+/* Unlinks a stream and releases its body. Caller holds qlock. */
+void remove_stream(Client *c, Stream *st) {
+    for (Stream **pp = &c->streams; *pp; pp = &(*pp)->next) {
+        if (*pp == st) {
+            *pp = st->next;
+            break;
+        }
+    }
+    free_stream(c, st);
+}
+
+/* Updates the epoll interest of a client slot (EPOLLOUT only while it has queued data). */
+void set_client_events(int slot, int want_out) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    ev.data.u32 = slot + 1;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, clients[slot].socket, &ev);
+}
+
+/* Marks older transfers of the same path (those with a lower stream id
+   than sid) as cancelled, telling the client with ABORT if it already saw
+   their header. Caller holds qlock.
+*/
+void cancel_streams(Client *c, const char *rel_path, unsigned sid) {
+    for (Stream *old = c->streams; old; old = old->next) {
+        if (!old->cancelled && (int)(old->body->sid - sid) < 0 &&
+            strcmp(old->body->rel_path, rel_path) == 0) {
+            Payload *abort_msg = frame_payload(F_ABORT, (uint64_t[]){ old->body->sid }, 1, NULL);
+            if (abort_msg) {
+                queue_msg(c, abort_msg, NULL);
+                payload_unref(abort_msg);
+            }
+            old->cancelled = 1;  // dropped once any in-flight frame is finished
+        }
+    }
+    for (OutMsg *m = c->q_head; m; m = m->next) {
+        if (!m->payload && (int)(m->announces->body->sid - sid) < 0 &&
+            strcmp(m->announces->body->rel_path, rel_path) == 0)
+            m->announces->cancelled = 1;  // never started; the placeholder is discarded
+    }
+}
+
+/* Appends a control message, and optionally a file transfer, to a client.
+   Never touches the network: the reactor drains the queue when the socket
+   becomes writable. With `delta`, p is the SIGREQ and the transfer header
+   is left as a placeholder until the client's signatures have been turned
+   into a delta. A client whose backlog exceeds CLIENT_QUEUE_MAX, or that
+   holds client_body_max file bodies not sent yet, is cut off instead of
+   stalling everyone else: every body keeps its file open until the last
+   client has it, so a stalled client would otherwise use up the process's
+   descriptors. It catches up from the journal when it reconnects.
+   Caller holds `lock`.
+*/
+void enqueue_payload(int slot, Payload *p, FileBody *body, int delta) {
+    Client *c = &clients[slot];
+    pthread_mutex_lock(&c->qlock);
+    if (c->closing) {
+        pthread_mutex_unlock(&c->qlock);
+        return;
+    }
+    size_t cost = sizeof(OutMsg) + p->len + (body ? sizeof(Stream) + sizeof(OutMsg) : 0);
+    if (((c->q_head || c->streams) && c->q_bytes + cost > CLIENT_QUEUE_MAX) ||
+        (body && c->stream_count >= client_body_max)) {
+        c->closing = 1;
+        shutdown(c->socket, SHUT_RDWR);  // reactor sees the hangup and frees the slot
+        pthread_mutex_unlock(&c->qlock);
+        fprintf(stderr, "Client %d too slow, disconnecting\n", c->socket);
+        return;
+    }
+    Stream *st = NULL;
+    if (body) {
+        st = calloc(1, sizeof(Stream));
+        if (!st) {
+            pthread_mutex_unlock(&c->qlock);
+            return;
+        }
+        cancel_streams(c, body->rel_path, body->sid);
+        __atomic_add_fetch(&body->refs, 1, __ATOMIC_RELAXED);
+        st->body = body;
+        c->q_bytes += sizeof(Stream);
+        c->stream_count++;
+    }
+    if (st && delta) {
+        queue_msg(c, p, NULL);
+        queue_msg(c, NULL, st);
+    } else {
+        queue_msg(c, p, st);
+        if (st) {
+            Stream **pp = &c->streams;
+            while (*pp) pp = &(*pp)->next;
+            *pp = st;
+        }
+    }
+    if (!c->out_armed) {
+        c->out_armed = 1;
+        set_client_events(slot, 1);
+    }
+    pthread_mutex_unlock(&c->qlock);
+}
+
+/* Whether a client takes live event seq: it must have said hello, must
+   not be replaying, and must not have got the event from the journal
+   already. Caller holds `lock`.
+*/
+int client_takes(Client *c, uint64_t seq) {
+    return c->socket >= 0 && c->have_ignore && !c->resuming && seq > c->cursor;
+}
+
+/* Queues SEQ after an event's messages; the client records seq as
+   applied once every transfer started before it has finished.
+*/
+void enqueue_seq_mark(int slot, uint64_t seq) {
+    Payload *mark = frame_payload(F_SEQ, &seq, 1, NULL);
+    if (!mark) return;
+    enqueue_payload(slot, mark, NULL, 0);
+    payload_unref(mark);
+}
+
+/* Metadata batching. Events without a file body are not queued to each
+   client as they happen: their frames, each event's closed by its SEQ
+   mark, are appended to a buffer per filter group, and batch_flush()
+   queues the run to the group's clients as one BATCH payload that all of
+   them share. A thread brackets a burst of events with batch_begin() and
+   batch_end(). Outside such a burst, when a buffer reaches
+   BATCH_MAX_BYTES, and before any file body is queued (it must not
+   overtake them), buffers are flushed at once. Buffers are protected by
+   `lock`.
+*/
+static __thread int batch_depth;
+
+/* Offset in a group's buffer just past the last event a client at cursor
+   already has (it caught up from the journal while they were buffered). */
+static size_t batch_skip(const Filter *f, uint64_t cursor) {
+    size_t off = 0, skip = 0;
+    while (off < f->batch_len) {
+        int op;
+        uint64_t len, seq;
+        int h = frame_header_get(f->batch + off, f->batch_len - off, &op, &len);
+        if (h <= 0) break;
+        const unsigned char *b = f->batch + off + h;
+        off += h + len;
+        if (op == F_SEQ && varint_get(&b, b + len, &seq) == 0) {
+            if (seq > cursor) break;
+            skip = off;
+        }
+    }
+    return skip;
+}
+
+/* A payload with the group's frames from off on, wrapped in a BATCH
+   frame if wrap is set. */
+static Payload *batch_payload(const Filter *f, size_t off, int wrap) {
+    size_t len = f->batch_len - off;
+    Payload *p = payload_new(FRAME_HDR_MAX + len);
+    if (!p) return NULL;
+    p->len = wrap ? frame_header_put((unsigned char *)p->data, F_BATCH, len) : 0;
+    memcpy(p->data + p->len, f->batch + off, len);
+    p->len += len;
+    return p;
+}
+
+/* Queues a group's buffered frames to its clients. Caller holds `lock`. */
+void batch_flush(Filter *f) {
+    if (!f->batch_len)
+        return;
+    Payload *shared[2] = { NULL, NULL };  // plain, wrapped
+    for (int j = f->first; j >= 0; j = clients[j].filter_next) {
+        Client *c = &clients[j];
+        if (!client_takes(c, f->batch_last))
+            continue;
+        int wrap = (c->caps & SYNC_CAP_BATCH) != 0;
+        if (c->cursor >= f->batch_first) {
+            Payload *p = batch_payload(f, batch_skip(f, c->cursor), wrap);
+            if (p) {
+                enqueue_payload(j, p, NULL, 0);
+                payload_unref(p);
+            }
+            continue;
+        }
+        if (!shared[wrap] && !(shared[wrap] = batch_payload(f, 0, wrap)))
+            continue;
+        enqueue_payload(j, shared[wrap], NULL, 0);
+    }
+    for (int i = 0; i < 2; i++)
+        if (shared[i]) payload_unref(shared[i]);
+    f->batch_len = 0;
+}
+
+void batch_flush_all(void) {
+    for (Filter *f = filters; f; f = f->next)
+        batch_flush(f);
+}
+
+/* Appends an event's frames, and its SEQ mark, to a group's buffer.
+   Caller holds `lock`. */
+void batch_add(Filter *f, const Payload *p, uint64_t seq) {
+    unsigned char mark[FRAME_BOUND(1, 0)];
+    size_t mark_len = frame_put(mark, F_SEQ, &seq, 1, NULL, 0);
+    size_t need = p->len + mark_len;
+    if (f->batch_len && f->batch_len + need > BATCH_MAX_BYTES)
+        batch_flush(f);
+    if (f->batch_len + need > f->batch_cap) {
+        size_t cap = f->batch_len + need > BATCH_MAX_BYTES ? f->batch_len + need : BATCH_MAX_BYTES;
+        unsigned char *grown = realloc(f->batch, cap);
+        if (!grown) return;
+        f->batch = grown;
+        f->batch_cap = cap;
+    }
+    if (!f->batch_len)
+        f->batch_first = seq;
+    f->batch_last = seq;
+    memcpy(f->batch + f->batch_len, p->data, p->len);
+    memcpy(f->batch + f->batch_len + p->len, mark, mark_len);
+    f->batch_len += need;
+}
+
+void batch_begin(void) {
+    batch_depth++;
+}
+
+void batch_end(void) {
+    if (--batch_depth > 0)
+        return;
+    uint64_t locked = broadcast_lock();
+    batch_flush_all();
+    broadcast_unlock(locked);
+}
+
+/* Buffers metadata event seq for every group whose filter lets rel_path
+   through. */
+void batch_event(const char *rel_path, const Payload *p, uint64_t seq) {
+    uint64_t locked = broadcast_lock();
+    for (Filter *f = filters; f; f = f->next) {
+        if (f->first >= 0 && !filter_ignores(f, rel_path))
+            batch_add(f, p, seq);
+    }
+    if (!batch_depth)
+        batch_flush_all();
+    broadcast_unlock(locked);
+}
+
+/* Queues a MATERIALIZE (sid is its stream id) to a client in place of a
+   transfer of rel_path, cancelling older transfers of the path as a
+   transfer would. Caller holds `lock`.
+*/
+void enqueue_materialize(int slot, Payload *p, const char *rel_path, unsigned sid) {
+    Client *c = &clients[slot];
+    pthread_mutex_lock(&c->qlock);
+    cancel_streams(c, rel_path, sid);
+    pthread_mutex_unlock(&c->qlock);
+    enqueue_payload(slot, p, NULL, 0);
+}
+
+/* Queues event seq's message and file body to every client whose ignore list lets rel_path through.
+   If unless is non-NULL, clients that would also accept that path are skipped.
+   Clients that take SYNC_CAP_DEDUP get dedup instead, if it is not NULL.
+   Paths are matched once per filter group, not once per client.
+*/
+void enqueue_to_clients(const char *rel_path, const char *unless, Payload *p, Payload *dedup,
+                        FileBody *body, int delta, uint64_t seq) {
+    uint64_t locked = broadcast_lock();
+    batch_flush_all();  // metadata events before it go first
+    for (Filter *f = filters; f; f = f->next) {
+        if (f->first < 0 || filter_ignores(f, rel_path) || (unless && !filter_ignores(f, unless)))
+            continue;
+        for (int j = f->first; j >= 0; j = clients[j].filter_next) {
+            if (!client_takes(&clients[j], seq))
+                continue;
+            if (dedup && (clients[j].caps & SYNC_CAP_DEDUP))
+                enqueue_materialize(j, dedup, rel_path, body->sid);
+            else
+                enqueue_payload(j, p, body, delta);
+            enqueue_seq_mark(j, seq);
+        }
+    }
+    broadcast_unlock(locked);
+}
+
+/* Whether a file's extension says it is compressed already. */
+static int precompressed(const char *rel_path) {
+    static const char *const exts[] = {
+        "gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jar", "apk",
+        "jpg", "jpeg", "png", "gif", "webp", "heic", "mp3", "ogg", "flac", "aac",
+        "mp4", "mkv", "webm", "mov", "avi", "pdf", "docx", "xlsx", "pptx", "odt",
+    };
+    const char *name = strrchr(rel_path, '/');
+    const char *dot = strrchr(name ? name + 1 : rel_path, '.');
+    if (!dot)
+        return 0;
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++)
+        if (strcasecmp(dot + 1, exts[i]) == 0)
+            return 1;
+    return 0;
+}
+
+/* Content sent recently, by hash, so that a file whose body a client
+   already has (a copy, or a rewrite with the same bytes) can be sent as
+   MATERIALIZE instead: the client copies it from the path it was sent to,
+   or from any file of its own with that hash, and answers NEED if it has
+   none. Direct mapped; a newer body simply replaces an older one. Files
+   are only hashed while some client takes SYNC_CAP_DEDUP.
+*/
+typedef struct {
+    int64_t size;
+    Hash128 hash;
+    unsigned sid;           // stream it was sent as
+    char *path;             // NULL if the slot is unused
+} DedupEntry;
+
+DedupEntry dedup_table[DEDUP_SLOTS];
+pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+int dedup_clients;          // connected clients with SYNC_CAP_DEDUP
+
+/* Hashes a file about to be sent as stream sid, remembers its content and
+   returns a MATERIALIZE for it if the same content went out before, NULL
+   otherwise. The hash is also kept in the index if the file is unchanged
+   since its entry was made, sparing reconciliation from computing it.
+*/
+static Payload *dedup_payload(const char *rel_path, int fd, const struct stat *st, unsigned sid) {
+    if (st->st_size < DEDUP_MIN_SIZE || !__atomic_load_n(&dedup_clients, __ATOMIC_RELAXED))
+        return NULL;
+    Hash128 h;
+    if (file_hash(fd, &h) < 0)
+        return NULL;
+    pthread_mutex_lock(&journal_lock);
+    IndexEntry *e = index_find(rel_path);
+    if (e && e->type == MANIFEST_FILE && e->size == st->st_size && e->mtime_ns == stat_mtime_ns(st)) {
+        e->hash = h;
+        e->hashed = 1;
+        index_dirty = 1;
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    Payload *p = NULL;
+    char *copy = strdup(rel_path);
+    pthread_mutex_lock(&dedup_lock);
+    DedupEntry *d = &dedup_table[h.h1 & (DEDUP_SLOTS - 1)];
+    if (d->path && d->size == st->st_size && d->hash.h1 == h.h1 && d->hash.h2 == h.h2) {
+        size_t slen = strlen(d->path), plen = strlen(rel_path);
+        uint64_t v[6] = { sid, st->st_size, h.h1, h.h2, d->sid, slen };
+        size_t fields = 0;
+        for (int i = 0; i < 6; i++)
+            fields += varint_size(v[i]);
+        if ((p = payload_new(FRAME_BOUND(6, slen + plen)))) {
+            unsigned char *b = (unsigned char *)p->data;
+            size_t n = frame_header_put(b, F_MATERIALIZE, fields + slen + plen);
+            for (int i = 0; i < 6; i++)
+                n += varint_put(b + n, v[i]);
+            memcpy(b + n, d->path, slen);
+            memcpy(b + n + slen, rel_path, plen);
+            p->len = n + slen + plen;
+        }
+    }
+    if (copy) {
+        free(d->path);
+        d->path = copy;
+        d->size = st->st_size;
+        d->hash = h;
+        d->sid = sid;
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    return p;
+}
+
+/* Prepares a file for sending as OPEN followed by its content in DATA
+   frames of at most CHUNK_SIZE bytes. The file is opened once; each
+   client streams the body from it with sendfile(). For a modified file of
+   at least DELTA_MIN_SIZE bytes, the message is SIGREQ instead and
+   clients get a delta against their copy.
+   *body is NULL for an empty file. If st is non-NULL it receives the
+   file's attributes. A non-zero sid reuses that stream id instead of
+   taking a new one. If dedup is non-NULL it receives a MATERIALIZE for
+   clients that take it, or NULL (see dedup_payload()). A file the
+   watcher read ahead is taken from there (see prefetch_take()).
+   Returns -1 with errno set if the file could not be opened.
+*/
+static int prefetch_take(const char *rel_path, int *fd, struct stat *st, unsigned char **data);
+
+int file_message(const char *rel_path, int modified, unsigned sid, Payload **p, Payload **dedup,
+                 FileBody **body, int *delta, struct stat *st_out) {
+    static unsigned next_sid = 1;
+    int fd;
+    struct stat st;
+    unsigned char *data = NULL;
+    if (!prefetch_take(rel_path, &fd, &st, &data)) {
+        fd = openat(base_fd, rel_path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && fstat(fd, &st) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) return -1;
+    if (!S_ISREG(st.st_mode)) {
+        errno = EISDIR;
+        close(fd);
+        free(data);
+        return -1;
+    }
+    if (st_out) *st_out = st;
+    if (!sid)
+        sid = __atomic_fetch_add(&next_sid, 1, __ATOMIC_RELAXED);
+    *delta = modified && st.st_size >= DELTA_MIN_SIZE;
+    *p = *delta ? frame_payload(F_SIGREQ, (uint64_t[]){ sid }, 1, rel_path)
+                : frame_payload(F_OPEN, (uint64_t[]){ sid, st.st_size }, 2, rel_path);
+    FileBody *b = st.st_size > 0 ? calloc(1, sizeof(FileBody)) : NULL;
+    if (!*p || (st.st_size > 0 && (!b || !(b->rel_path = strdup(rel_path))))) {
+        free(*p);
+        free(b);
+        close(fd);
+        free(data);
+        return -1;
+    }
+    if (dedup)
+        *dedup = dedup_payload(rel_path, fd, &st, sid);
+    if (b) {
+        b->refs = 1;
+        b->fd = fd;
+        b->data = data;
+        b->size = st.st_size;
+        b->sid = sid;
+        b->zlib = st.st_size < ZLIB_MIN_SIZE || precompressed(rel_path) ? 0 : -1;
+    } else {
+        close(fd);
+        free(data);
+    }
+    *body = b;
+    return 0;
+}
+
+/* Broadcasts a file to every client (see file_message()) as part of event
+   seq. unless is passed through to enqueue_to_clients().
+   Returns -1 if the file could not be opened.
+*/
+int broadcast_file(const char *rel_path, int modified, const char *unless, uint64_t seq) {
+    Payload *p, *dedup;
+    FileBody *body;
+    int delta;
+    if (file_message(rel_path, modified, 0, &p, &dedup, &body, &delta, NULL) < 0)
+        return -1;
+    enqueue_to_clients(rel_path, unless, p, dedup, body, delta, seq);
+    payload_unref(p);
+    if (dedup) payload_unref(dedup);
+    if (body) body_unref(body);
+    return 0;
+}
+
+/* Reads file bytes for the delta scan, zero-filling past EOF in case the
+   file shrank (the same padding the transfer itself uses). */
+void read_at(int fd, unsigned char *buf, size_t len, off_t pos) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, pos + got);
+        if (n <= 0) break;
+        got += n;
+    }
+    memset(buf + got, 0, len - got);
+}
+
+int add_op(OpList **list, int *cap, int copy, long long pos, long long len) {
+    OpList *l = *list;
+    if (l->count > 0) {
+        DeltaOp *last = &l->ops[l->count - 1];
+        if (last->copy == copy && last->pos + last->len == pos) {
+            last->len += len;  // extend a run of adjacent blocks or bytes
+            return 0;
+        }
+    }
+    if (l->count == *cap) {
+        int grown_cap = *cap * 2;
+        OpList *grown = realloc(l, sizeof(OpList) + grown_cap * sizeof(DeltaOp));
+        if (!grown) return -1;
+        *list = l = grown;
+        *cap = grown_cap;
+    }
+    l->ops[l->count].copy = copy;
+    l->ops[l->count].pos = pos;
+    l->ops[l->count].len = len;
+    l->count++;
+    return 0;
+}
+
+/* Computes the delta that turns the client's copy (described by its block
+   signatures) into the current file: the rsync algorithm. A hash table of
+   the weak checksums is probed at every byte offset while the checksum is
+   rolled forward; weak hits are confirmed with the strong hash.
+   Returns NULL if memory runs out, and the file is sent in full.
+*/
+OpList *compute_delta(FileBody *body, uint32_t bs, uint32_t count, const unsigned char *sigs) {
+    uint32_t nbuckets = 1;
+    while (nbuckets < count * 2) nbuckets <<= 1;
+    int32_t *heads = malloc(nbuckets * sizeof(int32_t));
+    int32_t *chain = malloc(count * sizeof(int32_t));
+    int cap = 64;
+    OpList *ops = malloc(sizeof(OpList) + cap * sizeof(DeltaOp));
+    size_t win = 16 * CHUNK_SIZE;
+    unsigned char *buf = malloc(win + bs);
+    if (!heads || !chain || !ops || !buf) {
+        free(heads); free(chain); free(ops); free(buf);
+        return NULL;
+    }
+    ops->refs = 1;
+    ops->block_size = bs;
+    ops->count = 0;
+    memset(heads, -1, nbuckets * sizeof(int32_t));
+    for (uint32_t i = count; i-- > 0;) {
+        uint32_t h = get_u32(sigs + i * SIG_BYTES) & (nbuckets - 1);
+        chain[i] = heads[h];
+        heads[h] = i;
+    }
+
+    long long size = body->size;
+    long long pos = 0, lit_start = 0;
+    long long buf_start = 0, buf_len = 0;
+    WeakSum w;
+    int have_sum = 0, failed = 0;
+    while (!failed && pos + bs <= size) {
+        // Keep the window [pos, pos + bs) inside the buffer.
+        if (pos + bs > buf_start + buf_len) {
+            buf_start = pos;
+            buf_len = size - pos < (long long)(win + bs) ? size - pos : (long long)(win + bs);
+            read_at(body->fd, buf, buf_len, buf_start);
+        }
+        unsigned char *p = buf + (pos - buf_start);
+        if (!have_sum) {
+            w = weak_init(p, bs);
+            have_sum = 1;
+        }
+        uint32_t weak = weak_value(w);
+        int match = -1;
+        int strong_done = 0;
+        Hash128 strong;
+        for (int32_t i = heads[weak & (nbuckets - 1)]; i >= 0; i = chain[i]) {
+            const unsigned char *sig = sigs + i * SIG_BYTES;
+            if (get_u32(sig) != weak) continue;
+            if (!strong_done) {
+                strong = hash128(p, bs, 0);
+                strong_done = 1;
+            }
+            if (get_u64(sig + 4) == strong.h1 && get_u64(sig + 12) == strong.h2) {
+                match = i;
+                break;
+            }
+        }
+        if (match >= 0) {
+            if ((pos > lit_start && add_op(&ops, &cap, 0, lit_start, pos - lit_start) < 0) ||
+                add_op(&ops, &cap, 1, match, 1) < 0)
+                failed = 1;
+            pos += bs;
+            lit_start = pos;
+            have_sum = 0;
+        } else {
+            if (pos + bs < size) {
+                if (pos + bs >= buf_start + buf_len) {
+                    buf_start = pos;
+                    buf_len = size - pos < (long long)(win + bs) ? size - pos : (long long)(win + bs);
+                    read_at(body->fd, buf, buf_len, buf_start);
+                    p = buf;
+                }
+                weak_roll(&w, p[0], p[bs], bs);
+            }
+            pos++;
+        }
+    }
+    if (!failed && size > lit_start && add_op(&ops, &cap, 0, lit_start, size - lit_start) < 0)
+        failed = 1;
+    free(heads);
+    free(chain);
+    free(buf);
+    if (failed) {
+        free(ops);
+        return NULL;
+    }
+    return ops;
+}
+
+/* Fills in a client's placeholder once its delta (or NULL for a full
+   transfer) is known, and lets the queue move again.
+*/
+void install_delta(DeltaJob *job, OpList *ops) {
+    pthread_mutex_lock(&lock);
+    Client *c = &clients[job->slot];
+    if (c->socket < 0 || c->gen != job->gen) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    pthread_mutex_lock(&c->qlock);
+    OutMsg *prev = NULL, *m = c->q_head;
+    while (m && (m->payload || m->announces->body->sid != job->sid)) {
+        prev = m;
+        m = m->next;
+    }
+    if (m) {
+        Stream *st = m->announces;
+        Payload *hdr = NULL;
+        if (!st->cancelled) {
+            FileBody *b = st->body;
+            hdr = ops ? frame_payload(F_DELTA, (uint64_t[]){ b->sid, b->size, ops->block_size }, 3, b->rel_path)
+                      : frame_payload(F_OPEN, (uint64_t[]){ b->sid, b->size }, 2, b->rel_path);
+        }
+        if (hdr) {
+            if (ops) __atomic_add_fetch(&ops->refs, 1, __ATOMIC_RELAXED);
+            st->ops = ops;
+            m->payload = hdr;
+            c->q_bytes += hdr->len;
+            Stream **pp = &c->streams;
+            while (*pp) pp = &(*pp)->next;
+            *pp = st;
+        } else {
+            // Cancelled while waiting: the client never hears about it.
+            if (prev) prev->next = m->next;
+            else c->q_head = m->next;
+            if (c->q_tail == m) c->q_tail = prev;
+            c->q_bytes -= sizeof(OutMsg);
+            free_stream(c, st);
+            free(m);
+        }
+        if (!c->out_armed) {
+            c->out_armed = 1;
+            set_client_events(job->slot, 1);
+        }
+    }
+    pthread_mutex_unlock(&c->qlock);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Delta worker thread: turns client signatures into deltas off the reactor
+   thread. Clients that sent identical signatures share one computed delta.
+*/
+void *delta_worker(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&job_lock);
+        while (!job_head)
+            pthread_cond_wait(&job_cond, &job_lock);
+        DeltaJob *job = job_head;
+        job_head = job->next;
+        if (!job_head) job_tail = NULL;
+        pthread_mutex_unlock(&job_lock);
+
+        // Look up the body through the waiting placeholder.
+        FileBody *body = NULL;
+        pthread_mutex_lock(&lock);
+        Client *c = &clients[job->slot];
+        if (c->socket >= 0 && c->gen == job->gen) {
+            pthread_mutex_lock(&c->qlock);
+            for (OutMsg *m = c->q_head; m; m = m->next) {
+                if (!m->payload && m->announces->body->sid == job->sid) {
+                    body = m->announces->body;
+                    __atomic_add_fetch(&body->refs, 1, __ATOMIC_RELAXED);
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&c->qlock);
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (body) {
+            OpList *ops = NULL;
+            if (job->count > 0) {
+                Hash128 key = hash128(job->sigs, (size_t)job->count * SIG_BYTES, job->block_size);
+                if (body->delta && body->delta_key.h1 == key.h1 && body->delta_key.h2 == key.h2) {
+                    ops = body->delta;
+                    __atomic_add_fetch(&ops->refs, 1, __ATOMIC_RELAXED);
+                } else if ((ops = compute_delta(body, job->block_size, job->count, job->sigs))) {
+                    oplist_unref(body->delta);
+                    __atomic_add_fetch(&ops->refs, 1, __ATOMIC_RELAXED);
+                    body->delta = ops;
+                    body->delta_key = key;
+                }
+            }
+            install_delta(job, ops);
+            oplist_unref(ops);
+            body_unref(body);
+        }
+        free(job->sigs);
+        free(job);
+    }
+    return NULL;
+}
+
+/* Adds an inotify watch for a directory. Called from every walker thread,
+   so table updates are serialised here; lookups only happen on the watcher
+   thread, which never runs concurrently with a walk.
+*/
+void register_watch(const char *abs_path, const char *rel_path) {
+    int wd = inotify_add_watch(inotify_fd, abs_path, WATCH_EVENTS);
+    if (wd >= 0) {
+        pthread_mutex_lock(&watch_lock);
+        watch_put(wd, rel_path);
+        pthread_mutex_unlock(&watch_lock);
+    } else if (errno == ENOSPC) {
+        static int warned = 0;
+        if (!__atomic_fetch_add(&warned, 1, __ATOMIC_RELAXED))
+            fprintf(stderr, "inotify watch limit reached; raise fs.inotify.max_user_watches\n");
+    }
+}
+
+/* Parallel tree walker. A walk starts at one directory and hands every
+   subdirectory it finds to a pool of threads, each with its own deque: a
+   thread pops its newest item, staying depth first, and when it runs dry
+   steals the oldest item of another thread. Directories are opened with
+   openat() against base_fd and listed with fdopendir(); d_type says what an
+   entry is, with fstatat() only where the filesystem leaves it DT_UNKNOWN.
+   Each directory is watched before it is listed, so nothing created during
+   the walk is missed. Symlinks are not followed.
+*/
+typedef void (*WalkVisit)(const char *rel_path, int is_dir, void *arg);
+
+typedef struct {
+    pthread_mutex_t lock;
+    char **items;             // ring buffer of relative paths
+    size_t head, tail, cap;   // the owner works at tail, thieves take from head
+} WalkDeque;
+
+WalkDeque *walk_deques;
+int walk_threads;             // pool size, counting the thread that starts a walk
+pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t walk_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t walk_done = PTHREAD_COND_INITIALIZER;
+unsigned walk_gen;            // bumped to wake the helpers
+int walk_woken;               // helpers already woken for the current walk
+int walk_helpers_busy;
+long walk_remaining;          // directories queued or being listed
+WalkVisit walk_visit;
+void *walk_arg;
+
+void deque_push(WalkDeque *d, char *item) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail - d->head == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 256;
+        char **grown = malloc(cap * sizeof(char *));
+        if (!grown) {
+            pthread_mutex_unlock(&d->lock);
+            free(item);
+            __atomic_sub_fetch(&walk_remaining, 1, __ATOMIC_ACQ_REL);
+            return;
+        }
+        for (size_t i = d->head; i != d->tail; i++)
+            grown[i - d->head] = d->items[i & (d->cap - 1)];
+        free(d->items);
+        d->items = grown;
+        d->tail -= d->head;
+        d->head = 0;
+        d->cap = cap;
+    }
+    d->items[d->tail++ & (d->cap - 1)] = item;
+    pthread_mutex_unlock(&d->lock);
+}
+
+char *deque_take(WalkDeque *d, int steal) {
+    char *item = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->head != d->tail)
+        item = steal ? d->items[d->head++ & (d->cap - 1)] : d->items[--d->tail & (d->cap - 1)];
+    pthread_mutex_unlock(&d->lock);
+    return item;
+}
+
+/* Watches and lists one directory, calling walk_visit for each directory
+   (before its contents) and regular file in it. Subdirectories are queued.
+*/
+void walk_list_dir(int self, const char *rel_path) {
+    char abs_path[PATH_MAX];
+    if (path_printf(abs_path, "%s%s%s", base_directory, rel_path[0] ? "/" : "", rel_path) < 0)
+        return;
+    register_watch(abs_path, rel_path);
+
+    int fd = openat(base_fd, rel_path[0] ? rel_path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return;
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type != DT_DIR && type != DT_REG)
+            continue;
+        if (relay_mode && type == DT_REG && is_temp_name(entry->d_name)) {
+            unlinkat(fd, entry->d_name, 0);  // left by a transfer cut short (relays walk only at startup)
+            continue;
+        }
+        char child_rel[PATH_MAX];
+        if (path_printf(child_rel, "%s%s%s", rel_path, rel_path[0] ? "/" : "", entry->d_name) < 0)
+            continue;
+        if (walk_visit)
+            walk_visit(child_rel, type == DT_DIR, walk_arg);
+        if (type != DT_DIR)
+            continue;
+        char *item = strdup(child_rel);
+        if (!item) continue;
+        __atomic_add_fetch(&walk_remaining, 1, __ATOMIC_ACQ_REL);
+        deque_push(&walk_deques[self], item);
+        if (walk_threads > 1 && !__atomic_exchange_n(&walk_woken, 1, __ATOMIC_ACQ_REL)) {
+            pthread_mutex_lock(&walk_lock);
+            walk_gen++;
+            pthread_cond_broadcast(&walk_start);
+            pthread_mutex_unlock(&walk_lock);
+        }
+    }
+    closedir(dir);
+}
+
+/* Works on the current walk until no directory is left anywhere. */
+void walk_run(int self) {
+    while (1) {
+        char *item = deque_take(&walk_deques[self], 0);
+        for (int k = 1; !item && k < walk_threads; k++)
+            item = deque_take(&walk_deques[(self + k) % walk_threads], 1);
+        if (item) {
+            walk_list_dir(self, item);
+            free(item);
+            if (__atomic_sub_fetch(&walk_remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_mutex_lock(&walk_lock);
+                pthread_cond_broadcast(&walk_done);
+                pthread_mutex_unlock(&walk_lock);
+            }
+        } else if (__atomic_load_n(&walk_remaining, __ATOMIC_ACQUIRE) == 0) {
+            return;
+        } else {
+            sched_yield();  // the last directories are still being listed
+        }
+    }
+}
+
+void *walk_helper(void *arg) {
+    int self = (int)(intptr_t)arg;
+    unsigned seen = 0;
+    pthread_mutex_lock(&walk_lock);
+    while (1) {
+        while (walk_gen == seen)
+            pthread_cond_wait(&walk_start, &walk_lock);
+        seen = walk_gen;
+        walk_helpers_busy++;
+        pthread_mutex_unlock(&walk_lock);
+        batch_begin();
+        walk_run(self);
+        batch_end();
+        pthread_mutex_lock(&walk_lock);
+        if (--walk_helpers_busy == 0)
+            pthread_cond_broadcast(&walk_done);
+    }
+    return NULL;
+}
+
+/* Opens base_fd and starts one helper per additional online CPU. */
+void walk_init(void) {
+    base_fd = open(base_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd < 0) {
+        perror("open sync directory");
+        exit(1);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk_threads = cpus < 1 ? 1 : cpus > MAX_WALK_THREADS ? MAX_WALK_THREADS : (int)cpus;
+    walk_deques = calloc(walk_threads, sizeof(WalkDeque));
+    if (!walk_deques) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < walk_threads; i++)
+        pthread_mutex_init(&walk_deques[i].lock, NULL);
+    for (int i = 1; i < walk_threads; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, walk_helper, (void *)(intptr_t)i) == 0)
+            pthread_detach(t);
+    }
+}
+
+/* Walks the tree below rel_path ("" for the root), watching every
+   directory and calling visit (if any) from the walker threads for each
+   entry below it. Walks run one at a time: at startup, then only from the
+   watcher thread. Returns once the whole subtree has been listed.
+*/
+void walk_tree(const char *rel_path, WalkVisit visit, void *arg) {
+    char *root = strdup(rel_path);
+    if (!root) return;
+    walk_visit = visit;
+    walk_arg = arg;
+    walk_woken = 0;
+    walk_remaining = 1;
+    deque_push(&walk_deques[0], root);
+    walk_run(0);
+    pthread_mutex_lock(&walk_lock);
+    while (walk_helpers_busy > 0)
+        pthread_cond_wait(&walk_done, &walk_lock);
+    pthread_mutex_unlock(&walk_lock);
+}
+
+/* Startup scan. The index is brought forward from the saved manifest and
+   the journal records written after it, then compared with a walk of the
+   tree (which also sets up the watches); whatever changed while the
+   server was down is journaled, so reconnecting clients replay it like
+   any other event. Without a manifest that matches the journal, offline
+   changes cannot be told apart: the index is built from the walk alone
+   and the journal starts over under a new id, which has every client
+   reconciled. Either way, hashes in the old manifest are reused for files
+   whose size and mtime are unchanged.
+*/
+typedef struct {
+    char *path;
+    int is_dir;
+    int replaces;           // an entry of the other type is in the way
+    int modified;           // the index has an older version of the file
+} ScanChange;
+
+typedef struct {
+    Manifest saved;
+    int trusted;            // the index was brought forward from saved
+    ScanChange *changes;    // in the order found, so parents come first
+    size_t count, cap;
+} ScanState;
+
+static void scan_visit(const char *rel_path, int is_dir, void *arg) {
+    ScanState *s = arg;
+    struct stat st;
+    if (fstatat(base_fd, rel_path, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return;
+    int type = is_dir ? MANIFEST_DIR : MANIFEST_FILE;
+    int64_t size = is_dir ? 0 : st.st_size, mtime_ns = is_dir ? 0 : stat_mtime_ns(&st);
+    pthread_mutex_lock(&journal_lock);
+    IndexEntry *e = index_find(rel_path);
+    if (s->trusted && e && e->type == type && !e->ino && !is_dir)
+        e->ino = st.st_ino;  // the saved manifest has no inodes
+    if (s->trusted && !(e && e->type == type && e->size == size && e->mtime_ns == mtime_ns &&
+                        (is_dir || e->ino == st.st_ino))) {
+        char *copy = strdup(rel_path);
+        if (copy && s->count == s->cap) {
+            size_t cap = s->cap ? s->cap * 2 : 64;
+            ScanChange *grown = realloc(s->changes, cap * sizeof(ScanChange));
+            if (grown) {
+                s->changes = grown;
+                s->cap = cap;
+            }
+        }
+        if (copy && s->count < s->cap) {
+            s->changes[s->count].path = copy;
+            s->changes[s->count].is_dir = is_dir;
+            s->changes[s->count].replaces = e && e->type != type;
+            s->changes[s->count].modified = e && e->type == type;
+            s->count++;
+        } else {
+            free(copy);
+        }
+    } else if (!s->trusted && (e = index_get(rel_path))) {
+        e->type = type;
+        e->size = size;
+        e->mtime_ns = mtime_ns;
+        e->ino = is_dir ? 0 : st.st_ino;
+        const ManifestRecord *r = is_dir ? NULL : manifest_find(&s->saved, rel_path);
+        if (r && r->type == MANIFEST_FILE && r->size == size && r->mtime_ns == mtime_ns) {
+            e->hash = r->hash;
+            e->hashed = 1;
+        }
+    }
+    if (e) e->seen = 1;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/* The entries the last walk did not find, in manifest order, each
+   deleted directory without its contents. Their paths are the caller's
+   to free. */
+static ManifestItem *index_unseen(size_t *count) {
+    pthread_mutex_lock(&journal_lock);
+    ManifestItem *gone = malloc((index_count + 1) * sizeof(ManifestItem));
+    size_t n = 0, kept = 0;
+    for (size_t i = 0; gone && i < index_nbuckets; i++) {
+        for (IndexEntry *e = index_buckets[i]; e; e = e->hnext) {
+            if (!e->seen && (gone[n].path = strdup(e->path)))
+                gone[n++].type = e->type;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    if (gone) qsort(gone, n, sizeof(ManifestItem), manifest_item_cmp);
+    const char *dir = NULL;
+    for (size_t i = 0; i < n; i++) {
+        if (dir && path_in_subtree(gone[i].path, dir, strlen(dir))) {
+            free((char *)gone[i].path);  // a directory sorts right before its contents
+            continue;
+        }
+        gone[kept] = gone[i];
+        dir = gone[kept].type == MANIFEST_DIR ? gone[kept].path : NULL;
+        kept++;
+    }
+    *count = kept;
+    return gone;
+}
+
+void index_scan(void) {
+    ScanState s;
+    memset(&s, 0, sizeof(s));
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/manifest", journal_dir);
+    manifest_open(path, &s.saved);
+    uint64_t head = journal_next_seq - 1;
+    s.trusted = s.saved.map && s.saved.journal_id == journal_id && s.saved.seq <= head &&
+                s.saved.seq + 1 >= journal_segs[0].first_seq;
+    if (s.trusted) {
+        for (uint64_t i = 0; i < s.saved.count; i++) {
+            const ManifestRecord *r = &s.saved.records[i];
+            char rel[PATH_MAX];
+            IndexEntry *e;
+            if (!manifest_path(&s.saved, i, rel, sizeof(rel)) || !(e = index_get(rel)))
+                continue;
+            e->type = r->type & ~MANIFEST_UNHASHED;
+            e->hashed = !(r->type & MANIFEST_UNHASHED);
+            e->size = r->size;
+            e->mtime_ns = r->mtime_ns;
+            e->hash = r->hash;
+        }
+        JournalPos pos = { 0, 0 };
+        JournalRecord rec;
+        for (uint64_t at = s.saved.seq; at < head && journal_next(&pos, at, &rec) > 0; at = rec.seq) {
+            pthread_mutex_lock(&journal_lock);
+            index_apply(rec.op, rec.is_dir, rec.path, rec.to, rec.size, rec.mtime_ns);
+            pthread_mutex_unlock(&journal_lock);
+        }
+    }
+
+    walk_tree("", scan_visit, &s);
+
+    size_t deleted = 0;
+    if (s.trusted) {
+        ManifestItem *gone = index_unseen(&deleted);
+        for (size_t i = 0; i < deleted; i++) {
+            journal_append(J_DELETE, gone[i].type == MANIFEST_DIR, gone[i].path, NULL, NULL);
+            free((char *)gone[i].path);
+        }
+        free(gone);
+        for (size_t i = 0; i < s.count; i++) {
+            ScanChange *ch = &s.changes[i];
+            struct stat st;
+            if (ch->replaces)
+                journal_append(J_DELETE, !ch->is_dir, ch->path, NULL, NULL);
+            if (ch->is_dir)
+                journal_append(J_MKDIR, 1, ch->path, NULL, NULL);
+            else if (fstatat(base_fd, ch->path, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                journal_append(J_FILE, 0, ch->path, NULL, &st);
+            free(ch->path);
+        }
+        free(s.changes);
+        printf("Index: %zu entries, %zu changed and %zu deleted since the last run\n",
+               index_count, s.count, deleted);
+    } else {
+        if (journal_next_seq > 1)
+            journal_reset();
+        printf("Index: %zu entries, built from the tree\n", index_count);
+    }
+    manifest_close(&s.saved);
+    index_save();
+}
+
+/* Whether a file could not be opened only for now, for want of
+   descriptors or memory, and should be tried again rather than sent as
+   empty or taken for gone. */
+static int transient_error(int err) {
+    return err == EMFILE || err == ENFILE || err == ENOMEM;
+}
+
+/* Journals an event and queues it for all connected clients: CREATE or
+   DELETE, batched (see batch_event()). For files that exist, the content
+   is sent instead; the file is opened first so its journal record
+   carries the size and mtime of the content sent. A file that is gone by
+   then is not sent at all: the rename or delete that took it has its own
+   event. Returns -1, having sent nothing, if the file could not be opened
+   for now (see transient_error()); the caller tries again later.
+*/
+int broadcast_update(const char *cmd, const char *rel_path, int is_dir) {
+    char norm_rel[PATH_MAX];
+    if (path_printf(norm_rel, "%s", rel_path) < 0)
+        return 0;
+    normalize_path(norm_rel);
+
+    int modified = strcmp(cmd, "MODIFY") == 0;
+    int is_delete = strcmp(cmd, "DELETE") == 0;
+    if (!is_delete && !is_dir) {
+        Payload *p, *dedup;
+        FileBody *body;
+        int delta;
+        struct stat st;
+        uint64_t start = metric_clock();
+        if (file_message(norm_rel, modified, 0, &p, NULL, &body, &delta, &st) == 0) {
+            uint64_t seq = journal_append(J_FILE, 0, norm_rel, NULL, &st);
+            dedup = body ? dedup_payload(norm_rel, body->fd, &st, body->sid) : NULL;
+            metric_since(M_FILE_PREPARE, start);
+            metric_add(modified ? M_EV_MODIFY : M_EV_CREATE, 1);
+            enqueue_to_clients(norm_rel, NULL, p, dedup, body, delta, seq);
+            payload_unref(p);
+            if (dedup) payload_unref(dedup);
+            if (body) body_unref(body);
+            return 0;
+        }
+        if (transient_error(errno))
+            return -1;
+        if (errno == ENOENT || errno == ENOTDIR)
+            return 0;
+        cmd = "CREATE";
+    }
+    uint64_t seq = journal_append(is_delete ? J_DELETE : is_dir ? J_MKDIR : J_FILE, is_dir, norm_rel, NULL, NULL);
+    metric_add(is_delete ? (is_dir ? M_EV_RMDIR : M_EV_DELETE) : is_dir ? M_EV_MKDIR : M_EV_CREATE, 1);
+    Payload *p = frame_payload(is_delete ? F_DELETE : F_CREATE, (uint64_t[]){ is_dir }, 1, norm_rel);
+    if (!p) return 0;
+    batch_event(norm_rel, p, seq);
+    payload_unref(p);
+    return 0;
+}
+
+/* The frame of a rename for a client that sees its old name: RENAME, or
+   DELETE if the new name is ignored (skip_to).
+*/
+Payload *rename_payload(const char *from, const char *to, int is_dir, int skip_to) {
+    if (skip_to)
+        return frame_payload(F_DELETE, (uint64_t[]){ is_dir }, 1, from);
+    size_t flen = strlen(from), tlen = strlen(to);
+    uint64_t v[2] = { is_dir, flen };
+    Payload *p = payload_new(FRAME_BOUND(2, flen + tlen));
+    if (!p) return NULL;
+    unsigned char *d = (unsigned char *)p->data;
+    size_t n = frame_header_put(d, F_RENAME, varint_size(v[0]) + varint_size(v[1]) + flen + tlen);
+    for (int i = 0; i < 2; i++)
+        n += varint_put(d + n, v[i]);
+    memcpy(d + n, from, flen);
+    memcpy(d + n + flen, to, tlen);
+    p->len = n + flen + tlen;
+    return p;
+}
+
+/* Queues a rename to one client (see rename_payload()). A client that
+   ignores one side cannot apply it as a rename: if it only sees the old
+   name the path is deleted, if it only sees the new name a file is sent
+   in full (that part is left to the caller, which gets 1 back). skip_from
+   and skip_to say which names its filter excludes. Caller holds `lock`.
+*/
+int enqueue_rename(int slot, const char *from, const char *to, int is_dir, int skip_from, int skip_to) {
+    if (skip_from)
+        return !is_dir && !skip_to;
+    Payload *p = rename_payload(from, to, is_dir, skip_to);
+    if (p) {
+        enqueue_payload(slot, p, NULL, 0);
+        payload_unref(p);
+    }
+    return 0;
+}
+
+/* Journals a rename inside the tree and broadcasts it, batched, as
+   enqueue_rename() would queue it to each client.
+*/
+void broadcast_rename(const char *from, const char *to, int is_dir) {
+    uint64_t seq = journal_append(J_RENAME, is_dir, from, to, NULL);
+    int need_file = 0;
+    Payload *p[2] = { NULL, NULL };  // rename, delete
+    metric_add(M_EV_RENAME, 1);
+    uint64_t locked = broadcast_lock();
+    for (Filter *f = filters; f; f = f->next) {
+        if (f->first < 0)
+            continue;
+        int skip_from = filter_ignores(f, from), skip_to = filter_ignores(f, to);
+        if (skip_from) {
+            for (int j = f->first; j >= 0 && !is_dir && !skip_to; j = clients[j].filter_next)
+                need_file |= client_takes(&clients[j], seq);
+            continue;
+        }
+        if (!p[skip_to] && !(p[skip_to] = rename_payload(from, to, is_dir, skip_to)))
+            continue;
+        batch_add(f, p[skip_to], seq);
+    }
+    if (!batch_depth)
+        batch_flush_all();
+    broadcast_unlock(locked);
+    for (int i = 0; i < 2; i++)
+        if (p[i]) payload_unref(p[i]);
+    if (need_file)
+        broadcast_file(to, 0, from, seq);  // clients that see only the new name
+}
+
+/* Event coalescing. File events are not broadcast as they arrive: each
+   path gets one Pending entry that records whether clients already have
+   the file (was_present), whether it exists now (now_present), and whether
+   it was deleted and recreated in between. The entry is flushed once the
+   path has been quiet for debounce_ms, so a burst of writes becomes one
+   transfer and a file created and deleted inside the window is never sent.
+   A file that is never quiet (a log closed after every line) is not held
+   back forever: once max_wait_ms have passed since its first event, later
+   events no longer postpone it.
+   Directory creates and deletes are broadcast immediately, since later
+   events depend on them. Entries are kept on a list in order of their last
+   event, so the head is always the next one due.
+*/
+typedef struct Pending {
+    struct Pending *hnext;         // hash chain
+    struct Pending *prev, *next;   // list ordered by last event
+    long long first_ms, last_ms;   // now_ms() at its first event, and the last that postponed it
+    uint64_t first_event;          // metric_clock() at its first event (-m)
+    int was_present, now_present, recreated;
+    char path[];
+} Pending;
+
+Pending **pending_buckets;
+size_t pending_nbuckets, pending_count;
+Pending *pending_head, *pending_tail;
+int debounce_ms = DEFAULT_DEBOUNCE_MS;
+int max_wait_ms = DEFAULT_MAX_WAIT_MS;
+
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+Pending *pending_find(const char *path) {
+    if (!pending_nbuckets) return NULL;
+    Pending *e = pending_buckets[path_hash(path) & (pending_nbuckets - 1)];
+    while (e && strcmp(e->path, path) != 0)
+        e = e->hnext;
+    return e;
+}
+
+static void pending_link_hash(Pending *e) {
+    size_t b = path_hash(e->path) & (pending_nbuckets - 1);
+    e->hnext = pending_buckets[b];
+    pending_buckets[b] = e;
+}
+
+static void pending_unlink_list(Pending *e) {
+    if (e->prev) e->prev->next = e->next; else pending_head = e->next;
+    if (e->next) e->next->prev = e->prev; else pending_tail = e->prev;
+}
+
+static void pending_append(Pending *e) {
+    e->next = NULL;
+    e->prev = pending_tail;
+    if (pending_tail) pending_tail->next = e; else pending_head = e;
+    pending_tail = e;
+}
+
+/* Adds an entry for path, doubling the bucket array when it fills up. */
+Pending *pending_add(const char *path) {
+    if (pending_count >= pending_nbuckets) {
+        size_t nb = pending_nbuckets ? pending_nbuckets * 2 : 256;
+        Pending **nbk = calloc(nb, sizeof(Pending *));
+        if (!nbk) return NULL;
+        free(pending_buckets);
+        pending_buckets = nbk;
+        pending_nbuckets = nb;
+        for (Pending *e = pending_head; e; e = e->next)
+            pending_link_hash(e);
+    }
+    size_t len = strlen(path) + 1;
+    Pending *e = calloc(1, sizeof(Pending) + len);
+    if (!e) return NULL;
+    memcpy(e->path, path, len);
+    pending_link_hash(e);
+    pending_append(e);
+    pending_count++;
+    return e;
+}
+
+void pending_drop(Pending *e) {
+    Pending **pp = &pending_buckets[path_hash(e->path) & (pending_nbuckets - 1)];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    pending_unlink_list(e);
+    pending_count--;
+    free(e);
+}
+
+/* Broadcasts what an entry adds up to and frees it. Returns -1, keeping
+   the entry, if its file could not be opened for now. */
+int pending_emit(Pending *e) {
+    uint64_t outer = event_origin;
+    event_origin = e->first_event;
+    int r;
+    if (!e->now_present)
+        r = broadcast_update("DELETE", e->path, 0);
+    else
+        r = broadcast_update(e->was_present && !e->recreated ? "MODIFY" : "CREATE", e->path, 0);
+    event_origin = outer;
+    if (r < 0)
+        return -1;
+    pending_drop(e);
+    return 0;
+}
+
+/* Drops every entry at or below prefix, or with emit set, broadcasts them first. */
+void pending_drop_subtree(const char *prefix, int emit) {
+    size_t plen = strlen(prefix);
+    Pending *e = pending_head;
+    while (e) {
+        Pending *next = e->next;
+        if (path_in_subtree(e->path, prefix, plen)) {
+            if (emit)
+                pending_emit(e);
+            else
+                pending_drop(e);
+        }
+        e = next;
+    }
+}
+
+/* Moves an entry to a new path, keeping its state. The rename counts as
+   an event on it: a file renamed again and again (a chain of renames)
+   must not be flushed in between, after it has moved on from the path.
+*/
+void pending_move_entry(Pending *e, const char *new_path) {
+    Pending *n = pending_add(new_path);
+    if (n) {
+        n->first_ms = e->first_ms;
+        n->last_ms = now_ms();
+        n->first_event = e->first_event;
+        n->was_present = e->was_present;
+        n->now_present = e->now_present;
+        n->recreated = e->recreated;
+    }
+    pending_drop(e);
+}
+
+/* Rewrites entries under old_prefix after a directory rename. */
+void pending_rebase(const char *old_prefix, const char *new_prefix) {
+    size_t plen = strlen(old_prefix);
+    Pending *e = pending_head;
+    while (e) {
+        Pending *next = e->next;
+        if (path_in_subtree(e->path, old_prefix, plen)) {
+            char moved[PATH_MAX];
+            if (path_printf(moved, "%s%s", new_prefix, e->path + plen) == 0)
+                pending_move_entry(e, moved);
+            else
+                pending_drop(e);
+        }
+        e = next;
+    }
+}
+
+/* Folds one file event into the path's entry. kind is 'C' (created),
+   'M' (written) or 'D' (deleted).
+*/
+void pending_note(const char *path, char kind) {
+    long long now = now_ms();
+    Pending *e = pending_find(path);
+    if (!e) {
+        if (!(e = pending_add(path))) {
+            broadcast_update(kind == 'D' ? "DELETE" : kind == 'C' ? "CREATE" : "MODIFY", path, 0);
+            return;
+        }
+        e->was_present = e->now_present = kind != 'C';
+        e->first_event = event_origin;
+        e->first_ms = e->last_ms = now;
+    } else if (now - e->first_ms < max_wait_ms) {
+        pending_unlink_list(e);
+        pending_append(e);
+        e->last_ms = now;
+    }  // else it stays where it is, due debounce_ms after its last postponement
+    if (kind == 'D') {
+        e->now_present = 0;
+        if (!e->was_present)
+            pending_drop(e);    // created and deleted within the window
+        return;
+    }
+    if (!e->now_present && e->was_present)
+        e->recreated = 1;
+    e->now_present = 1;
+}
+
+/* Read-ahead for -b uring. When the coalescer emits a run of files (a
+   directory moved in with thousands of them, say), the watcher opens the
+   next PREFETCH_BATCH through its ring in one io_uring_enter(), then stats
+   them and reads each one's head into a registered buffer in a second.
+   file_message() takes the descriptor and attributes from here instead of
+   opening the file itself, and a file that fit in its buffer goes out to
+   clients from memory. The table is per thread: only the watcher fills
+   it, and other threads never find anything in theirs.
+*/
+typedef struct {
+    char *path;             // NULL once taken
+    int fd;                 // -errno if it could not be opened
+    int stat_rc;
+    int got;                // bytes read into its buffer, or -errno
+    struct statx stx;
+    unsigned char *data;    // the whole body, if it fit
+} Prefetched;
+
+Uring watch_ring;           // the watcher thread's
+unsigned char *prefetch_bufs;  // PREFETCH_BATCH buffers of PREFETCH_READ_MAX bytes
+int prefetch_fixed;         // they are registered with watch_ring
+static __thread Prefetched prefetched[PREFETCH_BATCH];
+static __thread int prefetched_count, prefetched_next;
+
+static void statx_to_stat(const struct statx *x, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(x->stx_dev_major, x->stx_dev_minor);
+    st->st_ino = x->stx_ino;
+    st->st_mode = x->stx_mode;
+    st->st_nlink = x->stx_nlink;
+    st->st_uid = x->stx_uid;
+    st->st_gid = x->stx_gid;
+    st->st_size = x->stx_size;
+    st->st_blocks = x->stx_blocks;
+    st->st_mtim.tv_sec = x->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = x->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = x->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = x->stx_ctime.tv_nsec;
+}
+
+static void prefetch_release(Prefetched *f) {
+    if (!f->path) return;
+    if (f->fd >= 0) close(f->fd);
+    free(f->data);
+    free(f->path);
+    f->path = NULL;
+}
+
+/* Releases what is left of the current batch. */
+static void prefetch_clear(void) {
+    while (prefetched_next < prefetched_count)
+        prefetch_release(&prefetched[prefetched_next++]);
+    prefetched_count = prefetched_next = 0;
+}
+
+/* Submits what is queued on watch_ring and waits for all of it; each
+   result goes to the int its user_data points at. */
+static void prefetch_round(void) {
+    if (uring_submit(&watch_ring, watch_ring.queued + watch_ring.inflight) < 0) {
+        perror("io_uring_enter");
+        exit(1);
+    }
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek(&watch_ring))) {
+        *(int *)(uintptr_t)cqe->user_data = cqe->res;
+        uring_seen(&watch_ring);
+    }
+}
+
+/* Reads ahead the files among the due entries at the head of the pending
+   list. Returns how many entries the batch covers, for the caller to emit
+   before it asks for the next batch.
+*/
+static int prefetch_due(long long now) {
+    prefetch_clear();
+    int n = 0, covered = 0;
+    for (Pending *e = pending_head; e && n < PREFETCH_BATCH && covered < 4 * PREFETCH_BATCH &&
+                                    e->last_ms + debounce_ms <= now; e = e->next, covered++) {
+        if (!e->now_present)
+            continue;  // a deletion needs no file
+        Prefetched *f = &prefetched[n];
+        if (!(f->path = strdup(e->path)))
+            break;
+        struct io_uring_sqe *sqe = uring_get(&watch_ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = base_fd;
+        sqe->addr = (uintptr_t)f->path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = (uintptr_t)&f->fd;
+        f->data = NULL;
+        n++;
+    }
+    if (!n)
+        return covered ? covered : 1;
+    prefetch_round();
+    for (int i = 0; i < n; i++) {
+        Prefetched *f = &prefetched[i];
+        if (f->fd < 0)
+            continue;
+        struct io_uring_sqe *sqe = uring_get(&watch_ring);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = f->fd;
+        sqe->addr = (uintptr_t)"";
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uintptr_t)&f->stx;
+        sqe->statx_flags = AT_EMPTY_PATH;
+        sqe->user_data = (uintptr_t)&f->stat_rc;
+        sqe = uring_get(&watch_ring);
+        sqe->opcode = prefetch_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = f->fd;
+        sqe->addr = (uintptr_t)(prefetch_bufs + (size_t)i * PREFETCH_READ_MAX);
+        sqe->len = PREFETCH_READ_MAX;
+        sqe->buf_index = prefetch_fixed ? i : 0;
+        sqe->user_data = (uintptr_t)&f->got;
+    }
+    prefetch_round();
+    for (int i = 0; i < n; i++) {
+        Prefetched *f = &prefetched[i];
+        if (f->fd < 0)
+            continue;
+        if (f->stat_rc < 0) {
+            prefetch_release(f);  // left to file_message()
+            continue;
+        }
+        long long size = f->stx.stx_size;
+        if (S_ISREG(f->stx.stx_mode) && size > 0 && f->got == size && (f->data = malloc(size)))
+            memcpy(f->data, prefetch_bufs + (size_t)i * PREFETCH_READ_MAX, size);
+    }
+    prefetched_count = n;
+    return covered;
+}
+
+/* Hands over the read-ahead of rel_path: returns 1 with its descriptor
+   (-1 if it could not be opened), attributes and, if it was read whole,
+   its body; 0 if it was not read ahead. Entries passed over on the way
+   are released: files are emitted in the order they were read ahead.
+*/
+static int prefetch_take(const char *rel_path, int *fd, struct stat *st, unsigned char **data) {
+    for (int i = prefetched_next; i < prefetched_count; i++) {
+        Prefetched *f = &prefetched[i];
+        if (!f->path || strcmp(f->path, rel_path) != 0)
+            continue;
+        while (prefetched_next < i)
+            prefetch_release(&prefetched[prefetched_next++]);
+        prefetched_next = i + 1;
+        *fd = f->fd < 0 ? -1 : f->fd;
+        if (f->fd >= 0)
+            statx_to_stat(&f->stx, st);
+        else
+            errno = -f->fd;
+        *data = f->data;
+        free(f->path);
+        f->path = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/* Emits the entries that are due, reading their files ahead in batches
+   with -b uring. One that cannot be opened for now goes to the back of
+   the list, and the rest wait EMIT_RETRY_MS for descriptors to be freed.
+   Returns the milliseconds until the next one is due, or -1.
+*/
+int pending_flush(long long now) {
+    int timeout = -1, covered = 0;
+    while (pending_head) {
+        long long due = pending_head->last_ms + debounce_ms;
+        if (due > now) {
+            timeout = (int)(due - now);
+            break;
+        }
+        if (use_uring && !covered)
+            covered = prefetch_due(now);
+        if (covered)
+            covered--;
+        Pending *e = pending_head;
+        if (pending_emit(e) < 0) {
+            e->last_ms = now;
+            pending_unlink_list(e);
+            pending_append(e);
+            timeout = EMIT_RETRY_MS;
+            break;
+        }
+    }
+    prefetch_clear();
+    return timeout;
+}
+
+/* MOVED_FROMs waiting for their MOVED_TO, paired by inotify's cookie.
+   The two halves of a rename are queued back to back, but renames by
+   different processes may interleave, so several can wait at once. One
+   whose MOVED_TO has not come within MOVE_PAIR_TIMEOUT_MS, or whose path
+   another event touches first, left the tree. They all wait equally
+   long, so the list in arrival order is also the order they expire in.
+*/
+typedef struct HeldMove {
+    struct HeldMove *next;
+    uint32_t cookie;
+    int is_dir;
+    long long at_ms;
+    char path[];
+} HeldMove;
+
+HeldMove *held_head, *held_tail;
+int held_count;
+
+static void held_unlink(HeldMove *m, HeldMove *prev) {
+    if (prev) prev->next = m->next; else held_head = m->next;
+    if (held_tail == m) held_tail = prev;
+    held_count--;
+}
+
+/* Resolves a held MOVED_FROM and frees it: to is the MOVED_TO path, or
+   NULL if the path left the tree.
+*/
+void resolve_move(HeldMove *m, const char *to) {
+    const char *from = m->path;
+    if (m->is_dir) {
+        if (to) {
+            pending_drop_subtree(to, 1);  // deletes still pending inside the (empty) target go first
+            watch_rebase(from, to);
+            pending_rebase(from, to);
+            broadcast_rename(from, to, 1);
+        } else {
+            watch_forget_subtree(from);
+            pending_drop_subtree(from, 0);
+            broadcast_update("DELETE", from, 1);
+        }
+    } else if (to) {
+        Pending *src = pending_find(from);
+        Pending *dst = pending_find(to);
+        if (src && !src->was_present) {
+            // clients never saw the source (e.g. an editor's temp file):
+            // send the result under its final name instead of a rename
+            pending_drop(src);
+            pending_note(to, 'C');
+        } else {
+            if (dst)
+                pending_drop(dst);  // replaced by the rename
+            broadcast_rename(from, to, 0);
+            if (src)
+                pending_move_entry(src, to);
+        }
+    } else {
+        pending_note(from, 'D');
+    }
+    free(m);
+}
+
+/* Holds a MOVED_FROM until its MOVED_TO arrives. */
+void hold_move(uint32_t cookie, int is_dir, const char *rel_path) {
+    if (held_count >= MOVE_HELD_MAX) {
+        HeldMove *oldest = held_head;
+        held_unlink(oldest, NULL);
+        resolve_move(oldest, NULL);
+    }
+    size_t len = strlen(rel_path) + 1;
+    HeldMove *m = malloc(sizeof(HeldMove) + len);
+    if (!m) {
+        pending_note(rel_path, 'D');  // as if it left the tree
+        return;
+    }
+    m->next = NULL;
+    m->cookie = cookie;
+    m->is_dir = is_dir;
+    m->at_ms = now_ms();
+    memcpy(m->path, rel_path, len);
+    if (held_tail) held_tail->next = m; else held_head = m;
+    held_tail = m;
+    held_count++;
+}
+
+/* Takes the held MOVED_FROM with this cookie off the list, or returns NULL. */
+HeldMove *take_held_move(uint32_t cookie) {
+    for (HeldMove *m = held_head, *prev = NULL; m; prev = m, m = m->next)
+        if (m->cookie == cookie) {
+            held_unlink(m, prev);
+            return m;
+        }
+    return NULL;
+}
+
+/* Resolves, as having left the tree, the held moves of paths that an
+   event on rel_path depends on or affects: the same path, one of its
+   parents or something below it. Everything else may still pair up.
+*/
+void resolve_held_moves_under(const char *rel_path) {
+    size_t len = strlen(rel_path);
+    HeldMove *m = held_head, *prev = NULL;
+    while (m) {
+        HeldMove *next = m->next;
+        if (path_in_subtree(m->path, rel_path, len) ||
+            path_in_subtree(rel_path, m->path, strlen(m->path))) {
+            held_unlink(m, prev);
+            resolve_move(m, NULL);
+        } else {
+            prev = m;
+        }
+        m = next;
+    }
+}
+
+/* Resolves the held moves that waited MOVE_PAIR_TIMEOUT_MS in vain.
+   Returns the milliseconds until the next one is due, or -1.
+*/
+int expire_held_moves(long long now) {
+    while (held_head) {
+        long long due = held_head->at_ms + MOVE_PAIR_TIMEOUT_MS;
+        if (due > now)
+            return (int)(due - now);
+        HeldMove *m = held_head;
+        held_unlink(m, NULL);
+        resolve_move(m, NULL);
+    }
+    return -1;
+}
+
+/* Files found while adopting a directory, handed to the coalescer once
+   the walk is over (the pending table belongs to the watcher thread).
+*/
+typedef struct {
+    pthread_mutex_t lock;
+    char **paths;
+    size_t count, cap;
+} FoundFiles;
+
+static void adopt_visit(const char *rel_path, int is_dir, void *arg) {
+    if (is_dir) {
+        broadcast_update("CREATE", rel_path, 1);
+        return;
+    }
+    FoundFiles *found = arg;
+    char *copy = strdup(rel_path);
+    if (!copy) return;
+    pthread_mutex_lock(&found->lock);
+    if (found->count == found->cap) {
+        size_t cap = found->cap ? found->cap * 2 : 64;
+        char **grown = realloc(found->paths, cap * sizeof(char *));
+        if (!grown) {
+            pthread_mutex_unlock(&found->lock);
+            free(copy);
+            return;
+        }
+        found->paths = grown;
+        found->cap = cap;
+    }
+    found->paths[found->count++] = copy;
+    pthread_mutex_unlock(&found->lock);
+}
+
+/* Broadcasts a directory that appeared in the tree (created, or moved in
+   from outside) together with whatever it already contains: a directory
+   can fill up before its watch exists. Subdirectories are announced as the
+   walk finds them, parents first; files go through the coalescer.
+*/
+void adopt_directory(const char *rel_path) {
+    broadcast_update("CREATE", rel_path, 1);
+    FoundFiles found = { .lock = PTHREAD_MUTEX_INITIALIZER };
+    walk_tree(rel_path, adopt_visit, &found);
+    for (size_t i = 0; i < found.count; i++) {
+        pending_note(found.paths[i], 'C');
+        free(found.paths[i]);
+    }
+    free(found.paths);
+}
+
+/* Routes one inotify event through the coalescer. */
+void coalesce_event(uint32_t mask, uint32_t cookie, const char *rel_path) {
+    int is_dir = (mask & IN_ISDIR) ? 1 : 0;
+    HeldMove *from = (mask & IN_MOVED_TO) && held_head ? take_held_move(cookie) : NULL;
+    if (held_head)
+        resolve_held_moves_under(rel_path);
+    if (from) {
+        resolve_move(from, rel_path);
+        return;
+    }
+    if (mask & IN_MOVED_FROM) {
+        hold_move(cookie, is_dir, rel_path);
+        return;
+    }
+    if (is_dir) {
+        if (mask & (IN_CREATE | IN_MOVED_TO)) {
+            adopt_directory(rel_path);
+        } else if (mask & IN_DELETE) {
+            pending_drop_subtree(rel_path, 0);
+            broadcast_update("DELETE", rel_path, 1);
+        }
+        return;
+    }
+    if (mask & (IN_CREATE | IN_MOVED_TO))
+        pending_note(rel_path, 'C');
+    else if (mask & IN_CLOSE_WRITE)
+        pending_note(rel_path, 'M');
+    else if (mask & IN_DELETE)
+        pending_note(rel_path, 'D');
+}
+
+/* Recovers from lost events (the inotify queue overflowed). Held renames
+   are resolved as moves out of the tree and pending entries dropped; then
+   the tree is walked again by the parallel walker, statting every entry
+   against the index, which holds what clients were last sent (size,
+   mtime and inode). Only the differences are broadcast: what is gone
+   first, then new or changed directories and files in the order found,
+   parents first. The walk also re-registers every directory's watch, so
+   directories created or renamed while events were lost are followed
+   again. Clients stay connected and receive just the synthetic events.
+*/
+void rescan_tree(void) {
+    long long started = now_ms();
+    metric_add(M_RESCANS, 1);
+    expire_held_moves(LLONG_MAX);
+    while (pending_head)
+        pending_drop(pending_head);
+    pthread_mutex_lock(&journal_lock);
+    for (size_t i = 0; i < index_nbuckets; i++)
+        for (IndexEntry *e = index_buckets[i]; e; e = e->hnext)
+            e->seen = 0;
+    pthread_mutex_unlock(&journal_lock);
+
+    ScanState s;
+    memset(&s, 0, sizeof(s));
+    s.trusted = 1;  // compare with the index, do not rebuild it
+    walk_tree("", scan_visit, &s);
+
+    size_t deleted;
+    ManifestItem *gone = index_unseen(&deleted);
+    for (size_t i = 0; i < deleted; i++) {
+        broadcast_update("DELETE", gone[i].path, gone[i].type == MANIFEST_DIR);
+        free((char *)gone[i].path);
+    }
+    free(gone);
+    for (size_t i = 0; i < s.count; i++) {
+        ScanChange *ch = &s.changes[i];
+        if (ch->replaces)
+            broadcast_update("DELETE", ch->path, !ch->is_dir);
+        if (broadcast_update(ch->modified && !ch->is_dir ? "MODIFY" : "CREATE", ch->path, ch->is_dir) < 0)
+            pending_note(ch->path, ch->modified ? 'M' : 'C');  // tried again once descriptors are free
+        free(ch->path);
+    }
+    free(s.changes);
+    printf("Rescan: %zu changed and %zu deleted, %lld ms\n", s.count, deleted, now_ms() - started);
+}
+
+/* inotify watcher thread: reads events, builds full relative paths using
+   the watch table, and feeds them to the coalescer. Between reads it
+   waits only until the next pending entry or held rename is due. If the
+   kernel dropped events, or reading failed, the tree is rescanned.
+*/
+void *watch_directory(void *arg) {
+    char buffer[BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+    int timeout = -1;
+    while (1) {
+        int ready = poll(&pfd, 1, timeout) > 0;
+        uint64_t round = event_origin = metric_clock();
+        batch_begin();  // what this round broadcasts goes out together
+        int lost = 0;
+        if (ready) {
+            int length = read(inotify_fd, buffer, BUF_LEN);
+            if (length < 0 && errno != EINTR && errno != EAGAIN) {
+                perror("inotify read");
+                lost = 1;
+            }
+            int i = 0;
+            while (i < length) {
+                struct inotify_event *event = (struct inotify_event *)&buffer[i];
+                i += EVENT_SIZE + event->len;
+                metric_add(M_INOTIFY_EVENTS, 1);
+                if (event->mask & IN_Q_OVERFLOW) {
+                    fprintf(stderr, "inotify queue overflowed, rescanning the tree\n");
+                    lost = 1;
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    watch_remove(event->wd);  // watch gone: directory deleted or unwatched
+                    continue;
+                }
+                if (!event->len)
+                    continue;
+                const char *dir_rel = watch_lookup(event->wd);
+                if (!dir_rel)
+                    continue;  // event from a watch that was just dropped
+                char full_rel[PATH_MAX];
+                if (path_printf(full_rel, "%s%s%s", dir_rel, dir_rel[0] ? "/" : "", event->name) < 0)
+                    continue;
+                normalize_path(full_rel);
+                coalesce_event(event->mask, event->cookie, full_rel);
+            }
+        }
+        if (lost)
+            rescan_tree();
+        long long now = now_ms();
+        int move_timeout = expire_held_moves(now);
+        timeout = pending_flush(now);
+        if (move_timeout >= 0 && (timeout < 0 || move_timeout < timeout))
+            timeout = move_timeout;
+        batch_end();
+        metric_since(M_WATCH_ROUND, round);
+    }
+    return NULL;
+}
+
+/* Relay mode (-u host:port). Instead of watching the tree, the server
+   subscribes to an upstream server the way a client does and applies its
+   events to the tree: transfers are built in temp files next to their
+   target and renamed into place. Each event is then journaled and
+   broadcast exactly as the watcher would have, the moment it is applied,
+   so downstream clients see the upstream order, replay and reconcile
+   against the relay's own journal and index, and get deltas computed
+   against the relay's copy. A relay's clients may be relays themselves,
+   which makes a tree in which every server only feeds its own children.
+   How far upstream has been applied is kept in <journal_dir>/upstream,
+   so a restarted relay resumes instead of being reconciled.
+*/
+typedef struct RelayTransfer {
+    struct RelayTransfer *hnext;        // stream table chain
+    struct RelayTransfer *prev, *next;  // every transfer, oldest first
+    unsigned sid;
+    int fd;
+    int base_fd;            // old copy for COPY frames, -1 for a plain transfer
+    uint32_t block_size;    // 0 for a plain transfer
+    int replaces;           // the path held a file: downstream gets it as modified
+    long long size, received;
+    uint64_t seq;           // upstream event it belongs to
+    char rel_path[PATH_MAX];
+    char tmp_path[PATH_MAX];  // relative to base_fd
+} RelayTransfer;
+
+typedef struct {
+    char magic[8];
+    uint64_t journal_id;    // upstream journal that seq refers to
+    uint64_t seq;           // last upstream event applied
+} RelayState;
+
+struct sockaddr_in upstream_addr;
+int upstream_socket = -1;
+RelayState *relay_state;
+uint64_t upstream_mark;     // newest SEQ received
+uint64_t upstream_journal;  // journal upstream named in WELCOME
+int upstream_marked;        // a SEQ has arrived since then
+RelayTransfer *relay_streams[RELAY_STREAM_BUCKETS];
+RelayTransfer *relay_oldest, *relay_newest;
+
+/* Maps <journal_dir>/upstream, creating it for a relay that has never synced. */
+void relay_open_state(void) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/upstream", journal_dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(RelayState)) < 0) {
+        perror("relay state");
+        exit(1);
+    }
+    relay_state = mmap(NULL, sizeof(RelayState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (relay_state == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (memcmp(relay_state->magic, RELAY_STATE_MAGIC, 8) != 0) {
+        memset(relay_state, 0, sizeof(RelayState));
+        memcpy(relay_state->magic, RELAY_STATE_MAGIC, 8);
+    }
+}
+
+/* Records the newest upstream event whose effects are complete: the last
+   SEQ mark, held back by the oldest transfer still running. A new upstream
+   journal is only adopted once everything up to a mark is complete.
+*/
+static void relay_applied(void) {
+    uint64_t applied = upstream_mark;
+    if (relay_oldest && relay_oldest->seq - 1 < applied)
+        applied = relay_oldest->seq - 1;
+    if (relay_state->journal_id != upstream_journal) {
+        if (upstream_marked && applied == upstream_mark) {
+            relay_state->journal_id = upstream_journal;
+            relay_state->seq = applied;
+        }
+    } else if (applied > relay_state->seq) {
+        relay_state->seq = applied;
+    }
+}
+
+static RelayTransfer *relay_find(unsigned sid) {
+    for (RelayTransfer *t = relay_streams[sid % RELAY_STREAM_BUCKETS]; t; t = t->hnext)
+        if (t->sid == sid)
+            return t;
+    return NULL;
+}
+
+/* Closes a transfer, removing its temp file unless it was committed. */
+static void relay_end(RelayTransfer *t) {
+    if (t->fd >= 0) close(t->fd);
+    if (t->base_fd >= 0) close(t->base_fd);
+    unlinkat(base_fd, t->tmp_path, 0);  // no-op once it has been renamed
+    RelayTransfer **pp = &relay_streams[t->sid % RELAY_STREAM_BUCKETS];
+    while (*pp != t)
+        pp = &(*pp)->hnext;
+    *pp = t->hnext;
+    if (t->prev) t->prev->next = t->next;
+    else relay_oldest = t->next;
+    if (t->next) t->next->prev = t->prev;
+    else relay_newest = t->prev;
+    free(t);
+    relay_applied();
+}
+
+/* Ends the transfers into rel_path (or, for a directory, below it). */
+static void relay_abort(const char *rel_path, int is_dir) {
+    RelayTransfer *t = relay_oldest;
+    while (t) {
+        RelayTransfer *next = t->next;
+        if (strcmp(t->rel_path, rel_path) == 0 ||
+            (is_dir && path_in_subtree(t->rel_path, rel_path, strlen(rel_path))))
+            relay_end(t);
+        t = next;
+    }
+}
+
+/* Follows a rename: transfers into from or below it write to `to` now.
+   One whose new path would be too long is ended. */
+static void relay_rebase(const char *from, const char *to) {
+    size_t n = strlen(from);
+    RelayTransfer *t = relay_oldest;
+    while (t) {
+        RelayTransfer *next = t->next;
+        if (strcmp(t->rel_path, from) == 0 || path_in_subtree(t->rel_path, from, n)) {
+            char rel[PATH_MAX], tmp[PATH_MAX];
+            int moved = t->rel_path[n] != '\0';  // the temp file moved with its directory
+            if (path_printf(rel, "%s%s", to, t->rel_path + n) < 0 ||
+                (moved && path_printf(tmp, "%s%s", to, t->tmp_path + n) < 0)) {
+                relay_end(t);
+            } else {
+                strcpy(t->rel_path, rel);
+                if (moved) strcpy(t->tmp_path, tmp);
+            }
+        }
+        t = next;
+    }
+}
+
+/* Creates the missing parent directories of rel_path, broadcasting each. */
+static void relay_make_parents(const char *rel_path) {
+    char dir[PATH_MAX];
+    if (path_printf(dir, "%s", rel_path) < 0)
+        return;
+    for (char *slash = strchr(dir, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdirat(base_fd, dir, 0777) == 0)
+            broadcast_update("CREATE", dir, 1);
+        *slash = '/';
+    }
+}
+
+/* Removes rel_path, and for a directory everything below it. */
+static void relay_remove(const char *rel_path) {
+    if (unlinkat(base_fd, rel_path, 0) == 0 || (errno != EISDIR && errno != EPERM))
+        return;
+    int fd = openat(base_fd, rel_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char child[PATH_MAX];
+        if (path_printf(child, "%s/%s", rel_path, entry->d_name) == 0)
+            relay_remove(child);
+    }
+    closedir(d);
+    unlinkat(base_fd, rel_path, AT_REMOVEDIR);
+}
+
+/* Commits a transfer once all of it has arrived and broadcasts the file. */
+static void relay_finish(RelayTransfer *t) {
+    if (t->received < t->size)
+        return;
+    if (renameat(base_fd, t->tmp_path, base_fd, t->rel_path) < 0)
+        perror("rename");
+    else if (broadcast_update(t->replaces ? "MODIFY" : "CREATE", t->rel_path, 0) < 0)
+        fprintf(stderr, "%s: not sent, out of descriptors; clients get it when they reconnect\n", t->rel_path);
+    relay_end(t);
+}
+
+/* Starts a transfer from OPEN or DELTA: opens its temp file (and, for a
+   delta, the old copy), keeping the old copy's permissions. */
+static void relay_start(unsigned sid, long long size, uint32_t block_size, const char *rel_path) {
+    RelayTransfer *t = calloc(1, sizeof(RelayTransfer));
+    if (!t) return;
+    t->sid = sid;
+    t->size = size;
+    t->block_size = block_size;
+    t->base_fd = -1;
+    t->seq = upstream_mark + 1;
+    const char *slash = strrchr(rel_path, '/');
+    if (path_printf(t->rel_path, "%s", rel_path) < 0 ||
+        path_printf(t->tmp_path, "%.*s.%s.sync%u", slash ? (int)(slash - rel_path + 1) : 0, rel_path,
+                    slash ? slash + 1 : rel_path, sid) < 0) {
+        free(t);
+        return;
+    }
+    RelayTransfer **bucket = &relay_streams[sid % RELAY_STREAM_BUCKETS];
+    t->hnext = *bucket;
+    *bucket = t;
+    t->prev = relay_newest;
+    if (relay_newest) relay_newest->next = t;
+    else relay_oldest = t;
+    relay_newest = t;
+
+    relay_make_parents(rel_path);
+    t->fd = openat(base_fd, t->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (t->fd < 0) {
+        perror("open");
+        relay_end(t);
+        return;
+    }
+    int old = openat(base_fd, rel_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (old >= 0 && fstat(old, &st) == 0 && S_ISREG(st.st_mode)) {
+        fchmod(t->fd, st.st_mode & 07777);
+        t->replaces = 1;
+    }
+    if (block_size)
+        t->base_fd = old;
+    else if (old >= 0)
+        close(old);
+    if (size > 0)
+        fallocate(t->fd, 0, 0, size);  // best effort
+    relay_finish(t);  // an empty file is complete already
+}
+
+/* Writes a DATA body at the transfer's current offset. */
+static void relay_data(RelayTransfer *t, const unsigned char *data, size_t len) {
+    if (pwrite(t->fd, data, len, t->received) < 0)
+        perror("pwrite");
+    t->received += len;
+    relay_finish(t);
+}
+
+/* Applies COPY: appends blocks of the old copy. */
+static void relay_copy(RelayTransfer *t, long long block, long long count) {
+    static char buf[CHUNK_SIZE];
+    if (t->base_fd < 0) return;
+    long long pos = block * t->block_size, left = count * t->block_size;
+    while (left > 0) {
+        size_t want = (size_t)left < sizeof(buf) ? (size_t)left : sizeof(buf);  // left > 0 here
+        ssize_t r = pread(t->base_fd, buf, want, pos);
+        if (r <= 0) {
+            memset(buf, 0, want);  // old copy changed underneath us; keep the framing
+            r = want;
+        }
+        if (pwrite(t->fd, buf, r, t->received) < 0)
+            perror("pwrite");
+        t->received += r;
+        pos += r;
+        left -= r;
+    }
+    relay_finish(t);
+}
+
+/* Answers RECONCILE with a manifest of the tree, taken from the index.
+   Files the index has no hash for are hashed now, and the hash kept. */
+static void relay_manifest(void) {
+    pthread_mutex_lock(&journal_lock);
+    ManifestItem *items = malloc((index_count + 1) * sizeof(ManifestItem));
+    size_t n = 0;
+    for (size_t i = 0; items && i < index_nbuckets; i++) {
+        for (IndexEntry *e = index_buckets[i]; e; e = e->hnext) {
+            if (!(items[n].path = strdup(e->path)))
+                continue;
+            items[n].type = e->type | (e->type == MANIFEST_FILE && !e->hashed ? MANIFEST_UNHASHED : 0);
+            items[n].size = e->size;
+            items[n].mtime_ns = e->mtime_ns;
+            items[n].hash = e->hash;
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    size_t hashed = 0;
+    for (size_t i = 0; i < n; i++) {
+        ManifestItem *it = &items[i];
+        if (!(it->type & MANIFEST_UNHASHED))
+            continue;
+        it->type &= ~MANIFEST_UNHASHED;
+        int fd = openat(base_fd, it->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || file_hash(fd, &it->hash) < 0) {
+            memset(&it->hash, 0, sizeof(it->hash));  // differs, so upstream sends it again
+        } else {
+            hashed++;
+            pthread_mutex_lock(&journal_lock);
+            IndexEntry *e = index_find(it->path);
+            if (e && e->type == MANIFEST_FILE && e->size == st.st_size && e->mtime_ns == stat_mtime_ns(&st)) {
+                e->hash = it->hash;
+                e->hashed = 1;
+                index_dirty = 1;
+            }
+            pthread_mutex_unlock(&journal_lock);
+        }
+        if (fd >= 0) close(fd);
+    }
+    if (items)
+        qsort(items, n, sizeof(ManifestItem), manifest_item_cmp);
+
+    static unsigned char buf[CHUNK_SIZE];
+    size_t bytes = varint_size(n), used;
+    for (size_t i = 0; i < n; i++)
+        bytes += MANIFEST_WIRE_FIXED + strlen(items[i].path);
+    used = frame_header_put(buf, F_MANIFEST, bytes);
+    used += varint_put(buf + used, n);
+    for (size_t i = 0; i < n; i++) {
+        if (used + MANIFEST_WIRE_FIXED + PATH_MAX > sizeof(buf)) {
+            send_full(upstream_socket, buf, used);
+            used = 0;
+        }
+        used += manifest_wire_put(buf + used, &items[i]);
+        free((char *)items[i].path);
+    }
+    send_full(upstream_socket, buf, used);
+    free(items);
+    printf("Sent manifest upstream: %zu entries, %zu files hashed\n", n, hashed);
+}
+
+/* Copies the path that ends a frame body into rel_path (PATH_MAX bytes)
+   without its trailing slashes. Returns 0 if it is empty, too long,
+   holds a NUL, or would leave the tree.
+*/
+static int relay_path(const unsigned char *p, const unsigned char *end, char *rel_path) {
+    size_t len = end - p;
+    if (len == 0 || len >= PATH_MAX || memchr(p, '\0', len) || p[0] == '/')
+        return 0;
+    memcpy(rel_path, p, len);
+    rel_path[len] = '\0';
+    normalize_path(rel_path);
+    for (const char *s = rel_path; s; s = strchr(s, '/')) {
+        if (*s == '/') s++;
+        if (strncmp(s, "..", 2) == 0 && (s[2] == '/' || s[2] == '\0'))
+            return 0;
+    }
+    return rel_path[0] != '\0';
+}
+
+/* Applies one frame from upstream (see the F_* ops in syncproto.h).
+   Returns -1 if it is malformed; unknown ops are skipped.
+*/
+static int relay_frame(int op, const unsigned char *p, const unsigned char *end) {
+    static unsigned char zbuf[CHUNK_SIZE];
+    char rel_path[PATH_MAX], to_path[PATH_MAX];
+    uint64_t v[3];
+    RelayTransfer *t;
+    switch (op) {
+    case F_BATCH:
+        while (p < end) {
+            int inner;
+            uint64_t len;
+            int h = frame_header_get(p, end - p, &inner, &len);
+            if (h <= 0 || len > (uint64_t)(end - p - h) || inner == F_BATCH ||
+                relay_frame(inner, p + h, p + h + len) < 0)
+                return -1;
+            p += h + len;
+        }
+        return 0;
+    case F_WELCOME:
+        if (frame_fields(&p, end, v, 3) < 0)
+            return -1;
+        if (v[0] != SYNC_VERSION) {
+            fprintf(stderr, "Upstream speaks protocol version %llu, not %d\n",
+                    (unsigned long long)v[0], SYNC_VERSION);
+            exit(1);
+        }
+        if (v[2] != relay_state->journal_id) {
+            upstream_journal = v[2];  // upstream reconciles us
+            relay_state->journal_id = 0;
+            relay_state->seq = 0;
+            upstream_mark = 0;
+            upstream_marked = 0;
+        }
+        return 0;
+    case F_SEQ:
+        if (frame_fields(&p, end, v, 1) < 0)
+            return -1;
+        upstream_mark = v[0];
+        upstream_marked = 1;
+        relay_applied();
+        return 0;
+    case F_RECONCILE:
+        relay_manifest();
+        return 0;
+    case F_CREATE:
+    case F_DELETE:
+        if (frame_fields(&p, end, v, 1) < 0 || !relay_path(p, end, rel_path))
+            return -1;
+        if (op == F_DELETE) {
+            relay_abort(rel_path, v[0] != 0);
+            relay_remove(rel_path);
+            broadcast_update("DELETE", rel_path, v[0] != 0);
+        } else {
+            relay_make_parents(rel_path);
+            if (v[0]) {
+                mkdirat(base_fd, rel_path, 0777);
+            } else {
+                int fd = openat(base_fd, rel_path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0666);
+                if (fd >= 0) close(fd);
+            }
+            broadcast_update("CREATE", rel_path, v[0] != 0);
+        }
+        return 0;
+    case F_RENAME:
+        if (frame_fields(&p, end, v, 2) < 0 || v[1] > (uint64_t)(end - p) ||
+            !relay_path(p, p + v[1], rel_path) || !relay_path(p + v[1], end, to_path))
+            return -1;
+        relay_rebase(rel_path, to_path);
+        relay_make_parents(to_path);
+        if (renameat(base_fd, rel_path, base_fd, to_path) == 0)
+            broadcast_rename(rel_path, to_path, v[0] != 0);
+        return 0;
+    case F_OPEN:
+    case F_DELTA:
+        if (frame_fields(&p, end, v, op == F_DELTA ? 3 : 2) < 0 || !relay_path(p, end, rel_path) ||
+            (op == F_DELTA && (v[2] == 0 || v[2] > CHUNK_SIZE)))
+            return -1;
+        relay_start(v[0], v[1], op == F_DELTA ? v[2] : 0, rel_path);
+        return 0;
+    case F_SIGREQ: {
+        if (frame_fields(&p, end, v, 1) < 0 || !relay_path(p, end, rel_path))
+            return -1;
+        int fd = openat(base_fd, rel_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        send_signatures(upstream_socket, v[0], fd);
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    case F_DATA:
+    case F_ZDATA:
+    case F_COPY:
+    case F_ABORT:
+        if (frame_fields(&p, end, v, op == F_COPY ? 3 : op == F_ZDATA ? 2 : 1) < 0 ||
+            (op == F_ZDATA && v[1] > CHUNK_SIZE))
+            return -1;
+        if (!(t = relay_find(v[0])))
+            return 0;  // failed or aborted
+        if (op == F_ABORT) {
+            relay_end(t);
+        } else if (op == F_COPY) {
+            relay_copy(t, v[1], v[2]);
+        } else if (op == F_DATA) {
+            relay_data(t, p, end - p);
+        } else {
+            uLongf n = v[1];
+            if (uncompress(zbuf, &n, p, end - p) != Z_OK || n != v[1])
+                return -1;
+            relay_data(t, zbuf, n);
+        }
+        return 0;
+    }
+    return 0;
+}
+
+/* Sends HELLO upstream: everything (an empty ignore list), in batches and
+   compressed, from the last upstream event applied. */
+static void relay_hello(void) {
+    uint64_t v[4] = { SYNC_VERSION, SYNC_CAP_BATCH | SYNC_CAP_ZLIB, relay_state->journal_id, relay_state->seq };
+    unsigned char hello[FRAME_BOUND(4, 4)];
+    size_t body = 4;
+    for (int i = 0; i < 4; i++)
+        body += varint_size(v[i]);
+    size_t n = frame_header_put(hello, F_HELLO, body);
+    memcpy(hello + n, SYNC_MAGIC, 4);
+    n += 4;
+    for (int i = 0; i < 4; i++)
+        n += varint_put(hello + n, v[i]);
+    send_full(upstream_socket, hello, n);
+}
+
+/* Upstream thread: connects, applies frames in the order they arrive, and
+   reconnects with backoff when the connection ends. Each read's worth of
+   events is broadcast together (see batch_begin()).
+*/
+void *relay_upstream(void *arg) {
+    static unsigned char buf[FRAME_MAX + CHUNK_SIZE];
+    int delay = 1;
+    while (1) {
+        upstream_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (upstream_socket < 0 ||
+            connect(upstream_socket, (struct sockaddr *)&upstream_addr, sizeof(upstream_addr)) < 0) {
+            if (upstream_socket >= 0) close(upstream_socket);
+            sleep(delay);
+            if (delay < RELAY_RECONNECT_MAX_DELAY)
+                delay *= 2;
+            continue;
+        }
+        delay = 1;
+        upstream_mark = relay_state->seq;
+        upstream_journal = relay_state->journal_id;
+        upstream_marked = 0;
+        relay_hello();
+        printf("Connected upstream to %s:%d\n", inet_ntoa(upstream_addr.sin_addr), ntohs(upstream_addr.sin_port));
+        size_t have = 0;
+        while (1) {
+            ssize_t n = recv(upstream_socket, buf + have, sizeof(buf) - have, 0);
+            if (n <= 0)
+                break;
+            have += n;
+            size_t off = 0;
+            int op, bad = 0;
+            uint64_t len;
+            batch_begin();
+            while (1) {
+                int h = frame_header_get(buf + off, have - off, &op, &len);
+                if (h < 0 || (h > 0 && len > FRAME_MAX)) {
+                    bad = 1;
+                    break;
+                }
+                if (h == 0 || have - off - h < len)
+                    break;
+                if (relay_frame(op, buf + off + h, buf + off + h + len) < 0) {
+                    bad = 1;
+                    break;
+                }
+                off += h + len;
+            }
+            batch_end();
+            if (bad) {
+                fprintf(stderr, "Malformed frame from upstream\n");
+                break;
+            }
+            memmove(buf, buf + off, have - off);
+            have -= off;
+        }
+        close(upstream_socket);
+        while (relay_oldest)
+            relay_end(relay_oldest);  // unfinished; upstream sends them again
+        printf("Disconnected from upstream, reconnecting...\n");
+    }
+    return NULL;
+}
+
+/* Queues a file's current content to one client, as a delta where that
+   pays off (modified: the client has an older copy). Returns -1 with
+   errno set if the file could not be opened, usually because it no longer
+   exists. Caller holds `lock`, so the file is not hashed for dedup here.
+*/
+int queue_file(int slot, const char *rel_path, int modified) {
+    Payload *p;
+    FileBody *body;
+    int delta;
+    if (file_message(rel_path, modified, 0, &p, NULL, &body, &delta, NULL) < 0)
+        return -1;
+    enqueue_payload(slot, p, body, delta);
+    payload_unref(p);
+    if (body) body_unref(body);
+    return 0;
+}
+
+void forget_moved(Client *c) {
+    for (int i = 0; i < c->moved_count; i++)
+        free(c->moved[i]);
+    free(c->moved);
+    c->moved = NULL;
+    c->moved_count = c->moved_cap = 0;
+}
+
+/* Remembers a replayed file that is gone from its recorded path. A later
+   record renames it (send it then) or deletes it (drop it). Returns -1
+   if too many are outstanding.
+*/
+static int note_moved(Client *c, const char *rel_path) {
+    if (c->moved_count == c->moved_cap) {
+        int cap = c->moved_cap ? c->moved_cap * 2 : 16;
+        char **grown = cap <= CATCHUP_MAX_MOVED ? realloc(c->moved, cap * sizeof(char *)) : NULL;
+        if (!grown) return -1;
+        c->moved = grown;
+        c->moved_cap = cap;
+    }
+    if (!(c->moved[c->moved_count] = strdup(rel_path)))
+        return -1;
+    c->moved_count++;
+    return 0;
+}
+
+/* Applies a replayed rename or delete to the remembered files: those under
+   a renamed path get their new name and are sent if they now exist, those
+   under a deleted path are dropped.
+*/
+static void update_moved(int slot, const char *from, const char *to) {
+    Client *c = &clients[slot];
+    size_t flen = strlen(from);
+    for (int i = 0; i < c->moved_count; i++) {
+        if (!path_in_subtree(c->moved[i], from, flen))
+            continue;
+        char renamed[PATH_MAX];
+        if (to && path_printf(renamed, "%s%s", to, c->moved[i] + flen) == 0 && queue_file(slot, renamed, 1) < 0) {
+            char *copy = strdup(renamed);
+            if (copy) {
+                free(c->moved[i]);
+                c->moved[i] = copy;
+                continue;
+            }
+        }
+        free(c->moved[i]);
+        c->moved[i--] = c->moved[--c->moved_count];
+    }
+}
+
+static void queue_op(int slot, int op, int is_dir, const char *rel_path) {
+    Payload *p = frame_payload(op, (uint64_t[]){ is_dir }, 1, rel_path);
+    if (p) {
+        enqueue_payload(slot, p, NULL, 0);
+        payload_unref(p);
+    }
+}
+
+void free_actions(Client *c) {
+    for (size_t i = 0; i < c->action_count; i++)
+        free(c->actions[i].path);
+    free(c->actions);
+    c->actions = NULL;
+    c->action_count = c->next_action = 0;
+}
+
+/* Replaces journal replay with reconciliation, for a client that is new,
+   comes from another journal, or fell behind compaction: it is asked for
+   its manifest (RECONCILE), which is diffed against the index, and
+   only what differs is sent. Replay then carries on from the journal
+   position the diff was taken at. Caller holds `lock`.
+*/
+void request_reconcile(int slot) {
+    Client *c = &clients[slot];
+    forget_moved(c);
+    free_actions(c);
+    c->reconciling = 1;
+    Payload *p = frame_payload(F_RECONCILE, NULL, 0, NULL);
+    if (p) {
+        enqueue_payload(slot, p, NULL, 0);
+        payload_unref(p);
+    }
+}
+
+static int add_action(Action **list, size_t *count, size_t *cap, int op, int is_dir, int update, const char *path) {
+    if (*count == *cap) {
+        size_t n = *cap ? *cap * 2 : 64;
+        Action *grown = realloc(*list, n * sizeof(Action));
+        if (!grown) return -1;
+        *list = grown;
+        *cap = n;
+    }
+    Action *a = &(*list)[*count];
+    if (!(a->path = strdup(path)))
+        return -1;
+    a->op = op;
+    a->is_dir = is_dir;
+    a->update = update;
+    (*count)++;
+    return 0;
+}
+
+/* Whether our copy of a file has the content the client described. The
+   hash is computed now if the index has none (counted in *hashed), and
+   cached if the file has not changed since the index entry was made.
+*/
+static int same_content(const ManifestItem *ours, const ManifestItem *theirs, size_t *hashed) {
+    Hash128 h = ours->hash;
+    if (ours->type & MANIFEST_UNHASHED) {
+        int fd = openat(base_fd, ours->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+            return 1;  // gone; the journal has its deletion
+        struct stat st;
+        int ok = fstat(fd, &st) == 0 && file_hash(fd, &h) == 0;
+        close(fd);
+        if (!ok)
+            return 0;
+        (*hashed)++;
+        pthread_mutex_lock(&journal_lock);
+        IndexEntry *e = index_find(ours->path);
+        if (e && e->type == MANIFEST_FILE && e->size == st.st_size && e->mtime_ns == stat_mtime_ns(&st)) {
+            e->hash = h;
+            e->hashed = 1;
+            index_dirty = 1;
+        }
+        pthread_mutex_unlock(&journal_lock);
+    }
+    return h.h1 == theirs->hash.h1 && h.h2 == theirs->hash.h2;
+}
+
+/* Decodes the wire entries of a client manifest. Returns -1 if malformed. */
+static int parse_manifest(const ReconcileJob *job, ManifestItem *items) {
+    const unsigned char *p = job->data, *end = job->data + job->len;
+    for (uint64_t i = 0; i < job->count; i++) {
+        if (end - p < MANIFEST_WIRE_FIXED)
+            return -1;
+        size_t plen = p[1] | (p[2] << 8);
+        const char *path = (const char *)p + MANIFEST_WIRE_FIXED;
+        if ((size_t)(end - p) - MANIFEST_WIRE_FIXED < plen || plen == 0 || plen >= PATH_MAX ||
+            memchr(path, '\n', plen) || memchr(path, '\0', plen))
+            return -1;
+        if (!(items[i].path = strndup(path, plen)))
+            return -1;
+        items[i].type = p[0];
+        items[i].size = (int64_t)get_u64(p + 3);
+        items[i].hash.h1 = get_u64(p + 11);
+        items[i].hash.h2 = get_u64(p + 19);
+        p += MANIFEST_WIRE_FIXED + plen;
+    }
+    return 0;
+}
+
+/* Diffs a client's manifest against the index and hands the client the
+   resulting actions. Both sides are sorted with manifest_item_cmp(), so
+   one merge pass finds every difference, parents before children:
+   missing directories are created, files that are missing or differ in
+   size or hash are sent, entries only the client has are deleted (a
+   deleted directory takes its contents along), and a type mismatch is a
+   delete followed by a create. Paths the client ignores are left alone.
+   Runs on the reconcile worker, so hashing never stalls the reactor; the
+   index is saved afterwards if hashes had to be computed.
+*/
+void reconcile(ReconcileJob *job) {
+    ManifestItem *theirs = calloc(job->count + 1, sizeof(ManifestItem));
+    pthread_mutex_lock(&journal_lock);
+    uint64_t seq = journal_next_seq - 1;
+    ManifestItem *ours = malloc((index_count + 1) * sizeof(ManifestItem));
+    size_t n_ours = 0;
+    for (size_t i = 0; ours && i < index_nbuckets; i++) {
+        for (IndexEntry *e = index_buckets[i]; e; e = e->hnext) {
+            if (!(ours[n_ours].path = strdup(e->path)))
+                continue;
+            ours[n_ours].type = e->type | (e->hashed ? 0 : MANIFEST_UNHASHED);
+            ours[n_ours].size = e->size;
+            ours[n_ours].mtime_ns = e->mtime_ns;
+            ours[n_ours].hash = e->hash;
+            n_ours++;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    Action *acts = NULL;
+    size_t n_acts = 0, cap = 0, hashed = 0;
+    int failed = !theirs || !ours || parse_manifest(job, theirs) < 0;
+    if (!failed) {
+        size_t n_theirs = job->count;
+        qsort(ours, n_ours, sizeof(ManifestItem), manifest_item_cmp);
+        qsort(theirs, n_theirs, sizeof(ManifestItem), manifest_item_cmp);
+        const char *gone = NULL;  // client directory being deleted
+        size_t i = 0, j = 0;
+        while (!failed && (i < n_ours || j < n_theirs)) {
+            int cmp = i == n_ours ? 1 : j == n_theirs ? -1 : manifest_item_cmp(&ours[i], &theirs[j]);
+            const ManifestItem *o = cmp <= 0 ? &ours[i++] : NULL;
+            const ManifestItem *t = cmp >= 0 ? &theirs[j++] : NULL;
+            if (filter_ignores(job->filter, o ? o->path : t->path))
+                continue;
+            if (t && gone && path_in_subtree(t->path, gone, strlen(gone)))
+                continue;
+            if (t && (!o || t->type != (o->type & ~MANIFEST_UNHASHED))) {
+                failed |= add_action(&acts, &n_acts, &cap, J_DELETE, t->type == MANIFEST_DIR, 0, t->path);
+                if (t->type == MANIFEST_DIR)
+                    gone = t->path;
+                t = NULL;
+            }
+            if (!o)
+                continue;
+            if ((o->type & ~MANIFEST_UNHASHED) == MANIFEST_DIR) {
+                if (!t)
+                    failed |= add_action(&acts, &n_acts, &cap, J_MKDIR, 1, 0, o->path);
+            } else if (!t || t->size != o->size || !same_content(o, t, &hashed)) {
+                failed |= add_action(&acts, &n_acts, &cap, J_FILE, 0, t != NULL, o->path);
+            }
+        }
+    }
+    for (size_t i = 0; theirs && i < job->count; i++)
+        free((char *)theirs[i].path);
+    for (size_t i = 0; i < n_ours; i++)
+        free((char *)ours[i].path);
+    free(theirs);
+    free(ours);
+
+    pthread_mutex_lock(&lock);
+    Client *c = &clients[job->slot];
+    if (c->socket >= 0 && c->gen == job->gen && c->reconciling == 2) {
+        if (failed) {
+            fprintf(stderr, "Could not reconcile client %d, disconnecting\n", c->socket);
+            shutdown(c->socket, SHUT_RDWR);
+        } else {
+            printf("Client %d reconciled: %zu of %zu entries differ, %zu files hashed\n",
+                   c->socket, n_acts, n_ours, hashed);
+            c->actions = acts ? acts : calloc(1, sizeof(Action));
+            c->action_count = n_acts;
+            c->next_action = 0;
+            c->cursor = seq;
+            c->jpos.off = 0;
+            c->reconciling = 0;
+            acts = NULL;
+            pthread_mutex_lock(&c->qlock);
+            if (!c->out_armed) {
+                c->out_armed = 1;  // the reactor picks up the actions in catch_up()
+                set_client_events(job->slot, 1);
+            }
+            pthread_mutex_unlock(&c->qlock);
+        }
+    }
+    filter_release(job->filter);
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; acts && i < n_acts; i++)
+        free(acts[i].path);
+    free(acts);
+    if (hashed)
+        index_save();
+}
+
+/* Reconcile worker thread: diffs client manifests off the reactor thread. */
+void *reconcile_worker(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&recon_lock);
+        while (!recon_head)
+            pthread_cond_wait(&recon_cond, &recon_lock);
+        ReconcileJob *job = recon_head;
+        recon_head = job->next;
+        if (!recon_head) recon_tail = NULL;
+        pthread_mutex_unlock(&recon_lock);
+        reconcile(job);
+        free(job->data);
+        free(job);
+    }
+    return NULL;
+}
+
+/* Queues the next reconciliation action to a client. */
+static void apply_action(int slot, const Action *a) {
+    switch (a->op) {
+    case J_MKDIR:
+        queue_op(slot, F_CREATE, 1, a->path);
+        break;
+    case J_FILE:
+        queue_file(slot, a->path, a->update);
+        break;
+    case J_DELETE:
+        queue_op(slot, F_DELETE, a->is_dir, a->path);
+        break;
+    }
+}
+
+/* Queues one journal record to a client, as broadcast_update() and
+   broadcast_rename() would have, followed by its SEQ mark. Content is read
+   now, not when the event happened, so a file may since have been renamed
+   away; it is then sent when replay reaches the rename.
+   Returns -1 if replay cannot keep track and the client needs reconciling.
+   Caller holds `lock`.
+*/
+int replay_record(int slot, const JournalRecord *rec) {
+    Client *c = &clients[slot];
+    const Filter *f = c->filter;
+    switch (rec->op) {
+    case J_MKDIR:
+        if (!filter_ignores(f, rec->path))
+            queue_op(slot, F_CREATE, 1, rec->path);
+        break;
+    case J_FILE:
+        // A file that could not be opened for now is not taken for moved
+        if (!filter_ignores(f, rec->path) && queue_file(slot, rec->path, 1) < 0 &&
+            (transient_error(errno) || note_moved(c, rec->path) < 0))
+            return -1;
+        break;
+    case J_DELETE:
+        if (!filter_ignores(f, rec->path))
+            queue_op(slot, F_DELETE, rec->is_dir, rec->path);
+        update_moved(slot, rec->path, NULL);
+        break;
+    case J_RENAME:
+        if (enqueue_rename(slot, rec->path, rec->to, rec->is_dir,
+                           filter_ignores(f, rec->path), filter_ignores(f, rec->to)))
+            queue_file(slot, rec->to, 1);
+        update_moved(slot, rec->path, rec->to);
+        break;
+    }
+    enqueue_seq_mark(slot, rec->seq);
+    return 0;
+}
+
+/* Brings a reconnected client up to date: sends what reconciliation
+   found, then replays the journal from its cursor while its queue has
+   room, and puts it back on the live broadcast once nothing is left.
+   Runs on the reactor thread after every flush, so replay proceeds at
+   the client's pace.
+*/
+void catch_up(int slot) {
+    Client *c = &clients[slot];
+    pthread_mutex_lock(&lock);
+    while (c->resuming && c->socket >= 0) {
+        pthread_mutex_lock(&c->qlock);
+        int full = c->closing || c->q_bytes >= CATCHUP_QUEUE_BYTES || c->stream_count >= CATCHUP_MAX_STREAMS;
+        pthread_mutex_unlock(&c->qlock);
+        if (full)
+            break;
+        if (c->reconciling)
+            break;  // its manifest, or the diff against it, is still on the way
+        if (c->actions) {
+            if (c->next_action < c->action_count) {
+                apply_action(slot, &c->actions[c->next_action++]);
+            } else {
+                free_actions(c);
+                enqueue_seq_mark(slot, c->cursor);
+            }
+            continue;
+        }
+        JournalRecord rec;
+        int r = journal_next(&c->jpos, c->cursor, &rec);
+        if (r < 0) {
+            printf("Client %d is too far behind the journal, reconciling\n", c->socket);
+            request_reconcile(slot);
+        } else if (r == 0) {
+            c->resuming = 0;  // caught up; live events from here on
+            forget_moved(c);
+        } else if (replay_record(slot, &rec) < 0) {
+            request_reconcile(slot);
+        } else {
+            c->cursor = rec.seq;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* The reactor's side of -b uring. Client sockets sit in the ring's
+   registered file table at their slot. A frame whose body has to come
+   from the file is read into the slot's buffer (registered for the first
+   RING_FIXED_BUFFERS slots) by a read linked to the send. Each round, every
+   client being flushed gets its next send on the ring and one
+   io_uring_enter() submits them all and collects the results, so a file
+   fanned out to many clients costs a system call per frame, not a few per
+   client. What is sent, and in which order, is decided exactly as in
+   flush_client().
+*/
+typedef struct {
+    struct msghdr msg;
+    struct iovec iov[MAX_IOV];
+    int inflight;           // entries on the ring for this slot
+    int frame;              // the send carries the frame in flight, not control messages
+    int staged;             // that frame's body is in the slot's buffer
+    off_t stage_pos;        // file offset of the buffer's first byte
+    int read_len;
+    int dead;               // the connection failed during this flush
+} RingSlot;
+
+enum { RING_SEND, RING_READ };
+
+Uring reactor_ring;
+RingSlot *ring_slots;
+unsigned char *ring_bufs;   // CHUNK_SIZE per slot
+int ring_fixed_bufs;        // slots below this have their buffer registered
+
+/* Closes a client connection and releases its slot and queued messages. */
+void drop_client(int slot) {
+    Client *c = &clients[slot];
+    pthread_mutex_lock(&lock);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->socket, NULL);
+    if (use_uring) {
+        uring_set_file(&reactor_ring, slot, -1);  // the table holds the socket open too
+        ring_slots[slot].staged = 0;
+    }
+    close(c->socket);
+    pthread_mutex_lock(&c->qlock);
+    OutMsg *m = c->q_head;
+    while (m) {
+        OutMsg *next = m->next;
+        if (m->payload)
+            payload_unref(m->payload);
+        else
+            free_stream(c, m->announces);  // still waiting, not in the stream list
+        free(m);
+        m = next;
+    }
+    while (c->streams)
+        remove_stream(c, c->streams);
+    free(c->in_buf);
+    c->in_buf = NULL;
+    c->in_len = c->in_cap = 0;
+    c->cur = NULL;
+    c->chunk_left = 0;
+    if (c->zown)
+        free(c->zcur);
+    c->zcur = NULL;
+    c->zown = 0;
+    c->hdr_len = c->hdr_off = 0;
+    c->chunk_count = 0;
+    c->q_head = c->q_tail = NULL;
+    c->q_bytes = 0;
+    c->out_armed = 0;
+    c->closing = 0;
+    pthread_mutex_unlock(&c->qlock);
+    free_actions(c);
+    forget_moved(c);
+    filter_leave(slot);
+    if (c->caps & SYNC_CAP_DEDUP)
+        __atomic_sub_fetch(&dedup_clients, 1, __ATOMIC_RELAXED);
+    c->caps = 0;
+    c->reconciling = 0;
+    c->resuming = 0;
+    c->cursor = 0;
+    c->socket = -1;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Picks the stream that gets the next frame: normally the one with the
+   fewest bytes left, so small files overtake large ones, but every
+   FAIRNESS_INTERVAL-th frame goes to the oldest stream so it cannot starve.
+   Only streams whose header has gone out are eligible.
+*/
+Stream *pick_stream(Client *c) {
+    Stream *best = NULL;
+    int oldest = ++c->chunk_count % FAIRNESS_INTERVAL == 0;
+    for (Stream *st = c->streams; st; st = st->next) {
+        if (!st->announced)
+            continue;
+        if (oldest)
+            return st;
+        if (!best || st->body->size - st->off < best->body->size - best->off)
+            best = st;
+    }
+    return best;
+}
+
+/* The compressed chunk of b at pos (len bytes of the file), or NULL if
+   it is sent as it is. The first chunk compressed decides for the rest of
+   the file. Unless the file is too large to cache, the result is kept for
+   other clients; otherwise *own is set and the caller frees it.
+   Called by the reactor only.
+*/
+static ZChunk *body_zchunk(FileBody *b, off_t pos, size_t len, int *own) {
+    static unsigned char raw[CHUNK_SIZE];
+    off_t idx = pos / CHUNK_SIZE;
+    *own = 0;
+    if (b->zchunks && b->zchunks[idx])
+        return b->zchunks[idx] == &zchunk_raw ? NULL : b->zchunks[idx];
+    if (!b->zchunks && b->size <= ZLIB_CACHE_MAX)
+        b->zchunks = calloc((b->size + CHUNK_SIZE - 1) / CHUNK_SIZE, sizeof(ZChunk *));
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    read_at(b->fd, raw, len, pos);
+    uLongf zlen = compressBound(len);
+    ZChunk *z = malloc(sizeof(ZChunk) + zlen);
+    if (z && (compress2(z->data, &zlen, raw, len, ZLIB_LEVEL) != Z_OK ||
+              zlen * 100 > (uLongf)len * ZLIB_MAX_PERCENT)) {
+        free(z);
+        z = NULL;
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    b->z_ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+    b->z_in += len;
+    b->z_out += z ? (long long)zlen : (long long)len;
+    if (b->zlib < 0)
+        b->zlib = z != NULL;  // the sample
+    if (z)
+        z->len = zlen;
+    if (b->zchunks)
+        b->zchunks[idx] = z ? z : &zchunk_raw;
+    else
+        *own = z != NULL;
+    return z;
+}
+
+/* Sets up the next frame of a stream: COPY for blocks the client already
+   has, otherwise DATA with up to CHUNK_SIZE bytes of the file, or ZDATA
+   with them compressed where the client takes that and it pays. The
+   stream's position advances as soon as a frame is committed to.
+*/
+void start_frame(Client *c, Stream *st) {
+    unsigned sid = st->body->sid;
+    c->chunk_left = 0;
+    if (st->ops && st->ops->ops[st->op_idx].copy) {
+        DeltaOp *op = &st->ops->ops[st->op_idx];
+        c->hdr_len = frame_put(c->chunk_hdr, F_COPY, (uint64_t[]){ sid, op->pos, op->len }, 3, NULL, 0);
+        st->off += op->len * st->ops->block_size;
+        st->op_idx++;
+    } else {
+        long long left;
+        if (st->ops) {
+            DeltaOp *op = &st->ops->ops[st->op_idx];
+            c->chunk_pos = op->pos + st->op_off;
+            left = op->len - st->op_off;
+        } else {
+            c->chunk_pos = st->off;
+            left = st->body->size - st->off;
+        }
+        c->chunk_left = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+        ZChunk *z = NULL;
+        if (!st->ops && (c->caps & SYNC_CAP_ZLIB) && st->body->zlib)
+            z = body_zchunk(st->body, c->chunk_pos, c->chunk_left, &c->zown);
+        if (z) {
+            uint64_t v[2] = { sid, c->chunk_left };
+            c->hdr_len = frame_header_put(c->chunk_hdr, F_ZDATA, varint_size(v[0]) + varint_size(v[1]) + z->len);
+            for (int i = 0; i < 2; i++)
+                c->hdr_len += varint_put(c->chunk_hdr + c->hdr_len, v[i]);
+            st->off += c->chunk_left;
+            st->body->z_sent += z->len;
+            c->zcur = z;
+            c->chunk_pos = 0;
+            c->chunk_left = z->len;
+        } else {
+            c->hdr_len = frame_header_put(c->chunk_hdr, F_DATA, varint_size(sid) + c->chunk_left);
+            c->hdr_len += varint_put(c->chunk_hdr + c->hdr_len, sid);
+            st->off += c->chunk_left;
+        }
+        if (st->ops && (st->op_off += c->chunk_left) == st->ops->ops[st->op_idx].len) {
+            st->op_idx++;
+            st->op_off = 0;
+        }
+    }
+    c->hdr_off = 0;
+    c->cur = st;
+}
+
+/* The body of the frame in flight from its current position, if it is in
+   memory (ZDATA, or a body read ahead), or NULL if it is in the file. */
+static const unsigned char *frame_memory(Client *c) {
+    if (c->zcur)
+        return c->zcur->data + c->chunk_pos;
+    if (c->cur->body->data)
+        return c->cur->body->data + c->chunk_pos;
+    return NULL;
+}
+
+/* Releases the frame in flight once all of it is sent. Caller holds qlock. */
+static void end_frame(Client *c) {
+    Stream *st = c->cur;
+    if (c->zown)
+        free(c->zcur);
+    c->zcur = NULL;
+    c->zown = 0;
+    c->cur = NULL;
+    if (st->cancelled || st->off >= st->body->size)
+        remove_stream(c, st);
+}
+
+/* Counts bytes sent to a client (-m). Caller holds qlock. */
+static void count_sent(Client *c, size_t n) {
+    c->sent_bytes += n;
+    metric_add(M_SENT_BYTES, n);
+}
+
+/* Takes sent bytes off the front of the control queue. Caller holds qlock. */
+static void control_sent(Client *c, size_t sent) {
+    while (sent > 0) {
+        OutMsg *m = c->q_head;
+        size_t left = m->payload->len - m->off;
+        if (sent < left) {
+            m->off += sent;
+            break;
+        }
+        sent -= left;
+        c->q_head = m->next;
+        if (!c->q_head) c->q_tail = NULL;
+        c->q_bytes -= sizeof(OutMsg) + m->payload->len;
+        if (m->announces)
+            m->announces->announced = 1;
+        payload_unref(m->payload);
+        free(m);
+    }
+}
+
+/* Drops EPOLLOUT if nothing is ready to go; new data, or a waiting
+   placeholder being filled, arms it again. Caller holds qlock. */
+static void disarm_if_idle(int slot) {
+    Client *c = &clients[slot];
+    int busy = (c->q_head && c->q_head->payload) || c->cur;
+    for (Stream *st = c->streams; st && !busy; st = st->next)
+        busy = st->announced;
+    if (!busy && c->out_armed) {
+        c->out_armed = 0;
+        set_client_events(slot, 0);
+    }
+}
+
+/* Continues the frame in flight: header first, then body via sendfile()
+   (or from memory for ZDATA and bodies read ahead). If the file shrank
+   since its size was advertised, the remainder is padded with zeros so
+   the frame stays intact; the write that shrank it produces a fresh
+   event anyway.
+   Returns 1 when the frame is complete, 0 on EAGAIN, -1 on error.
+*/
+int send_chunk(Client *c) {
+    static const char zeros[4096];
+    while (c->hdr_off < c->hdr_len) {
+        ssize_t n = send(c->socket, c->chunk_hdr + c->hdr_off, c->hdr_len - c->hdr_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT | (c->chunk_left ? MSG_MORE : 0));
+        if (n < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        count_sent(c, n);
+        c->hdr_off += n;
+    }
+    Stream *st = c->cur;
+    while (c->chunk_left > 0) {
+        off_t pos = c->chunk_pos;
+        const unsigned char *mem = frame_memory(c);
+        ssize_t n = mem ? send(c->socket, mem, c->chunk_left, MSG_NOSIGNAL | MSG_DONTWAIT)
+                        : sendfile(c->socket, st->body->fd, &pos, c->chunk_left);
+        if (n == 0) {
+            size_t pad = c->chunk_left < sizeof(zeros) ? c->chunk_left : sizeof(zeros);
+            n = send(c->socket, zeros, pad, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        if (n < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        count_sent(c, n);
+        c->chunk_pos += n;
+        c->chunk_left -= n;
+    }
+    end_frame(c);
+    return 1;
+}
+
+/* Sends as much as the socket accepts without blocking. A frame that is
+   partly sent is finished first; then pending control messages go out in
+   one sendmsg(), up to any placeholder still waiting for a delta; then the
+   next frame of the chosen stream.
+   Returns -1 if the connection failed.
+*/
+int flush_client(int slot) {
+    Client *c = &clients[slot];
+    int rc = 0;
+    pthread_mutex_lock(&c->qlock);
+    while (1) {
+        if (c->cur) {
+            int r = send_chunk(c);
+            if (r <= 0) {
+                rc = r;
+                break;
+            }
+            continue;
+        }
+        if (c->q_head && c->q_head->payload) {
+            struct iovec iov[MAX_IOV];
+            int n = 0;
+            for (OutMsg *m = c->q_head; m && m->payload && n < MAX_IOV; m = m->next, n++) {
+                iov[n].iov_base = m->payload->data + m->off;
+                iov[n].iov_len = m->payload->len - m->off;
+            }
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+            ssize_t sent = sendmsg(c->socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    rc = -1;
+                break;
+            }
+            count_sent(c, sent);
+            control_sent(c, sent);
+            if (c->q_head && c->q_head->payload)
+                break;  // socket buffer is full
+            continue;
+        }
+        while (c->streams && c->streams->cancelled)
+            remove_stream(c, c->streams);
+        Stream *st = pick_stream(c);
+        if (!st)
+            break;
+        if (st->cancelled) {
+            remove_stream(c, st);
+            continue;
+        }
+        start_frame(c, st);
+    }
+    disarm_if_idle(slot);
+    pthread_mutex_unlock(&c->qlock);
+    return rc;
+}
+
+static void ring_send(int slot, int n) {
+    RingSlot *rs = &ring_slots[slot];
+    memset(&rs->msg, 0, sizeof(rs->msg));
+    rs->msg.msg_iov = rs->iov;
+    rs->msg.msg_iovlen = n;
+    struct io_uring_sqe *sqe = uring_get(&reactor_ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)&rs->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    sqe->user_data = (uint64_t)RING_SEND << 32 | slot;
+    rs->inflight++;
+}
+
+/* Puts a client's next send on the ring: the rest of the frame in flight
+   (after reading its body, if that is in the file), else pending control
+   messages, else a new frame. Drops EPOLLOUT if there is nothing to send.
+   A client that finds the ring full waits for epoll to report it again.
+*/
+static void ring_issue(int slot) {
+    Client *c = &clients[slot];
+    RingSlot *rs = &ring_slots[slot];
+    if (rs->inflight || reactor_ring.queued + reactor_ring.inflight + 2 > reactor_ring.entries)
+        return;
+    pthread_mutex_lock(&c->qlock);
+    while (1) {
+        if (c->cur) {
+            int n = 0;
+            if (c->hdr_off < c->hdr_len)
+                rs->iov[n++] = (struct iovec){ c->chunk_hdr + c->hdr_off, c->hdr_len - c->hdr_off };
+            if (c->chunk_left) {
+                const unsigned char *mem = frame_memory(c);
+                unsigned char *buf = ring_bufs + (size_t)slot * CHUNK_SIZE;
+                if (!mem && !rs->staged) {
+                    struct io_uring_sqe *sqe = uring_get(&reactor_ring);
+                    int fixed = slot < ring_fixed_bufs;
+                    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+                    sqe->fd = c->cur->body->fd;
+                    sqe->addr = (uintptr_t)buf;
+                    sqe->len = c->chunk_left;
+                    sqe->off = c->chunk_pos;
+                    sqe->buf_index = fixed ? slot : 0;
+                    sqe->flags = IOSQE_IO_LINK;  // a short read cancels the send
+                    sqe->user_data = (uint64_t)RING_READ << 32 | slot;
+                    rs->inflight++;
+                    rs->staged = 1;
+                    rs->stage_pos = c->chunk_pos;
+                    rs->read_len = c->chunk_left;
+                }
+                if (!mem)
+                    mem = buf + (c->chunk_pos - rs->stage_pos);
+                rs->iov[n++] = (struct iovec){ (void *)mem, c->chunk_left };
+            }
+            rs->frame = 1;
+            ring_send(slot, n);
+            break;
+        }
+        if (c->q_head && c->q_head->payload) {
+            int n = 0;
+            for (OutMsg *m = c->q_head; m && m->payload && n < MAX_IOV; m = m->next, n++)
+                rs->iov[n] = (struct iovec){ m->payload->data + m->off, m->payload->len - m->off };
+            rs->frame = 0;
+            ring_send(slot, n);
+            break;
+        }
+        while (c->streams && c->streams->cancelled)
+            remove_stream(c, c->streams);
+        Stream *st = pick_stream(c);
+        if (!st) {
+            disarm_if_idle(slot);
+            break;
+        }
+        if (st->cancelled) {
+            remove_stream(c, st);
+            continue;
+        }
+        start_frame(c, st);
+    }
+    pthread_mutex_unlock(&c->qlock);
+}
+
+/* Applies one completion for slot. Returns 1 if the client can take its
+   next send, 0 if it has to wait (socket full, or the other half of a
+   read and send is still out), -1 if the connection failed.
+*/
+static int ring_complete(int slot, int kind, int res) {
+    Client *c = &clients[slot];
+    RingSlot *rs = &ring_slots[slot];
+    rs->inflight--;
+    if (kind == RING_READ) {
+        int got = res < 0 ? 0 : res;
+        if (got < rs->read_len)  // the file shrank: pad, as send_chunk() does
+            memset(ring_bufs + (size_t)slot * CHUNK_SIZE + got, 0, rs->read_len - got);
+        return 0;
+    }
+    if (res == -ECANCELED)
+        return 1;  // its read came up short; the padded buffer goes next time
+    if (res == -EAGAIN || res == -EINTR || res == 0)
+        return 0;
+    if (res < 0)
+        return -1;
+    pthread_mutex_lock(&c->qlock);
+    count_sent(c, res);
+    if (rs->frame) {
+        size_t sent = res, hdr = c->hdr_len - c->hdr_off;
+        size_t take = sent < hdr ? sent : hdr;
+        c->hdr_off += take;
+        c->chunk_pos += sent - take;
+        c->chunk_left -= sent - take;
+        if (c->hdr_off == c->hdr_len && !c->chunk_left) {
+            end_frame(c);
+            rs->staged = 0;
+        }
+    } else {
+        control_sent(c, res);
+    }
+    pthread_mutex_unlock(&c->qlock);
+    return 1;
+}
+
+/* Flushes the given clients through the reactor ring, round after round,
+   until each one's socket is full or it has nothing left; then drops the
+   ones whose connection failed and feeds replay to the rest, as the
+   reactor does after flush_client().
+*/
+void ring_flush(const int *slots, int n) {
+    for (int i = 0; i < n; i++) {
+        ring_slots[slots[i]].dead = 0;
+        ring_issue(slots[i]);
+    }
+    while (reactor_ring.queued || reactor_ring.inflight) {
+        if (uring_submit(&reactor_ring, reactor_ring.queued + reactor_ring.inflight) < 0) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&reactor_ring))) {
+            int slot = (uint32_t)cqe->user_data, kind = cqe->user_data >> 32;
+            int r = ring_complete(slot, kind, cqe->res);
+            uring_seen(&reactor_ring);
+            RingSlot *rs = &ring_slots[slot];
+            if (r < 0)
+                rs->dead = 1;
+            else if (r > 0 && !rs->inflight && !rs->dead)
+                ring_issue(slot);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        int slot = slots[i];
+        if (ring_slots[slot].dead)
+            drop_client(slot);
+        else if (clients[slot].resuming)
+            catch_up(slot);
+    }
+}
+
+/* Sets up io_uring for -b uring: the reactor ring, with a file table
+   entry and a frame buffer per client slot, and the watcher's read-ahead
+   ring with its buffers. Buffers are pinned when registered; if the
+   locked memory limit does not allow it they are used unregistered.
+   Returns -1 if io_uring is not available.
+*/
+int ring_setup(void) {
+    unsigned entries = 2 * (unsigned)max_clients;
+    if (entries > RING_MAX_ENTRIES) entries = RING_MAX_ENTRIES;
+    if (entries < 8) entries = 8;
+    if (uring_init(&reactor_ring, entries) < 0)
+        return -1;
+    if (uring_init(&watch_ring, 2 * PREFETCH_BATCH) < 0) {
+        close(reactor_ring.fd);
+        return -1;
+    }
+    int *fds = malloc(max_clients * sizeof(int));
+    ring_slots = calloc(max_clients, sizeof(RingSlot));
+    ring_bufs = mmap(NULL, (size_t)max_clients * CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    prefetch_bufs = mmap(NULL, PREFETCH_BATCH * PREFETCH_READ_MAX, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!fds || !ring_slots || ring_bufs == MAP_FAILED || prefetch_bufs == MAP_FAILED) {
+        perror("ring_setup");
+        exit(1);
+    }
+    for (int i = 0; i < max_clients; i++)
+        fds[i] = -1;
+    int rc = uring_register(&reactor_ring, IORING_REGISTER_FILES, fds, max_clients);
+    free(fds);
+    if (rc < 0) {
+        close(reactor_ring.fd);
+        close(watch_ring.fd);
+        return -1;
+    }
+    struct iovec iov[RING_FIXED_BUFFERS > PREFETCH_BATCH ? RING_FIXED_BUFFERS : PREFETCH_BATCH];
+    int n = max_clients < RING_FIXED_BUFFERS ? max_clients : RING_FIXED_BUFFERS;
+    for (int i = 0; i < n; i++)
+        iov[i] = (struct iovec){ ring_bufs + (size_t)i * CHUNK_SIZE, CHUNK_SIZE };
+    if (uring_register(&reactor_ring, IORING_REGISTER_BUFFERS, iov, n) == 0)
+        ring_fixed_bufs = n;
+    for (int i = 0; i < PREFETCH_BATCH; i++)
+        iov[i] = (struct iovec){ prefetch_bufs + (size_t)i * PREFETCH_READ_MAX, PREFETCH_READ_MAX };
+    prefetch_fixed = uring_register(&watch_ring, IORING_REGISTER_BUFFERS, iov, PREFETCH_BATCH) == 0;
+    if (!ring_fixed_bufs || !prefetch_fixed)
+        fprintf(stderr, "io_uring: buffers not registered (RLIMIT_MEMLOCK?); reading into plain ones\n");
+    return 0;
+}
+
+/* Answers HELLO: compiles the client's ignore list, agrees on
+   capabilities and sends WELCOME with the journal id, then starts replay
+   from the position the client reported (or reconciles it). A client
+   speaking another protocol version is only told ours, so it can hang up.
+   Returns -1 if the hello is malformed.
+*/
+static int client_hello(int slot, const unsigned char *p, const unsigned char *end) {
+    Client *c = &clients[slot];
+    uint64_t v[4];  // version, caps, journal id, seq
+    if (end - p < 4 || memcmp(p, SYNC_MAGIC, 4) != 0)
+        return -1;
+    p += 4;
+    if (frame_fields(&p, end, v, 4) < 0)
+        return -1;
+    pthread_mutex_lock(&lock);
+    if (v[0] != SYNC_VERSION) {
+        fprintf(stderr, "Client %d speaks protocol version %llu, not %d\n",
+                c->socket, (unsigned long long)v[0], SYNC_VERSION);
+        Payload *w = frame_payload(F_WELCOME, (uint64_t[]){ SYNC_VERSION, 0, 0 }, 3, NULL);
+        if (w) {
+            enqueue_payload(slot, w, NULL, 0);
+            payload_unref(w);
+        }
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    char *list = strndup((const char *)p, end - p);
+    Filter *f = list ? filter_acquire(list) : NULL;
+    free(list);
+    if (!f) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    filter_join(slot, f);
+    c->have_ignore = 1;
+    c->caps = v[1] & (SYNC_CAP_BATCH | SYNC_CAP_ZLIB | SYNC_CAP_DEDUP | SYNC_CAP_ACK);
+    if (c->caps & SYNC_CAP_DEDUP)
+        __atomic_add_fetch(&dedup_clients, 1, __ATOMIC_RELAXED);
+    Payload *w = frame_payload(F_WELCOME, (uint64_t[]){ SYNC_VERSION, c->caps, journal_id }, 3, NULL);
+    if (w) {
+        enqueue_payload(slot, w, NULL, 0);
+        payload_unref(w);
+    }
+    c->resuming = 1;
+    c->jpos.off = 0;
+    if (v[2] == journal_id)
+        c->cursor = c->acked = v[3];
+    else
+        request_reconcile(slot);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/* Hands a client's manifest to the reconcile worker. */
+static int client_manifest(int slot, const unsigned char *p, const unsigned char *end) {
+    Client *c = &clients[slot];
+    uint64_t entries;
+    if (c->reconciling != 1 || varint_get(&p, end, &entries) < 0 ||
+        entries > (uint64_t)(end - p) / MANIFEST_WIRE_FIXED)
+        return -1;
+    size_t bytes = end - p;
+    ReconcileJob *job = calloc(1, sizeof(ReconcileJob));
+    if (!job || !(job->data = malloc(bytes + 1))) {
+        free(job);
+        return -1;
+    }
+    job->slot = slot;
+    job->gen = c->gen;
+    job->count = entries;
+    job->len = bytes;
+    memcpy(job->data, p, bytes);
+    pthread_mutex_lock(&lock);
+    job->filter = c->filter;
+    job->filter->refs++;
+    c->reconciling = 2;
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_lock(&recon_lock);
+    if (recon_tail) recon_tail->next = job;
+    else recon_head = job;
+    recon_tail = job;
+    pthread_cond_signal(&recon_cond);
+    pthread_mutex_unlock(&recon_lock);
+    return 0;
+}
+
+/* Hands a client's block signatures to the delta worker. */
+static int client_sigs(int slot, const unsigned char *p, const unsigned char *end) {
+    Client *c = &clients[slot];
+    uint64_t v[3];  // sid, block size, count
+    if (frame_fields(&p, end, v, 3) < 0 || v[1] == 0 || v[1] > CHUNK_SIZE ||
+        v[2] > MAX_SIG_BLOCKS || (uint64_t)(end - p) != v[2] * SIG_BYTES)
+        return -1;
+    DeltaJob *job = calloc(1, sizeof(DeltaJob));
+    if (!job)
+        return 0;
+    job->slot = slot;
+    job->gen = c->gen;
+    job->sid = v[0];
+    job->block_size = v[1];
+    job->count = v[2];
+    if (job->count > 0 && !(job->sigs = malloc((size_t)job->count * SIG_BYTES))) {
+        job->count = 0;  // fall back to a full transfer
+    } else if (job->count > 0) {
+        memcpy(job->sigs, p, (size_t)job->count * SIG_BYTES);
+    }
+    pthread_mutex_lock(&job_lock);
+    if (job_tail) job_tail->next = job;
+    else job_head = job;
+    job_tail = job;
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+    return 0;
+}
+
+/* Sends a file in full after all, answering a MATERIALIZE the client had
+   no content for. The stream id is the MATERIALIZE's, which the client
+   is waiting on; if the file is gone by now the wait is ended with ABORT
+   (its deletion is on the way).
+*/
+static int client_need(int slot, const unsigned char *p, const unsigned char *end) {
+    uint64_t sid;
+    if (varint_get(&p, end, &sid) < 0 || sid == 0 || sid > UINT32_MAX || p == end || end - p >= PATH_MAX ||
+        memchr(p, '\0', end - p))
+        return -1;
+    char rel_path[PATH_MAX];
+    memcpy(rel_path, p, end - p);
+    rel_path[end - p] = '\0';
+    pthread_mutex_lock(&lock);
+    Payload *msg;
+    FileBody *body;
+    int delta;
+    if (file_message(rel_path, 0, sid, &msg, NULL, &body, &delta, NULL) == 0) {
+        enqueue_payload(slot, msg, body, delta);
+        payload_unref(msg);
+        if (body) body_unref(body);
+    } else if ((msg = frame_payload(F_ABORT, (uint64_t[]){ sid }, 1, NULL))) {
+        enqueue_payload(slot, msg, NULL, 0);
+        payload_unref(msg);
+    }
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/* Records a client's ACK. Once every connected client that acknowledges
+   has applied an event, the time since the event was first reported is
+   observed (-m); events too old for event_times are skipped.
+*/
+static int client_ack(int slot, const unsigned char *p, const unsigned char *end) {
+    uint64_t seq;
+    if (frame_fields(&p, end, &seq, 1) < 0)
+        return -1;
+    pthread_mutex_lock(&lock);
+    Client *c = &clients[slot];
+    if (seq > c->acked)
+        c->acked = seq;
+    uint64_t low = UINT64_MAX;
+    for (int i = 0; i < max_clients; i++)
+        if (clients[i].socket >= 0 && (clients[i].caps & SYNC_CAP_ACK) && clients[i].acked < low)
+            low = clients[i].acked;
+    pthread_mutex_unlock(&lock);
+    if (!metrics_on)
+        return 0;
+    uint64_t now = metric_clock();
+    pthread_mutex_lock(&journal_lock);
+    if (low >= journal_next_seq)
+        low = journal_next_seq - 1;  // from before a restart that lost the tail
+    if (acked_all + EVENT_TIMES < low)
+        acked_all = low - EVENT_TIMES;
+    for (; acked_all < low; acked_all++) {
+        uint64_t t = event_times[(acked_all + 1) % EVENT_TIMES];
+        if (t)
+            metric_observe(M_EVENT_ACKED, now - t);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return 0;
+}
+
+/* Gauges for a scrape (-m): the coalescer's backlog, the newest event,
+   and per client the bytes sent and queued and how many events it has
+   yet to acknowledge. */
+static void server_gauges(FILE *out) {
+    pthread_mutex_lock(&journal_lock);
+    unsigned long long newest = journal_next_seq - 1;
+    pthread_mutex_unlock(&journal_lock);
+    fprintf(out, "# HELP sync_pending_files Files waiting out the debounce window.\n"
+                 "# TYPE sync_pending_files gauge\nsync_pending_files %zu\n",
+            __atomic_load_n(&pending_count, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP sync_journal_seq Newest event in the journal.\n"
+                 "# TYPE sync_journal_seq gauge\nsync_journal_seq %llu\n", newest);
+    static const char *family[3][3] = {
+        { "sync_client_sent_bytes_total", "counter", "Bytes sent to the client since it connected." },
+        { "sync_client_queue_bytes", "gauge", "Memory queued for the client." },
+        { "sync_client_lag_events", "gauge", "Events the client has not acknowledged." },
+    };
+    pthread_mutex_lock(&lock);
+    for (int k = 0; k < 3; k++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", family[k][0], family[k][2], family[k][0], family[k][1]);
+        for (int i = 0; i < max_clients; i++) {
+            Client *c = &clients[i];
+            if (c->socket < 0 || !c->have_ignore || (k == 2 && !(c->caps & SYNC_CAP_ACK)))
+                continue;
+            pthread_mutex_lock(&c->qlock);
+            unsigned long long v = k == 0 ? c->sent_bytes : k == 1 ? c->q_bytes
+                                 : newest > c->acked ? newest - c->acked : 0;
+            pthread_mutex_unlock(&c->qlock);
+            fprintf(out, "%s{client=\"%s\"} %llu\n", family[k][0], c->peer, v);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Handles one complete frame from the client. Returns the number of
+   input bytes consumed, 0 if more input is needed, -1 on a protocol error.
+   The first frame must be HELLO; after it the client sends MANIFEST
+   (answering RECONCILE), SIGS (answering SIGREQ), NEED (answering
+   MATERIALIZE) and ACK.
+*/
+long parse_client_message(int slot, const unsigned char *buf, size_t len) {
+    Client *c = &clients[slot];
+    int op;
+    uint64_t body_len;
+    int h = frame_header_get(buf, len, &op, &body_len);
+    if (h <= 0)
+        return h;
+    uint64_t max = op == F_MANIFEST ? MANIFEST_MAX_BYTES + FRAME_HDR_MAX
+                 : op == F_SIGS ? (uint64_t)MAX_SIG_BLOCKS * SIG_BYTES + 3 * FRAME_HDR_MAX
+                 : HELLO_MAX_BYTES;
+    if (body_len > max || (op == F_HELLO) == c->have_ignore)
+        return -1;
+    if (len - h < body_len)
+        return 0;
+    const unsigned char *body = buf + h, *end = body + body_len;
+    int r = op == F_HELLO ? client_hello(slot, body, end)
+          : op == F_MANIFEST ? client_manifest(slot, body, end)
+          : op == F_SIGS ? client_sigs(slot, body, end)
+          : op == F_NEED ? client_need(slot, body, end)
+          : op == F_ACK ? client_ack(slot, body, end)
+          : -1;
+    return r < 0 ? -1 : (long)(h + body_len);
+}
+
+/* Handles readable data from a client: its hello upon connecting, its
+   manifest when asked, then block signatures answering SIGREQ.
+   Returns -1 once the peer has closed the connection or misbehaved.
+*/
+int handle_client_input(int slot) {
+    Client *c = &clients[slot];
+    while (1) {
+        if (c->in_cap - c->in_len < 4096) {
+            size_t cap = c->in_cap ? c->in_cap * 2 : 8192;
+            unsigned char *grown = realloc(c->in_buf, cap);
+            if (!grown) return -1;
+            c->in_buf = grown;
+            c->in_cap = cap;
+        }
+        ssize_t bytes = recv(c->socket, c->in_buf + c->in_len, c->in_cap - c->in_len, MSG_DONTWAIT);
+        if (bytes == 0)
+            return -1;
+        if (bytes < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        c->in_len += bytes;
+        size_t done = 0;
+        long used;
+        while (done < c->in_len && (used = parse_client_message(slot, c->in_buf + done, c->in_len - done)) != 0) {
+            if (used < 0)
+                return -1;
+            done += used;
+        }
+        memmove(c->in_buf, c->in_buf + done, c->in_len - done);
+        c->in_len -= done;
+    }
+}
+
+/* Accepts every pending connection and registers it with the reactor. */
+void accept_clients(int server_socket) {
+    while (1) {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        int client_sock = accept4(server_socket, (struct sockaddr *)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
+        }
+        pthread_mutex_lock(&lock);
+        int slot = -1;
+        for (int i = 0; i < max_clients; i++) {
+            if (clients[i].socket < 0) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot < 0) {
+            pthread_mutex_unlock(&lock);
+            close(client_sock);
+            continue;
+        }
+        Client *c = &clients[slot];
+        c->socket = client_sock;
+        c->gen++;
+        c->have_ignore = 0;
+        c->filter = NULL;
+        c->acked = 0;
+        c->sent_bytes = 0;
+        char ip[INET_ADDRSTRLEN] = "?";
+        inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+        snprintf(c->peer, sizeof(c->peer), "%s:%u", ip, ntohs(peer.sin_port));
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = slot + 1;
+        if (use_uring && uring_set_file(&reactor_ring, slot, client_sock) < 0) {
+            perror("io_uring_register");
+            close(client_sock);
+            c->socket = -1;
+        } else if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            perror("epoll_ctl");
+            if (use_uring)
+                uring_set_file(&reactor_ring, slot, -1);
+            close(client_sock);
+            c->socket = -1;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+/* Single-threaded reactor: accepts clients, reads their input, drains
+   their outgoing queues on EPOLLOUT and feeds replay to clients that are
+   catching up. The watcher thread only enqueues. With -b uring, the
+   clients found writable are drained together by ring_flush().
+*/
+void run_reactor(int server_socket) {
+    struct epoll_event events[MAX_EVENTS];
+    int writable[MAX_EVENTS];
+    while (1) {
+        int nwritable = 0;
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            uint32_t id = events[i].data.u32;
+            if (id == 0) {
+                accept_clients(server_socket);
+                continue;
+            }
+            int slot = id - 1;
+            if (clients[slot].socket < 0)
+                continue;
+            int dead = 0;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                dead = 1;
+            if (!dead && (events[i].events & EPOLLIN))
+                dead = handle_client_input(slot) < 0;
+            if (!dead && (events[i].events & EPOLLOUT)) {
+                if (use_uring) {
+                    writable[nwritable++] = slot;  // replay is fed after the flush
+                    continue;
+                }
+                dead = flush_client(slot) < 0;
+            }
+            if (!dead && clients[slot].resuming)
+                catch_up(slot);
+            if (dead)
+                drop_client(slot);
+        }
+        if (nwritable)
+            ring_flush(writable, nwritable);
+    }
+}
+
+/* Main server function.
+   Usage: ./server <sync_directory> <port> <max_clients>
+*/
+int main(int argc, char *argv[]) {
+    int opt, bad_args = 0;
+    const char *journal_path = NULL;
+    int metrics_port = 0;
+    while ((opt = getopt(argc, argv, "b:d:D:j:m:u:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (strcmp(optarg, "uring") == 0)
+                use_uring = 1;
+            else if (strcmp(optarg, "sync") != 0)
+                bad_args = 1;
+            break;
+        case 'd':
+            debounce_ms = atoi(optarg);
+            break;
+        case 'D':
+            max_wait_ms = atoi(optarg);
+            break;
+        case 'j':
+            journal_path = optarg;
+            break;
+        case 'm':
+            if ((metrics_port = atoi(optarg)) <= 0)
+                bad_args = 1;
+            break;
+        case 'u': {
+            char host[64];
+            const char *colon = strrchr(optarg, ':');
+            upstream_addr.sin_family = AF_INET;
+            if (!colon || colon - optarg >= (long)sizeof(host) || atoi(colon + 1) <= 0) {
+                bad_args = 1;
+                break;
+            }
+            snprintf(host, sizeof(host), "%.*s", (int)(colon - optarg), optarg);
+            upstream_addr.sin_port = htons(atoi(colon + 1));
+            if (inet_pton(AF_INET, host, &upstream_addr.sin_addr) <= 0)
+                bad_args = 1;
+            relay_mode = 1;
+            break;
+        }
+        default:
+            bad_args = 1;
+        }
+    }
+    if (bad_args || argc - optind != 3 || debounce_ms < 0 || max_wait_ms < 0) {
+        fprintf(stderr, "Usage: %s [-d debounce_ms] [-D max_wait_ms] [-j journal_dir] [-u upstream_ip:port] [-b sync|uring] [-m metrics_port] <sync_directory> <port> <max_clients>\n", argv[0]);
+        exit(1);
+    }
+    char *sync_dir = argv[optind];
+    int port = atoi(argv[optind + 1]);
+    max_clients = atoi(argv[optind + 2]);
+    if (max_clients <= 0) {
+        fprintf(stderr, "max_clients must be positive\n");
+        exit(1);
+    }
+    // Half the descriptors are left for sockets, the journal and the rest
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY &&
+        nofile.rlim_cur / 2 < (rlim_t)client_body_max)
+        client_body_max = nofile.rlim_cur / 2;
+
+    if (path_printf(base_directory, "%s", sync_dir) < 0)
+        exit(1);
+    normalize_path(base_directory);
+
+    // The journal defaults to a sibling of the sync directory, outside the watched tree.
+    char default_journal[PATH_MAX];
+    if (!journal_path) {
+        if (path_printf(default_journal, "%s.syncjournal", base_directory) < 0)
+            exit(1);
+        journal_path = default_journal;
+    }
+    journal_open(journal_path);
+
+    clients = calloc(max_clients, sizeof(Client));
+    if (!clients) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < max_clients; i++) {
+        clients[i].socket = -1;
+        pthread_mutex_init(&clients[i].qlock, NULL);
+    }
+    if (use_uring && ring_setup() < 0) {
+        perror("io_uring unavailable, using plain system calls");
+        use_uring = 0;
+    }
+    if (metrics_port && metrics_start(metrics_port, server_metrics, M_COUNT, server_gauges) < 0) {
+        perror("metrics port");
+        exit(1);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    inotify_fd = relay_mode ? -1 : inotify_init();  // a relay's tree only changes under it
+    if (inotify_fd < 0 && !relay_mode) {
+        perror("inotify_init");
+        exit(1);
+    }
+    walk_init();
+    index_scan();
+
+    pthread_t watcher_thread, delta_thread, recon_thread, saver_thread;
+    if (relay_mode) {
+        relay_open_state();
+        pthread_create(&watcher_thread, NULL, relay_upstream, NULL);
+    } else {
+        pthread_create(&watcher_thread, NULL, watch_directory, NULL);
+    }
+    pthread_create(&delta_thread, NULL, delta_worker, NULL);
+    pthread_create(&recon_thread, NULL, reconcile_worker, NULL);
+    pthread_create(&saver_thread, NULL, index_saver, NULL);
+
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (server_socket < 0) {
+        perror("socket");
+        exit(1);
+    }
+    opt = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(server_socket, max_clients) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev);
+    printf("Server listening on port %d...\n", port);
+
+    run_reactor(server_socket);
+
+    close(server_socket);
+    return 0;
+}